@@ -32,6 +32,7 @@ struct md_pkey_spec_t;
 
 #define MD_PKEY_RSA_BITS_MIN       2048
 #define MD_PKEY_RSA_BITS_DEF       2048
+#define MD_PKEY_EC_CURVE_DEF       "P-256"
 
 /* Minimum age for the HSTS header (RFC 6797), considered appropriate by Mozilla Security */
 #define MD_HSTS_HEADER             "Strict-Transport-Security"
@@ -71,6 +72,9 @@ typedef enum {
     MD_SG_STAGING,
     MD_SG_ARCHIVE,
     MD_SG_TMP,
+    MD_SG_KEYS,
+    MD_SG_OCSP,
+    MD_SG_CACHE,
     MD_SG_COUNT,
 } md_store_group_t;
 
@@ -114,6 +118,7 @@ struct md_t {
 };
 
 #define MD_KEY_ACCOUNT          "account"
+#define MD_KEY_ACCOUNTS         "accounts"
 #define MD_KEY_ACME_TLS_1       "acme-tls/1"
 #define MD_KEY_AGREEMENT        "agreement"
 #define MD_KEY_AUTHORIZATIONS   "authorizations"
@@ -122,31 +127,54 @@ struct md_t {
 #define MD_KEY_CA_URL           "ca-url"
 #define MD_KEY_CERT             "cert"
 #define MD_KEY_CERTIFICATE      "certificate"
+#define MD_KEY_CHAIN            "chain"
 #define MD_KEY_CHALLENGES       "challenges"
 #define MD_KEY_CONTACT          "contact"
 #define MD_KEY_CONTACTS         "contacts"
+#define MD_KEY_COUNT            "count"
+#define MD_KEY_COUNTERS         "counters"
 #define MD_KEY_CSR              "csr"
+#define MD_KEY_CURVE            "curve"
+#define MD_KEY_DELAY            "delay"
 #define MD_KEY_DETAIL           "detail"
+#define MD_KEY_DIGEST           "digest"
 #define MD_KEY_DISABLED         "disabled"
 #define MD_KEY_DIR              "dir"
+#define MD_KEY_DIRECTORY        "directory"
 #define MD_KEY_DOMAIN           "domain"
 #define MD_KEY_DOMAINS          "domains"
 #define MD_KEY_DRIVE_MODE       "drive-mode"
 #define MD_KEY_ERRORS           "errors"
 #define MD_KEY_EXPIRES          "expires"
+#define MD_KEY_FETCHED          "fetched"
 #define MD_KEY_FINALIZE         "finalize"
+#define MD_KEY_FINGERPRINT      "fingerprint"
+#define MD_KEY_HISTOGRAM        "histogram"
 #define MD_KEY_HTTP             "http"
 #define MD_KEY_HTTPS            "https"
 #define MD_KEY_ID               "id"
 #define MD_KEY_IDENTIFIER       "identifier"
+#define MD_KEY_JOBS             "jobs"
 #define MD_KEY_KEY              "key"
 #define MD_KEY_KEYAUTHZ         "keyAuthorization"
+#define MD_KEY_LAST             "last"
+#define MD_KEY_LIVE             "live"
 #define MD_KEY_LOCATION         "location"
+#define MD_KEY_MAX_MS           "max-ms"
+#define MD_KEY_MDS              "mds"
+#define MD_KEY_MESSAGE          "message"
+#define MD_KEY_METRICS          "metrics"
+#define MD_KEY_MODIFIED         "modified"
 #define MD_KEY_MUST_STAPLE      "must-staple"
 #define MD_KEY_NAME             "name"
+#define MD_KEY_NEXT_CHECK       "next-check"
+#define MD_KEY_NEXT_UPDATE      "next-update"
+#define MD_KEY_OCSP             "ocsp"
 #define MD_KEY_ORDERS           "orders"
+#define MD_KEY_OWNER            "owner"
 #define MD_KEY_PERMANENT        "permanent"
 #define MD_KEY_PKEY             "privkey"
+#define MD_KEY_POLL             "poll"
 #define MD_KEY_PROCESSED        "processed"
 #define MD_KEY_PROTO            "proto"
 #define MD_KEY_REGISTRATION     "registration"
@@ -154,13 +182,19 @@ struct md_t {
 #define MD_KEY_RENEW_WINDOW     "renew-window"
 #define MD_KEY_REQUIRE_HTTPS    "require-https"
 #define MD_KEY_RESOURCE         "resource"
+#define MD_KEY_RESPONSE         "response"
+#define MD_KEY_RESTART_PENDING  "restart-pending"
+#define MD_KEY_STAGED           "staged"
 #define MD_KEY_STATE            "state"
 #define MD_KEY_STATUS           "status"
 #define MD_KEY_STORE            "store"
 #define MD_KEY_TEMPORARY        "temporary"
+#define MD_KEY_THIS_UPDATE      "this-update"
 #define MD_KEY_TOKEN            "token"
+#define MD_KEY_TOTAL_MS         "total-ms"
 #define MD_KEY_TRANSITIVE       "transitive"
 #define MD_KEY_TYPE             "type"
+#define MD_KEY_UNTIL            "until"
 #define MD_KEY_URL              "url"
 #define MD_KEY_URI              "uri"
 #define MD_KEY_VALID_FROM       "validFrom"
@@ -171,8 +205,12 @@ struct md_t {
 #define MD_FN_JOB               "job.json"
 #define MD_FN_PRIVKEY           "privkey.pem"
 #define MD_FN_PUBCERT           "pubcert.pem"
+#define MD_FN_PUBCERT_DER       "pubcert.der"
 #define MD_FN_CERT              "cert.pem"
 #define MD_FN_HTTPD_JSON        "httpd.json"
+#define MD_FN_ASSESSMENT        "assessment.json"
+#define MD_FN_SYNC              "sync.json"
+#define MD_FN_STAGED            "staged.json"
 
 #define MD_FN_FALLBACK_PKEY     "fallback-privkey.pem"
 #define MD_FN_FALLBACK_CERT     "fallback-cert.pem"
@@ -273,6 +311,11 @@ md_t *md_from_json(struct md_json_t *json, apr_pool_t *p);
  */
 int md_should_renew(const md_t *md);
 
+/**
+ * Get the time when the MD's certificate enters its renew window, 0 if unknown.
+ */
+apr_time_t md_renew_at(const md_t *md);
+
 /**************************************************************************************************/
 /* domain credentials */
 
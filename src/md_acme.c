@@ -21,6 +21,7 @@
 #include <apr_strings.h>
 #include <apr_buckets.h>
 #include <apr_hash.h>
+#include <apr_thread_mutex.h>
 #include <apr_uri.h>
 
 #include "md.h"
@@ -29,6 +30,7 @@
 #include "md_jws.h"
 #include "md_http.h"
 #include "md_log.h"
+#include "md_metrics.h"
 #include "md_store.h"
 #include "md_util.h"
 #include "md_version.h"
@@ -85,6 +87,97 @@ static apr_status_t problem_status_get(const char *type) {
     return APR_EGENERAL;
 }
 
+/**************************************************************************************************/
+/* nonce pool */
+
+#define MD_ACME_NONCES_MAX      8
+#define MD_ACME_NONCE_MAX_LEN   255
+#define MD_ACME_NONCE_PREFETCH  2
+
+/* Every response from the ACME server may carry a fresh nonce, not all of them are used
+ * for the next request. Keep the most recent ones around so that requests rarely need
+ * an extra round trip to get one. The newest nonce is used first, if the pool runs full,
+ * the oldest one is dropped. */
+struct md_acme_nonces_t {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    int count;
+    char values[MD_ACME_NONCES_MAX][MD_ACME_NONCE_MAX_LEN+1];
+};
+
+static apr_status_t nonces_create(md_acme_nonces_t **pnonces, apr_pool_t *p)
+{
+    md_acme_nonces_t *nonces;
+    apr_status_t rv = APR_SUCCESS;
+    
+    nonces = apr_pcalloc(p, sizeof(*nonces));
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&nonces->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    *pnonces = (APR_SUCCESS == rv)? nonces : NULL;
+    return rv;
+}
+
+static void nonces_lock(md_acme_nonces_t *nonces)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(nonces->mutex);
+#else
+    (void)nonces;
+#endif
+}
+
+static void nonces_unlock(md_acme_nonces_t *nonces)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(nonces->mutex);
+#else
+    (void)nonces;
+#endif
+}
+
+static void nonces_add(md_acme_nonces_t *nonces, const char *nonce)
+{
+    size_t len = strlen(nonce);
+    
+    if (len == 0 || len > MD_ACME_NONCE_MAX_LEN) {
+        return;
+    }
+    nonces_lock(nonces);
+    if (nonces->count >= MD_ACME_NONCES_MAX) {
+        memmove(nonces->values[0], nonces->values[1], 
+                sizeof(nonces->values[0]) * (MD_ACME_NONCES_MAX - 1));
+        nonces->count = MD_ACME_NONCES_MAX - 1;
+    }
+    memcpy(nonces->values[nonces->count], nonce, len + 1);
+    ++nonces->count;
+    nonces_unlock(nonces);
+}
+
+static const char *nonces_take(md_acme_nonces_t *nonces, apr_pool_t *p)
+{
+    const char *nonce = NULL;
+    
+    nonces_lock(nonces);
+    if (nonces->count > 0) {
+        --nonces->count;
+        nonce = apr_pstrdup(p, nonces->values[nonces->count]);
+    }
+    nonces_unlock(nonces);
+    return nonce;
+}
+
+static int nonces_count(md_acme_nonces_t *nonces)
+{
+    int count;
+    
+    nonces_lock(nonces);
+    count = nonces->count;
+    nonces_unlock(nonces);
+    return count;
+}
+
 /**************************************************************************************************/
 /* acme requests */
 
@@ -93,21 +186,42 @@ static void req_update_nonce(md_acme_t *acme, apr_table_t *hdrs)
     if (hdrs) {
         const char *nonce = apr_table_get(hdrs, "Replay-Nonce");
         if (nonce) {
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            nonces_add(acme->nonces, nonce);
         }
     }
 }
 
 static apr_status_t http_update_nonce(const md_http_response_t *res)
 {
-    if (res->headers) {
-        const char *nonce = apr_table_get(res->headers, "Replay-Nonce");
-        if (nonce) {
-            md_acme_t *acme = res->req->baton;
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+    req_update_nonce(res->req->baton, res->headers);
+    return res->rv;
+}
+
+static apr_status_t prefetch_nonces(md_acme_t *acme, const char *url, int count)
+{
+    apr_array_header_t *reqs;
+    md_http_request_t *req;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    int i;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, acme->p))) {
+        return rv;
+    }
+    reqs = apr_array_make(ptemp, count, sizeof(md_http_request_t *));
+    for (i = 0; i < count; ++i) {
+        if (APR_SUCCESS != (rv = md_http_HEAD_create(&req, acme->http, url, NULL, 
+                                                     http_update_nonce, acme))) {
+            break;
         }
+        APR_ARRAY_PUSH(reqs, md_http_request_t *) = req;
     }
-    return res->rv;
+    if (reqs->nelts > 0) {
+        rv = md_http_multi_perform(acme->http, reqs);
+    }
+    apr_pool_destroy(ptemp);
+    /* having got some is good enough */
+    return (nonces_count(acme->nonces) > 0)? APR_SUCCESS : (rv? rv : APR_EGENERAL);
 }
 
 static md_acme_req_t *md_acme_req_create(md_acme_t *acme, const char *method, const char *url)
@@ -141,20 +255,441 @@ static md_acme_req_t *md_acme_req_create(md_acme_t *acme, const char *method, co
     return req;
 }
  
-static apr_status_t acmev1_new_nonce(md_acme_t *acme)
+static apr_status_t acmev1_new_nonce(md_acme_t *acme, int count)
+{
+    return prefetch_nonces(acme, acme->api.v1.new_reg, count);
+}
+
+static apr_status_t acmev2_new_nonce(md_acme_t *acme, int count)
+{
+    return prefetch_nonces(acme, acme->api.v2.new_nonce, count);
+}
+
+
+/**************************************************************************************************/
+/* rate limits */
+
+#define MD_ACME_RATE_MAX        20.0    /* requests per second to one account, default */
+#define MD_ACME_RATE_MIN        0.05
+#define MD_ACME_RATE_INCR       0.5     /* added to the rate with every successful response */
+#define MD_ACME_BURST           20.0
+#define MD_ACME_LIMITED_DELAY   apr_time_from_sec(60)
+#define MD_ACME_BUCKET_IDLE     apr_time_from_sec(60 * 60)
+
+/* Requests to a CA are paced per account by a token bucket. The rate starts at what
+ * CAs commonly allow and adapts to what the CA tells us: every successful response 
+ * raises it a little, a rateLimited problem halves it and holds back all requests
+ * of the account until the Retry-After of the CA (or a doubling delay without one). 
+ * A request that would have to wait is not sent, it fails with APR_EAGAIN and 
+ * acme->retry_after set to when it may go, so the driver thread never sleeps on it. 
+ * The buckets are shared by all md_acme_t instances of the process. Each lives in a
+ * pool of its own and is removed once unused for MD_ACME_BUCKET_IDLE. */
+
+typedef struct {
+    apr_pool_t *p;                  /* owns the bucket and its key */
+    double rate;                    /* tokens added per second */
+    double tokens;                  /* requests that may go now, negative when queued */
+    apr_time_t refilled;
+    apr_time_t blocked_until;       /* no requests before this, as the CA asked */
+    int limited;                    /* rateLimited problems in a row */
+} acme_bucket_t;
+
+static double limits_rate_max = MD_ACME_RATE_MAX;
+static apr_pool_t *limits_pool;
+static apr_hash_t *limits_buckets;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *limits_mutex;
+#endif
+
+static apr_status_t limits_cleanup(void *dummy)
+{
+    (void)dummy;
+    limits_buckets = NULL;
+    limits_pool = NULL;
+#if APR_HAS_THREADS
+    limits_mutex = NULL;
+#endif
+    return APR_SUCCESS;
+}
+
+static apr_status_t limits_init(apr_pool_t *p)
+{
+    apr_status_t rv = APR_SUCCESS;
+    
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&limits_mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        return rv;
+    }
+#endif
+    limits_pool = p;
+    limits_buckets = apr_hash_make(p);
+    apr_pool_cleanup_register(p, NULL, limits_cleanup, apr_pool_cleanup_null);
+    return rv;
+}
+
+static void limits_lock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(limits_mutex);
+#endif
+}
+
+static void limits_unlock(void)
 {
-    return md_http_HEAD(acme->http, acme->api.v1.new_reg, NULL, http_update_nonce, acme);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(limits_mutex);
+#endif
 }
 
-static apr_status_t acmev2_new_nonce(md_acme_t *acme)
+/* call with limits locked */
+static void buckets_expire(apr_time_t now)
 {
-    return md_http_HEAD(acme->http, acme->api.v2.new_nonce, NULL, http_update_nonce, acme);
+    apr_hash_index_t *hi;
+    acme_bucket_t *b;
+    const void *key;
+    
+    for (hi = apr_hash_first(NULL, limits_buckets); hi; ) {
+        apr_hash_this(hi, &key, NULL, (void**)&b);
+        hi = apr_hash_next(hi);
+        if (b->blocked_until <= now && now - b->refilled > MD_ACME_BUCKET_IDLE) {
+            apr_hash_set(limits_buckets, key, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(b->p);
+        }
+    }
 }
 
+/* call with limits locked, NULL if no bucket could be made */
+static acme_bucket_t *bucket_get(md_acme_t *acme, apr_pool_t *p, apr_time_t now)
+{
+    acme_bucket_t *b;
+    apr_pool_t *bp;
+    const char *key;
+    
+    key = apr_pstrcat(p, acme->url, " ", acme->acct? acme->acct->url : "", NULL);
+    if (!(b = apr_hash_get(limits_buckets, key, APR_HASH_KEY_STRING))) {
+        buckets_expire(now);
+        if (APR_SUCCESS != apr_pool_create(&bp, limits_pool)) {
+            return NULL;
+        }
+        b = apr_pcalloc(bp, sizeof(*b));
+        b->p = bp;
+        b->rate = limits_rate_max;
+        b->tokens = MD_ACME_BURST;
+        b->refilled = now;
+        apr_hash_set(limits_buckets, apr_pstrdup(bp, key), APR_HASH_KEY_STRING, b);
+    }
+    else if (now > b->refilled) {
+        b->tokens += b->rate * (double)(now - b->refilled) / APR_USEC_PER_SEC;
+        if (b->tokens > MD_ACME_BURST) {
+            b->tokens = MD_ACME_BURST;
+        }
+        b->refilled = now;
+    }
+    return b;
+}
+
+static apr_status_t limits_pace(md_acme_req_t *req)
+{
+    acme_bucket_t *b;
+    apr_time_t now;
+    apr_interval_time_t wait = 0;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (!limits_buckets || limits_rate_max <= 0 || !req->acme->url) {
+        return APR_SUCCESS;
+    }
+    now = apr_time_now();
+    limits_lock();
+    if ((b = bucket_get(req->acme, req->p, now))) {
+        if (b->blocked_until > now) {
+            wait = b->blocked_until - now;
+        }
+        else if (b->tokens < 1.0) {
+            wait = (apr_interval_time_t)((1.0 - b->tokens) / b->rate * APR_USEC_PER_SEC);
+        }
+        if (wait > 0) {
+            req->acme->retry_after = now + wait;
+            rv = APR_EAGAIN;
+        }
+        else {
+            b->tokens -= 1.0;
+        }
+    }
+    limits_unlock();
+    
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, req->p, "acme rate limit, not sending "
+                      "%s %s for %s", req->method, req->url, md_print_duration(req->p, wait));
+    }
+    return rv;
+}
+
+static void limits_learn(md_acme_t *acme, apr_pool_t *p, int limited)
+{
+    acme_bucket_t *b;
+    apr_time_t now;
+    apr_interval_time_t delay;
+    
+    if (!limits_buckets || limits_rate_max <= 0 || !acme->url) {
+        return;
+    }
+    now = apr_time_now();
+    limits_lock();
+    if (!(b = bucket_get(acme, p, now))) {
+        /* nothing to learn for */
+    }
+    else if (limited) {
+        ++b->limited;
+        b->rate /= 2;
+        if (b->rate < MD_ACME_RATE_MIN) {
+            b->rate = MD_ACME_RATE_MIN;
+        }
+        if (b->tokens > 0) {
+            b->tokens = 0;
+        }
+        delay = MD_ACME_LIMITED_DELAY << ((b->limited > 6)? 5 : b->limited - 1);
+        b->blocked_until = (acme->retry_after > now)? acme->retry_after : now + delay;
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "acme %s rate limited, pausing "
+                      "requests for %s, then sending %.2f per second", acme->url, 
+                      md_print_duration(p, b->blocked_until - now), b->rate);
+    }
+    else {
+        b->limited = 0;
+        b->rate += MD_ACME_RATE_INCR;
+        if (b->rate > limits_rate_max) {
+            b->rate = limits_rate_max;
+        }
+    }
+    limits_unlock();
+}
+
+void md_acme_rate_max_set(int rate)
+{
+    limits_rate_max = (rate > 0)? rate : 0;
+}
+
+/**************************************************************************************************/
+/* CA state shared by all md_acme_t of the process */
+
+/* The directory of a CA changes rarely, the nonces it hands out are good for any
+ * account and an account that was valid a moment ago still is. Renewing several MDs
+ * at the same CA would otherwise repeat these round trips for each of them. Directory
+ * documents and account checks are reused for cache_ttl, nonces are shared by all
+ * instances talking to the same CA. Lives in the pool given to md_acme_init().
+ * The watchdog child that renews is replaced at every graceful restart, taking this
+ * memory with it. Directories are therefore also saved, with their fetch time, in
+ * the MD_SG_CACHE group of the store, writable by the child, and read from there 
+ * when the memory has none. */
+
+typedef struct {
+    apr_pool_t *pool;               /* for the directory document, cleared on refresh */
+    const char *directory;          /* the document, serialized, or NULL */
+    apr_time_t fetched;
+    md_acme_nonces_t *nonces;
+} acme_ca_t;
+
+static apr_interval_time_t cache_ttl = apr_time_from_sec(MD_SECS_PER_HOUR);
+static apr_hash_t *ca_entries;
+static apr_hash_t *acct_checks;
+
+static apr_status_t cas_cleanup(void *dummy)
+{
+    (void)dummy;
+    ca_entries = NULL;
+    acct_checks = NULL;
+    return APR_SUCCESS;
+}
+
+static void cas_init(apr_pool_t *p)
+{
+    ca_entries = apr_hash_make(p);
+    acct_checks = apr_hash_make(p);
+    apr_pool_cleanup_register(p, NULL, cas_cleanup, apr_pool_cleanup_null);
+}
+
+/* call with limits locked */
+static acme_ca_t *ca_get(const char *url)
+{
+    acme_ca_t *ca;
+    
+    if (!(ca = apr_hash_get(ca_entries, url, APR_HASH_KEY_STRING))) {
+        ca = apr_pcalloc(limits_pool, sizeof(*ca));
+        if (APR_SUCCESS != apr_pool_create(&ca->pool, limits_pool)
+            || APR_SUCCESS != nonces_create(&ca->nonces, limits_pool)) {
+            return NULL;
+        }
+        apr_hash_set(ca_entries, apr_pstrdup(limits_pool, url), APR_HASH_KEY_STRING, ca);
+    }
+    return ca;
+}
+
+static md_acme_nonces_t *ca_nonces_get(const char *url)
+{
+    acme_ca_t *ca;
+    md_acme_nonces_t *nonces = NULL;
+    
+    if (ca_entries) {
+        limits_lock();
+        if ((ca = ca_get(url))) {
+            nonces = ca->nonces;
+        }
+        limits_unlock();
+    }
+    return nonces;
+}
+
+/* call with limits locked */
+static void ca_directory_keep(acme_ca_t *ca, md_json_t *json, apr_time_t fetched)
+{
+    apr_pool_clear(ca->pool);
+    ca->directory = md_json_writep(json, ca->pool, MD_JSON_FMT_COMPACT);
+    ca->fetched = fetched;
+}
+
+static const char *ca_store_name(md_acme_t *acme)
+{
+    const char *hex;
+    
+    if (APR_SUCCESS != md_crypt_sha256_digest_hex(&hex, acme->p, acme->url, strlen(acme->url))) {
+        return NULL;
+    }
+    return apr_pstrcat(acme->p, "ca-", hex, NULL);
+}
+
+static md_json_t *ca_directory_load(md_acme_t *acme, apr_time_t *pfetched)
+{
+    md_json_t *json, *dir;
+    const char *name, *url;
+    
+    if (!acme->store || !(name = ca_store_name(acme))
+        || APR_SUCCESS != md_store_load_json(acme->store, MD_SG_CACHE, name, 
+                                             MD_FN_CA_DIRECTORY, &json, acme->p)) {
+        return NULL;
+    }
+    url = md_json_gets(json, MD_KEY_URL, NULL);
+    *pfetched = apr_time_from_sec(md_json_getl(json, MD_KEY_FETCHED, NULL));
+    dir = md_json_getj(json, MD_KEY_DIRECTORY, NULL);
+    if (!url || strcmp(url, acme->url) || !dir
+        || apr_time_now() - *pfetched >= cache_ttl) {
+        return NULL;
+    }
+    return dir;
+}
+
+static void ca_directory_save(md_acme_t *acme, md_json_t *dir, apr_time_t fetched)
+{
+    md_json_t *json;
+    const char *name;
+    apr_status_t rv;
+    
+    if (!acme->store || !(name = ca_store_name(acme))) return;
+    json = md_json_create(acme->p);
+    md_json_sets(acme->url, json, MD_KEY_URL, NULL);
+    md_json_setl((long)apr_time_sec(fetched), json, MD_KEY_FETCHED, NULL);
+    md_json_setj(dir, json, MD_KEY_DIRECTORY, NULL);
+    rv = md_store_save_json(acme->store, acme->p, MD_SG_CACHE, name, 
+                            MD_FN_CA_DIRECTORY, json, 0);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, acme->p, 
+                      "saving directory of %s", acme->url);
+    }
+}
+
+static md_json_t *ca_directory_get(md_acme_t *acme)
+{
+    acme_ca_t *ca;
+    md_json_t *json = NULL, *dir;
+    apr_time_t fetched;
+    
+    if (cache_ttl <= 0) return NULL;
+    if (ca_entries) {
+        limits_lock();
+        if ((ca = ca_get(acme->url)) && ca->directory 
+            && apr_time_now() - ca->fetched < cache_ttl) {
+            md_json_readd(&json, acme->p, ca->directory, strlen(ca->directory));
+        }
+        limits_unlock();
+    }
+    if (!json && (dir = ca_directory_load(acme, &fetched))) {
+        json = dir;
+        if (ca_entries) {
+            limits_lock();
+            if ((ca = ca_get(acme->url))) {
+                ca_directory_keep(ca, json, fetched);
+            }
+            limits_unlock();
+        }
+    }
+    return json;
+}
+
+/* only for documents freshly fetched from the CA, reuse must not extend their time */
+static void ca_directory_set(md_acme_t *acme, md_json_t *json)
+{
+    acme_ca_t *ca;
+    apr_time_t now = apr_time_now();
+    
+    if (cache_ttl <= 0) return;
+    if (ca_entries) {
+        limits_lock();
+        if ((ca = ca_get(acme->url))) {
+            ca_directory_keep(ca, json, now);
+        }
+        limits_unlock();
+    }
+    ca_directory_save(acme, json, now);
+}
+
+int md_acme_acct_checked(md_acme_t *acme)
+{
+    apr_time_t *checked;
+    const char *key;
+    int fresh = 0;
+    
+    if (acct_checks && cache_ttl > 0 && acme->acct && acme->acct->url) {
+        key = apr_pstrcat(acme->p, acme->url, " ", acme->acct->url, NULL);
+        limits_lock();
+        checked = apr_hash_get(acct_checks, key, APR_HASH_KEY_STRING);
+        fresh = (checked && apr_time_now() - *checked < cache_ttl);
+        limits_unlock();
+    }
+    return fresh;
+}
+
+void md_acme_acct_checked_set(md_acme_t *acme, int valid)
+{
+    apr_time_t *checked;
+    const char *key;
+    
+    if (acct_checks && acme->acct && acme->acct->url) {
+        key = apr_pstrcat(acme->p, acme->url, " ", acme->acct->url, NULL);
+        limits_lock();
+        if (!(checked = apr_hash_get(acct_checks, key, APR_HASH_KEY_STRING))) {
+            checked = apr_pcalloc(limits_pool, sizeof(*checked));
+            apr_hash_set(acct_checks, apr_pstrdup(limits_pool, key), APR_HASH_KEY_STRING, checked);
+        }
+        *checked = valid? apr_time_now() : 0;
+        limits_unlock();
+    }
+}
+
+void md_acme_cache_ttl_set(apr_interval_time_t ttl)
+{
+    cache_ttl = (ttl > 0)? ttl : 0;
+}
 
 apr_status_t md_acme_init(apr_pool_t *p, const char *base,  int init_ssl)
 {
+    apr_status_t rv;
+    
     base_product = base;
+    if (!limits_buckets) {
+        if (APR_SUCCESS != (rv = limits_init(p))) {
+            return rv;
+        }
+        cas_init(p);
+    }
     return init_ssl? md_crypt_init(p) : APR_SUCCESS;
 }
 
@@ -175,6 +710,11 @@ static apr_status_t inspect_problem(md_acme_req_t *req, const md_http_response_t
             pdetail = md_json_gets(problem, MD_KEY_DETAIL, NULL);
             req->rv = problem_status_get(ptype);
             
+            if (ptype && strstr(ptype, "rateLimited")) {
+                /* retried once the limit allows */
+                limits_learn(req->acme, req->p, 1);
+                req->rv = APR_EAGAIN;
+            }
             if (APR_STATUS_IS_EAGAIN(req->rv)) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, req->rv, req->p,
                               "acme reports %s: %s", ptype, pdetail);
@@ -195,6 +735,9 @@ static apr_status_t inspect_problem(md_acme_req_t *req, const md_http_response_t
                 return APR_EACCES;
             case 404:
                 return APR_ENOENT;
+            case 429:
+                limits_learn(req->acme, req->p, 1);
+                return APR_EAGAIN;
             default:
                 md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, req->p,
                               "acme problem unknown: http status %d", res->status);
@@ -263,22 +806,54 @@ static apr_status_t md_acme_req_done(md_acme_req_t *req)
     return rv;
 }
 
-static apr_status_t on_response(const md_http_response_t *res)
+static int url_is(const char *url, const char *api_url)
+{
+    return api_url && !strcmp(url, api_url);
+}
+
+/* The endpoint a request goes to, for metrics. Requests to orders, authorizations etc. 
+ * are known by their method only, since their urls are particular to each. */
+static const char *req_endpoint(md_acme_req_t *req)
+{
+    md_acme_t *acme = req->acme;
+    
+    if (url_is(req->url, acme->url)) return "directory";
+    if (MD_ACME_VERSION_MAJOR(acme->version) > 1) {
+        if (url_is(req->url, acme->api.v2.new_nonce)) return "new-nonce";
+        if (url_is(req->url, acme->api.v2.new_account)) return "new-account";
+        if (url_is(req->url, acme->api.v2.new_order)) return "new-order";
+        if (url_is(req->url, acme->api.v2.key_change)) return "key-change";
+        if (url_is(req->url, acme->api.v2.revoke_cert)) return "revoke-cert";
+    }
+    else if (MD_ACME_VERSION_MAJOR(acme->version) == 1) {
+        if (url_is(req->url, acme->api.v1.new_reg)) return "new-reg";
+        if (url_is(req->url, acme->api.v1.new_authz)) return "new-authz";
+        if (url_is(req->url, acme->api.v1.new_cert)) return "new-cert";
+        if (url_is(req->url, acme->api.v1.revoke_cert)) return "revoke-cert";
+    }
+    return req->method;
+}
+
+static apr_status_t req_response(md_acme_req_t *req, const md_http_response_t *res)
 {
-    md_acme_req_t *req = res->req->baton;
     apr_status_t rv = res->rv;
     
+    md_metrics_record(MD_METRICS_ACME, req_endpoint(req), apr_time_now() - req->sent, 
+                      APR_SUCCESS != rv || res->status >= 400);
     if (APR_SUCCESS != rv) {
         goto out;
     }
     
     req->resp_hdrs = apr_table_clone(req->p, res->headers);
     req_update_nonce(req->acme, res->headers);
+    req->acme->retry_after = md_util_parse_retry_after(apr_table_get(res->headers, "Retry-After"),
+                                                       apr_time_now());
     
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, req->p, "response: %d", res->status);
     if (res->status >= 200 && res->status < 300) {
         int processed = 0;
         
+        limits_learn(req->acme, req->p, 0);
         if (req->on_json) {
             processed = 1;
             rv = md_json_read_http(&req->resp_json, req->p, res);
@@ -323,14 +898,33 @@ out:
     return rv;
 }
 
-static apr_status_t md_acme_req_send(md_acme_req_t *req)
+static apr_status_t on_response(const md_http_response_t *res)
+{
+    return req_response(res->req->baton, res);
+}
+
+static apr_status_t req_body_write(void *baton, apr_bucket_brigade *body)
+{
+    md_acme_req_t *req = baton;
+    
+    /* serialized straight into the request brigade, compact since indentation
+     * only adds bytes on the wire */
+    return md_json_writeb(req->req_json, MD_JSON_FMT_COMPACT, body);
+}
+
+static apr_status_t req_http_create(md_http_request_t **phreq, md_acme_req_t *req,
+                                    md_http_cb *cb, void *baton)
 {
     apr_status_t rv;
     md_acme_t *acme = req->acme;
-    const char *body = NULL;
+    const char *nonce;
 
     assert(acme->url);
     
+    *phreq = NULL;
+    if (APR_SUCCESS != (rv = limits_pace(req))) {
+        return rv;
+    }
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
                   "sending req: %s %s", req->method, req->url);
     if (strcmp("GET", req->method) && strcmp("HEAD", req->method)) {
@@ -339,34 +933,30 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
                 return rv;
             }
         }
-        if (!acme->nonce) {
-            if (APR_SUCCESS != (rv = acme->new_nonce_fn(acme))) {
+        /* on retries, e.g. after a badNonce, this takes the nonce from the last response */
+        if (!(nonce = nonces_take(acme->nonces, req->p))) {
+            if (APR_SUCCESS != (rv = acme->new_nonce_fn(acme, acme->nonce_prefetch))
+                || !(nonce = nonces_take(acme->nonces, req->p))) {
+                rv = (APR_SUCCESS == rv)? APR_EGENERAL : rv;
                 md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, req->p, 
                               "error retrieving new nonce from ACME server");
                 return rv;
             }
         }
         
-        apr_table_set(req->prot_hdrs, "nonce", acme->nonce);
+        apr_table_set(req->prot_hdrs, "nonce", nonce);
         if (MD_ACME_VERSION_MAJOR(acme->version) > 1) {
             apr_table_set(req->prot_hdrs, "url", req->url);
         }
-        acme->nonce = NULL;
     }
     
     rv = req->on_init? req->on_init(req, req->baton) : APR_SUCCESS;
     
-    if ((rv == APR_SUCCESS) && req->req_json) {
-        body = md_json_writep(req->req_json, req->p, MD_JSON_FMT_INDENT);
-        if (!body) {
-            rv = APR_EINVAL;
-        }
-    }
-
     if (rv == APR_SUCCESS) {
-        if (body && md_log_is_level(req->p, MD_LOG_TRACE2)) {
+        if (req->req_json && md_log_is_level(req->p, MD_LOG_TRACE2)) {
             md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, req->p, 
-                          "req: %s %s, body:\n%s", req->method, req->url, body);
+                          "req: %s %s, body:\n%s", req->method, req->url, 
+                          md_json_writep(req->req_json, req->p, MD_JSON_FMT_INDENT));
         }
         else {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
@@ -374,32 +964,149 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
         }
         
         if (!strcmp("GET", req->method)) {
-            rv = md_http_GET(req->acme->http, req->url, NULL, on_response, req);
+            rv = md_http_GET_create(phreq, acme->http, req->url, NULL, cb, baton);
         }
         else if (!strcmp("POST", req->method)) {
-            rv = md_http_POSTd(req->acme->http, req->url, NULL, "application/jose+json",  
-                               body, body? strlen(body) : 0, on_response, req);
+            rv = md_http_POSTw_create(phreq, acme->http, req->url, NULL, "application/jose+json",  
+                                      req->req_json? req_body_write : NULL, req, cb, baton);
         }
         else if (!strcmp("HEAD", req->method)) {
-            rv = md_http_HEAD(req->acme->http, req->url, NULL, on_response, req);
+            rv = md_http_HEAD_create(phreq, acme->http, req->url, NULL, cb, baton);
         }
         else {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, req->p, 
                           "HTTP method %s against: %s", req->method, req->url);
             rv = APR_ENOTIMPL;
         }
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, req->p, "req sent");
-        
-        if (APR_EAGAIN == rv && req->max_retries > 0) {
-            --req->max_retries;
-            return md_acme_req_send(req);
-        }
-        req = NULL;
     }
+    req->sent = apr_time_now();
+    return rv;
+}
 
-    if (req) {
+static apr_status_t md_acme_req_send(md_acme_req_t *req)
+{
+    md_http_request_t *hreq;
+    apr_status_t rv;
+    
+    if (req->acme->batch) {
+        /* sent later in md_acme_batch_perform() */
+        APR_ARRAY_PUSH(req->acme->batch, md_acme_req_t *) = req;
+        return APR_SUCCESS;
+    }
+    
+    if (APR_SUCCESS != (rv = req_http_create(&hreq, req, on_response, req))) {
         md_acme_req_done(req);
+        return rv;
+    }
+    
+    rv = md_http_perform(hreq);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, req->p, "req sent");
+    
+    if (APR_EAGAIN == rv && req->max_retries > 0) {
+        --req->max_retries;
+        return md_acme_req_send(req);
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* batches of requests */
+
+#define MD_ACME_BATCH_MAX       MD_ACME_NONCES_MAX
+
+typedef struct {
+    md_acme_req_t *req;             /* the request, NULL once it is done */
+    apr_status_t rv;
+} batch_item_t;
+
+static apr_status_t on_batch_response(const md_http_response_t *res)
+{
+    batch_item_t *item = res->req->baton;
+    
+    item->rv = req_response(item->req, res);
+    if (APR_EAGAIN != item->rv) {
+        /* req_response() has destroyed the request */
+        item->req = NULL;
+    }
+    return item->rv;
+}
+
+static int needs_nonce(const md_acme_req_t *req)
+{
+    return strcmp("GET", req->method) && strcmp("HEAD", req->method);
+}
+
+void md_acme_batch_start(md_acme_t *acme, apr_pool_t *p)
+{
+    assert(!acme->batch);
+    acme->batch = apr_array_make(p, 10, sizeof(md_acme_req_t *));
+}
+
+apr_status_t md_acme_batch_perform(md_acme_t *acme)
+{
+    apr_array_header_t *queued = acme->batch, *hreqs;
+    batch_item_t *items;
+    md_http_request_t *hreq;
+    md_acme_req_t *req;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int i, start, n, nonces, missing;
+    
+    assert(queued);
+    /* requests made while processing responses are sent right away */
+    acme->batch = NULL;
+    if (queued->nelts <= 0) {
+        return APR_SUCCESS;
+    }
+    
+    items = apr_pcalloc(queued->pool, (apr_size_t)queued->nelts * sizeof(*items));
+    hreqs = apr_array_make(queued->pool, MD_ACME_BATCH_MAX, sizeof(md_http_request_t *));
+    for (start = 0; start < queued->nelts; start += MD_ACME_BATCH_MAX) {
+        /* Send at most MD_ACME_BATCH_MAX requests at a time, which is also the 
+         * number of nonces to get in one go for them to be signed. */
+        n = queued->nelts - start;
+        n = (n > MD_ACME_BATCH_MAX)? MD_ACME_BATCH_MAX : n;
+        for (i = start, nonces = 0; i < start + n; ++i) {
+            nonces += needs_nonce(APR_ARRAY_IDX(queued, i, md_acme_req_t *));
+        }
+        missing = nonces - nonces_count(acme->nonces);
+        if (missing > 0 && acme->version != MD_ACME_VERSION_UNKNOWN) {
+            /* if this fails, req_http_create() gets them one by one */
+            acme->new_nonce_fn(acme, missing);
+        }
+        
+        apr_array_clear(hreqs);
+        for (i = start; i < start + n; ++i) {
+            req = APR_ARRAY_IDX(queued, i, md_acme_req_t *);
+            items[i].req = req;
+            items[i].rv = APR_EINCOMPLETE;
+            if (APR_SUCCESS != (rv2 = req_http_create(&hreq, req, on_batch_response, &items[i]))) {
+                md_acme_req_done(req);
+                items[i].req = NULL;
+                items[i].rv = rv2;
+                continue;
+            }
+            APR_ARRAY_PUSH(hreqs, md_http_request_t *) = hreq;
+        }
+        md_http_multi_perform(acme->http, hreqs);
+        
+        for (i = start; i < start + n; ++i) {
+            if ((req = items[i].req)) {
+                if (APR_EAGAIN == items[i].rv && req->max_retries > 0) {
+                    --req->max_retries;
+                    items[i].rv = md_acme_req_send(req);
+                }
+                else {
+                    md_acme_req_done(req);
+                }
+                items[i].req = NULL;
+            }
+            if (APR_SUCCESS == rv) {
+                rv = items[i].rv;
+            }
+        }
     }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, acme->p, 
+                  "performed batch of %d requests", queued->nelts);
     return rv;
 }
 
@@ -461,7 +1168,7 @@ static apr_status_t on_got_json(md_acme_t *acme, apr_pool_t *p, const apr_table_
     (void)acme;
     (void)p;
     (void)headers;
-    ctx->json = md_json_clone(ctx->pool, jbody);
+    ctx->json = md_json_share(ctx->pool, jbody);
     return APR_SUCCESS;
 }
 
@@ -584,6 +1291,12 @@ apr_status_t md_acme_create(md_acme_t **pacme, apr_pool_t *p, const char *url,
                                     base_product, MOD_MD_VERSION);
     acme->proxy_url = proxy_url? apr_pstrdup(p, proxy_url) : NULL;
     acme->max_retries = 3;
+    acme->nonce_prefetch = MD_ACME_NONCE_PREFETCH;
+    if (!(acme->nonces = ca_nonces_get(url)) 
+        && APR_SUCCESS != (rv = nonces_create(&acme->nonces, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "creating nonce pool");
+        return rv;
+    }
     
     if (APR_SUCCESS != (rv = apr_uri_parse(p, url, &uri_parsed))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "parsing ACME uri: %s", url);
@@ -604,6 +1317,7 @@ apr_status_t md_acme_setup(md_acme_t *acme)
     apr_status_t rv;
     md_json_t *json;
     const char *s;
+    int fetched = 0;
     
     assert(acme->url);
     acme->version = MD_ACME_VERSION_UNKNOWN;
@@ -614,6 +1328,12 @@ apr_status_t md_acme_setup(md_acme_t *acme)
     }
     md_http_set_response_limit(acme->http, 1024*1024);
     
+    if ((json = ca_directory_get(acme))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "using known directory of %s", 
+                      acme->url);
+        rv = APR_SUCCESS;
+        goto parse;
+    }
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "get directory from %s", acme->url);
     
     rv = md_acme_get_json(&json, acme, acme->url, acme->p);
@@ -628,7 +1348,9 @@ apr_status_t md_acme_setup(md_acme_t *acme)
                       "continue retrying this.", acme->url);
         goto out;
     }
+    fetched = 1;
     
+parse:
     if ((s = md_json_gets(json, "new-authz", NULL))) {
         acme->api.v1.new_authz = s;
         acme->api.v1.new_cert = md_json_gets(json, "new-cert", NULL);
@@ -665,6 +1387,9 @@ apr_status_t md_acme_setup(md_acme_t *acme)
                       "Unable to understand ACME server response. Wrong ACME protocol version or link?");
         rv = APR_EINVAL;
     }
+    else if (fetched) {
+        ca_directory_set(acme, json);
+    }
 out:
     return rv;
 }
@@ -26,6 +26,7 @@ struct md_json_t;
 struct md_pkey_t;
 struct md_t;
 struct md_acme_acct_t;
+struct md_acme_acct_index_t;
 struct md_acmev2_acct_t;
 struct md_proto_t;
 struct md_store_t;
@@ -41,6 +42,8 @@ struct md_store_t;
 
 #define MD_ACME_VERSION_MAJOR(i)    (((i)&0xFF0000) >> 16)
 
+#define MD_FN_CA_DIRECTORY          "directory.json"
+
 typedef enum {
     MD_ACME_S_UNKNOWN,              /* MD has not been analysed yet */
     MD_ACME_S_REGISTERED,           /* MD is registered at CA, but not more */
@@ -74,7 +77,13 @@ typedef apr_status_t md_acme_req_json_cb(md_acme_t *acme, apr_pool_t *p,
                                          const apr_table_t *headers, 
                                          struct md_json_t *jbody, void *baton);
 
-typedef apr_status_t md_acme_new_nonce_fn(md_acme_t *acme);
+typedef struct md_acme_nonces_t md_acme_nonces_t;
+
+/**
+ * Fetch count new nonces from the server into acme->nonces. Succeeds if at least
+ * one nonce is available afterwards.
+ */
+typedef apr_status_t md_acme_new_nonce_fn(md_acme_t *acme, int count);
 typedef apr_status_t md_acme_req_init_fn(md_acme_req_t *req, struct md_json_t *jpayload);
 
 typedef apr_status_t md_acme_post_fn(md_acme_t *acme, 
@@ -89,10 +98,13 @@ struct md_acme_t {
     apr_pool_t *p;
     const char *user_agent;
     const char *proxy_url;
+    struct md_store_t *store;       /* where CA directories are kept across restarts or NULL */
     
     const char *acct_id;            /* local storage id account was loaded from or NULL */
     struct md_acme_acct_t *acct;    /* account at ACME server to use for requests */
-    struct md_pkey_t *acct_key;     /* private RSA key belonging to account */
+    struct md_pkey_t *acct_key;     /* private key belonging to account */
+    struct md_pkey_spec_t *acct_key_spec; /* for new account keys, NULL for RSA default */
+    struct md_acme_acct_index_t *acct_index; /* accounts in store, read when needed */
     
     int version;                    /* as detected from the server */
     union {
@@ -120,8 +132,13 @@ struct md_acme_t {
     
     struct md_http_t *http;
     
-    const char *nonce;
+    md_acme_nonces_t *nonces;       /* replay nonces received and not used yet */
+    int nonce_prefetch;             /* number of nonces to fetch when none are left */
+    struct apr_array_header_t *batch; /* requests queued for md_acme_batch_perform() or NULL */
+    struct apr_array_header_t *dns01; /* dns-01 challenges waiting for their TXT records */
+    struct apr_array_header_t *preflight; /* http-01 challenges to check before validation */
     int max_retries;
+    apr_time_t retry_after;         /* when the last response asked us to retry or 0 */
 };
 
 /**
@@ -129,6 +146,27 @@ struct md_acme_t {
  */
 apr_status_t md_acme_init(apr_pool_t *pool, const char *base_version, int init_ssl);
 
+/**
+ * Set the most requests per second sent to a CA for one account. Requests are
+ * paced below that when the CA answers with rateLimited problems. 0 turns pacing off.
+ */
+void md_acme_rate_max_set(int rate);
+
+/**
+ * Set how long directory documents of CAs and successful account checks are reused
+ * by all instances of the process. 0 turns this off. Directories are also kept
+ * in the MD_SG_CACHE group of the store of an instance, so that the processes
+ * started after a restart find them.
+ */
+void md_acme_cache_ttl_set(apr_interval_time_t ttl);
+
+/**
+ * != 0 iff the current account of acme was checked valid at the CA within the
+ * cache time. Record the outcome of a check with md_acme_acct_checked_set().
+ */
+int md_acme_acct_checked(md_acme_t *acme);
+void md_acme_acct_checked_set(md_acme_t *acme, int valid);
+
 /**
  * Create a new ACME server instance. If path is not NULL, will use that directory
  * for persisting information. Will load any information persisted in earlier session.
@@ -232,6 +270,7 @@ struct md_acme_req_t {
     md_acme_req_res_cb *on_res;    /* callback on generic HTTP response */
     int max_retries;               /* how often this might be retried */
     void *baton;                   /* userdata for callbacks */
+    apr_time_t sent;               /* when the request was last sent */
 };
 
 apr_status_t md_acme_req_body_init(md_acme_req_t *req, struct md_json_t *payload);
@@ -267,6 +306,21 @@ apr_status_t md_acme_GET(md_acme_t *acme, const char *url,
                          md_acme_req_res_cb *on_res,
                          void *baton);
 
+/**
+ * Start a batch of requests: until md_acme_batch_perform() is called, md_acme_GET()
+ * and md_acme_POST() only queue their requests and return APR_SUCCESS. Callbacks
+ * are invoked later, so batons need to stay valid until the batch is performed.
+ * Not for md_acme_get_json(), which needs its response right away.
+ */
+void md_acme_batch_start(md_acme_t *acme, apr_pool_t *p);
+
+/**
+ * Send all queued requests of the batch, several at a time, and end it.
+ * @return APR_SUCCESS if all requests succeeded, otherwise the status of the
+ *         first one that failed
+ */
+apr_status_t md_acme_batch_perform(md_acme_t *acme);
+
 /**
  * Retrieve a JSON resource from the ACME server 
  */
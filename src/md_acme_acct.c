@@ -16,6 +16,7 @@
  
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <apr_lib.h>
 #include <apr_file_info.h>
@@ -62,11 +63,6 @@ static const char *mk_acct_id(apr_pool_t *p, md_acme_t *acme, int i)
     return apr_psprintf(p, "ACME-%s-%04d", acme->sname, i);
 }
 
-static const char *mk_acct_pattern(apr_pool_t *p, md_acme_t *acme)
-{
-    return apr_psprintf(p, "ACME-%s-*", acme->sname);
-}
- 
 /**************************************************************************************************/
 /* json load/save */
 
@@ -86,6 +82,30 @@ static md_acme_acct_st acct_st_from_str(const char *s)
     return MD_ACME_ACCT_ST_UNKNOWN;
 }
 
+static const char *acct_st_to_str(md_acme_acct_st status) 
+{
+    switch (status) {
+        case MD_ACME_ACCT_ST_VALID:
+            return "valid";
+        case MD_ACME_ACCT_ST_DEACTIVATED:
+            return "deactivated";
+        case MD_ACME_ACCT_ST_REVOKED:
+            return "revoked";
+        default:
+            return NULL;
+    }    
+}
+
+static md_acme_acct_st acct_st_from_json(md_json_t *json) 
+{
+    if (md_json_has_key(json, MD_KEY_STATUS, NULL)) {
+        return acct_st_from_str(md_json_gets(json, MD_KEY_STATUS, NULL));
+    }
+    /* old accounts only had disabled boolean field */
+    return md_json_getb(json, MD_KEY_DISABLED, NULL)? 
+        MD_ACME_ACCT_ST_DEACTIVATED : MD_ACME_ACCT_ST_VALID;
+}
+
 md_json_t *md_acme_acct_to_json(md_acme_acct_t *acct, apr_pool_t *p)
 {
     md_json_t *jacct;
@@ -93,21 +113,7 @@ md_json_t *md_acme_acct_to_json(md_acme_acct_t *acct, apr_pool_t *p)
 
     assert(acct);
     jacct = md_json_create(p);
-    switch (acct->status) {
-        case MD_ACME_ACCT_ST_VALID:
-            s = "valid";
-            break;
-        case MD_ACME_ACCT_ST_DEACTIVATED:
-            s = "deactivated";
-            break;
-        case MD_ACME_ACCT_ST_REVOKED:
-            s = "revoked";
-            break;
-        default:
-            s = NULL;
-            break;
-    }    
-    if (s) {
+    if ((s = acct_st_to_str(acct->status))) {
         md_json_sets(s, jacct, MD_KEY_STATUS, NULL);
     }
     md_json_sets(acct->url, jacct, MD_KEY_URL, NULL);
@@ -127,18 +133,11 @@ apr_status_t md_acme_acct_from_json(md_acme_acct_t **pacct, md_json_t *json, apr
 {
     apr_status_t rv = APR_EINVAL;
     md_acme_acct_t *acct;
-    md_acme_acct_st status = MD_ACME_ACCT_ST_UNKNOWN;
+    md_acme_acct_st status;
     const char *ca_url, *url;
     apr_array_header_t *contacts;
     
-    if (md_json_has_key(json, MD_KEY_STATUS, NULL)) {
-        status = acct_st_from_str(md_json_gets(json, MD_KEY_STATUS, NULL));
-    }
-    else {
-        /* old accounts only had disabled boolean field */
-        status = md_json_getb(json, MD_KEY_DISABLED, NULL)? 
-            MD_ACME_ACCT_ST_DEACTIVATED : MD_ACME_ACCT_ST_VALID;
-    }
+    status = acct_st_from_json(json);
     
     url = md_json_gets(json, MD_KEY_URL, NULL);
     if (!url) {
@@ -167,11 +166,14 @@ out:
     return rv;
 }
 
+static apr_status_t index_update(md_store_t *store, apr_pool_t *p, 
+                                 const char *id, md_acme_acct_t *acct);
+
 apr_status_t md_acme_acct_save(md_store_t *store, apr_pool_t *p, md_acme_t *acme, 
                                const char **pid, md_acme_acct_t *acct, md_pkey_t *acct_key)
 {
     md_json_t *jacct;
-    apr_status_t rv;
+    apr_status_t rv, rv2;
     int i;
     const char *id = pid? *pid : NULL;
     
@@ -190,6 +192,13 @@ apr_status_t md_acme_acct_save(md_store_t *store, apr_pool_t *p, md_acme_t *acme
         if (pid) *pid = id;
         rv = md_store_save(store, p, MD_SG_ACCOUNTS, id, MD_FN_ACCT_KEY, MD_SV_PKEY, acct_key, 0);
     }
+    if (APR_SUCCESS == rv) {
+        if (APR_SUCCESS != (rv2 = index_update(store, p, id, acct))) {
+            /* lookups will rebuild the index */
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv2, p, "updating account index for %s", id);
+        }
+        acme->acct_index = NULL;
+    }
     return rv;
 }
 
@@ -225,6 +234,289 @@ out:
     return rv;
 }
 
+/**************************************************************************************************/
+/* account index */
+
+/* The index lists all accounts in MD_SG_ACCOUNTS with the url of their CA, their own
+ * url and status. It lives in MD_FN_ACCT_INDEX in MD_SG_CACHE, so that the watchdog
+ * child may update it as well, and is kept current when accounts are saved or removed.
+ * Lookups use it instead of reading every account.json. Several processes may save
+ * accounts at the same time, so an index can miss an account or list a removed one.
+ * It records the modification time of MD_SG_ACCOUNTS it was built from and lookups
+ * rebuild it only when that has changed since, or drop the stale entry. */
+
+typedef struct {
+    const char *id;
+    const char *ca_url;
+    const char *url;
+    md_acme_acct_st status;
+} idx_entry_t;
+
+struct md_acme_acct_index_t {
+    apr_pool_t *p;
+    apr_array_header_t *entries;    /* idx_entry_t*, ordered by id */
+    apr_hash_t *by_ca;              /* ca url -> apr_array_header_t of idx_entry_t* */
+    apr_time_t modified;            /* of the index file this was read from/written to */
+    apr_time_t accts_modified;      /* of MD_SG_ACCOUNTS when the index was built */
+};
+
+static md_acme_acct_index_t *index_make(apr_pool_t *p)
+{
+    md_acme_acct_index_t *idx;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->p = p;
+    idx->entries = apr_array_make(p, 10, sizeof(idx_entry_t*));
+    idx->by_ca = apr_hash_make(p);
+    return idx;
+}
+
+static int entry_cmp(const void *v1, const void *v2)
+{
+    return strcmp((*(const idx_entry_t**)v1)->id, (*(const idx_entry_t**)v2)->id);
+}
+
+static void index_sort(md_acme_acct_index_t *idx)
+{
+    apr_array_header_t *entries;
+    idx_entry_t *e;
+    int i;
+    
+    qsort(idx->entries->elts, (size_t)idx->entries->nelts, sizeof(idx_entry_t*), entry_cmp);
+    apr_hash_clear(idx->by_ca);
+    for (i = 0; i < idx->entries->nelts; ++i) {
+        e = APR_ARRAY_IDX(idx->entries, i, idx_entry_t*);
+        entries = apr_hash_get(idx->by_ca, e->ca_url, APR_HASH_KEY_STRING);
+        if (!entries) {
+            entries = apr_array_make(idx->p, 3, sizeof(idx_entry_t*));
+            apr_hash_set(idx->by_ca, e->ca_url, APR_HASH_KEY_STRING, entries);
+        }
+        APR_ARRAY_PUSH(entries, idx_entry_t*) = e;
+    }
+}
+
+static int index_pos(md_acme_acct_index_t *idx, const char *id)
+{
+    int i;
+    
+    for (i = 0; i < idx->entries->nelts; ++i) {
+        if (!strcmp(id, APR_ARRAY_IDX(idx->entries, i, idx_entry_t*)->id)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Add or replace an entry. Call index_sort() when done with changes. */
+static void index_put(md_acme_acct_index_t *idx, const char *id, const char *ca_url, 
+                      const char *url, md_acme_acct_st status)
+{
+    idx_entry_t *e;
+    int i;
+    
+    if ((i = index_pos(idx, id)) >= 0) {
+        e = APR_ARRAY_IDX(idx->entries, i, idx_entry_t*);
+    }
+    else {
+        e = apr_pcalloc(idx->p, sizeof(*e));
+        e->id = apr_pstrdup(idx->p, id);
+        APR_ARRAY_PUSH(idx->entries, idx_entry_t*) = e;
+    }
+    e->ca_url = apr_pstrdup(idx->p, ca_url);
+    e->url = url? apr_pstrdup(idx->p, url) : NULL;
+    e->status = status;
+}
+
+static int index_remove(md_acme_acct_index_t *idx, const char *id)
+{
+    int i;
+    
+    if ((i = index_pos(idx, id)) >= 0) {
+        if (i + 1 < idx->entries->nelts) {
+            memmove(idx->entries->elts + (i * idx->entries->elt_size), 
+                    idx->entries->elts + ((i + 1) * idx->entries->elt_size), 
+                    (size_t)(idx->entries->nelts - i - 1) * (size_t)idx->entries->elt_size);
+        }
+        --idx->entries->nelts;
+        index_sort(idx);
+        return 1;
+    }
+    return 0;
+}
+
+static apr_status_t entry_to_json(void *value, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    idx_entry_t *e = value;
+    const char *s;
+    
+    (void)p;
+    (void)baton;
+    md_json_sets(e->id, json, MD_KEY_ID, NULL);
+    md_json_sets(e->ca_url, json, MD_KEY_CA_URL, NULL);
+    if (e->url) {
+        md_json_sets(e->url, json, MD_KEY_URL, NULL);
+    }
+    if ((s = acct_st_to_str(e->status))) {
+        md_json_sets(s, json, MD_KEY_STATUS, NULL);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t entry_from_json(void **pvalue, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    idx_entry_t *e;
+    
+    (void)baton;
+    e = apr_pcalloc(p, sizeof(*e));
+    e->id = md_json_dups(p, json, MD_KEY_ID, NULL);
+    e->ca_url = md_json_dups(p, json, MD_KEY_CA_URL, NULL);
+    e->url = md_json_dups(p, json, MD_KEY_URL, NULL);
+    e->status = acct_st_from_str(md_json_gets(json, MD_KEY_STATUS, NULL));
+    *pvalue = (e->id && e->ca_url)? e : NULL;
+    return APR_SUCCESS;
+}
+
+static apr_status_t index_write(md_acme_acct_index_t *idx, md_store_t *store, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_status_t rv;
+    
+    json = md_json_create(p);
+    md_json_seta(idx->entries, entry_to_json, NULL, json, MD_KEY_ACCOUNTS, NULL);
+    md_json_setn((double)idx->accts_modified, json, MD_KEY_MODIFIED, NULL);
+    rv = md_store_save(store, p, MD_SG_CACHE, MD_ACCT_INDEX_NAME, MD_FN_ACCT_INDEX, MD_SV_JSON, json, 0);
+    idx->modified = (APR_SUCCESS == rv)? 
+        md_store_get_modified(store, MD_SG_CACHE, MD_ACCT_INDEX_NAME, MD_FN_ACCT_INDEX, p) : 0;
+    return rv;
+}
+
+static int index_add_acct(void *baton, const char *name, const char *aspect,
+                          md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    md_acme_acct_index_t *idx = baton;
+    md_json_t *json;
+    const char *ca_url;
+    
+    (void)aspect;
+    (void)ptemp;
+    if (MD_SV_JSON == vtype) {
+        json = value;
+        if ((ca_url = md_json_gets(json, MD_KEY_CA_URL, NULL))) {
+            index_put(idx, name, ca_url, md_json_gets(json, MD_KEY_URL, NULL), 
+                      acct_st_from_json(json));
+        }
+    }
+    return 1;
+}
+
+static apr_status_t index_rebuild(md_acme_acct_index_t **pidx, md_store_t *store, apr_pool_t *p)
+{
+    md_acme_acct_index_t *idx;
+    apr_status_t rv;
+    
+    idx = index_make(p);
+    /* taken before looking, accounts added meanwhile make it change again */
+    idx->accts_modified = md_store_get_modified(store, MD_SG_ACCOUNTS, NULL, NULL, p);
+    rv = md_store_iter(index_add_acct, idx, store, p, MD_SG_ACCOUNTS, "*", 
+                       MD_FN_ACCOUNT, MD_SV_JSON);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        /* no accounts at all */
+        rv = APR_SUCCESS;
+    }
+    if (APR_SUCCESS == rv) {
+        index_sort(idx);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "rebuilt account index, %d accounts",
+                      idx->entries->nelts);
+        if (APR_SUCCESS != (rv = index_write(idx, store, p))) {
+            /* lookups work without it, only slower */
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "saving account index");
+            rv = APR_SUCCESS;
+        }
+    }
+    *pidx = (APR_SUCCESS == rv)? idx : NULL;
+    return rv;
+}
+
+static apr_status_t index_read(md_acme_acct_index_t **pidx, md_store_t *store, apr_pool_t *p)
+{
+    md_acme_acct_index_t *idx;
+    md_json_t *json;
+    apr_status_t rv;
+    
+    idx = index_make(p);
+    idx->modified = md_store_get_modified(store, MD_SG_CACHE, MD_ACCT_INDEX_NAME, MD_FN_ACCT_INDEX, p);
+    rv = md_store_load_json(store, MD_SG_CACHE, MD_ACCT_INDEX_NAME, MD_FN_ACCT_INDEX, &json, p);
+    if (APR_SUCCESS == rv) {
+        rv = md_json_geta(idx->entries, entry_from_json, NULL, json, MD_KEY_ACCOUNTS, NULL);
+        idx->accts_modified = (apr_time_t)md_json_getn(json, MD_KEY_MODIFIED, NULL);
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "no usable account index");
+        return index_rebuild(pidx, store, p);
+    }
+    index_sort(idx);
+    *pidx = idx;
+    return rv;
+}
+
+static apr_status_t index_update(md_store_t *store, apr_pool_t *p, 
+                                 const char *id, md_acme_acct_t *acct)
+{
+    md_acme_acct_index_t *idx;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = index_read(&idx, store, p))) {
+        if (acct) {
+            index_put(idx, id, acct->ca_url, acct->url, acct->status);
+            index_sort(idx);
+        }
+        else if (!index_remove(idx, id)) {
+            return APR_SUCCESS;
+        }
+        rv = index_write(idx, store, p);
+    }
+    return rv;
+}
+
+/* Get the index for lookups by this acme instance, read again when the file changed. */
+static apr_status_t acme_index_get(md_acme_acct_index_t **pidx, md_acme_t *acme, 
+                                   md_store_t *store)
+{
+    md_acme_acct_index_t *idx = acme->acct_index;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (!idx || !idx->modified 
+        || idx->modified != md_store_get_modified(store, MD_SG_CACHE, MD_ACCT_INDEX_NAME, 
+                                                  MD_FN_ACCT_INDEX, acme->p)) {
+        rv = index_read(&idx, store, acme->p);
+        acme->acct_index = (APR_SUCCESS == rv)? idx : NULL;
+    }
+    *pidx = acme->acct_index;
+    return rv;
+}
+
+/* Has MD_SG_ACCOUNTS changed since the index was built? */
+static int index_is_stale(md_acme_acct_index_t *idx, md_store_t *store, apr_pool_t *p)
+{
+    apr_time_t mtime = md_store_get_modified(store, MD_SG_ACCOUNTS, NULL, NULL, p);
+    return !mtime || !idx->accts_modified || mtime != idx->accts_modified;
+}
+
+static void acme_index_disable(md_acme_t *acme, const char *id)
+{
+    int i;
+    
+    if (acme->acct_index && (i = index_pos(acme->acct_index, id)) >= 0) {
+        APR_ARRAY_IDX(acme->acct_index->entries, i, idx_entry_t*)->status = 
+            MD_ACME_ACCT_ST_UNKNOWN;
+    }
+}
+
+apr_status_t md_acme_acct_index_remove(md_store_t *store, apr_pool_t *p, const char *id)
+{
+    return index_update(store, p, id, NULL);
+}
+
 /**************************************************************************************************/
 /* Lookup */
 
@@ -291,15 +583,81 @@ static apr_status_t acct_find(const char **pid, md_acme_acct_t **pacct, md_pkey_
     return rv;
 }
 
+static idx_entry_t *index_find_valid(md_acme_acct_index_t *idx, const char *ca_url)
+{
+    apr_array_header_t *entries;
+    idx_entry_t *e;
+    int i;
+    
+    if ((entries = apr_hash_get(idx->by_ca, ca_url, APR_HASH_KEY_STRING))) {
+        for (i = 0; i < entries->nelts; ++i) {
+            e = APR_ARRAY_IDX(entries, i, idx_entry_t*);
+            if (MD_ACME_ACCT_ST_VALID == e->status) {
+                return e;
+            }
+        }
+    }
+    return NULL;
+}
+
+static apr_status_t acct_find_indexed(const char **pid, md_acme_acct_t **pacct, 
+                                      md_pkey_t **ppkey, md_store_t *store, 
+                                      md_acme_t *acme, apr_pool_t *p)
+{
+    md_acme_acct_index_t *idx;
+    idx_entry_t *e;
+    int rebuilt = 0;
+    apr_status_t rv;
+    
+    *pid = NULL;
+    *pacct = NULL;
+    if (APR_SUCCESS != (rv = acme_index_get(&idx, acme, store))) goto out;
+    
+    while (1) {
+        if (!(e = index_find_valid(idx, acme->url))) {
+            if (rebuilt || !index_is_stale(idx, store, p)) {
+                rv = APR_ENOENT;
+                break;
+            }
+            /* the index lacks accounts saved since it was built, look again */
+            rebuilt = 1;
+            if (APR_SUCCESS != (rv = index_rebuild(&idx, store, acme->p))) break;
+            acme->acct_index = idx;
+            continue;
+        }
+        
+        rv = md_acme_acct_load(pacct, ppkey, store, MD_SG_ACCOUNTS, e->id, p);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "loading account %s", e->id);
+        if (APR_SUCCESS == rv) {
+            *pid = e->id;
+            break;
+        }
+        e->status = MD_ACME_ACCT_ST_UNKNOWN;
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            index_update(store, p, e->id, NULL);
+        }
+    }
+out:
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                  "acct_find %s", (*pacct)? (*pacct)->url : "NULL"); 
+    return rv;
+}
+
 static apr_status_t acct_find_and_verify(md_store_t *store, md_store_group_t group, 
-                                         const char *name_pattern, md_acme_t *acme, apr_pool_t *p)
+                                         md_acme_t *acme, apr_pool_t *p)
 {
     md_acme_acct_t *acct;
     md_pkey_t *pkey;
     const char *id;
     apr_status_t rv;
 
-    if (APR_SUCCESS == (rv = acct_find(&id, &acct, &pkey, store, group, name_pattern, acme, p))) {
+    if (MD_SG_ACCOUNTS == group) {
+        rv = acct_find_indexed(&id, &acct, &pkey, store, acme, p);
+    }
+    else {
+        rv = acct_find(&id, &acct, &pkey, store, group, "*", acme, p);
+    }
+    if (APR_SUCCESS == rv) {
         acme->acct_id = (MD_SG_STAGING == group)? NULL : id;
         acme->acct = acct;
         acme->acct_key = pkey;
@@ -312,6 +670,9 @@ static apr_status_t acct_find_and_verify(md_store_t *store, md_store_group_t gro
             if (APR_STATUS_IS_ENOENT(rv)) {
                 /* verification failed and account has been disabled.
                    Indicate to caller that he may try again. */
+                if (MD_SG_ACCOUNTS == group) {
+                    acme_index_disable(acme, id);
+                }
                 rv = APR_EAGAIN;
             }
         }
@@ -323,9 +684,7 @@ apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store)
 {
     apr_status_t rv;
     
-    while (APR_EAGAIN == (rv = acct_find_and_verify(store, MD_SG_ACCOUNTS, 
-                                                    mk_acct_pattern(acme->p, acme), 
-                                                    acme, acme->p))) {
+    while (APR_EAGAIN == (rv = acct_find_and_verify(store, MD_SG_ACCOUNTS, acme, acme->p))) {
         /* nop */
     }
     
@@ -334,8 +693,7 @@ apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store)
          * can already be found in MD_SG_STAGING? */
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, 
                       "no account found, looking in STAGING");
-        while (APR_EAGAIN == (rv = acct_find_and_verify(store, MD_SG_STAGING, "*", 
-                                                        acme, acme->p))) {
+        while (APR_EAGAIN == (rv = acct_find_and_verify(store, MD_SG_STAGING, acme, acme->p))) {
             /* nop */
         }
     }
@@ -379,14 +737,30 @@ static int id_by_url(void *baton, const char *name, const char *aspect,
 apr_status_t md_acme_acct_id_for_url(const char **pid, md_store_t *store, 
                                      md_store_group_t group, const char *url, apr_pool_t *p)
 {
+    md_acme_acct_index_t *idx;
+    idx_entry_t *e;
     apr_status_t rv;
     load_ctx ctx;
+    int i;
     
     ctx.p = p;
     ctx.url = url;
     ctx.id = NULL;
     
-    rv = md_store_iter(id_by_url, &ctx, store, p, group, "*", MD_FN_ACCOUNT, MD_SV_JSON);
+    if (MD_SG_ACCOUNTS == group) {
+        if (APR_SUCCESS == (rv = index_read(&idx, store, p))) {
+            for (i = 0; i < idx->entries->nelts; ++i) {
+                e = APR_ARRAY_IDX(idx->entries, i, idx_entry_t*);
+                if (MD_ACME_ACCT_ST_VALID == e->status && e->url && !strcmp(url, e->url)) {
+                    ctx.id = e->id;
+                    break;
+                }
+            }
+        }
+    }
+    else {
+        rv = md_store_iter(id_by_url, &ctx, store, p, group, "*", MD_FN_ACCOUNT, MD_SV_JSON);
+    }
     *pid = (APR_SUCCESS == rv)? ctx.id : NULL;
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "acct_id_by_url %s -> %s", url, *pid);
     return rv;
@@ -446,7 +820,7 @@ static apr_status_t acct_upd(md_acme_t *acme, apr_pool_t *p,
     if (md_json_has_key(body, MD_KEY_ORDERS, NULL)) {
         acct->orders = md_json_dups(acme->p, body, MD_KEY_ORDERS, NULL);
     }
-    acct->registration = md_json_clone(ctx->p, body);
+    acct->registration = md_json_share(ctx->p, body);
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "updated acct %s", acct->url);
     return rv;
@@ -469,7 +843,17 @@ apr_status_t md_acme_acct_validate(md_acme_t *acme, md_store_t *store, apr_pool_
 {
     apr_status_t rv;
     
-    if (APR_SUCCESS != (rv = md_acme_acct_update(acme))) {
+    if (acme->acct && MD_ACME_ACCT_ST_VALID == acme->acct->status 
+        && md_acme_acct_checked(acme)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "acct %s checked recently", 
+                      acme->acct->url);
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS == (rv = md_acme_acct_update(acme))) {
+        md_acme_acct_checked_set(acme, MD_ACME_ACCT_ST_VALID == acme->acct->status);
+    }
+    else {
+        md_acme_acct_checked_set(acme, 0);
         if (acme->acct && (APR_ENOENT == rv || APR_EACCES == rv)) {
             if (MD_ACME_ACCT_ST_VALID == acme->acct->status) {
                 acme->acct->status = MD_ACME_ACCT_ST_UNKNOWN;
@@ -553,8 +937,13 @@ apr_status_t md_acme_acct_register(md_acme_t *acme, apr_pool_t *p, apr_array_hea
         }
     }
     
-    spec.type = MD_PKEY_TYPE_RSA;
-    spec.params.rsa.bits = MD_ACME_ACCT_PKEY_BITS;
+    if (acme->acct_key_spec) {
+        spec = *acme->acct_key_spec;
+    }
+    else {
+        spec.type = MD_PKEY_TYPE_RSA;
+        spec.params.rsa.bits = MD_ACME_ACCT_PKEY_BITS;
+    }
     
     if (APR_SUCCESS == (rv = md_pkey_gen(&pkey, acme->p, &spec))
         && APR_SUCCESS == (rv = acct_make(&acme->acct,  p, acme->url, contacts))) {
@@ -46,8 +46,15 @@ struct md_acme_acct_t {
     struct md_json_t *registration; /* data from server registration */
 };
 
+/**
+ * Index of the accounts in the store, by CA url. Opaque.
+ */
+typedef struct md_acme_acct_index_t md_acme_acct_index_t;
+
 #define MD_FN_ACCOUNT           "account.json"
 #define MD_FN_ACCT_KEY          "account.pem"
+#define MD_FN_ACCT_INDEX        "accounts.json"
+#define MD_ACCT_INDEX_NAME      "accounts"      /* in MD_SG_CACHE */
 
 /* ACME account private keys are always RSA and have that many bits. Since accounts
  * are expected to live long, better err on the safe side. */
@@ -106,7 +113,8 @@ const char *md_acme_get_agreement(md_acme_t *acme);
 apr_status_t md_acme_find_acct(md_acme_t *acme, struct md_store_t *store);
 
 /**
- * Find the account id for a given account url. 
+ * Find the account id for a given account url. For MD_SG_ACCOUNTS, this uses
+ * the account index.
  */
 apr_status_t md_acme_acct_id_for_url(const char **pid, struct md_store_t *store, 
                                      md_store_group_t group, const char *url, apr_pool_t *p);
@@ -127,6 +135,13 @@ apr_status_t md_acme_acct_save(struct md_store_t *store, apr_pool_t *p, md_acme_
  */
 apr_status_t md_acme_acct_deactivate(md_acme_t *acme, apr_pool_t *p);
 
+/**
+ * Remove the account from the index of accounts, once it has been removed 
+ * from the store. Saving an account via md_acme_acct_save() adds/updates
+ * its index entry.
+ */
+apr_status_t md_acme_acct_index_remove(struct md_store_t *store, apr_pool_t *p, const char *id);
+
 apr_status_t md_acme_acct_load(struct md_acme_acct_t **pacct, struct md_pkey_t **ppkey,
                                struct md_store_t *store, md_store_group_t group, 
                                const char *name, apr_pool_t *p);
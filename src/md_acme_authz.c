@@ -32,6 +32,7 @@
 #include "md_http.h"
 #include "md_log.h"
 #include "md_jws.h"
+#include "md_keypool.h"
 #include "md_store.h"
 #include "md_util.h"
 
@@ -101,7 +102,7 @@ static apr_status_t authz_created(md_acme_t *acme, apr_pool_t *p, const apr_tabl
         ctx->authz = md_acme_authz_create(ctx->p);
         ctx->authz->domain = apr_pstrdup(ctx->p, ctx->domain);
         ctx->authz->url = apr_pstrdup(ctx->p, location);
-        ctx->authz->resource = md_json_clone(ctx->p, body);
+        ctx->authz->resource = md_json_share(ctx->p, body);
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, ctx->p, "authz_new at %s", location);
     }
     else {
@@ -143,28 +144,20 @@ apr_status_t md_acme_authz_retrieve(md_acme_t *acme, apr_pool_t *p, const char *
     return rv;
 }
 
-apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+static apr_status_t authz_update_from(md_acme_authz_t *authz, md_json_t *json, 
+                                      apr_status_t rv, apr_pool_t *p)
 {
-    md_json_t *json;
     const char *s, *err;
     md_log_level_t log_level;
-    apr_status_t rv;
-    MD_CHK_VARS;
     
-    assert(acme);
-    assert(acme->http);
-    assert(authz);
-    assert(authz->url);
-
     authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
-    json = NULL;
     err = "unable to parse response";
     log_level = MD_LOG_ERR;
     
-    if (MD_OK(md_acme_get_json(&json, acme, authz->url, p))
-        && (s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
+    if (APR_SUCCESS == rv && json && (s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
             
         authz->domain = md_json_gets(json, MD_KEY_IDENTIFIER, MD_KEY_VALUE, NULL); 
+        authz->expires = md_util_parse_rfc3339(md_json_gets(json, MD_KEY_EXPIRES, NULL));
         authz->resource = json;
         if (!strcmp(s, "pending")) {
             authz->state = MD_ACME_AUTHZ_S_PENDING;
@@ -196,6 +189,53 @@ apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_p
     return rv;
 }
 
+apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+{
+    md_json_t *json = NULL;
+    apr_status_t rv;
+    
+    assert(acme);
+    assert(acme->http);
+    assert(authz);
+    assert(authz->url);
+
+    rv = md_acme_get_json(&json, acme, authz->url, p);
+    return authz_update_from(authz, json, rv, p);
+}
+
+static apr_status_t on_authz_json(md_acme_t *acme, apr_pool_t *p, const apr_table_t *hdrs, 
+                                  md_json_t *body, void *baton)
+{
+    authz_req_ctx *ctx = baton;
+    
+    (void)acme;
+    (void)p;
+    (void)hdrs;
+    return authz_update_from(ctx->authz, md_json_share(ctx->p, body), APR_SUCCESS, ctx->p);
+}
+
+apr_status_t md_acme_authz_update_all(apr_array_header_t *authzs, md_acme_t *acme, 
+                                      apr_pool_t *p)
+{
+    md_acme_authz_t *authz;
+    authz_req_ctx *ctx;
+    int i;
+    
+    assert(acme);
+    assert(acme->http);
+    
+    md_acme_batch_start(acme, p);
+    for (i = 0; i < authzs->nelts; ++i) {
+        authz = APR_ARRAY_IDX(authzs, i, md_acme_authz_t *);
+        assert(authz->url);
+        authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
+        ctx = apr_palloc(p, sizeof(*ctx));
+        authz_req_ctx_init(ctx, acme, NULL, authz, p);
+        md_acme_GET(acme, authz->url, NULL, on_authz_json, NULL, ctx);
+    }
+    return md_acme_batch_perform(acme);
+}
+
 /**************************************************************************************************/
 /* response to a challenge */
 
@@ -247,6 +287,167 @@ static apr_status_t authz_http_set(md_acme_t *acme, apr_pool_t *p, const apr_tab
     return APR_SUCCESS;
 }
 
+static md_acme_authz_publish_cb *cha_publisher;
+static void *cha_publisher_baton;
+
+void md_acme_authz_set_publisher(md_acme_authz_publish_cb *cb, void *baton)
+{
+    cha_publisher = cb;
+    cha_publisher_baton = baton;
+}
+
+/* Before the ACME server is asked to validate, make sure the challenge data reads
+ * back from the store and, with a publisher set, has reached wherever else validation 
+ * requests may arrive. Failing here leaves the challenge pending to be tried again, 
+ * while a failed validation invalidates the whole authorization. */
+static apr_status_t cha_publish(md_acme_authz_cha_t *cha, md_store_t *store, 
+                                const char *name, const char *aspect, 
+                                const char *expected, apr_pool_t *p)
+{
+    const char *data;
+    apr_status_t rv;
+    
+    rv = md_store_load(store, MD_SG_CHALLENGES, name, aspect, MD_SV_TEXT, (void**)&data, p);
+    if (APR_SUCCESS == rv && expected && strcmp(expected, data)) {
+        rv = APR_EAGAIN;
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "%s: %s challenge data not "
+                      "readable from store", name, cha->type);
+        return APR_EAGAIN;
+    }
+    if (cha_publisher) {
+        rv = cha_publisher(cha_publisher_baton, store, cha->type, name, p);
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "%s: publishing %s challenge "
+                          "data, not asking for validation yet", name, cha->type);
+            return APR_EAGAIN;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t cha_notify_post(md_acme_authz_cha_t *cha, md_acme_authz_t *authz,
+                                    md_acme_t *acme, apr_pool_t *p)
+{
+    authz_req_ctx *ctx;
+    
+    /* challenge is setup or was changed from previous data, tell ACME server
+     * so it may (re)try verification. The request may be part of a batch,
+     * its context needs to live in the pool. */
+    ctx = apr_palloc(p, sizeof(*ctx));
+    authz_req_ctx_init(ctx, acme, NULL, authz, p);
+    ctx->challenge = cha;
+    return md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, ctx);
+}
+
+static apr_status_t cha_notify_server(md_acme_authz_cha_t *cha, md_acme_authz_t *authz,
+                                      md_acme_t *acme, md_store_t *store, const char *name, 
+                                      const char *aspect, const char *expected, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = cha_publish(cha, store, name, aspect, expected, p))) {
+        return rv;
+    }
+    return cha_notify_post(cha, authz, acme, p);
+}
+
+/**************************************************************************************************/
+/* http-01 preflight */
+
+/* A validation the server fails invalidates the authorization. When enabled, http-01 
+ * responses are first fetched the way the server will, from port 80 of the domain, 
+ * so that a vhost, port mapping or proxy in the way shows up without it. All
+ * fetches of an order run at the same time. */
+
+#define PREFLIGHT_PATH      "/.well-known/acme-challenge/"
+
+static int preflight_enabled;
+
+typedef struct {
+    md_acme_authz_cha_t *cha;
+    md_acme_authz_t *authz;
+    md_store_t *store;
+    apr_pool_t *pool;
+    int status;
+    const char *data;
+} preflight_pending;
+
+void md_acme_authz_set_preflight(int enabled)
+{
+    preflight_enabled = enabled;
+}
+
+static apr_status_t on_preflight_resp(const md_http_response_t *res)
+{
+    preflight_pending *pending = res->req->baton;
+    char *data;
+    apr_size_t len;
+    
+    pending->status = res->status;
+    if (res->status == 200 && res->body
+        && APR_SUCCESS == apr_brigade_pflatten(res->body, &data, &len, res->req->pool)) {
+        /* the response lives in the request pool, it is gone afterwards */
+        pending->data = apr_pstrndup(pending->pool, data, len);
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_acme_authz_preflight_perform(md_acme_t *acme, apr_pool_t *p)
+{
+    apr_array_header_t *pendings, *reqs;
+    preflight_pending *pending;
+    md_http_request_t *req;
+    md_http_t *http;
+    const char *url;
+    apr_status_t rv, rv2;
+    int i;
+    
+    if (!(pendings = acme->preflight) || pendings->nelts <= 0) {
+        return APR_SUCCESS;
+    }
+    acme->preflight = NULL;
+    
+    /* fetched directly, not via the proxy for the ACME server */
+    if (APR_SUCCESS != (rv = md_http_create(&http, p, acme->user_agent, NULL))) {
+        return rv;
+    }
+    md_http_set_response_limit(http, 4 * 1024);
+    reqs = apr_array_make(p, pendings->nelts, sizeof(md_http_request_t *));
+    for (i = 0; i < pendings->nelts; ++i) {
+        pending = APR_ARRAY_IDX(pendings, i, preflight_pending *);
+        url = apr_pstrcat(p, "http://", pending->authz->domain, PREFLIGHT_PATH, 
+                          pending->cha->token, NULL);
+        if (APR_SUCCESS == md_http_GET_create(&req, http, url, NULL, on_preflight_resp, pending)) {
+            APR_ARRAY_PUSH(reqs, md_http_request_t *) = req;
+        }
+    }
+    md_http_multi_perform(http, reqs);
+    
+    rv = APR_SUCCESS;
+    for (i = 0; i < pendings->nelts; ++i) {
+        pending = APR_ARRAY_IDX(pendings, i, preflight_pending *);
+        if (pending->data && !strcmp(pending->cha->key_authz, pending->data)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: http-01 preflight ok", 
+                          pending->authz->domain);
+            rv2 = cha_notify_post(pending->cha, pending->authz, acme, p);
+        }
+        else {
+            rv2 = APR_EAGAIN;
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv2, p, "%s: http-01 challenge "
+                          "response is not reachable at http://%s%s%s (status %d%s), not "
+                          "asking the server for validation. Check the VirtualHost, "
+                          "MDPortMap and anything proxying port 80.", 
+                          pending->authz->domain, pending->authz->domain, PREFLIGHT_PATH, 
+                          pending->cha->token, pending->status, 
+                          pending->data? ", unexpected content" : "");
+        }
+        rv = (APR_SUCCESS == rv)? rv2 : rv;
+    }
+    return rv;
+}
+
 static apr_status_t setup_key_authz(md_acme_authz_cha_t *cha, md_acme_authz_t *authz,
                                     md_acme_t *acme, apr_pool_t *p, int *pchanged)
 {
@@ -280,6 +481,7 @@ static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t
                                       md_pkey_spec_t *key_spec, apr_pool_t *p)
 {
     const char *data;
+    preflight_pending *pending;
     apr_status_t rv;
     int notify_server;
     MD_CHK_VARS;
@@ -298,14 +500,27 @@ static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t
         notify_server = 1;
     }
     
-    if (APR_SUCCESS == rv && notify_server) {
-        authz_req_ctx ctx;
-
-        /* challenge is setup or was changed from previous data, tell ACME server
-         * so it may (re)try verification */        
-        authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-        ctx.challenge = cha;
-        rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, &ctx);
+    if (APR_SUCCESS == rv && notify_server && preflight_enabled) {
+        if (APR_SUCCESS != (rv = cha_publish(cha, store, authz->domain, MD_FN_HTTP01, 
+                                             cha->key_authz, p))) {
+            goto out;
+        }
+        if (!acme->preflight) {
+            acme->preflight = apr_array_make(p, 5, sizeof(preflight_pending *));
+        }
+        pending = apr_pcalloc(p, sizeof(*pending));
+        pending->cha = cha;
+        pending->authz = authz;
+        pending->store = store;
+        pending->pool = p;
+        APR_ARRAY_PUSH(acme->preflight, preflight_pending *) = pending;
+        if (!acme->batch) {
+            rv = md_acme_authz_preflight_perform(acme, p);
+        }
+    }
+    else if (APR_SUCCESS == rv && notify_server) {
+        rv = cha_notify_server(cha, authz, acme, store, authz->domain, MD_FN_HTTP01, 
+                               cha->key_authz, p);
     }
 out:
     return rv;
@@ -334,7 +549,7 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
             goto out;
         }
         
-        if (APR_SUCCESS != (rv = md_pkey_gen(&cha_key, p, key_spec))) {
+        if (APR_SUCCESS != (rv = md_keypool_get(&cha_key, store, key_spec, p))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: create tls-alpn-01 challenge key",
                           authz->domain);
             goto out;
@@ -369,13 +584,8 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
     }
     
     if (APR_SUCCESS == rv && notify_server) {
-        authz_req_ctx ctx;
-
-        /* challenge is setup or was changed from previous data, tell ACME server
-         * so it may (re)try verification */        
-        authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-        ctx.challenge = cha;
-        rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, &ctx);
+        rv = cha_notify_server(cha, authz, acme, store, authz->domain, 
+                               MD_FN_TLSALPN01_CERT, NULL, p);
     }
 out:    
     return rv;
@@ -428,7 +638,7 @@ static apr_status_t cha_tls_sni_01_setup(md_acme_authz_cha_t *cha, md_acme_authz
     if ((APR_SUCCESS == rv && !md_cert_covers_domain(cha_cert, cha_dns)) 
         || APR_STATUS_IS_ENOENT(rv)) {
         
-        if (APR_SUCCESS != (rv = md_pkey_gen(&cha_key, p, key_spec))) {
+        if (APR_SUCCESS != (rv = md_keypool_get(&cha_key, store, key_spec, p))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: create tls-sni-01 challenge key",
                           authz->domain);
             goto out;
@@ -454,18 +664,224 @@ static apr_status_t cha_tls_sni_01_setup(md_acme_authz_cha_t *cha, md_acme_authz
     }
     
     if (APR_SUCCESS == rv && notify_server) {
-        authz_req_ctx ctx;
+        rv = cha_notify_server(cha, authz, acme, store, cha_dns, 
+                               MD_FN_TLSSNI01_CERT, NULL, p);
+    }
+out:    
+    return rv;
+}
+
+/* dns-01 TXT records are set up by an external command. DNS changes take their time
+ * to reach all servers of a zone, so the records of all challenges in a batch are 
+ * given to one invocation, after which a single wait for propagation follows before 
+ * the server is asked to validate them all. The command is called as
+ *   <cmd> setup <domain> <txt value> [<domain> <txt value> ...]
+ *   <cmd> teardown <domain> [<domain> ...]
+ * and is expected to exit with 0 on success. The time each record was set up is saved
+ * in MD_FN_DNS01_SETUP next to its challenge. Instead of sleeping through the wait, the caller gets
+ * APR_EAGAIN with acme->retry_after at its end and the challenges are validated 
+ * when it comes back then. */
+
+#define MD_FN_DNS01_SETUP       "acme-dns-01.json"
+
+static const char *dns01_cmd;
+static apr_interval_time_t dns01_wait;
+
+typedef struct {
+    md_acme_authz_cha_t *cha;
+    md_acme_authz_t *authz;
+    md_store_t *store;
+    const char *txt;
+} dns01_pending;
+
+void md_acme_authz_set_dns01(const char *cmd, apr_interval_time_t wait)
+{
+    dns01_cmd = cmd;
+    dns01_wait = wait;
+}
+
+static apr_status_t dns01_exec(const char *action, apr_array_header_t *args, apr_pool_t *p)
+{
+    apr_array_header_t *argv;
+    apr_status_t rv;
+    int i, exit_code;
+    
+    argv = apr_array_make(p, args->nelts + 3, sizeof(const char *));
+    APR_ARRAY_PUSH(argv, const char *) = dns01_cmd;
+    APR_ARRAY_PUSH(argv, const char *) = action;
+    for (i = 0; i < args->nelts; ++i) {
+        APR_ARRAY_PUSH(argv, const char *) = APR_ARRAY_IDX(args, i, const char *);
+    }
+    APR_ARRAY_PUSH(argv, const char *) = NULL;
+    
+    rv = md_util_exec(p, dns01_cmd, (const char * const *)argv->elts, &exit_code);
+    if (APR_SUCCESS == rv && exit_code) {
+        rv = APR_EGENERAL;
+    }
+    md_log_perror(MD_LOG_MARK, APR_SUCCESS == rv? MD_LOG_DEBUG : MD_LOG_WARNING, rv, p, 
+                  "dns-01 %s of %d records via %s, exit code %d", 
+                  action, (argv->nelts - 3) / (strcmp("setup", action)? 1 : 2), 
+                  dns01_cmd, exit_code);
+    return rv;
+}
 
-        /* challenge is setup or was changed from previous data, tell ACME server
-         * so it may (re)try verification */        
-        authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-        ctx.challenge = cha;
-        rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, &ctx);
+static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
+                                     md_acme_t *acme, md_store_t *store, 
+                                     md_pkey_spec_t *key_spec, apr_pool_t *p)
+{
+    const char *data, *txt;
+    dns01_pending *pending;
+    apr_status_t rv;
+    int notify_server;
+    MD_CHK_VARS;
+    
+    (void)key_spec;
+    if (!dns01_cmd) {
+        rv = APR_ENOTIMPL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: dns-01 challenge needs a "
+                      "command to set up TXT records, none is configured", authz->domain);
+        goto out;
+    }
+    if (   !MD_OK(setup_key_authz(cha, authz, acme, p, &notify_server))
+        || !MD_OK(md_crypt_sha256_digest64(&txt, p, cha->key_authz, strlen(cha->key_authz)))) {
+        goto out;
+    }
+    
+    rv = md_store_load(store, MD_SG_CHALLENGES, authz->domain, MD_FN_DNS01,
+                       MD_SV_TEXT, (void**)&data, p);
+    if ((APR_SUCCESS == rv && strcmp(txt, data)) || APR_STATUS_IS_ENOENT(rv)) {
+        rv = md_store_save(store, p, MD_SG_CHALLENGES, authz->domain, MD_FN_DNS01,
+                           MD_SV_TEXT, (void*)txt, 0);
+        authz->dir = authz->domain;
+        notify_server = 1;
+    }
+    
+    if (APR_SUCCESS == rv && notify_server) {
+        if (!acme->dns01) {
+            acme->dns01 = apr_array_make(p, 5, sizeof(dns01_pending *));
+        }
+        pending = apr_pcalloc(p, sizeof(*pending));
+        pending->cha = cha;
+        pending->authz = authz;
+        pending->store = store;
+        pending->txt = txt;
+        APR_ARRAY_PUSH(acme->dns01, dns01_pending *) = pending;
+        if (!acme->batch) {
+            rv = md_acme_authz_dns01_perform(acme, p);
+        }
     }
 out:    
     return rv;
 }
 
+/* when the record of pending was set up, or 0 if it was not */
+static apr_time_t dns01_setup_at(dns01_pending *pending, apr_pool_t *p)
+{
+    md_json_t *json;
+    const char *txt;
+    
+    if (APR_SUCCESS == md_store_load_json(pending->store, MD_SG_CHALLENGES, 
+                                          pending->authz->domain, MD_FN_DNS01_SETUP, 
+                                          &json, p)
+        && (txt = md_json_gets(json, MD_KEY_VALUE, NULL)) && !strcmp(txt, pending->txt)) {
+        return apr_time_from_sec(md_json_getl(json, MD_KEY_MODIFIED, NULL));
+    }
+    return 0;
+}
+
+static apr_status_t dns01_setup_save(dns01_pending *pending, apr_time_t at, apr_pool_t *p)
+{
+    md_json_t *json;
+    
+    json = md_json_create(p);
+    md_json_sets(pending->txt, json, MD_KEY_VALUE, NULL);
+    md_json_setl((long)apr_time_sec(at), json, MD_KEY_MODIFIED, NULL);
+    return md_store_save_json(pending->store, p, MD_SG_CHALLENGES, pending->authz->domain, 
+                              MD_FN_DNS01_SETUP, json, 0);
+}
+
+apr_status_t md_acme_authz_dns01_perform(md_acme_t *acme, apr_pool_t *p)
+{
+    apr_array_header_t *pendings, *args, *fresh;
+    dns01_pending *pending;
+    apr_time_t now, setup_at, ready_at = 0;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int i;
+    
+    if (!(pendings = acme->dns01) || pendings->nelts <= 0) {
+        return APR_SUCCESS;
+    }
+    acme->dns01 = NULL;
+    
+    now = apr_time_now();
+    args = apr_array_make(p, pendings->nelts * 2, sizeof(const char *));
+    fresh = apr_array_make(p, pendings->nelts, sizeof(dns01_pending *));
+    for (i = 0; i < pendings->nelts; ++i) {
+        pending = APR_ARRAY_IDX(pendings, i, dns01_pending *);
+        if ((setup_at = dns01_setup_at(pending, p))) {
+            /* set up on an earlier attempt, maybe still propagating */
+            if (setup_at + dns01_wait > ready_at) {
+                ready_at = setup_at + dns01_wait;
+            }
+            continue;
+        }
+        APR_ARRAY_PUSH(args, const char *) = pending->authz->domain;
+        APR_ARRAY_PUSH(args, const char *) = pending->txt;
+        APR_ARRAY_PUSH(fresh, dns01_pending *) = pending;
+    }
+    if (fresh->nelts > 0) {
+        if (APR_SUCCESS != (rv = dns01_exec("setup", args, p))) {
+            /* leave the challenges pending, the records are set up again next time */
+            return APR_EAGAIN;
+        }
+        for (i = 0; i < fresh->nelts; ++i) {
+            pending = APR_ARRAY_IDX(fresh, i, dns01_pending *);
+            if (APR_SUCCESS != (rv2 = dns01_setup_save(pending, now, p))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv2, p, "%s: saving dns-01 "
+                              "setup time", pending->authz->domain);
+            }
+        }
+        if (now + dns01_wait > ready_at) {
+            ready_at = now + dns01_wait;
+        }
+    }
+    if (ready_at > apr_time_now()) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "waiting %s for dns-01 records "
+                      "to propagate", md_print_duration(p, ready_at - apr_time_now()));
+        if (ready_at > acme->retry_after) {
+            acme->retry_after = ready_at;
+        }
+        return APR_EAGAIN;
+    }
+    for (i = 0; i < pendings->nelts; ++i) {
+        pending = APR_ARRAY_IDX(pendings, i, dns01_pending *);
+        rv2 = cha_notify_server(pending->cha, pending->authz, acme, pending->store, 
+                                pending->authz->domain, MD_FN_DNS01, pending->txt, p);
+        rv = (APR_SUCCESS == rv)? rv2 : rv;
+    }
+    return rv;
+}
+
+apr_status_t md_acme_authz_teardown(md_store_t *store, apr_array_header_t *dirs, apr_pool_t *p)
+{
+    apr_array_header_t *args;
+    const char *dir, *data;
+    int i;
+    
+    if (!dns01_cmd) {
+        return APR_SUCCESS;
+    }
+    args = apr_array_make(p, dirs->nelts, sizeof(const char *));
+    for (i = 0; i < dirs->nelts; ++i) {
+        dir = APR_ARRAY_IDX(dirs, i, const char *);
+        if (APR_SUCCESS == md_store_load(store, MD_SG_CHALLENGES, dir, MD_FN_DNS01,
+                                         MD_SV_TEXT, (void**)&data, p)) {
+            APR_ARRAY_PUSH(args, const char *) = dir;
+        }
+    }
+    return (args->nelts > 0)? dns01_exec("teardown", args, p) : APR_SUCCESS;
+}
+
 typedef apr_status_t cha_starter(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
                                  md_acme_t *acme, md_store_t *store, 
                                  md_pkey_spec_t *key_spec, apr_pool_t *p);
@@ -479,6 +895,7 @@ static const cha_type CHA_TYPES[] = {
     { MD_AUTHZ_TYPE_HTTP01,     cha_http_01_setup },
     { MD_AUTHZ_TYPE_TLSALPN01,  cha_tls_alpn_01_setup },
     { MD_AUTHZ_TYPE_TLSSNI01,   cha_tls_sni_01_setup },
+    { MD_AUTHZ_TYPE_DNS01,      cha_dns_01_setup },
 };
 static const apr_size_t CHA_TYPES_LEN = (sizeof(CHA_TYPES)/sizeof(CHA_TYPES[0]));
 
@@ -619,6 +1036,10 @@ md_json_t *md_acme_authz_to_json(md_acme_authz_t *a, apr_pool_t *p)
         md_json_sets(a->url, json, MD_KEY_LOCATION, NULL);
         md_json_sets(a->dir, json, MD_KEY_DIR, NULL);
         md_json_setl(a->state, json, MD_KEY_STATE, NULL);
+        if (a->expires) {
+            md_json_sets(apr_psprintf(p, "%" APR_TIME_T_FMT, a->expires), 
+                         json, MD_KEY_EXPIRES, NULL);
+        }
         return json;
     }
     return NULL;
@@ -627,14 +1048,175 @@ md_json_t *md_acme_authz_to_json(md_acme_authz_t *a, apr_pool_t *p)
 md_acme_authz_t *md_acme_authz_from_json(struct md_json_t *json, apr_pool_t *p)
 {
     md_acme_authz_t *authz = md_acme_authz_create(p);
+    const char *s;
+    
     if (authz) {
         authz->domain = md_json_dups(p, json, MD_KEY_DOMAIN, NULL);            
         authz->url = md_json_dups(p, json, MD_KEY_LOCATION, NULL);            
         authz->dir = md_json_dups(p, json, MD_KEY_DIR, NULL);            
         authz->state = (md_acme_authz_state_t)md_json_getl(json, MD_KEY_STATE, NULL);            
+        if ((s = md_json_gets(json, MD_KEY_EXPIRES, NULL))) {
+            authz->expires = (apr_time_t)apr_atoi64(s);
+        }
         return authz;
     }
     return NULL;
 }
 
+/**************************************************************************************************/
+/* valid authorizations of an account */
+
+/* A CA accepts a valid authorization of the account for a domain in new orders until 
+ * it expires, shared names and reissued certificates need no challenges then. The 
+ * valid ones seen are kept per account, by domain, so that orders know them without 
+ * asking the CA. They are in the CACHE group, the watchdog writes them as the worker
+ * user. They are only used well before the CA lets them expire. Updates
+ * from several orders at the same time may lose entries, they are seen again the
+ * next time. */
+
+#define MD_AUTHZ_CACHE_MARGIN   apr_time_from_sec(MD_SECS_PER_HOUR)
 
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *valid;
+    apr_time_t min_expires;
+} authz_cache_ctx;
+
+static int authz_cache_collect(void *baton, const char *key, md_json_t *json)
+{
+    authz_cache_ctx *ctx = baton;
+    md_acme_authz_t *authz;
+    
+    (void)key;
+    authz = md_acme_authz_from_json(json, ctx->p);
+    if (authz && authz->url && authz->domain 
+        && authz->state == MD_ACME_AUTHZ_S_VALID && authz->expires > ctx->min_expires) {
+        APR_ARRAY_PUSH(ctx->valid, md_acme_authz_t *) = authz;
+    }
+    return 1;
+}
+
+static apr_status_t authz_cache_save(md_acme_t *acme, md_store_t *store, md_json_t *json, 
+                                     apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    rv = md_store_save_json(store, p, MD_SG_CACHE, acme->acct_id, MD_FN_AUTHZ_CACHE, json, 0);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "%s: saving valid authorizations of account", acme->acct_id);
+    }
+    return rv;
+}
+
+apr_array_header_t *md_acme_authz_cache_get(md_acme_t *acme, md_store_t *store, apr_pool_t *p)
+{
+    authz_cache_ctx ctx;
+    md_json_t *json;
+    
+    ctx.p = p;
+    ctx.valid = apr_array_make(p, 5, sizeof(md_acme_authz_t *));
+    ctx.min_expires = apr_time_now() + MD_AUTHZ_CACHE_MARGIN;
+    if (acme->acct_id && APR_SUCCESS == md_store_load_json(store, MD_SG_CACHE, acme->acct_id, 
+                                                           MD_FN_AUTHZ_CACHE, &json, p)) {
+        md_json_iterkey(authz_cache_collect, &ctx, json, MD_KEY_AUTHORIZATIONS, NULL);
+    }
+    return ctx.valid;
+}
+
+md_acme_authz_t *md_acme_authz_cache_find(apr_array_header_t *valid, const char *url, 
+                                          const char *domain)
+{
+    md_acme_authz_t *authz;
+    int i;
+    
+    for (i = 0; i < valid->nelts; ++i) {
+        authz = APR_ARRAY_IDX(valid, i, md_acme_authz_t *);
+        if ((url && !strcmp(url, authz->url)) 
+            || (domain && !apr_strnatcasecmp(domain, authz->domain))) {
+            return authz;
+        }
+    }
+    return NULL;
+}
+
+apr_status_t md_acme_authz_cache_update(md_acme_t *acme, md_store_t *store, 
+                                        apr_array_header_t *authzs, apr_pool_t *p)
+{
+    md_acme_authz_t *authz;
+    md_json_t *json, *entry;
+    const char *url;
+    apr_time_t now = apr_time_now();
+    int i, changed = 0;
+    
+    if (!acme->acct_id) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != md_store_load_json(store, MD_SG_CACHE, acme->acct_id, 
+                                          MD_FN_AUTHZ_CACHE, &json, p)) {
+        json = md_json_create(p);
+    }
+    for (i = 0; i < authzs->nelts; ++i) {
+        authz = APR_ARRAY_IDX(authzs, i, md_acme_authz_t *);
+        if (!authz->domain || !authz->url) {
+            continue;
+        }
+        if (authz->state == MD_ACME_AUTHZ_S_VALID && authz->expires > now) {
+            url = md_json_gets(json, MD_KEY_AUTHORIZATIONS, authz->domain, MD_KEY_LOCATION, NULL);
+            if (!url || strcmp(url, authz->url)) {
+                entry = md_acme_authz_to_json(authz, p);
+                md_json_del(entry, MD_KEY_DIR, NULL);
+                md_json_setj(entry, json, MD_KEY_AUTHORIZATIONS, authz->domain, NULL);
+                changed = 1;
+            }
+        }
+        else if (authz->state != MD_ACME_AUTHZ_S_VALID
+                 && md_json_has_key(json, MD_KEY_AUTHORIZATIONS, authz->domain, NULL)) {
+            md_json_del(json, MD_KEY_AUTHORIZATIONS, authz->domain, NULL);
+            changed = 1;
+        }
+    }
+    if (!changed) {
+        return APR_SUCCESS;
+    }
+    return authz_cache_save(acme, store, json, p);
+}
+
+typedef struct {
+    apr_array_header_t *urls;
+    apr_array_header_t *domains;
+} authz_forget_ctx;
+
+static int authz_cache_match(void *baton, const char *key, md_json_t *json)
+{
+    authz_forget_ctx *ctx = baton;
+    const char *url = md_json_gets(json, MD_KEY_LOCATION, NULL);
+    
+    if (url && md_array_str_index(ctx->urls, url, 0, 1) >= 0) {
+        APR_ARRAY_PUSH(ctx->domains, const char *) = key;
+    }
+    return 1;
+}
+
+apr_status_t md_acme_authz_cache_forget(md_acme_t *acme, md_store_t *store, 
+                                        apr_array_header_t *urls, apr_pool_t *p)
+{
+    authz_forget_ctx ctx;
+    md_json_t *json;
+    int i;
+    
+    if (!acme->acct_id || APR_SUCCESS != md_store_load_json(store, MD_SG_CACHE, acme->acct_id, 
+                                                            MD_FN_AUTHZ_CACHE, &json, p)) {
+        return APR_SUCCESS;
+    }
+    ctx.urls = urls;
+    ctx.domains = apr_array_make(p, 5, sizeof(const char *));
+    md_json_iterkey(authz_cache_match, &ctx, json, MD_KEY_AUTHORIZATIONS, NULL);
+    if (ctx.domains->nelts <= 0) {
+        return APR_SUCCESS;
+    }
+    for (i = 0; i < ctx.domains->nelts; ++i) {
+        md_json_del(json, MD_KEY_AUTHORIZATIONS, APR_ARRAY_IDX(ctx.domains, i, const char *), NULL);
+    }
+    return authz_cache_save(acme, store, json, p);
+}
@@ -32,6 +32,7 @@ typedef struct md_acme_challenge_t md_acme_challenge_t;
 #define MD_AUTHZ_TYPE_HTTP01        "http-01"
 #define MD_AUTHZ_TYPE_TLSSNI01      "tls-sni-01"
 #define MD_AUTHZ_TYPE_TLSALPN01     "tls-alpn-01"
+#define MD_AUTHZ_TYPE_DNS01         "dns-01"
 
 typedef enum {
     MD_ACME_AUTHZ_S_UNKNOWN,
@@ -56,6 +57,7 @@ struct md_acme_authz_t {
 #define MD_FN_TLSSNI01_PKEY     "acme-tls-sni-01.key.pem"
 #define MD_FN_TLSALPN01_CERT    "acme-tls-alpn-01.cert.pem"
 #define MD_FN_TLSALPN01_PKEY    "acme-tls-alpn-01.key.pem"
+#define MD_FN_DNS01             "acme-dns-01.txt"
 
 
 md_acme_authz_t *md_acme_authz_create(apr_pool_t *p);
@@ -71,10 +73,108 @@ apr_status_t md_acme_authz_retrieve(md_acme_t *acme, apr_pool_t *p, const char *
                                     md_acme_authz_t **pauthz);
 apr_status_t md_acme_authz_update(md_acme_authz_t *authz, struct md_acme_t *acme, apr_pool_t *p);
 
+/**
+ * Update all authz (md_acme_authz_t*) in the array with their resources from the
+ * server, retrieving several at the same time.
+ */
+apr_status_t md_acme_authz_update_all(struct apr_array_header_t *authzs, 
+                                      struct md_acme_t *acme, apr_pool_t *p);
+
+/**
+ * Set up the response to one of the challenges in the authz and notify the server
+ * if needed. When a batch is started on the acme instance, the notification is
+ * sent with the batch.
+ */
 apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, struct md_acme_t *acme, 
                                    struct md_store_t *store, apr_array_header_t *challenges, 
                                    struct md_pkey_spec_t *key_spec, apr_pool_t *p);
+/**
+ * Called when challenge data for name has been written to the store, before the
+ * ACME server is asked to validate it. A publisher makes the data available where
+ * else validation requests may arrive, e.g. other nodes behind a load balancer, and
+ * returns APR_SUCCESS once it is visible there. On other return values, validation
+ * is not requested and the challenge is set up again on the next attempt.
+ */
+typedef apr_status_t md_acme_authz_publish_cb(void *baton, struct md_store_t *store,
+                                              const char *cha_type, const char *name, 
+                                              apr_pool_t *p);
+
+/**
+ * Set the publisher of challenge data, NULL for none. Without one, challenge data
+ * is only checked to be readable from the store. In the server, other modules install
+ * theirs via the optional function md_set_challenge_publisher of mod_md.h.
+ */
+void md_acme_authz_set_publisher(md_acme_authz_publish_cb *cb, void *baton);
+
 apr_status_t md_acme_authz_del(md_acme_authz_t *authz, struct md_acme_t *acme, 
                                struct md_store_t *store, apr_pool_t *p);
 
+/**
+ * Set the command that sets up and tears down dns-01 TXT records and how long
+ * to wait for new records to propagate. NULL disables dns-01 challenges.
+ */
+void md_acme_authz_set_dns01(const char *cmd, apr_interval_time_t wait);
+
+/**
+ * Set up the TXT records of all dns-01 challenges responded to since the last call 
+ * in one go and ask the server to validate them once they had time to propagate. 
+ * Until then, this returns APR_EAGAIN with acme->retry_after set to when to call
+ * again, without setting the records up twice. Responses inside a batch of acme wait
+ * for this, otherwise it happens right away.
+ */
+apr_status_t md_acme_authz_dns01_perform(struct md_acme_t *acme, apr_pool_t *p);
+
+/**
+ * Enable/disable fetching http-01 challenge responses from the domains ourselves, 
+ * before the server is asked to validate them.
+ */
+void md_acme_authz_set_preflight(int enabled);
+
+/**
+ * Fetch the http-01 challenge responses set up since the last call, all at the same
+ * time, and ask the server to validate those that arrived as expected. Responses 
+ * inside a batch of acme wait for this, otherwise it happens right away.
+ * @return APR_EAGAIN if a challenge could not be fetched, leaving it pending
+ */
+apr_status_t md_acme_authz_preflight_perform(struct md_acme_t *acme, apr_pool_t *p);
+
+/**
+ * Remove what challenges left outside the store in the challenge dirs, before
+ * they are purged.
+ */
+apr_status_t md_acme_authz_teardown(struct md_store_t *store, 
+                                    struct apr_array_header_t *dirs, apr_pool_t *p);
+
+/**************************************************************************************************/
+/* valid authorizations of an account */
+
+#define MD_FN_AUTHZ_CACHE       "authz.json"
+
+/**
+ * Get the authorizations (md_acme_authz_t*) of the current account of acme that 
+ * were valid when last seen and do not expire soon. The array may be empty.
+ */
+struct apr_array_header_t *md_acme_authz_cache_get(struct md_acme_t *acme, 
+                                                   struct md_store_t *store, apr_pool_t *p);
+
+/**
+ * Find the authorization in valid for the url or, if url is NULL, the domain.
+ */
+md_acme_authz_t *md_acme_authz_cache_find(struct apr_array_header_t *valid, const char *url, 
+                                          const char *domain);
+
+/**
+ * Remember the valid ones among the updated authzs for the current account of acme and
+ * forget those for domains that are no longer valid.
+ */
+apr_status_t md_acme_authz_cache_update(struct md_acme_t *acme, struct md_store_t *store, 
+                                        struct apr_array_header_t *authzs, apr_pool_t *p);
+
+/**
+ * Forget the authorizations with the given urls, e.g. when the CA did not accept
+ * them as valid for an order.
+ */
+apr_status_t md_acme_authz_cache_forget(struct md_acme_t *acme, struct md_store_t *store, 
+                                        struct apr_array_header_t *urls, apr_pool_t *p);
+
 #endif /* md_acme_authz_h */
@@ -27,6 +27,7 @@
 #include "md_crypt.h"
 #include "md_json.h"
 #include "md_jws.h"
+#include "md_keypool.h"
 #include "md_http.h"
 #include "md_log.h"
 #include "md_reg.h"
@@ -66,16 +67,15 @@ static apr_status_t save_acct_staged(md_acme_t *acme, md_store_t *store,
                                      const char *md_name, apr_pool_t *p)
 {
     md_json_t *jacct;
-    apr_status_t rv;
+    md_store_batch_t *batch;
     
     jacct = md_acme_acct_to_json(acme->acct, p);
     
-    rv = md_store_save(store, p, MD_SG_STAGING, md_name, MD_FN_ACCOUNT, MD_SV_JSON, jacct, 0);
-    if (APR_SUCCESS == rv) {
-        rv = md_store_save(store, p, MD_SG_STAGING, md_name, MD_FN_ACCT_KEY, 
-                           MD_SV_PKEY, acme->acct_key, 0);
-    }
-    return rv;
+    md_store_batch_begin(&batch, store, p);
+    md_store_batch_save(batch, MD_SG_STAGING, md_name, MD_FN_ACCOUNT, MD_SV_JSON, jacct, 0);
+    md_store_batch_save(batch, MD_SG_STAGING, md_name, MD_FN_ACCT_KEY, 
+                        MD_SV_PKEY, acme->acct_key, 0);
+    return md_store_batch_commit(batch);
 }
 
 apr_status_t md_acme_drive_set_acct(md_proto_driver_t *d) 
@@ -150,6 +150,10 @@ apr_status_t md_acme_drive_set_acct(md_proto_driver_t *d)
             goto out;
         }
     
+        /* MDs with EC keys get an EC account key as well, signing with it is cheaper */
+        if (md->pkey_spec && MD_PKEY_TYPE_EC == md->pkey_spec->type) {
+            ad->acme->acct_key_spec = md->pkey_spec;
+        }
         rv = md_acme_acct_register(ad->acme, d->p, md->contacts, md->ca_agreement);
         if (APR_SUCCESS == rv) {
             md->ca_account = NULL;
@@ -224,20 +228,85 @@ static apr_status_t on_add_cert(md_acme_t *acme, const md_http_response_t *res,
     return rv;
 }
 
-static apr_status_t get_cert(void *baton, int attempt)
+static apr_status_t get_cert(void *baton, md_util_poll_t *poll)
 {
     md_proto_driver_t *d = baton;
     md_acme_driver_t *ad = d->baton;
+    apr_status_t rv;
     
-    (void)attempt;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, d->p, "retrieving cert from %s",
                   ad->order->certificate);
-    return md_acme_GET(ad->acme, ad->order->certificate, NULL, NULL, on_add_cert, d);
+    rv = md_acme_GET(ad->acme, ad->order->certificate, NULL, NULL, on_add_cert, d);
+    if (poll) {
+        poll->retry_after = ad->acme->retry_after;
+    }
+    return rv;
+}
+
+void md_acme_drive_poll_init(md_util_poll_t *poll, md_proto_driver_t *d, 
+                             const char *name, apr_interval_time_t timeout, int backoff)
+{
+    md_acme_driver_t *ad = d->baton;
+    md_acme_order_t *order = ad->order;
+    
+    md_util_poll_init(poll, timeout, 0, 0, backoff);
+    poll->max_block = d->max_block;
+    poll->name = name;
+    if (order && order->poll_name && !strcmp(name, order->poll_name)) {
+        /* continue where the last run stopped waiting */
+        if (order->poll_giveup_at) {
+            poll->giveup_at = order->poll_giveup_at;
+        }
+        if (order->poll_delay > 0) {
+            poll->delay = order->poll_delay;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, d->p, "%s: continuing poll '%s'", 
+                      d->md->name, name);
+    }
+}
+
+static void poll_state_save(md_proto_driver_t *d, md_acme_order_t *order)
+{
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = md_acme_order_save(d->store, d->p, MD_SG_STAGING, 
+                                                d->md->name, order, 0))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, d->p, "%s: saving poll state", 
+                      d->md->name);
+    }
+}
+
+apr_status_t md_acme_drive_poll_end(md_proto_driver_t *d, md_util_poll_t *poll, apr_status_t rv)
+{
+    md_acme_driver_t *ad = d->baton;
+    md_acme_order_t *order = ad->order;
+    
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        d->resume_at = poll->next_at;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: not waiting any longer "
+                      "in phase '%s', to continue in %s", d->md->name, ad->phase, 
+                      md_print_duration(d->p, poll->next_at - apr_time_now()));
+        if (order && poll->name) {
+            order->poll_name = poll->name;
+            order->poll_giveup_at = poll->giveup_at;
+            order->poll_delay = poll->delay;
+            poll_state_save(d, order);
+        }
+    }
+    else if (order && order->poll_name && poll->name && !strcmp(poll->name, order->poll_name)) {
+        /* done or failed, a new poll starts afresh */
+        order->poll_name = NULL;
+        order->poll_giveup_at = 0;
+        order->poll_delay = 0;
+        poll_state_save(d, order);
+    }
+    return rv;
 }
 
 apr_status_t md_acme_drive_cert_poll(md_proto_driver_t *d, int only_once)
 {
     md_acme_driver_t *ad = d->baton;
+    md_util_poll_t poll;
     apr_status_t rv;
     
     assert(ad->md);
@@ -247,10 +316,11 @@ apr_status_t md_acme_drive_cert_poll(md_proto_driver_t *d, int only_once)
     
     ad->phase = "poll certificate";
     if (only_once) {
-        rv = get_cert(d, 0);
+        rv = get_cert(d, NULL);
     }
     else {
-        rv = md_util_try(get_cert, d, 1, ad->cert_poll_timeout, 0, 0, 1);
+        md_acme_drive_poll_init(&poll, d, "certificate", ad->cert_poll_timeout, 1);
+        rv = md_acme_drive_poll_end(d, &poll, md_util_poll(get_cert, d, &poll, 1));
     }
     
     md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, "poll for cert at %s", ad->order->certificate);
@@ -348,7 +418,7 @@ apr_status_t md_acme_drive_setup_certificate(md_proto_driver_t *d)
     
     rv = md_pkey_load(d->store, MD_SG_STAGING, ad->md->name, &privkey, d->p);
     if (APR_STATUS_IS_ENOENT(rv)) {
-        if (APR_SUCCESS == (rv = md_pkey_gen(&privkey, d->p, d->md->pkey_spec))) {
+        if (APR_SUCCESS == (rv = md_keypool_get(&privkey, d->store, d->md->pkey_spec, d->p))) {
             rv = md_pkey_save(d->store, d->p, MD_SG_STAGING, ad->md->name, privkey, 1);
         }
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: generate privkey", ad->md->name);
@@ -400,13 +470,23 @@ static apr_status_t on_add_chain(md_acme_t *acme, const md_http_response_t *res,
     return rv;
 }
 
-static apr_status_t get_chain(void *baton, int attempt)
+static apr_status_t get_chain(void *baton, md_util_poll_t *poll)
 {
     md_proto_driver_t *d = baton;
     md_acme_driver_t *ad = d->baton;
-    const char *prev_link = NULL;
+    const char *prev_link = NULL, *first_link;
     apr_status_t rv = APR_SUCCESS;
 
+    /* Chains of MDs from the same CA usually are the same, no need to fetch it again */
+    first_link = (ad->certs->nelts == 1)? ad->next_up_link : NULL;
+    if (first_link && md_cert_cache_chain_get(ad->certs, first_link, 
+                                               APR_ARRAY_IDX(ad->certs, 0, md_cert_t *), 
+                                               d->p) > 0) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, 
+                      "using known chain from %s", first_link);
+        return APR_SUCCESS;
+    }
+    
     while (APR_SUCCESS == rv && ad->certs->nelts < 10) {
         int nelts = ad->certs->nelts;
         
@@ -435,13 +515,17 @@ static apr_status_t get_chain(void *baton, int attempt)
         }
     }
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, d->p, 
-                  "got chain with %d certs (%d. attempt)", ad->certs->nelts, attempt);
+                  "got chain with %d certs (%d. attempt)", ad->certs->nelts, poll->attempts);
+    if (APR_SUCCESS == rv && first_link) {
+        md_cert_cache_chain_set(first_link, ad->certs, 1);
+    }
     return rv;
 }
 
 static apr_status_t ad_chain_retrieve(md_proto_driver_t *d)
 {
     md_acme_driver_t *ad = d->baton;
+    md_util_poll_t poll;
     apr_status_t rv;
     
     /* This may be called repeatedly and needs to progress. The relevant state is in
@@ -476,7 +560,8 @@ static apr_status_t ad_chain_retrieve(md_proto_driver_t *d)
         }
     }
     
-    rv = md_util_try(get_chain, d, 0, ad->cert_poll_timeout, 0, 0, 0);
+    md_acme_drive_poll_init(&poll, d, "chain", ad->cert_poll_timeout, 0);
+    rv = md_acme_drive_poll_end(d, &poll, md_util_poll(get_chain, d, &poll, 0));
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "chain retrieved");
     
 out:
@@ -633,8 +718,11 @@ static apr_status_t acme_stage(md_proto_driver_t *d)
     }
 
     /* Need to renew */
-    if (APR_SUCCESS != (rv = md_acme_create(&ad->acme, d->p, d->md->ca_url, d->proxy_url)) 
-        || APR_SUCCESS != (rv = md_acme_setup(ad->acme))) {
+    if (APR_SUCCESS == (rv = md_acme_create(&ad->acme, d->p, d->md->ca_url, d->proxy_url))) {
+        ad->acme->store = d->store;
+        rv = md_acme_setup(ad->acme);
+    }
+    if (APR_SUCCESS != rv) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: setup ACME(%s)", 
                       d->md->name, d->md->ca_url);
         goto out;
@@ -710,6 +798,11 @@ static apr_status_t acme_stage(md_proto_driver_t *d)
     md_acme_order_purge(d->store, d->p, MD_SG_STAGING, d->md->name);
 
 out:    
+    if (APR_STATUS_IS_EAGAIN(rv) && !d->resume_at && ad->acme 
+        && ad->acme->retry_after > apr_time_now()) {
+        /* held back by the rate limits of the CA or waiting for dns-01 records */
+        d->resume_at = ad->acme->retry_after;
+    }
     return rv;
 }
 
@@ -739,6 +832,7 @@ static apr_status_t acme_preload(md_store_t *store, md_store_group_t load_group,
     md_t *md;
     apr_array_header_t *pubcert;
     struct md_acme_acct_t *acct;
+    md_store_batch_t *batch;
 
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: preload start", name);
     /* Load data from MD_SG_STAGING and save it into "load_group".
@@ -819,19 +913,14 @@ static apr_status_t acme_preload(md_store_t *store, md_store_group_t load_group,
                       name, id);
     }
     
-    if (APR_SUCCESS != (rv = md_save(store, p, load_group, md, 1))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving md json", name);
-        return rv;
-    }
-    if (APR_SUCCESS != (rv = md_pubcert_save(store, p, load_group, name, pubcert, 1))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving cert chain", name);
-        return rv;
-    }
-    if (APR_SUCCESS != (rv = md_pkey_save(store, p, load_group, name, privkey, 1))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving private key", name);
-        return rv;
+    /* md, chain and key go into the empty load_group together */
+    md_store_batch_begin(&batch, store, p);
+    md_store_batch_save(batch, load_group, name, MD_FN_MD, MD_SV_JSON, md_to_json(md, p), 1);
+    md_store_batch_save(batch, load_group, name, MD_FN_PUBCERT, MD_SV_CHAIN, pubcert, 1);
+    md_store_batch_save(batch, load_group, name, MD_FN_PRIVKEY, MD_SV_PKEY, privkey, 1);
+    if (APR_SUCCESS != (rv = md_store_batch_commit(batch))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving md, cert chain and key", name);
     }
-    
     return rv;
 }
 
@@ -850,8 +939,70 @@ static apr_status_t acme_driver_preload(md_proto_driver_t *d, md_store_group_t g
     return rv;
 }
 
+/**************************************************************************************************/
+/* ACME staging check */
+
+/* Staging saves each step as it is done: the md copy, the account, the private key, 
+ * the order with its authz urls (and challenge states at the CA) and, once the chain 
+ * is complete, the certificates. A restarted staging continues from these and has 
+ * the CA confirm account and order. What is checked here is that each file that is
+ * present can be read and that the certificates fit the key and the domains. */
+
+static apr_status_t acme_driver_check(md_proto_driver_t *d)
+{
+    md_t *md;
+    md_acme_acct_t *acct;
+    md_pkey_t *acct_key, *privkey = NULL;
+    md_acme_order_t *order;
+    apr_array_header_t *certs;
+    md_cert_t *cert;
+    const char *step;
+    apr_status_t rv;
+    
+    step = "md";
+    if (APR_SUCCESS != (rv = md_load(d->store, MD_SG_STAGING, d->md->name, &md, d->p))) {
+        /* ENOENT: nothing staged */
+        goto out;
+    }
+    
+    step = "account";
+    rv = md_acme_acct_load(&acct, &acct_key, d->store, MD_SG_STAGING, d->md->name, d->p);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) goto out;
+    
+    step = "private key";
+    rv = md_pkey_load(d->store, MD_SG_STAGING, d->md->name, &privkey, d->p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        privkey = NULL;
+    }
+    else if (APR_SUCCESS != rv) goto out;
+    
+    step = "order";
+    rv = md_acme_order_load(d->store, MD_SG_STAGING, d->md->name, &order, d->p);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) goto out;
+    
+    step = "certificate";
+    rv = md_pubcert_load(d->store, MD_SG_STAGING, d->md->name, &certs, d->p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        rv = APR_SUCCESS;
+    }
+    else if (APR_SUCCESS == rv) {
+        cert = certs->nelts > 0? APR_ARRAY_IDX(certs, 0, md_cert_t*) : NULL;
+        if (!cert || certs->nelts < 2 || !privkey 
+            || !md_cert_matches_pkey(cert, privkey) || !md_cert_covers_md(cert, md)) {
+            rv = APR_EINVAL;
+        }
+    }
+    
+out:
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, d->p, 
+                      "%s: staged %s is damaged", d->md->name, step);
+    }
+    return rv;
+}
+
 static md_proto_t ACME_PROTO = {
-    MD_PROTO_ACME, acme_driver_init, acme_driver_stage, acme_driver_preload
+    MD_PROTO_ACME, acme_driver_init, acme_driver_stage, acme_driver_preload, acme_driver_check
 };
  
 apr_status_t md_acme_protos_add(apr_hash_t *protos, apr_pool_t *p)
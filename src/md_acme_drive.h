@@ -48,5 +48,19 @@ apr_status_t md_acme_drive_set_acct(struct md_proto_driver_t *d);
 apr_status_t md_acme_drive_setup_certificate(struct md_proto_driver_t *d);
 apr_status_t md_acme_drive_cert_poll(struct md_proto_driver_t *d, int only_once);
 
+/**
+ * Init a poll on the ACME server, limited to what the driver may block. If a poll
+ * with this name was left waiting in an earlier run, its deadline and delay are 
+ * taken from the staged order, so that resuming does not start the timeout anew.
+ */
+void md_acme_drive_poll_init(struct md_util_poll_t *poll, struct md_proto_driver_t *d, 
+                             const char *name, apr_interval_time_t timeout, int backoff);
+/**
+ * Finish a poll with the given status. On APR_EAGAIN, remember in the driver
+ * when to resume and save the state of the poll with the staged order.
+ */
+apr_status_t md_acme_drive_poll_end(struct md_proto_driver_t *d, struct md_util_poll_t *poll, 
+                                    apr_status_t rv);
+
 #endif /* md_acme_drive_h */
 
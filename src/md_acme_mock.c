@@ -0,0 +1,712 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_buckets.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_acme.h"
+#include "md_acme_authz.h"
+#include "md_json.h"
+#include "md_http.h"
+#include "md_log.h"
+#include "md_util.h"
+#include "md_acme_mock.h"
+
+#define MOCK_BASE       "https://mock-ca.bench.test"
+
+typedef enum {
+    EP_DIRECTORY,
+    EP_NONCE,
+    EP_NEW_ACCOUNT,
+    EP_ACCOUNT,
+    EP_NEW_ORDER,
+    EP_ORDER,
+    EP_FINALIZE,
+    EP_AUTHZ,
+    EP_CHALLENGE,
+    EP_CERT,
+    EP_UNKNOWN,
+    EP_COUNT
+} mock_ep_t;
+
+static const char *EpNames[EP_COUNT] = {
+    "directory",
+    "new-nonce",
+    "new-account",
+    "account",
+    "new-order",
+    "order",
+    "finalize",
+    "authz",
+    "challenge",
+    "cert",
+    "unknown",
+};
+
+typedef struct {
+    int id;
+    const char *status;             /* "pending", "ready", "processing" or "valid" */
+    apr_array_header_t *authzs;     /* ids of its authorizations */
+    apr_array_header_t *domains;
+    int polls;                      /* left to report "processing" */
+    const char *pem;                /* the certificate chain, once finalized */
+} mock_order_t;
+
+typedef struct {
+    int id;
+    const char *domain;
+    const char *status;             /* "pending" or "valid" */
+    const char *token;
+    int triggered;                  /* client asked for validation */
+    int polls;                      /* left to report "pending" after that */
+} mock_authz_t;
+
+struct md_acme_mock_t {
+    apr_pool_t *p;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    md_acme_mock_conf_t conf;
+    md_pkey_t *ca_pkey;
+    md_cert_t *ca_cert;
+    apr_array_header_t *orders;     /* of mock_order_t*, by id - 1 */
+    apr_array_header_t *authzs;     /* of mock_authz_t*, by id - 1 */
+    long accounts;
+    long nonce;
+    long serial;
+    apr_uint32_t random;
+    long requests[EP_COUNT];
+    long errors;
+    long bad_nonces;
+};
+
+static md_acme_mock_t *cur_mock;
+
+static void mock_lock(md_acme_mock_t *mock)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(mock->mutex);
+#else
+    (void)mock;
+#endif
+}
+
+static void mock_unlock(md_acme_mock_t *mock)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(mock->mutex);
+#else
+    (void)mock;
+#endif
+}
+
+/* needs the lock, xorshift is good enough for picking errors */
+static apr_uint32_t mock_random(md_acme_mock_t *mock)
+{
+    apr_uint32_t x = mock->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    mock->random = x;
+    return x;
+}
+
+static int mock_chance(md_acme_mock_t *mock, int pct)
+{
+    return (pct > 0) && (int)(mock_random(mock) % 100) < pct;
+}
+
+apr_status_t md_acme_mock_create(md_acme_mock_t **pmock, apr_pool_t *p,
+                                 const md_acme_mock_conf_t *conf)
+{
+    md_acme_mock_t *mock;
+    md_pkey_spec_t spec;
+    apr_array_header_t *names;
+    apr_status_t rv;
+
+    mock = apr_pcalloc(p, sizeof(*mock));
+    mock->p = p;
+    mock->conf = *conf;
+    mock->orders = apr_array_make(p, 100, sizeof(mock_order_t *));
+    mock->authzs = apr_array_make(p, 100, sizeof(mock_authz_t *));
+    mock->random = (apr_uint32_t)apr_time_now() | 1;
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&mock->mutex,
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        goto out;
+    }
+#endif
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    if (APR_SUCCESS != (rv = md_pkey_gen(&mock->ca_pkey, p, &spec))) goto out;
+    names = apr_array_make(p, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(names, const char *) = "mock-ca.bench.test";
+    rv = md_cert_self_sign(&mock->ca_cert, "Mock ACME CA", names, mock->ca_pkey,
+                           apr_time_from_sec(365 * MD_SECS_PER_DAY), p);
+out:
+    *pmock = (APR_SUCCESS == rv)? mock : NULL;
+    return rv;
+}
+
+/**************************************************************************************************/
+/* resources, all need the lock */
+
+static const char *mock_url(apr_pool_t *p, const char *what, int id)
+{
+    return apr_psprintf(p, MOCK_BASE "/%s/%d", what, id);
+}
+
+static mock_order_t *order_get(md_acme_mock_t *mock, int id)
+{
+    return (id > 0 && id <= mock->orders->nelts)?
+        APR_ARRAY_IDX(mock->orders, id - 1, mock_order_t *) : NULL;
+}
+
+static mock_authz_t *authz_get(md_acme_mock_t *mock, int id)
+{
+    return (id > 0 && id <= mock->authzs->nelts)?
+        APR_ARRAY_IDX(mock->authzs, id - 1, mock_authz_t *) : NULL;
+}
+
+static int add_identifier(void *baton, size_t index, md_json_t *json)
+{
+    apr_array_header_t *domains = baton;
+    const char *value;
+
+    (void)index;
+    if ((value = md_json_gets(json, "value", NULL))) {
+        APR_ARRAY_PUSH(domains, const char *) = apr_pstrdup(domains->pool, value);
+    }
+    return 1;
+}
+
+static mock_order_t *order_create(md_acme_mock_t *mock, md_json_t *payload)
+{
+    mock_order_t *order;
+    mock_authz_t *authz;
+    int i;
+
+    order = apr_pcalloc(mock->p, sizeof(*order));
+    order->id = mock->orders->nelts + 1;
+    order->status = "pending";
+    order->domains = apr_array_make(mock->p, 5, sizeof(const char *));
+    order->authzs = apr_array_make(mock->p, 5, sizeof(int));
+    md_json_itera(add_identifier, order->domains, payload, "identifiers", NULL);
+    for (i = 0; i < order->domains->nelts; ++i) {
+        authz = apr_pcalloc(mock->p, sizeof(*authz));
+        authz->id = mock->authzs->nelts + 1;
+        authz->domain = APR_ARRAY_IDX(order->domains, i, const char *);
+        authz->status = "pending";
+        authz->token = apr_psprintf(mock->p, "mock-token-%d", authz->id);
+        APR_ARRAY_PUSH(mock->authzs, mock_authz_t *) = authz;
+        APR_ARRAY_PUSH(order->authzs, int) = authz->id;
+    }
+    APR_ARRAY_PUSH(mock->orders, mock_order_t *) = order;
+    return order;
+}
+
+static md_json_t *order_to_json(mock_order_t *order, apr_pool_t *p)
+{
+    md_json_t *json, *jid;
+    int i;
+
+    json = md_json_create(p);
+    md_json_sets(order->status, json, MD_KEY_STATUS, NULL);
+    for (i = 0; i < order->domains->nelts; ++i) {
+        jid = md_json_create(p);
+        md_json_sets("dns", jid, MD_KEY_TYPE, NULL);
+        md_json_sets(APR_ARRAY_IDX(order->domains, i, const char *), jid, MD_KEY_VALUE, NULL);
+        md_json_addj(jid, json, "identifiers", NULL);
+    }
+    for (i = 0; i < order->authzs->nelts; ++i) {
+        md_json_addj(md_json_create_s(p, mock_url(p, "authz",
+                                                  APR_ARRAY_IDX(order->authzs, i, int))),
+                     json, MD_KEY_AUTHORIZATIONS, NULL);
+    }
+    md_json_sets(apr_psprintf(p, MOCK_BASE "/order/%d/finalize", order->id),
+                 json, MD_KEY_FINALIZE, NULL);
+    if (order->pem && !strcmp("valid", order->status)) {
+        md_json_sets(mock_url(p, "cert", order->id), json, MD_KEY_CERTIFICATE, NULL);
+    }
+    return json;
+}
+
+static md_json_t *challenge_to_json(mock_authz_t *authz, apr_pool_t *p)
+{
+    md_json_t *json = md_json_create(p);
+
+    md_json_sets(MD_AUTHZ_TYPE_HTTP01, json, MD_KEY_TYPE, NULL);
+    md_json_sets(mock_url(p, "chall", authz->id), json, MD_KEY_URL, NULL);
+    md_json_sets(authz->token, json, MD_KEY_TOKEN, NULL);
+    md_json_sets(!strcmp("valid", authz->status)? "valid"
+                 : (authz->triggered? "processing" : "pending"), json, MD_KEY_STATUS, NULL);
+    return json;
+}
+
+static md_json_t *authz_to_json(mock_authz_t *authz, apr_pool_t *p)
+{
+    md_json_t *json = md_json_create(p);
+
+    md_json_sets(authz->status, json, MD_KEY_STATUS, NULL);
+    md_json_sets("dns", json, MD_KEY_IDENTIFIER, MD_KEY_TYPE, NULL);
+    md_json_sets(authz->domain, json, MD_KEY_IDENTIFIER, MD_KEY_VALUE, NULL);
+    md_json_addj(challenge_to_json(authz, p), json, MD_KEY_CHALLENGES, NULL);
+    return json;
+}
+
+/* Sign the CSR with the key of the mock CA, any CSR will do. */
+static const char *order_issue(md_acme_mock_t *mock, mock_order_t *order,
+                               const char *csr_der, apr_size_t csr_len)
+{
+    const unsigned char *der = (const unsigned char *)csr_der;
+    X509_REQ *csr = NULL;
+    X509 *x = NULL;
+    EVP_PKEY *pkey = NULL;
+    STACK_OF(X509_EXTENSION) *exts = NULL;
+    BIO *bio = NULL;
+    char *data;
+    const char *pem = NULL;
+    long len;
+    int i;
+
+    if (!(csr = d2i_X509_REQ(NULL, &der, (long)csr_len))
+        || !(pkey = X509_REQ_get_pubkey(csr))
+        || !(x = X509_new())) {
+        goto out;
+    }
+    X509_set_version(x, 2L);
+    ASN1_INTEGER_set(X509_get_serialNumber(x), ++mock->serial);
+    X509_set_issuer_name(x, X509_get_subject_name(md_cert_get_X509(mock->ca_cert)));
+    X509_set_subject_name(x, X509_REQ_get_subject_name(csr));
+    X509_gmtime_adj(X509_get_notBefore(x), -60);
+    X509_gmtime_adj(X509_get_notAfter(x), 90L * MD_SECS_PER_DAY);
+    X509_set_pubkey(x, pkey);
+    /* the SAN names, and must-staple if asked for */
+    exts = X509_REQ_get_extensions(csr);
+    for (i = 0; exts && i < sk_X509_EXTENSION_num(exts); ++i) {
+        X509_add_ext(x, sk_X509_EXTENSION_value(exts, i), -1);
+    }
+    if (!X509_sign(x, md_pkey_get_EVP_PKEY(mock->ca_pkey), EVP_sha256())
+        || !(bio = BIO_new(BIO_s_mem()))
+        || !PEM_write_bio_X509(bio, x)
+        || !PEM_write_bio_X509(bio, md_cert_get_X509(mock->ca_cert))) {
+        goto out;
+    }
+    len = BIO_get_mem_data(bio, &data);
+    pem = apr_pstrndup(mock->p, data, (apr_size_t)len);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, mock->p, "mock: issued cert %ld for order %d",
+                  mock->serial, order->id);
+out:
+    if (bio) BIO_free(bio);
+    if (exts) sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    if (x) X509_free(x);
+    if (pkey) EVP_PKEY_free(pkey);
+    if (csr) X509_REQ_free(csr);
+    return pem;
+}
+
+/**************************************************************************************************/
+/* requests */
+
+typedef struct {
+    md_http_response_t *res;
+    mock_ep_t ep;
+    int id;
+    md_json_t *payload;             /* of a POSTed JWS, NULL if none or empty */
+} mock_req_t;
+
+static mock_ep_t endpoint_of(const char *url, int *pid)
+{
+    const char *path;
+    char what[32], rest[32];
+    int n;
+
+    *pid = 0;
+    if (strncmp(MOCK_BASE "/", url, sizeof(MOCK_BASE))) {
+        return EP_UNKNOWN;
+    }
+    path = url + sizeof(MOCK_BASE);
+    if (!strcmp("directory", path)) return EP_DIRECTORY;
+    if (!strcmp("nonce", path)) return EP_NONCE;
+    if (!strcmp("acct/new", path)) return EP_NEW_ACCOUNT;
+    if (!strcmp("order/new", path)) return EP_NEW_ORDER;
+
+    rest[0] = '\0';
+    n = sscanf(path, "%31[a-z]/%d/%31s", what, pid, rest);
+    if (n < 2) return EP_UNKNOWN;
+    if (!strcmp("acct", what)) return EP_ACCOUNT;
+    if (!strcmp("order", what)) return (n == 3 && !strcmp("finalize", rest))?
+        EP_FINALIZE : EP_ORDER;
+    if (!strcmp("authz", what)) return EP_AUTHZ;
+    if (!strcmp("chall", what)) return EP_CHALLENGE;
+    if (!strcmp("cert", what)) return EP_CERT;
+    return EP_UNKNOWN;
+}
+
+static md_json_t *payload_get(md_http_request_t *req)
+{
+    md_json_t *jws, *payload = NULL;
+    const char *s, *decoded;
+    char *data;
+    apr_size_t len;
+
+    if (req->body
+        && APR_SUCCESS == apr_brigade_pflatten(req->body, &data, &len, req->pool)
+        && APR_SUCCESS == md_json_readd(&jws, req->pool, data, len)
+        && (s = md_json_gets(jws, "payload", NULL)) && *s
+        && (len = md_util_base64url_decode(&decoded, s, req->pool)) > 0) {
+        md_json_readd(&payload, req->pool, decoded, len);
+    }
+    return payload;
+}
+
+static void respond(mock_req_t *r, int status, const char *ctype, const char *body)
+{
+    md_http_response_t *res = r->res;
+
+    res->status = status;
+    if (ctype) {
+        apr_table_setn(res->headers, "Content-Type", ctype);
+    }
+    if (body && *body) {
+        apr_brigade_write(res->body, NULL, NULL, body, strlen(body));
+    }
+}
+
+static void respond_json(mock_req_t *r, int status, md_json_t *json)
+{
+    respond(r, status, "application/json",
+            md_json_writep(json, r->res->req->pool, MD_JSON_FMT_COMPACT));
+}
+
+static void respond_problem(mock_req_t *r, int status, const char *type, const char *detail)
+{
+    apr_pool_t *p = r->res->req->pool;
+    md_json_t *json = md_json_create(p);
+
+    md_json_sets(apr_pstrcat(p, "urn:ietf:params:acme:error:", type, NULL),
+                 json, MD_KEY_TYPE, NULL);
+    md_json_sets(detail, json, MD_KEY_DETAIL, NULL);
+    respond(r, status, "application/problem+json",
+            md_json_writep(json, p, MD_JSON_FMT_COMPACT));
+}
+
+static void retry_after(md_acme_mock_t *mock, mock_req_t *r)
+{
+    if (mock->conf.retry_after > 0) {
+        apr_table_setn(r->res->headers, "Retry-After",
+                       apr_itoa(r->res->req->pool, mock->conf.retry_after));
+    }
+}
+
+/* needs the lock */
+static void answer(md_acme_mock_t *mock, mock_req_t *r)
+{
+    md_http_request_t *req = r->res->req;
+    apr_pool_t *p = req->pool;
+    md_json_t *json;
+    mock_order_t *order = NULL;
+    mock_authz_t *authz = NULL;
+    const char *csr, *der, *location;
+    apr_size_t der_len;
+    int i, ready;
+
+    ++mock->requests[r->ep];
+    apr_table_setn(r->res->headers, "Replay-Nonce",
+                   apr_psprintf(p, "mock-nonce-%ld", ++mock->nonce));
+
+    if (mock_chance(mock, mock->conf.error_pct)) {
+        ++mock->errors;
+        respond_problem(r, 500, "serverInternal", "made up by the mock");
+        return;
+    }
+    if (!strcmp("POST", req->method) && mock_chance(mock, mock->conf.bad_nonce_pct)) {
+        ++mock->bad_nonces;
+        respond_problem(r, 400, "badNonce", "made up by the mock");
+        return;
+    }
+
+    switch (r->ep) {
+        case EP_DIRECTORY:
+            json = md_json_create(p);
+            md_json_sets(MOCK_BASE "/nonce", json, "newNonce", NULL);
+            md_json_sets(MOCK_BASE "/acct/new", json, "newAccount", NULL);
+            md_json_sets(MOCK_BASE "/order/new", json, "newOrder", NULL);
+            md_json_sets(MOCK_BASE "/revoke", json, "revokeCert", NULL);
+            md_json_sets(MOCK_BASE "/key-change", json, "keyChange", NULL);
+            md_json_sets(MOCK_BASE "/terms", json, "meta", "termsOfService", NULL);
+            respond_json(r, 200, json);
+            break;
+
+        case EP_NONCE:
+            respond(r, 200, NULL, NULL);
+            break;
+
+        case EP_NEW_ACCOUNT:
+        case EP_ACCOUNT:
+            json = r->payload? md_json_clone(p, r->payload) : md_json_create(p);
+            md_json_sets("valid", json, MD_KEY_STATUS, NULL);
+            if (EP_NEW_ACCOUNT == r->ep) {
+                r->id = (int)++mock->accounts;
+                apr_table_setn(r->res->headers, "Location", mock_url(p, "acct", r->id));
+            }
+            md_json_sets(apr_psprintf(p, MOCK_BASE "/acct/%d/orders", r->id),
+                         json, MD_KEY_ORDERS, NULL);
+            respond_json(r, (EP_NEW_ACCOUNT == r->ep)? 201 : 200, json);
+            break;
+
+        case EP_NEW_ORDER:
+            if (!r->payload) {
+                respond_problem(r, 400, "malformed", "no identifiers");
+                break;
+            }
+            order = order_create(mock, r->payload);
+            apr_table_setn(r->res->headers, "Location", mock_url(p, "order", order->id));
+            respond_json(r, 201, order_to_json(order, p));
+            break;
+
+        case EP_ORDER:
+            if (!(order = order_get(mock, r->id))) goto not_found;
+            if (!strcmp("pending", order->status)) {
+                for (i = 0, ready = 1; i < order->authzs->nelts; ++i) {
+                    authz = authz_get(mock, APR_ARRAY_IDX(order->authzs, i, int));
+                    ready = ready && !strcmp("valid", authz->status);
+                }
+                if (ready) order->status = "ready";
+            }
+            else if (!strcmp("processing", order->status)) {
+                if (order->polls > 0) {
+                    --order->polls;
+                    retry_after(mock, r);
+                }
+                else {
+                    order->status = "valid";
+                }
+            }
+            respond_json(r, 200, order_to_json(order, p));
+            break;
+
+        case EP_FINALIZE:
+            if (!(order = order_get(mock, r->id))) goto not_found;
+            if (strcmp("ready", order->status)) {
+                respond_problem(r, 403, "orderNotReady", order->status);
+                break;
+            }
+            csr = r->payload? md_json_gets(r->payload, MD_KEY_CSR, NULL) : NULL;
+            if (!csr || !(der_len = md_util_base64url_decode(&der, csr, p))
+                || !(order->pem = order_issue(mock, order, der, der_len))) {
+                respond_problem(r, 400, "badCSR", "unable to sign");
+                break;
+            }
+            order->polls = mock->conf.pending_polls;
+            order->status = (order->polls > 0)? "processing" : "valid";
+            if (order->polls > 0) retry_after(mock, r);
+            /* the client takes the location as the certificate url */
+            location = mock_url(p, "cert", order->id);
+            apr_table_setn(r->res->headers, "Location", location);
+            respond_json(r, 200, order_to_json(order, p));
+            break;
+
+        case EP_AUTHZ:
+            if (!(authz = authz_get(mock, r->id))) goto not_found;
+            if (authz->triggered && !strcmp("pending", authz->status)) {
+                if (authz->polls > 0) {
+                    --authz->polls;
+                    retry_after(mock, r);
+                }
+                else {
+                    authz->status = "valid";
+                }
+            }
+            respond_json(r, 200, authz_to_json(authz, p));
+            break;
+
+        case EP_CHALLENGE:
+            if (!(authz = authz_get(mock, r->id))) goto not_found;
+            if (!authz->triggered) {
+                authz->triggered = 1;
+                authz->polls = mock->conf.pending_polls;
+            }
+            respond_json(r, 200, challenge_to_json(authz, p));
+            break;
+
+        case EP_CERT:
+            if (!(order = order_get(mock, r->id)) || !order->pem) goto not_found;
+            respond(r, 200, "application/pem-certificate-chain", order->pem);
+            break;
+
+        default:
+        not_found:
+            respond_problem(r, 404, "malformed", "no such resource");
+            break;
+    }
+}
+
+static void mock_req_init(mock_req_t *r, md_http_response_t *res, md_http_request_t *req)
+{
+    memset(res, 0, sizeof(*res));
+    res->req = req;
+    res->rv = APR_SUCCESS;
+    res->headers = apr_table_make(req->pool, 5);
+    res->body = apr_brigade_create(req->pool, req->bucket_alloc);
+    r->res = res;
+    r->ep = endpoint_of(req->url, &r->id);
+    r->payload = strcmp("POST", req->method)? NULL : payload_get(req);
+}
+
+static apr_interval_time_t mock_latency(md_acme_mock_t *mock)
+{
+    apr_interval_time_t latency = mock->conf.latency;
+
+    if (latency > 0) {
+        mock_lock(mock);
+        latency = latency / 2 + (apr_interval_time_t)(mock_random(mock) % (apr_uint32_t)latency);
+        mock_unlock(mock);
+    }
+    return latency;
+}
+
+static apr_status_t mock_done(md_http_response_t *res)
+{
+    md_http_request_t *req = res->req;
+    apr_status_t rv;
+
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, "mock: %s %s <-- %d",
+                  req->method, req->url, res->status);
+    res->rv = req->cb? req->cb(res) : APR_SUCCESS;
+    rv = res->rv;
+    md_http_req_destroy(req);
+    return rv;
+}
+
+/**************************************************************************************************/
+/* md_http implementation */
+
+static apr_status_t mock_init(void)
+{
+    return cur_mock? APR_SUCCESS : APR_EGENERAL;
+}
+
+static void mock_req_cleanup(md_http_request_t *req)
+{
+    req->internals = NULL;
+}
+
+static apr_status_t mock_perform(md_http_request_t *req)
+{
+    md_acme_mock_t *mock = cur_mock;
+    md_http_response_t res;
+    mock_req_t r;
+    apr_interval_time_t latency;
+
+    latency = mock_latency(mock);
+    if (latency > 0) {
+        apr_sleep(latency);
+    }
+    mock_req_init(&r, &res, req);
+    mock_lock(mock);
+    answer(mock, &r);
+    mock_unlock(mock);
+    return mock_done(&res);
+}
+
+/* Requests of a batch go out at the same time, the batch takes one latency. */
+static apr_status_t mock_multi_perform(md_http_t *http, apr_array_header_t *reqs)
+{
+    md_acme_mock_t *mock = cur_mock;
+    md_http_response_t *res;
+    md_http_request_t **batch;
+    mock_req_t r;
+    apr_interval_time_t latency;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int i, n = reqs->nelts;
+
+    (void)http;
+    if (n <= 0) {
+        return APR_SUCCESS;
+    }
+    /* callbacks may change the array */
+    batch = apr_pmemdup(reqs->pool, reqs->elts, (apr_size_t)n * sizeof(*batch));
+    res = apr_pcalloc(reqs->pool, (apr_size_t)n * sizeof(*res));
+    latency = mock_latency(mock);
+    if (latency > 0) {
+        apr_sleep(latency);
+    }
+    for (i = 0; i < n; ++i) {
+        mock_req_init(&r, &res[i], batch[i]);
+        mock_lock(mock);
+        answer(mock, &r);
+        mock_unlock(mock);
+        rv2 = mock_done(&res[i]);
+        if (APR_SUCCESS == rv) {
+            rv = rv2;
+        }
+    }
+    return rv;
+}
+
+static md_http_impl_t impl = {
+    mock_init,
+    mock_req_cleanup,
+    mock_perform,
+    mock_multi_perform,
+    NULL,
+};
+
+md_http_impl_t *md_acme_mock_get_impl(md_acme_mock_t *mock)
+{
+    cur_mock = mock;
+    return &impl;
+}
+
+md_json_t *md_acme_mock_stats_to_json(md_acme_mock_t *mock, apr_pool_t *p)
+{
+    md_json_t *json;
+    long total = 0;
+    int i;
+
+    json = md_json_create(p);
+    mock_lock(mock);
+    for (i = 0; i < EP_COUNT; ++i) {
+        if (mock->requests[i]) {
+            md_json_setl(mock->requests[i], json, "requests", EpNames[i], NULL);
+            total += mock->requests[i];
+        }
+    }
+    md_json_setl(total, json, "requests", "total", NULL);
+    md_json_setl(mock->errors, json, "errors", NULL);
+    md_json_setl(mock->bad_nonces, json, "bad-nonces", NULL);
+    md_json_setl(mock->accounts, json, "accounts", NULL);
+    md_json_setl(mock->orders->nelts, json, "orders", NULL);
+    md_json_setl(mock->serial, json, "certificates", NULL);
+    mock_unlock(mock);
+    return json;
+}
@@ -0,0 +1,56 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_acme_mock_h
+#define mod_md_md_acme_mock_h
+
+struct md_http_impl_t;
+struct md_json_t;
+
+/**
+ * An ACMEv2 CA that lives in the process, answering the requests of md_http_t
+ * instead of a network connection. Challenges are valid once the client asks for
+ * them to be validated and every CSR is signed. It is meant for load tests of
+ * the drive pipeline, not for checking the protocol: signatures are not verified.
+ */
+typedef struct md_acme_mock_t md_acme_mock_t;
+
+typedef struct md_acme_mock_conf_t md_acme_mock_conf_t;
+struct md_acme_mock_conf_t {
+    apr_interval_time_t latency;    /* per request, varied by +/- 50% */
+    int error_pct;                  /* requests answered with a serverInternal problem */
+    int bad_nonce_pct;              /* POSTs answered with a badNonce problem */
+    int pending_polls;              /* times an authz/order is reported in progress */
+    int retry_after;                /* seconds given in Retry-After while in progress */
+};
+
+#define MD_ACME_MOCK_URL        "https://mock-ca.bench.test/directory"
+
+apr_status_t md_acme_mock_create(md_acme_mock_t **pmock, apr_pool_t *p,
+                                 const md_acme_mock_conf_t *conf);
+
+/**
+ * The http implementation that sends requests to the mock. Install it with
+ * md_http_use_implementation(). Only one mock can be in use at a time.
+ */
+struct md_http_impl_t *md_acme_mock_get_impl(md_acme_mock_t *mock);
+
+/**
+ * Counts of the requests the mock answered, by endpoint, and the errors it made up.
+ */
+struct md_json_t *md_acme_mock_stats_to_json(md_acme_mock_t *mock, apr_pool_t *p);
+
+#endif /* mod_md_md_acme_mock_h */
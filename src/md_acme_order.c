@@ -113,6 +113,13 @@ md_json_t *md_acme_order_to_json(md_acme_order_t *order, apr_pool_t *p)
     if (order->certificate) {
         md_json_sets(order->certificate, json, MD_KEY_CERTIFICATE, NULL);
     }
+    if (order->poll_name) {
+        md_json_sets(order->poll_name, json, MD_KEY_POLL, MD_KEY_NAME, NULL);
+        md_json_setl((long)apr_time_sec(order->poll_giveup_at), json, 
+                     MD_KEY_POLL, MD_KEY_UNTIL, NULL);
+        md_json_setl((long)apr_time_as_msec(order->poll_delay), json, 
+                     MD_KEY_POLL, MD_KEY_DELAY, NULL);
+    }
     return json;
 }
 
@@ -141,6 +148,14 @@ md_acme_order_t *md_acme_order_from_json(md_json_t *json, apr_pool_t *p)
     md_acme_order_t *order = md_acme_order_create(p);
 
     order_update_from_json(order, json, p);
+    /* only in what we saved ourself, not in what the CA sends */
+    if (md_json_has_key(json, MD_KEY_POLL, MD_KEY_NAME, NULL)) {
+        order->poll_name = md_json_dups(p, json, MD_KEY_POLL, MD_KEY_NAME, NULL);
+        order->poll_giveup_at = apr_time_from_sec(md_json_getl(json, MD_KEY_POLL, 
+                                                               MD_KEY_UNTIL, NULL));
+        order->poll_delay = apr_time_from_msec(md_json_getl(json, MD_KEY_POLL, 
+                                                            MD_KEY_DELAY, NULL));
+    }
     return order;
 }
 
@@ -233,6 +248,7 @@ static apr_status_t p_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_li
 
     if (APR_SUCCESS == md_acme_order_load(store, group, md_name, &order, p)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "order loaded for %s", md_name);
+        md_acme_authz_teardown(store, order->challenge_dirs, p);
         for (i = 0; i < order->challenge_dirs->nelts; ++i) {
             dir = APR_ARRAY_IDX(order->challenge_dirs, i, const char*);
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "order purge challenge at %s", dir);
@@ -256,10 +272,13 @@ typedef struct {
     md_acme_order_t *order;
     md_acme_t *acme;
     const md_t *md;
+    apr_array_header_t *authzs;
+    md_store_t *store;
 } order_ctx_t;
 
 #define ORDER_CTX_INIT(ctx, p, o, a, m) \
-    (ctx)->p = (p); (ctx)->order = (o); (ctx)->acme = (a); (ctx)->md = (m);
+    (ctx)->p = (p); (ctx)->order = (o); (ctx)->acme = (a); (ctx)->md = (m); \
+    (ctx)->authzs = NULL; (ctx)->store = NULL;
 
 static apr_status_t identifier_to_json(void *value, md_json_t *json, apr_pool_t *p, void *baton)
 {
@@ -331,13 +350,14 @@ apr_status_t md_acme_order_update(md_acme_order_t *order, md_acme_t *acme, apr_p
     return md_acme_GET(acme, order->url, NULL, on_order_upd, NULL, &ctx);
 }
 
-static apr_status_t await_ready(void *baton, int attempt)
+static apr_status_t await_ready(void *baton, md_util_poll_t *poll)
 {
     order_ctx_t *ctx = baton;
     apr_status_t rv = APR_SUCCESS;
     
-    (void)attempt;
-    if (APR_SUCCESS != (rv = md_acme_order_update(ctx->order, ctx->acme, ctx->p))) goto out;
+    rv = md_acme_order_update(ctx->order, ctx->acme, ctx->p);
+    poll->retry_after = ctx->acme->retry_after;
+    if (APR_SUCCESS != rv) goto out;
     switch (ctx->order->status) {
         case MD_ACME_ORDER_ST_READY:
         case MD_ACME_ORDER_ST_PROCESSING:
@@ -355,7 +375,7 @@ out:
 }
 
 apr_status_t md_acme_order_await_ready(md_acme_order_t *order, md_acme_t *acme, 
-                                       const md_t *md, apr_interval_time_t timeout, 
+                                       const md_t *md, md_util_poll_t *poll, 
                                        apr_pool_t *p)
 {
     order_ctx_t ctx;
@@ -363,18 +383,19 @@ apr_status_t md_acme_order_await_ready(md_acme_order_t *order, md_acme_t *acme,
     
     assert(MD_ACME_VERSION_MAJOR(acme->version) > 1);
     ORDER_CTX_INIT(&ctx, p, order, acme, md);
-    rv = md_util_try(await_ready, &ctx, 0, timeout, 0, 0, 1);
+    rv = md_util_poll(await_ready, &ctx, poll, 0);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: checked order ready", md->name);
     return rv;
 }
 
-static apr_status_t await_valid(void *baton, int attempt)
+static apr_status_t await_valid(void *baton, md_util_poll_t *poll)
 {
     order_ctx_t *ctx = baton;
     apr_status_t rv = APR_SUCCESS;
 
-    (void)attempt;
-    if (APR_SUCCESS != (rv = md_acme_order_update(ctx->order, ctx->acme, ctx->p))) goto out;
+    rv = md_acme_order_update(ctx->order, ctx->acme, ctx->p);
+    poll->retry_after = ctx->acme->retry_after;
+    if (APR_SUCCESS != rv) goto out;
     switch (ctx->order->status) {
         case MD_ACME_ORDER_ST_VALID:
             break;
@@ -390,7 +411,7 @@ out:
 }
 
 apr_status_t md_acme_order_await_valid(md_acme_order_t *order, md_acme_t *acme, 
-                                       const md_t *md, apr_interval_time_t timeout, 
+                                       const md_t *md, md_util_poll_t *poll, 
                                        apr_pool_t *p)
 {
     order_ctx_t ctx;
@@ -398,7 +419,7 @@ apr_status_t md_acme_order_await_valid(md_acme_order_t *order, md_acme_t *acme,
     
     assert(MD_ACME_VERSION_MAJOR(acme->version) > 1);
     ORDER_CTX_INIT(&ctx, p, order, acme, md);
-    rv = md_util_try(await_valid, &ctx, 0, timeout, 0, 0, 1);
+    rv = md_util_poll(await_valid, &ctx, poll, 0);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: checked order valid", md->name);
     return rv;
 }
@@ -419,91 +440,141 @@ apr_status_t md_acme_order_finalize(md_acme_order_t *order, md_acme_t *acme,
 /**************************************************************************************************/
 /* processing */
 
-apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *acme, 
-                                            apr_array_header_t *challenge_types,
-                                            md_store_t *store, const md_t *md, apr_pool_t *p)
+/* The authzs for the urls that the account does not know to be valid already */
+static apr_array_header_t *authzs_create(apr_array_header_t *urls, apr_array_header_t *valid,
+                                         apr_pool_t *p)
 {
-    apr_status_t rv = APR_SUCCESS;
+    apr_array_header_t *authzs;
     md_acme_authz_t *authz;
     const char *url;
     int i;
     
-    for (i = 0; i < order->authz_urls->nelts; ++i) {
-        url = APR_ARRAY_IDX(order->authz_urls, i, const char*);
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: check AUTHZ at %s", md->name, url);
-        
-        if (APR_SUCCESS != (rv = md_acme_authz_retrieve(acme, p, url, &authz))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: check authz for %s",
-                          md->name, authz->domain);
-            goto out;
+    authzs = apr_array_make(p, urls->nelts, sizeof(md_acme_authz_t *));
+    for (i = 0; i < urls->nelts; ++i) {
+        url = APR_ARRAY_IDX(urls, i, const char*);
+        if (valid && md_acme_authz_cache_find(valid, url, NULL)) {
+            continue;
         }
+        authz = md_acme_authz_create(p);
+        authz->url = url;
+        APR_ARRAY_PUSH(authzs, md_acme_authz_t *) = authz;
+    }
+    return authzs;
+}
+
+apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *acme, 
+                                            apr_array_header_t *challenge_types,
+                                            md_store_t *store, const md_t *md, apr_pool_t *p)
+{
+    apr_status_t rv, rv2;
+    apr_array_header_t *authzs;
+    md_acme_authz_t *authz;
+    int i, changed = 0;
+    
+    authzs = authzs_create(order->authz_urls, md_acme_authz_cache_get(acme, store, p), p);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: check %d AUTHZs, %d known valid", 
+                  md->name, authzs->nelts, order->authz_urls->nelts - authzs->nelts);
+    if (APR_SUCCESS != (rv = md_acme_authz_update_all(authzs, acme, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: check authzs", md->name);
+        goto out;
+    }
+    md_acme_authz_cache_update(acme, store, authzs, p);
 
+    /* challenge responses that need to notify the server are sent together */
+    md_acme_batch_start(acme, p);
+    for (i = 0; i < authzs->nelts && APR_SUCCESS == rv; ++i) {
+        authz = APR_ARRAY_IDX(authzs, i, md_acme_authz_t *);
         switch (authz->state) {
             case MD_ACME_AUTHZ_S_VALID:
                 break;
                 
             case MD_ACME_AUTHZ_S_PENDING:
                 rv = md_acme_authz_respond(authz, acme, store, challenge_types, md->pkey_spec, p);
-                if (APR_SUCCESS != rv) {
-                    goto out;
+                if (APR_SUCCESS == rv) {
+                    md_acme_order_add_challenge_dir(order, authz->dir);
+                    changed = 1;
                 }
-                md_acme_order_add_challenge_dir(order, authz->dir);
-                md_acme_order_save(store, p, MD_SG_STAGING, md->name, order, 0);
                 break;
                 
             default:
                 rv = APR_EINVAL;
                 md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: unexpected AUTHZ state %d at %s", 
-                              authz->domain, authz->state, url);
-             goto out;
+                              authz->domain, authz->state, authz->url);
+                break;
         }
     }
+    /* http-01 responses of all authzs are fetched together, those reachable validated */
+    rv2 = md_acme_authz_preflight_perform(acme, p);
+    rv = (APR_SUCCESS == rv)? rv2 : rv;
+    /* dns-01 records of all authzs go up together, after one wait all are validated */
+    rv2 = md_acme_authz_dns01_perform(acme, p);
+    rv = (APR_SUCCESS == rv)? rv2 : rv;
+    rv2 = md_acme_batch_perform(acme);
+    rv = (APR_SUCCESS == rv)? rv2 : rv;
+    if (changed) {
+        md_acme_order_save(store, p, MD_SG_STAGING, md->name, order, 0);
+    }
 out:    
     return rv;
 }
 
-static apr_status_t check_challenges(void *baton, int attempt)
+static apr_status_t check_challenges(void *baton, md_util_poll_t *poll)
 {
     order_ctx_t *ctx = baton;
-    const char *url;
+    apr_array_header_t *pending;
     md_acme_authz_t *authz;
-    apr_status_t rv = APR_SUCCESS;
+    apr_status_t rv;
     int i;
     
-    for (i = 0; i < ctx->order->authz_urls->nelts && APR_SUCCESS == rv; ++i) {
-        url = APR_ARRAY_IDX(ctx->order->authz_urls, i, const char*);
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, "%s: check AUTHZ at %s(%d. attempt)", 
-                      ctx->md->name, url, attempt);
-        if (APR_SUCCESS == (rv = md_acme_authz_retrieve(ctx->acme, ctx->p, url, &authz))) {
-            switch (authz->state) {
-                case MD_ACME_AUTHZ_S_VALID:
-                    break;
-                case MD_ACME_AUTHZ_S_PENDING:
-                    rv = APR_EAGAIN;
-                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, 
-                                  "%s: status pending at %s", authz->domain, authz->url);
-                    break;
-                default:
-                    rv = APR_EINVAL;
-                    md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, 
-                                  "%s: unexpected AUTHZ state %d at %s", 
-                                  authz->domain, authz->state, authz->url);
-                    break;
-            }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ctx->p, "%s: check %d pending AUTHZs"
+                  "(%d. attempt)", ctx->md->name, ctx->authzs->nelts, poll->attempts + 1);
+    rv = md_acme_authz_update_all(ctx->authzs, ctx->acme, ctx->p);
+    if (ctx->acme->retry_after > poll->retry_after) {
+        poll->retry_after = ctx->acme->retry_after;
+    }
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    md_acme_authz_cache_update(ctx->acme, ctx->store, ctx->authzs, ctx->p);
+    
+    /* only the ones still pending need to be checked again */
+    pending = apr_array_make(ctx->p, ctx->authzs->nelts, sizeof(md_acme_authz_t *));
+    for (i = 0; i < ctx->authzs->nelts && APR_SUCCESS == rv; ++i) {
+        authz = APR_ARRAY_IDX(ctx->authzs, i, md_acme_authz_t *);
+        switch (authz->state) {
+            case MD_ACME_AUTHZ_S_VALID:
+                break;
+            case MD_ACME_AUTHZ_S_PENDING:
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ctx->p, 
+                              "%s: status pending at %s", authz->domain, authz->url);
+                APR_ARRAY_PUSH(pending, md_acme_authz_t *) = authz;
+                break;
+            default:
+                rv = APR_EINVAL;
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, 
+                              "%s: unexpected AUTHZ state %d at %s", 
+                              authz->domain, authz->state, authz->url);
+                break;
         }
     }
+    ctx->authzs = pending;
+    if (APR_SUCCESS == rv && pending->nelts > 0) {
+        rv = APR_EAGAIN;
+    }
     return rv;
 }
 
 apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acme, 
-                                          const md_t *md, apr_interval_time_t timeout, 
-                                          apr_pool_t *p)
+                                          md_store_t *store, const md_t *md, 
+                                          md_util_poll_t *poll, apr_pool_t *p)
 {
     order_ctx_t ctx;
     apr_status_t rv;
     
     ORDER_CTX_INIT(&ctx, p, order, acme, md);
-    rv = md_util_try(check_challenges, &ctx, 0, timeout, 0, 0, 1);
+    ctx.store = store;
+    ctx.authzs = authzs_create(order->authz_urls, md_acme_authz_cache_get(acme, store, p), p);
+    rv = (ctx.authzs->nelts > 0)? md_util_poll(check_challenges, &ctx, poll, 0) : APR_SUCCESS;
     
     md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "%s: checked authorizations", md->name);
     return rv;
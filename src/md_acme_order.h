@@ -37,6 +37,9 @@ struct md_acme_order_t {
     struct md_json_t *json;
     const char *finalize;
     const char *certificate;
+    const char *poll_name;           /* poll left waiting for the CA, to be continued, or NULL */
+    apr_time_t poll_giveup_at;       /* when that poll times out */
+    apr_interval_time_t poll_delay;  /* its delay before the next attempt */
 };
 
 #define MD_FN_ORDER             "order.json"
@@ -69,9 +72,14 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
                                             apr_array_header_t *challenge_types,
                                             md_store_t *store, const md_t *md, apr_pool_t *p);
 
+/**
+ * Wait for all authorizations of the order to become valid. Gives APR_EAGAIN
+ * if the poll would block longer than allowed and needs to be continued.
+ * Authorizations the account already knows to be valid are not polled.
+ */
 apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acme, 
-                                          const md_t *md, apr_interval_time_t timeout, 
-                                          apr_pool_t *p);
+                                          struct md_store_t *store, const md_t *md, 
+                                          struct md_util_poll_t *poll, apr_pool_t *p);
 
 /* ACMEv2 only ************************************************************************************/
 
@@ -81,10 +89,10 @@ apr_status_t md_acme_order_register(md_acme_order_t **porder, md_acme_t *acme, a
 apr_status_t md_acme_order_update(md_acme_order_t *order, md_acme_t *acme, apr_pool_t *p);
 
 apr_status_t md_acme_order_await_ready(md_acme_order_t *order, md_acme_t *acme, 
-                                       const md_t *md, apr_interval_time_t timeout, 
+                                       const md_t *md, struct md_util_poll_t *poll, 
                                        apr_pool_t *p);
 apr_status_t md_acme_order_await_valid(md_acme_order_t *order, md_acme_t *acme, 
-                                       const md_t *md, apr_interval_time_t timeout, 
+                                       const md_t *md, struct md_util_poll_t *poll, 
                                        apr_pool_t *p);
 
 apr_status_t md_acme_order_finalize(md_acme_order_t *order, md_acme_t *acme, 
@@ -57,7 +57,7 @@ static apr_status_t ad_setup_order(md_proto_driver_t *d)
     md_t *md = ad->md;
     const char *url;
     md_acme_authz_t *authz;
-    apr_array_header_t *domains_covered;
+    apr_array_header_t *domains_covered, *valid = NULL;
     int i;
     int changed = 0;
     
@@ -113,6 +113,19 @@ static apr_status_t ad_setup_order(md_proto_driver_t *d)
         const char *domain = APR_ARRAY_IDX(md->domains, i, const char *);
     
         if (md_array_str_index(domains_covered, domain, 0, 0) < 0) {
+            /* a valid one of the account from another order will do, if the CA agrees */
+            if (!valid) {
+                valid = md_acme_authz_cache_get(ad->acme, d->store, d->p);
+            }
+            if ((authz = md_acme_authz_cache_find(valid, NULL, domain))
+                && APR_SUCCESS == md_acme_authz_retrieve(ad->acme, d->p, authz->url, &authz)
+                && MD_ACME_AUTHZ_S_VALID == authz->state) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: reusing valid authz "
+                              "for %s", md->name, domain);
+                rv = md_acme_order_add(ad->order, authz->url);
+                changed = 1;
+                continue;
+            }
             /* create new one */
             rv = md_acme_authz_register(&authz, ad->acme, domain, d->p);
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: created authz for %s", 
@@ -136,6 +149,7 @@ out:
 
 apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
 {
+    md_util_poll_t poll;
     apr_status_t rv = APR_SUCCESS;
     
     ad->phase = "get certificate";
@@ -198,8 +212,10 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
                       "%s: monitoring challenge status", d->md->name);
         ad->phase = "monitor challenges";
-        if (APR_SUCCESS != (rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->md,
-                                                              ad->authz_monitor_timeout, d->p))) {
+        md_acme_drive_poll_init(&poll, d, "challenges", ad->authz_monitor_timeout, 1);
+        rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->store, d->md, 
+                                          &poll, d->p);
+        if (APR_SUCCESS != (rv = md_acme_drive_poll_end(d, &poll, rv))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: monitor challenges", 
                           ad->md->name);
             goto out;
@@ -93,6 +93,7 @@ out:
 
 apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
 {
+    md_util_poll_t poll;
     apr_status_t rv = APR_SUCCESS;
     
     ad->phase = "get certificate";
@@ -156,29 +157,41 @@ apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
                       "%s: monitoring challenge status", d->md->name);
         ad->phase = "monitor challenges";
-        if (APR_SUCCESS != (rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->md,
-                                                              ad->authz_monitor_timeout, d->p))) {
+        md_acme_drive_poll_init(&poll, d, "challenges", ad->authz_monitor_timeout, 1);
+        rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->store, d->md, 
+                                          &poll, d->p);
+        if (APR_SUCCESS != (rv = md_acme_drive_poll_end(d, &poll, rv))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: monitor challenges", 
                           ad->md->name);
             goto out;
         }
         
-        if (APR_SUCCESS != (rv = md_acme_order_await_ready(ad->order, ad->acme, d->md, 
-                                                           ad->authz_monitor_timeout, d->p))) goto out; 
+        md_acme_drive_poll_init(&poll, d, "order ready", ad->authz_monitor_timeout, 1);
+        rv = md_acme_order_await_ready(ad->order, ad->acme, d->md, &poll, d->p);
+        if (APR_SUCCESS != rv && !APR_STATUS_IS_EAGAIN(rv)) {
+            /* the CA did not take the authorizations we thought valid */
+            md_acme_authz_cache_forget(ad->acme, d->store, ad->order->authz_urls, d->p);
+        }
+        if (APR_SUCCESS != (rv = md_acme_drive_poll_end(d, &poll, rv))) goto out; 
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, 
                       "%s: order status: %d", d->md->name, ad->order->status); 
 
-        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
-                      "%s: finalizing order", d->md->name);
-        ad->phase = "finalize order";
-        if (APR_SUCCESS != (rv = md_acme_drive_setup_certificate(d))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: finalize order", ad->md->name);
-            goto out;
+        if (MD_ACME_ORDER_ST_READY == ad->order->status) {
+            /* when continuing a previous run, the order may be finalized already */
+            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
+                          "%s: finalizing order", d->md->name);
+            ad->phase = "finalize order";
+            if (APR_SUCCESS != (rv = md_acme_drive_setup_certificate(d))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: finalize order", 
+                              ad->md->name);
+                goto out;
+            }
+            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, "%s: finalized order", d->md->name);
         }
-        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, "%s: finalized order", d->md->name);
         
-        if (APR_SUCCESS != (rv = md_acme_order_await_valid(ad->order, ad->acme, d->md, 
-                                                           ad->authz_monitor_timeout, d->p))) goto out;
+        md_acme_drive_poll_init(&poll, d, "order valid", ad->authz_monitor_timeout, 1);
+        rv = md_acme_order_await_valid(ad->order, ad->acme, d->md, &poll, d->p);
+        if (APR_SUCCESS != (rv = md_acme_drive_poll_end(d, &poll, rv))) goto out;
         if (!ad->order->certificate) {
             rv = APR_EINVAL;
             md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, d->p, 
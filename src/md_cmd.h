@@ -51,6 +51,7 @@ struct md_cmd_ctx {
 };
 
 #define MD_CMD_OPT_PROXY_URL        "proxy-url"
+#define MD_CMD_OPT_STORE_TYPE       "store-type"
 
 int md_cmd_ctx_has_option(md_cmd_ctx *ctx, const char *key);
 const char *md_cmd_ctx_get_option(md_cmd_ctx *ctx, const char *key);
@@ -86,4 +87,14 @@ apr_array_header_t *md_cmd_gather_args(md_cmd_ctx *ctx, int index);
 
 void md_cmd_print_md(md_cmd_ctx *ctx, const md_t *md);
 
+typedef apr_status_t md_cmd_job_fn(void *baton, int index, apr_pool_t *p);
+
+/**
+ * Invoke fn for every index from 0 to count - 1, in up to parallel threads at
+ * the same time. Each thread has its own pool, cleared after every job. All jobs
+ * are done, the status of the first that failed is returned.
+ */
+apr_status_t md_cmd_parallel_do(md_cmd_job_fn *fn, void *baton, int count, int parallel,
+                                apr_pool_t *p);
+
 #endif /* md_cmd_h */
@@ -0,0 +1,345 @@
+/* Copyright 2019 greenbytes GmbH (https://www.greenbytes.de)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_http.h"
+#include "md_log.h"
+#include "md_reg.h"
+#include "md_acme.h"
+#include "md_acme_mock.h"
+#include "md_cmd.h"
+#include "md_cmd_bench.h"
+
+#define BENCH_DOMAIN            "bench.test"
+#define BENCH_STAGE_TRIES       5
+
+/**************************************************************************************************/
+/* command: bench drive */
+
+typedef struct {
+    md_cmd_ctx *ctx;
+    apr_array_header_t *names;
+    apr_interval_time_t *durations;     /* per md, of names->nelts */
+    int ok;
+    int failed;
+    int retries;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} bench_results;
+
+static int bench_opt_int(md_cmd_ctx *ctx, const char *key, int dflt)
+{
+    const char *s = md_cmd_ctx_get_option(ctx, key);
+    return s? (int)apr_atoi64(s) : dflt;
+}
+
+static void bench_done(bench_results *q, int i, apr_interval_time_t duration,
+                       int retries, apr_status_t rv)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(q->mutex);
+#endif
+    q->durations[i] = duration;
+    q->retries += retries;
+    if (APR_SUCCESS == rv) {
+        ++q->ok;
+    }
+    else {
+        ++q->failed;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(q->mutex);
+#endif
+}
+
+static apr_status_t bench_drive_md(md_reg_t *reg, const char *name, int *pretries, apr_pool_t *p)
+{
+    md_t *md;
+    apr_time_t resume_at, now;
+    apr_status_t rv;
+    int tries;
+
+    *pretries = 0;
+    if (!(md = md_reg_get(reg, name, p))) {
+        return APR_ENOENT;
+    }
+    /* errors made up by the mock are meant to be survived by trying again */
+    for (tries = 1; ; ++tries) {
+        resume_at = 0;
+        rv = md_reg_stage(reg, md, NULL, 0, 0, &resume_at, NULL, p);
+        if (APR_STATUS_IS_EAGAIN(rv) && resume_at > (now = apr_time_now())) {
+            /* held back by pacing, continue when the watchdog would */
+            apr_sleep(resume_at - now);
+            --tries;
+            continue;
+        }
+        if (APR_SUCCESS == rv || tries >= BENCH_STAGE_TRIES) {
+            break;
+        }
+        ++(*pretries);
+    }
+    if (APR_SUCCESS == rv) {
+        rv = md_reg_load(reg, name, p);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: driven after %d tries", name, tries);
+    return rv;
+}
+
+static apr_status_t bench_job(void *baton, int i, apr_pool_t *p)
+{
+    bench_results *q = baton;
+    const char *name;
+    apr_time_t start;
+    apr_status_t rv;
+    int retries;
+
+    name = APR_ARRAY_IDX(q->names, i, const char *);
+    start = apr_time_now();
+    rv = bench_drive_md(q->ctx->reg, name, &retries, p);
+    bench_done(q, i, apr_time_now() - start, retries, rv);
+    return rv;
+}
+
+static int duration_cmp(const void *v1, const void *v2)
+{
+    apr_interval_time_t d1 = *(const apr_interval_time_t *)v1;
+    apr_interval_time_t d2 = *(const apr_interval_time_t *)v2;
+    return (d1 < d2)? -1 : ((d1 > d2)? 1 : 0);
+}
+
+static long percentile_ms(apr_interval_time_t *sorted, int n, int pct)
+{
+    int i;
+
+    if (n <= 0) {
+        return 0;
+    }
+    i = (int)(((long)n * pct + 99) / 100) - 1;
+    return (long)apr_time_as_msec(sorted[(i < 0)? 0 : i]);
+}
+
+static apr_status_t bench_add_mds(md_cmd_ctx *ctx, apr_array_header_t *names, int count,
+                                  md_pkey_spec_t *spec)
+{
+    apr_array_header_t *domains, *contacts;
+    const char *name;
+    md_t *md;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    contacts = apr_array_make(ctx->p, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(contacts, const char *) = "mailto:admin@" BENCH_DOMAIN;
+    for (i = 0; i < count; ++i) {
+        name = apr_psprintf(ctx->p, "md%d." BENCH_DOMAIN, i);
+        APR_ARRAY_PUSH(names, const char *) = name;
+        if (md_reg_get(ctx->reg, name, ctx->p)) {
+            /* from an earlier run, it gets renewed */
+            continue;
+        }
+        domains = apr_array_make(ctx->p, 2, sizeof(const char *));
+        APR_ARRAY_PUSH(domains, const char *) = name;
+        APR_ARRAY_PUSH(domains, const char *) = apr_pstrcat(ctx->p, "www.", name, NULL);
+        md = md_create(ctx->p, domains);
+        md->contacts = contacts;
+        md->ca_url = MD_ACME_MOCK_URL;
+        md->ca_proto = "ACME";
+        md->ca_agreement = "accepted";
+        md->pkey_spec = spec;
+        if (APR_SUCCESS != (rv = md_reg_add(ctx->reg, md, ctx->p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "%s: adding", name);
+            break;
+        }
+    }
+    return rv;
+}
+
+static apr_status_t cmd_bench_drive(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    md_acme_mock_conf_t conf;
+    md_acme_mock_t *mock;
+    md_pkey_spec_t *spec;
+    bench_results *q;
+    md_json_t *json;
+    const char *s;
+    apr_time_t start;
+    double secs;
+    apr_status_t rv;
+    int count, parallel;
+
+    (void)cmd;
+    count = bench_opt_int(ctx, "count", 1000);
+    parallel = bench_opt_int(ctx, "parallel", 10);
+    memset(&conf, 0, sizeof(conf));
+    conf.latency = apr_time_from_msec(bench_opt_int(ctx, "latency", 50));
+    conf.error_pct = bench_opt_int(ctx, "error-pct", 0);
+    conf.bad_nonce_pct = bench_opt_int(ctx, "bad-nonce-pct", 0);
+    conf.pending_polls = bench_opt_int(ctx, "pending-polls", 1);
+    conf.retry_after = bench_opt_int(ctx, "retry-after", 0);
+    /* the mock has no limits, unless asked for, requests are not paced */
+    md_acme_rate_max_set(bench_opt_int(ctx, "rate", 0));
+    if (count <= 0 || parallel <= 0) {
+        return usage(cmd, "count and parallel need to be positive");
+    }
+
+    spec = apr_pcalloc(ctx->p, sizeof(*spec));
+    s = md_cmd_ctx_get_option(ctx, "key");
+    if (!s || !strcmp("ec", s)) {
+        /* keeps the cost of key generation out of the way */
+        spec->type = MD_PKEY_TYPE_EC;
+        spec->params.ec.curve = "P-256";
+    }
+    else if (!strcmp("rsa", s)) {
+        spec->type = MD_PKEY_TYPE_RSA;
+        spec->params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
+    }
+    else {
+        return usage(cmd, "key needs to be 'rsa' or 'ec'");
+    }
+
+    if (APR_SUCCESS != (rv = md_acme_mock_create(&mock, ctx->p, &conf))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "creating the mock CA");
+        return rv;
+    }
+    md_http_use_implementation(md_acme_mock_get_impl(mock));
+    /* the mock passes http-01 challenges without anyone listening */
+    if (APR_SUCCESS != (rv = md_reg_set_props(ctx->reg, ctx->p, 1, 0))) {
+        return rv;
+    }
+
+    q = apr_pcalloc(ctx->p, sizeof(*q));
+    q->ctx = ctx;
+    q->names = apr_array_make(ctx->p, count, sizeof(const char *));
+    q->durations = apr_pcalloc(ctx->p, (apr_size_t)count * sizeof(*q->durations));
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&q->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                                     ctx->p))) {
+        return rv;
+    }
+#endif
+    if (APR_SUCCESS != (rv = bench_add_mds(ctx, q->names, count, spec))) {
+        return rv;
+    }
+
+    start = apr_time_now();
+    md_cmd_parallel_do(bench_job, q, count, parallel, ctx->p);
+    secs = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+    qsort(q->durations, (size_t)count, sizeof(*q->durations), duration_cmp);
+
+    json = md_json_create(ctx->p);
+    md_json_setl(count, json, "mds", NULL);
+    md_json_setl(parallel, json, "parallel", NULL);
+    md_json_setl(q->ok, json, "ok", NULL);
+    md_json_setl(q->failed, json, "failed", NULL);
+    md_json_setl(q->retries, json, "stage-retries", NULL);
+    md_json_setn(secs, json, "seconds", NULL);
+    md_json_setn((secs > 0)? q->ok / secs : 0, json, "mds-per-sec", NULL);
+    md_json_setl(percentile_ms(q->durations, count, 50), json, "latency-ms", "p50", NULL);
+    md_json_setl(percentile_ms(q->durations, count, 90), json, "latency-ms", "p90", NULL);
+    md_json_setl(percentile_ms(q->durations, count, 99), json, "latency-ms", "p99", NULL);
+    md_json_setl(percentile_ms(q->durations, count, 100), json, "latency-ms", "max", NULL);
+    md_json_setj(md_acme_mock_stats_to_json(mock, ctx->p), json, "ca", NULL);
+
+    if (ctx->json_out) {
+        md_json_addj(json, ctx->json_out, "output", NULL);
+    }
+    else {
+        fprintf(stdout, "%s\n", md_json_writep(json, ctx->p, MD_JSON_FMT_INDENT));
+    }
+    return q->failed? APR_EGENERAL : APR_SUCCESS;
+}
+
+static apr_status_t cmd_bench_drive_opts(md_cmd_ctx *ctx, int option, const char *optarg)
+{
+    switch (option) {
+        case 'n':
+            md_cmd_ctx_set_option(ctx, "count", optarg);
+            break;
+        case 'p':
+            md_cmd_ctx_set_option(ctx, "parallel", optarg);
+            break;
+        case 'l':
+            md_cmd_ctx_set_option(ctx, "latency", optarg);
+            break;
+        case 'e':
+            md_cmd_ctx_set_option(ctx, "error-pct", optarg);
+            break;
+        case 'b':
+            md_cmd_ctx_set_option(ctx, "bad-nonce-pct", optarg);
+            break;
+        case 'w':
+            md_cmd_ctx_set_option(ctx, "pending-polls", optarg);
+            break;
+        case 'r':
+            md_cmd_ctx_set_option(ctx, "retry-after", optarg);
+            break;
+        case 'k':
+            md_cmd_ctx_set_option(ctx, "key", optarg);
+            break;
+        case 'R':
+            md_cmd_ctx_set_option(ctx, "rate", optarg);
+            break;
+        default:
+            return APR_EINVAL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_getopt_option_t BenchDriveOptions [] = {
+    { "count",       'n', 1, "number of managed domains, default 1000"},
+    { "parallel",    'p', 1, "number of mds driven at the same time, default 10"},
+    { "latency",     'l', 1, "average latency of the CA in milliseconds, default 50"},
+    { "errors",      'e', 1, "percentage of requests failing with a server error"},
+    { "bad-nonces",  'b', 1, "percentage of POSTs failing with a bad nonce"},
+    { "pending",     'w', 1, "times authorizations and orders stay in progress, default 1"},
+    { "retry-after", 'r', 1, "seconds of Retry-After the CA sends while in progress"},
+    { "key",         'k', 1, "type of the md keys, 'rsa' or 'ec' (default)"},
+    { "rate",        'R', 1, "requests per second sent, at most, default unlimited"},
+    { NULL , 0, 0, NULL }
+};
+
+static md_cmd_t BenchDriveCmd = {
+    "drive", MD_CTX_REG,
+    cmd_bench_drive_opts, cmd_bench_drive, BenchDriveOptions, NULL,
+    "drive [opts]",
+    "drive many managed domains against an in-process mock CA and report the "
+    "throughput and latencies as JSON",
+};
+
+/**************************************************************************************************/
+/* command: bench */
+
+static const md_cmd_t *BenchSubCmds[] = {
+    &BenchDriveCmd,
+    NULL
+};
+
+md_cmd_t MD_BenchCmd = {
+    "bench", MD_CTX_STORE,
+    NULL, NULL, MD_NoOptions, BenchSubCmds,
+    "bench cmd [opts]",
+    "measure the performance of md operations",
+};
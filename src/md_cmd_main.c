@@ -22,6 +22,8 @@
 #include <apr_getopt.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 
 #include "md.h"
 #include "md_acme.h"
@@ -31,6 +33,7 @@
 #include "md_reg.h"
 #include "md_store.h"
 #include "md_store_fs.h"
+#include "md_store_pack.h"
 #include "md_util.h"
 #include "md_version.h"
 
@@ -38,6 +41,7 @@
 #include "md_cmd_acme.h"
 #include "md_cmd_reg.h"
 #include "md_cmd_store.h"
+#include "md_cmd_bench.h"
 #include "md_curl.h"
 
 
@@ -160,11 +164,23 @@ static apr_status_t cmd_process(md_cmd_ctx *ctx, const md_cmd_t *cmd)
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, ctx->p, "args remaining: %d", ctx->argc);
                    
     if (cmd->needs & (MD_CTX_STORE|MD_CTX_REG|MD_CTX_ACME) && !ctx->store) {
+        const char *stype = md_cmd_ctx_get_option(ctx, MD_CMD_OPT_STORE_TYPE);
+        
         if (!ctx->base_dir) {
             fprintf(stderr, "need store directory for command: %s\n", cmd->name);
             return APR_EINVAL;
         }
-        if (APR_SUCCESS != (rv = md_store_fs_init(&ctx->store, ctx->p, ctx->base_dir))) {
+        if (stype && !strcmp("pack", stype)) {
+            rv = md_store_pack_init(&ctx->store, ctx->p, ctx->base_dir);
+        }
+        else if (!stype || !strcmp("fs", stype)) {
+            rv = md_store_fs_init(&ctx->store, ctx->p, ctx->base_dir);
+        }
+        else {
+            fprintf(stderr, "unknown store type: %s\n", stype);
+            return APR_EINVAL;
+        }
+        if (APR_SUCCESS != rv) {
             fprintf(stderr, "error %d creating store for: %s\n", rv, ctx->base_dir);
             return APR_EINVAL;
         }
@@ -192,6 +208,7 @@ static apr_status_t cmd_process(md_cmd_ctx *ctx, const md_cmd_t *cmd)
                     ctx->ca_url, ctx->base_dir);
             return rv;
         }
+        ctx->acme->store = ctx->store;
         rv = md_acme_setup(ctx->acme);
         if (rv != APR_SUCCESS) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "contacting %s", ctx->ca_url);
@@ -303,6 +320,129 @@ apr_array_header_t *md_cmd_gather_args(md_cmd_ctx *ctx, int index)
     return args;
 }
 
+typedef struct {
+    md_cmd_job_fn *fn;
+    void *baton;
+    int count;
+    int next;
+    apr_status_t rv;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} cmd_jobs;
+
+static int jobs_next(cmd_jobs *jobs, apr_status_t rv)
+{
+    int i = -1;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(jobs->mutex);
+#endif
+    if (APR_SUCCESS == jobs->rv) {
+        jobs->rv = rv;
+    }
+    if (jobs->next < jobs->count) {
+        i = jobs->next++;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(jobs->mutex);
+#endif
+    return i;
+}
+
+static void jobs_run(cmd_jobs *jobs, apr_pool_t *p)
+{
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    while ((i = jobs_next(jobs, rv)) >= 0) {
+        rv = jobs->fn(jobs->baton, i, p);
+        apr_pool_clear(p);
+    }
+}
+
+#if APR_HAS_THREADS
+
+typedef struct {
+    cmd_jobs *jobs;
+    apr_pool_t *p;
+} cmd_worker;
+
+static void * APR_THREAD_FUNC worker_run(apr_thread_t *thread, void *baton)
+{
+    cmd_worker *worker = baton;
+
+    jobs_run(worker->jobs, worker->p);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+#endif /* APR_HAS_THREADS */
+
+apr_status_t md_cmd_parallel_do(md_cmd_job_fn *fn, void *baton, int count, int parallel,
+                                apr_pool_t *p)
+{
+    cmd_jobs jobs;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+#if APR_HAS_THREADS
+    cmd_worker *worker;
+    apr_allocator_t *allocator;
+    apr_thread_t **threads;
+    apr_status_t rv2;
+    int i, n;
+#endif
+
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.fn = fn;
+    jobs.baton = baton;
+    jobs.count = count;
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&jobs.mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        return rv;
+    }
+    n = (parallel < count)? parallel : count;
+    threads = apr_pcalloc(p, (apr_size_t)(n > 0? n : 1) * sizeof(*threads));
+    for (i = 0; n > 1 && i < n; ++i) {
+        worker = apr_pcalloc(p, sizeof(*worker));
+        worker->jobs = &jobs;
+        /* workers run concurrently, each needs its own allocator */
+        if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+            break;
+        }
+        if (APR_SUCCESS != (rv = apr_pool_create_ex(&worker->p, p, NULL, allocator))) {
+            apr_allocator_destroy(allocator);
+            break;
+        }
+        apr_allocator_owner_set(allocator, worker->p);
+        if (APR_SUCCESS != (rv = apr_thread_create(&threads[i], NULL, 
+                                                   worker_run, worker, p))) {
+            break;
+        }
+    }
+    if (n > 1 && i < n) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "started only %d of %d workers", i, n);
+    }
+    for (n = (n > 1)? i : 0, i = 0; i < n; ++i) {
+        apr_thread_join(&rv2, threads[i]);
+    }
+    if (n > 0) {
+        return jobs.rv;
+    }
+#else
+    (void)parallel;
+#endif
+    /* no workers, do the remaining jobs here */
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+    jobs_run(&jobs, ptemp);
+    apr_pool_destroy(ptemp);
+    return jobs.rv;
+}
+
 /**************************************************************************************************/
 /* command: main() */
 
@@ -334,15 +474,20 @@ static apr_status_t main_opts(md_cmd_ctx *ctx, int option, const char *optarg)
         case 'p':
             md_cmd_ctx_set_option(ctx, MD_CMD_OPT_PROXY_URL, optarg);
             break;
+        case 's':
+            md_cmd_ctx_set_option(ctx, MD_CMD_OPT_STORE_TYPE, optarg);
+            break;
         case 'q':
             if (active_level > 0) {
                 --active_level;
             }
+            md_log_update_level();
             break;
         case 'v':
             if (active_level < MD_LOG_TRACE8) {
                 ++active_level;
             }
+            md_log_update_level();
             break;
         case 'V':
             md_cmd_ctx_set_option(ctx, "version", "1");
@@ -362,7 +507,10 @@ static const md_cmd_t *MainSubCmds[] = {
     &MD_RegUpdateCmd, 
     &MD_RegDriveCmd,
     &MD_RegListCmd,
+    &MD_RegImportCmd,
+    &MD_RegExportCmd,
     &MD_StoreCmd,
+    &MD_BenchCmd,
     NULL
 };
 
@@ -373,6 +521,7 @@ static apr_getopt_option_t MainOptions [] = {
     { "json",    'j', 0, "produce json output"},
     { "proxy",   'p', 1, "use the HTTP proxy url"},
     { "quiet",   'q', 0, "produce less output"},
+    { "store",   's', 1, "type of store in dir: 'fs' (default) or 'pack' single file"},
     { "terms",   't', 1, "you agree to the terms of services (url)" },
     { "verbose", 'v', 0, "produce more output" },
     { "version", 'V', 0, "print version" },
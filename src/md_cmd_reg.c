@@ -241,10 +241,203 @@ md_cmd_t MD_RegUpdateCmd = {
     "'contacts' or 'agreement'"
 };
 
+/**************************************************************************************************/
+/* command: import */
+
+#define MD_IMPORT_LINE_MAX      (64 * 1024)
+
+typedef struct {
+    const char *key;
+    const char *sub;
+    int field;
+} import_field_t;
+
+/* properties taken over from an import line when an md of that name exists */
+static const import_field_t ImportFields[] = {
+    { MD_KEY_DOMAINS,       NULL,               MD_UPD_DOMAINS },
+    { MD_KEY_CONTACTS,      NULL,               MD_UPD_CONTACTS },
+    { MD_KEY_CA,            MD_KEY_URL,         MD_UPD_CA_URL },
+    { MD_KEY_CA,            MD_KEY_PROTO,       MD_UPD_CA_PROTO },
+    { MD_KEY_CA,            MD_KEY_AGREEMENT,   MD_UPD_AGREEMENT },
+    { MD_KEY_CA,            MD_KEY_CHALLENGES,  MD_UPD_CA_CHALLENGES },
+    { MD_KEY_PKEY,          NULL,               MD_UPD_PKEY_SPEC },
+    { MD_KEY_DRIVE_MODE,    NULL,               MD_UPD_DRIVE_MODE },
+    { MD_KEY_RENEW_WINDOW,  NULL,               MD_UPD_RENEW_WINDOW },
+    { MD_KEY_TRANSITIVE,    NULL,               MD_UPD_TRANSITIVE },
+    { MD_KEY_REQUIRE_HTTPS, NULL,               MD_UPD_REQUIRE_HTTPS },
+    { MD_KEY_MUST_STAPLE,   NULL,               MD_UPD_MUST_STAPLE },
+};
+
+static apr_status_t import_md(md_cmd_ctx *ctx, md_json_t *json, int *pupdated, apr_pool_t *p)
+{
+    md_t *md;
+    int i, fields = 0;
+
+    *pupdated = 0;
+    md = md_from_json(json, p);
+    if (apr_is_empty_array(md->domains)) {
+        return APR_EINVAL;
+    }
+    if (!md->name) {
+        md->name = APR_ARRAY_IDX(md->domains, 0, const char *);
+    }
+    /* accounts belong to the store they were exported from */
+    md->ca_account = NULL;
+    md->state = MD_S_UNKNOWN;
+    
+    if (md_reg_get(ctx->reg, md->name, p)) {
+        for (i = 0; i < (int)(sizeof(ImportFields)/sizeof(ImportFields[0])); ++i) {
+            if (md_json_has_key(json, ImportFields[i].key, ImportFields[i].sub, NULL)) {
+                fields |= ImportFields[i].field;
+            }
+        }
+        *pupdated = 1;
+        return fields? md_reg_update(ctx->reg, p, md->name, md, fields) : APR_SUCCESS;
+    }
+    if (!md->ca_url) {
+        md->ca_url = ctx->ca_url;
+    }
+    if (!md->ca_proto) {
+        md->ca_proto = "ACME";
+    }
+    return md_reg_add(ctx->reg, md, p);
+}
+
+static apr_status_t cmd_reg_import(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    apr_file_t *f;
+    apr_pool_t *ptemp;
+    md_json_t *json;
+    char *line;
+    apr_size_t len;
+    apr_status_t rv, rv2;
+    int lineno, added, updated, failed, is_update;
+
+    if (ctx->argc > 1) {
+        return usage(cmd, NULL);
+    }
+    if (ctx->argc == 0 || !strcmp("-", ctx->argv[0])) {
+        rv = apr_file_open_stdin(&f, ctx->p);
+    }
+    else {
+        rv = apr_file_open(&f, ctx->argv[0], APR_FOPEN_READ|APR_FOPEN_BUFFERED, 
+                           APR_OS_DEFAULT, ctx->p);
+    }
+    if (APR_SUCCESS != rv) {
+        fprintf(stderr, "unable to open input: %s\n", ctx->argc? ctx->argv[0] : "-");
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, ctx->p))) {
+        return rv;
+    }
+    
+    line = apr_palloc(ctx->p, MD_IMPORT_LINE_MAX);
+    added = updated = failed = 0;
+    /* The registry indexes the domains of all mds on first use and keeps it up to
+     * date with every md added, so overlaps are checked without rereading the store. */
+    for (lineno = 1; APR_SUCCESS == (rv = apr_file_gets(line, MD_IMPORT_LINE_MAX, f)); 
+         ++lineno, apr_pool_clear(ptemp)) {
+        len = strlen(line);
+        if (len > 0 && line[len-1] != '\n' && len == MD_IMPORT_LINE_MAX - 1) {
+            fprintf(stderr, "line %d: too long\n", lineno);
+            rv = APR_EINVAL;
+            break;
+        }
+        while (len > 0 && apr_isspace(line[len-1])) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (APR_SUCCESS != (rv2 = md_json_readd(&json, ptemp, line, len))) {
+            fprintf(stderr, "line %d: not JSON\n", lineno);
+            ++failed;
+        }
+        else if (APR_SUCCESS != (rv2 = import_md(ctx, json, &is_update, ptemp))) {
+            fprintf(stderr, "line %d: rejected (%d), %s\n", lineno, rv2, 
+                    md_json_writep(json, ptemp, MD_JSON_FMT_COMPACT));
+            ++failed;
+        }
+        else if (is_update) {
+            ++updated;
+        }
+        else {
+            ++added;
+        }
+    }
+    apr_pool_destroy(ptemp);
+    if (APR_STATUS_IS_EOF(rv)) {
+        rv = failed? APR_EINVAL : APR_SUCCESS;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, ctx->p, 
+                  "import: %d added, %d updated, %d failed", added, updated, failed);
+    if (ctx->json_out) {
+        json = md_json_create(ctx->p);
+        md_json_setl(added, json, "added", NULL);
+        md_json_setl(updated, json, "updated", NULL);
+        md_json_setl(failed, json, "failed", NULL);
+        md_json_addj(json, ctx->json_out, "output", NULL);
+    }
+    return rv;
+}
+
+md_cmd_t MD_RegImportCmd = {
+    "import", MD_CTX_REG, 
+    NULL, cmd_reg_import, MD_NoOptions, NULL,
+    "import [file]",
+    "add or update managed domains, one JSON object per line as written by 'export', "
+    "read from file or stdin. Accounts are not imported."
+};
+
+/**************************************************************************************************/
+/* command: export */
+
+static apr_status_t cmd_reg_export(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    apr_array_header_t *mdlist = apr_array_make(ctx->p, 100, sizeof(md_t *));
+    const md_t *md;
+    md_json_t *json;
+    int i;
+    
+    (void)cmd;
+    if (ctx->argc > 0) {
+        for (i = 0; i < ctx->argc; ++i) {
+            if (!(md = md_reg_get(ctx->reg, ctx->argv[i], ctx->p))) {
+                fprintf(stderr, "md not found: %s\n", ctx->argv[i]);
+                return APR_ENOENT;
+            }
+            APR_ARRAY_PUSH(mdlist, const md_t *) = md;
+        }
+    }
+    else {
+        md_reg_do(list_add_md, mdlist, ctx->reg, ctx->p);
+        qsort(mdlist->elts, (size_t)mdlist->nelts, sizeof(md_t *), md_name_cmp);
+    }
+    
+    for (i = 0; i < mdlist->nelts; ++i) {
+        md = APR_ARRAY_IDX(mdlist, i, const md_t*);
+        json = md_to_json(md, ctx->p);
+        if (ctx->json_out) {
+            md_json_addj(json, ctx->json_out, "output", NULL);
+        }
+        else {
+            fprintf(stdout, "%s\n", md_json_writep(json, ctx->p, MD_JSON_FMT_COMPACT));
+        }
+    }
+    return APR_SUCCESS;
+}
+
+md_cmd_t MD_RegExportCmd = {
+    "export", MD_CTX_REG, 
+    NULL, cmd_reg_export, MD_NoOptions, NULL,
+    "export [md...]",
+    "write all or the mentioned managed domains, one JSON object per line"
+};
+
 /**************************************************************************************************/
 /* command: drive */
 
-static apr_status_t assess_and_drive(md_cmd_ctx *ctx, md_t *md)
+static apr_status_t assess_and_drive(md_cmd_ctx *ctx, md_t *md, apr_pool_t *p)
 {
     int errored, force, renew, reset;
     const char *challenge, *msg;
@@ -254,7 +447,7 @@ static apr_status_t assess_and_drive(md_cmd_ctx *ctx, md_t *md)
     force = md_cmd_ctx_has_option(ctx, "force");
     challenge = md_cmd_ctx_get_option(ctx, "challenge");
      
-    if (APR_SUCCESS != (rv = md_reg_assess(ctx->reg, md, &errored, &renew, ctx->p))) {
+    if (APR_SUCCESS != (rv = md_reg_assess(ctx->reg, md, &errored, &renew, p))) {
         msg = "error assessing the current state of the "
               "Managed Domain. Please check the server "
               "logs or run this command in very verbose form and check the output.";
@@ -274,12 +467,13 @@ static apr_status_t assess_and_drive(md_cmd_ctx *ctx, md_t *md)
         if (md->state == MD_S_COMPLETE) {
             msg = force? "forcing renewal" : "for renewal";
         }
-        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "%s: %s", md->name, msg);
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "%s: %s", md->name, msg);
         
-        if (APR_SUCCESS == (rv = md_reg_stage(ctx->reg, md, challenge, reset, NULL, ctx->p))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "%s: loading", md->name);
+        rv = md_reg_stage(ctx->reg, md, challenge, reset, 0, NULL, NULL, p);
+        if (APR_SUCCESS == rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "%s: loading", md->name);
             
-            rv = md_reg_load(ctx->reg, md->name, ctx->p);
+            rv = md_reg_load(ctx->reg, md->name, p);
             
             if (APR_SUCCESS == rv) {
                 msg = "new credentials active on next server restart";
@@ -296,16 +490,30 @@ static apr_status_t assess_and_drive(md_cmd_ctx *ctx, md_t *md)
         msg = "up-to-date";
     }
 out:
-    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "%s: %s", md->name, msg);
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "%s: %s", md->name, msg);
     return rv;
 }
 
+typedef struct {
+    md_cmd_ctx *ctx;
+    apr_array_header_t *mdlist;
+} drive_ctx;
+
+static apr_status_t drive_job(void *baton, int i, apr_pool_t *p)
+{
+    drive_ctx *dctx = baton;
+    
+    return assess_and_drive(dctx->ctx, APR_ARRAY_IDX(dctx->mdlist, i, md_t*), p);
+}
+
 static apr_status_t cmd_reg_drive(md_cmd_ctx *ctx, const md_cmd_t *cmd)
 {
     apr_array_header_t *mdlist = apr_array_make(ctx->p, 5, sizeof(md_t *));
+    drive_ctx dctx;
+    const char *s;
     md_t *md;
     apr_status_t rv;
-    int i;
+    int i, parallel;
  
     (void)cmd;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, ctx->p, "drive do");
@@ -324,10 +532,23 @@ static apr_status_t cmd_reg_drive(md_cmd_ctx *ctx, const md_cmd_t *cmd)
         qsort(mdlist->elts, (size_t)mdlist->nelts, sizeof(md_t *), md_name_cmp);
     }   
     
+    s = md_cmd_ctx_get_option(ctx, "parallel");
+    parallel = s? (int)apr_atoi64(s) : 1;
+    if (parallel > 1 && !md_reg_is_concurrent(ctx->reg)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, ctx->p, 
+                      "store does not support parallel use, driving one after the other");
+        parallel = 1;
+    }
+    if (parallel > 1 && mdlist->nelts > 1) {
+        dctx.ctx = ctx;
+        dctx.mdlist = mdlist;
+        return md_cmd_parallel_do(drive_job, &dctx, mdlist->nelts, parallel, ctx->p);
+    }
+    
     rv = APR_SUCCESS;
     for (i = 0; i < mdlist->nelts; ++i) {
         md = APR_ARRAY_IDX(mdlist, i, md_t*);
-        if (APR_SUCCESS != (rv = assess_and_drive(ctx, md))) {
+        if (APR_SUCCESS != (rv = assess_and_drive(ctx, md, ctx->p))) {
             break;
         }
     }
@@ -344,6 +565,9 @@ static apr_status_t cmd_reg_drive_opts(md_cmd_ctx *ctx, int option, const char *
         case 'f':
             md_cmd_ctx_set_option(ctx, "force", "1");
             break;
+        case 'p':
+            md_cmd_ctx_set_option(ctx, "parallel", optarg);
+            break;
         case 'r':
             md_cmd_ctx_set_option(ctx, "reset", "1");
             break;
@@ -356,6 +580,7 @@ static apr_status_t cmd_reg_drive_opts(md_cmd_ctx *ctx, int option, const char *
 static apr_getopt_option_t DriveOptions [] = {
     { "challenge",'c', 1, "which challenge type to use"},
     { "force",    'f', 0, "force driving the managed domain, even when it seems valid"},
+    { "parallel", 'p', 1, "number of managed domains to drive at the same time"},
     { "reset",    'r', 0, "reset any staging data for the managed domain"},
     { NULL , 0, 0, NULL }
 };
@@ -363,7 +588,7 @@ static apr_getopt_option_t DriveOptions [] = {
 md_cmd_t MD_RegDriveCmd = {
     "drive", MD_CTX_REG, 
     cmd_reg_drive_opts, cmd_reg_drive, DriveOptions, NULL,
-    "drive [md...]",
+    "drive [opts] [md...]",
     "drive all or the mentioned managed domains toward completeness"
 };
 
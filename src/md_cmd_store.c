@@ -213,6 +213,68 @@ static md_cmd_t UpdateCmd = {
     "update the managed domain <name> in the store"
 };
 
+/**************************************************************************************************/
+/* command: store gc */
+
+static apr_status_t cmd_gc(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    md_store_gc_policy_t policy;
+    md_store_gc_stats_t stats;
+    md_json_t *json;
+    const char *s;
+    apr_status_t rv;
+    
+    if (ctx->argc > 0) {
+        return usage(cmd, NULL);
+    }
+    s = md_cmd_ctx_get_option(ctx, "keep");
+    policy.archive_keep = s? (int)apr_atoi64(s) : 5;
+    s = md_cmd_ctx_get_option(ctx, "age");
+    policy.tmp_age = policy.challenges_age = 
+        apr_time_from_sec((s? apr_atoi64(s) : 7) * MD_SECS_PER_DAY);
+    
+    rv = md_store_gc(ctx->store, ctx->p, &policy, &stats);
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "gc: removed %d archived, %d tmp "
+                  "and %d challenges", stats.archives, stats.tmp, stats.challenges);
+    if (ctx->json_out) {
+        json = md_json_create(ctx->p);
+        md_json_setl(stats.archives, json, "archives", NULL);
+        md_json_setl(stats.tmp, json, "tmp", NULL);
+        md_json_setl(stats.challenges, json, "challenges", NULL);
+        md_json_addj(json, ctx->json_out, "output", NULL);
+    }
+    return rv;
+}
+
+static apr_status_t opts_gc(md_cmd_ctx *ctx, int option, const char *optarg)
+{
+    switch (option) {
+        case 'k':
+            md_cmd_ctx_set_option(ctx, "keep", optarg);
+            break;
+        case 'a':
+            md_cmd_ctx_set_option(ctx, "age", optarg);
+            break;
+        default:
+            return APR_EINVAL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_getopt_option_t GcOptions [] = {
+    { "keep",    'k', 1, "archived copies to keep per managed domain, -1 for all (default 5)"},
+    { "age",     'a', 1, "days after which tmp and challenge data is stale (default 7)"},
+    { NULL , 0, 0, NULL }
+};
+
+static md_cmd_t GcCmd = {
+    "gc", MD_CTX_STORE, 
+    opts_gc, cmd_gc, 
+    GcOptions, NULL,
+    "gc [options]",
+    "remove old archived copies and stale tmp and challenge data from the store",
+};
+
 /**************************************************************************************************/
 /* command: store */
 
@@ -221,6 +283,7 @@ static const md_cmd_t *StoreSubCmds[] = {
     &RemoveCmd,
     &ListCmd,
     &UpdateCmd,
+    &GcCmd,
     NULL
 };
 
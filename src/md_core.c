@@ -97,32 +97,14 @@ md_t *md_create_empty(apr_pool_t *p)
 
 int md_equal_domains(const md_t *md1, const md_t *md2, int case_sensitive)
 {
-    int i;
-    if (md1->domains->nelts == md2->domains->nelts) {
-        for (i = 0; i < md1->domains->nelts; ++i) {
-            const char *name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
-            if (!md_contains(md2, name1, case_sensitive)) {
-                return 0;
-            }
-        }
-        return 1;
-    }
-    return 0;
+    return (md1->domains->nelts == md2->domains->nelts
+            && md_array_str_contains_all(md2->domains, md1->domains, case_sensitive));
 }
 
 int md_contains_domains(const md_t *md1, const md_t *md2)
 {
-    int i;
-    if (md1->domains->nelts >= md2->domains->nelts) {
-        for (i = 0; i < md2->domains->nelts; ++i) {
-            const char *name2 = APR_ARRAY_IDX(md2->domains, i, const char*);
-            if (!md_contains(md1, name2, 0)) {
-                return 0;
-            }
-        }
-        return 1;
-    }
-    return 0;
+    return (md1->domains->nelts >= md2->domains->nelts
+            && md_array_str_contains_all(md1->domains, md2->domains, 0));
 }
 
 md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md)
@@ -204,6 +186,21 @@ md_t *md_create(apr_pool_t *p, apr_array_header_t *domains)
     return md;
 }
 
+static apr_interval_time_t renew_window(const md_t *md)
+{
+    double renew_win, life;
+    
+    renew_win = (double)md->renew_window;
+    if (md->renew_norm > 0 
+        && md->renew_norm > renew_win
+        && md->expires > md->valid_from) {
+        /* Calc renewal days as fraction of cert lifetime - if known */
+        life = (double)(md->expires - md->valid_from); 
+        renew_win = life * renew_win / (double)md->renew_norm;
+    }
+    return (apr_interval_time_t)renew_win;
+}
+
 int md_should_renew(const md_t *md) 
 {
     apr_time_t now = apr_time_now();
@@ -212,26 +209,18 @@ int md_should_renew(const md_t *md)
         return 1;
     }
     else if (md->expires > 0) {
-        double renew_win,  life;
-        apr_interval_time_t left;
-        
-        renew_win = (double)md->renew_window;
-        if (md->renew_norm > 0 
-            && md->renew_norm > renew_win
-            && md->expires > md->valid_from) {
-            /* Calc renewal days as fraction of cert lifetime - if known */
-            life = (double)(md->expires - md->valid_from); 
-            renew_win = life * renew_win / (double)md->renew_norm;
-        }
-        
-        left = md->expires - now;
-        if (left <= renew_win) {
+        if (md->expires - now <= renew_window(md)) {
             return 1;
         }                
     }
     return 0;
 }
 
+apr_time_t md_renew_at(const md_t *md)
+{
+    return (md->expires > 0)? md->expires - renew_window(md) : 0;
+}
+
 /**************************************************************************************************/
 /* lifetime */
 
@@ -21,10 +21,15 @@
 #include <apr_lib.h>
 #include <apr_buckets.h>
 #include <apr_file_io.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/objects.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
@@ -34,6 +39,7 @@
 #include "md_crypt.h"
 #include "md_json.h"
 #include "md_log.h"
+#include "md_metrics.h"
 #include "md_http.h"
 #include "md_util.h"
 
@@ -62,6 +68,10 @@ static int initialized;
 struct md_pkey_t {
     apr_pool_t *pool;
     EVP_PKEY   *pkey;
+    EVP_MD_CTX *sign_ctx;          /* reused by md_crypt_sign64(), made on first use */
+    const EVP_MD *sign_digest;
+    apr_size_t sign_ec_bytes;      /* size of a signature part with EC keys, 0 for RSA */
+    apr_hash_t *derived;           /* see md_pkey_derived_get() */
 };
 
 #ifdef MD_HAVE_ARC4RANDOM
@@ -195,7 +205,7 @@ static int pem_passwd(char *buf, int size, int rwflag, void *baton)
  * not caughts up yet or chose to ignore. An alternative is implemented, we prefer 
  * however the *SSL to maintain such things.
  */
-static apr_time_t md_asn1_time_get(const ASN1_TIME* time)
+apr_time_t md_asn1_time_get(const ASN1_TIME* time)
 {
 #if OPENSSL_VERSION_NUMBER < 0x10002000L || defined(LIBRESSL_VERSION_NUMBER)
     /* courtesy: https://stackoverflow.com/questions/10975542/asn1-time-to-time-t-conversion#11263731
@@ -250,6 +260,52 @@ static apr_time_t md_asn1_time_get(const ASN1_TIME* time)
 /**************************************************************************************************/
 /* private keys */
 
+typedef struct {
+    const char *name;               /* as used in JOSE */
+    int nid;
+    const char *alias1;             /* SECG name */
+    const char *alias2;             /* X9.62 name, if there is one */
+    apr_size_t bytes;               /* length of a coordinate or signature part */
+    int digest_bits;                /* the SHA-2 digest the curve is used with */
+} ec_curve_t;
+
+static const ec_curve_t EcCurves[] = {
+    { "P-256", NID_X9_62_prime256v1, "secp256r1", "prime256v1", 32, 256 },
+    { "P-384", NID_secp384r1,        "secp384r1", NULL,         48, 384 },
+};
+
+static const ec_curve_t *ec_curve_get(const char *name)
+{
+    size_t i;
+    
+    for (i = 0; name && i < sizeof(EcCurves)/sizeof(EcCurves[0]); ++i) {
+        if (!apr_strnatcasecmp(name, EcCurves[i].name)
+            || !apr_strnatcasecmp(name, EcCurves[i].alias1)
+            || (EcCurves[i].alias2 && !apr_strnatcasecmp(name, EcCurves[i].alias2))) {
+            return &EcCurves[i];
+        }
+    }
+    return NULL;
+}
+
+static const ec_curve_t *ec_curve_by_nid(int nid)
+{
+    size_t i;
+    
+    for (i = 0; i < sizeof(EcCurves)/sizeof(EcCurves[0]); ++i) {
+        if (nid == EcCurves[i].nid) {
+            return &EcCurves[i];
+        }
+    }
+    return NULL;
+}
+
+const char *md_pkey_ec_curve_name(const char *name)
+{
+    const ec_curve_t *curve = ec_curve_get(name);
+    return curve? curve->name : NULL;
+}
+
 md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p)
 {
     md_json_t *json = md_json_create(p);
@@ -264,6 +320,12 @@ md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p)
                     md_json_setl((long)spec->params.rsa.bits, json, MD_KEY_BITS, NULL);
                 }
                 break;
+            case MD_PKEY_TYPE_EC:
+                md_json_sets("EC", json, MD_KEY_TYPE, NULL);
+                if (spec->params.ec.curve) {
+                    md_json_sets(spec->params.ec.curve, json, MD_KEY_CURVE, NULL);
+                }
+                break;
             default:
                 md_json_sets("Unsupported", json, MD_KEY_TYPE, NULL);
                 break;
@@ -293,6 +355,11 @@ md_pkey_spec_t *md_pkey_spec_from_json(struct md_json_t *json, apr_pool_t *p)
                 spec->params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
             }
         }
+        else if (!apr_strnatcasecmp("EC", s)) {
+            spec->type = MD_PKEY_TYPE_EC;
+            s = md_pkey_ec_curve_name(md_json_gets(json, MD_KEY_CURVE, NULL));
+            spec->params.ec.curve = s? s : MD_PKEY_EC_CURVE_DEF;
+        }
     }
     return spec;
 }
@@ -311,11 +378,33 @@ int md_pkey_spec_eq(md_pkey_spec_t *spec1, md_pkey_spec_t *spec2)
                     return 1;
                 }
                 break;
+            case MD_PKEY_TYPE_EC:
+                if (spec1->params.ec.curve && spec2->params.ec.curve 
+                    && !strcmp(spec1->params.ec.curve, spec2->params.ec.curve)) {
+                    return 1;
+                }
+                break;
         }
     }
     return 0;
 }
 
+const char *md_pkey_spec_name(const md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    md_pkey_type_t ptype = spec? spec->type : MD_PKEY_TYPE_DEFAULT;
+    switch (ptype) {
+        case MD_PKEY_TYPE_DEFAULT:
+            return apr_psprintf(p, "rsa-%d", MD_PKEY_RSA_BITS_DEF);
+        case MD_PKEY_TYPE_RSA:
+            return apr_psprintf(p, "rsa-%u", spec->params.rsa.bits);
+        case MD_PKEY_TYPE_EC:
+            return apr_pstrcat(p, "ec-", spec->params.ec.curve? 
+                               spec->params.ec.curve : MD_PKEY_EC_CURVE_DEF, NULL);
+        default:
+            return "unsupported";
+    }
+}
+
 static md_pkey_t *make_pkey(apr_pool_t *p) 
 {
     md_pkey_t *pkey = apr_pcalloc(p, sizeof(*pkey));
@@ -326,10 +415,15 @@ static md_pkey_t *make_pkey(apr_pool_t *p)
 static apr_status_t pkey_cleanup(void *data)
 {
     md_pkey_t *pkey = data;
+    if (pkey->sign_ctx) {
+        EVP_MD_CTX_destroy(pkey->sign_ctx);
+        pkey->sign_ctx = NULL;
+    }
     if (pkey->pkey) {
         EVP_PKEY_free(pkey->pkey);
         pkey->pkey = NULL;
     }
+    pkey->derived = NULL;
     return APR_SUCCESS;
 }
 
@@ -343,15 +437,240 @@ void *md_pkey_get_EVP_PKEY(struct md_pkey_t *pkey)
     return pkey->pkey;
 }
 
+void *md_pkey_derived_get(md_pkey_t *pkey, const char *name)
+{
+    return pkey->derived? apr_hash_get(pkey->derived, name, APR_HASH_KEY_STRING) : NULL;
+}
+
+void md_pkey_derived_set(md_pkey_t *pkey, const char *name, void *data)
+{
+    if (!pkey->derived) {
+        pkey->derived = apr_hash_make(pkey->pool);
+    }
+    apr_hash_set(pkey->derived, name, APR_HASH_KEY_STRING, data);
+}
+
+apr_pool_t *md_pkey_get_pool(md_pkey_t *pkey)
+{
+    return pkey->pool;
+}
+
+md_pkey_t *md_pkey_share(md_pkey_t *pkey, apr_pool_t *p)
+{
+    md_pkey_t *shared;
+    
+    if (!pkey->pkey) {
+        return NULL;
+    }
+#if MD_USE_OPENSSL_PRE_1_1_API
+    CRYPTO_add(&pkey->pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+#else
+    EVP_PKEY_up_ref(pkey->pkey);
+#endif
+    shared = make_pkey(p);
+    shared->pkey = pkey->pkey;
+    apr_pool_cleanup_register(p, shared, pkey_cleanup, apr_pool_cleanup_null);
+    return shared;
+}
+
+/**************************************************************************************************/
+/* decrypted private key cache */
+
+/* Private keys protected by a pass phrase go through the key derivation of their PEM
+ * encryption on every load. With the cache enabled, a decrypted key is kept for a 
+ * short time and shared with later loads of the same file, as long as the file did 
+ * not change. Each key lives in a pool of its own, destroyed when the key expires or
+ * its file changes, which frees it. Freeing a key makes OpenSSL clear its private
+ * parts. */
+
+typedef struct {
+    apr_pool_t *p;                     /* owns this entry and the shared key */
+    md_pkey_t *pkey;
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_time_t expires;
+} pkey_cache_entry_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *entries;               /* file name -> pkey_cache_entry_t* */
+    apr_interval_time_t ttl;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} md_pkey_cache_t;
+
+static md_pkey_cache_t *pkey_cache;
+
+static void pkey_cache_lock(md_pkey_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    if (cache->mutex) apr_thread_mutex_lock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static void pkey_cache_unlock(md_pkey_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    if (cache->mutex) apr_thread_mutex_unlock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static apr_status_t pkey_cache_cleanup(void *data)
+{
+    if (pkey_cache == data) {
+        pkey_cache = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/* call with lock held */
+static void pkey_cache_drop(md_pkey_cache_t *cache, const char *fname, pkey_cache_entry_t *e)
+{
+    apr_hash_set(cache->entries, fname, APR_HASH_KEY_STRING, NULL);
+    apr_pool_destroy(e->p);
+}
+
+/* call with lock held */
+static void pkey_cache_expire(md_pkey_cache_t *cache, apr_time_t now)
+{
+    apr_hash_index_t *hi;
+    pkey_cache_entry_t *e;
+    const void *fname;
+    
+    for (hi = apr_hash_first(NULL, cache->entries); hi; ) {
+        apr_hash_this(hi, &fname, NULL, (void**)&e);
+        hi = apr_hash_next(hi);
+        if (e->expires <= now) {
+            pkey_cache_drop(cache, fname, e);
+        }
+    }
+}
+
+apr_status_t md_pkey_cache_enable(apr_pool_t *p, apr_interval_time_t ttl)
+{
+    md_pkey_cache_t *cache;
+    apr_status_t rv;
+    
+    if (ttl <= 0) {
+        pkey_cache = NULL;
+        return APR_SUCCESS;
+    }
+    cache = apr_pcalloc(p, sizeof(*cache));
+    if (APR_SUCCESS != (rv = apr_pool_create(&cache->p, p))) {
+        return rv;
+    }
+    apr_pool_tag(cache->p, "md_pkey_cache");
+    cache->entries = apr_hash_make(cache->p);
+    cache->ttl = ttl;
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&cache->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        return rv;
+    }
+#endif
+    apr_pool_cleanup_register(p, cache, pkey_cache_cleanup, apr_pool_cleanup_null);
+    pkey_cache = cache;
+    return APR_SUCCESS;
+}
+
+void md_pkey_cache_clear(void)
+{
+    md_pkey_cache_t *cache = pkey_cache;
+    
+    if (cache) {
+        pkey_cache_lock(cache);
+        apr_pool_clear(cache->p);
+        cache->entries = apr_hash_make(cache->p);
+        pkey_cache_unlock(cache);
+    }
+}
+
+void md_pkey_cache_forget(const char *fname)
+{
+    md_pkey_cache_t *cache = pkey_cache;
+    pkey_cache_entry_t *e;
+    
+    if (cache) {
+        pkey_cache_lock(cache);
+        if ((e = apr_hash_get(cache->entries, fname, APR_HASH_KEY_STRING))) {
+            pkey_cache_drop(cache, fname, e);
+        }
+        pkey_cache_unlock(cache);
+    }
+}
+
+static md_pkey_t *pkey_cache_get(md_pkey_cache_t *cache, const char *fname, 
+                                 const apr_finfo_t *finfo, apr_pool_t *p)
+{
+    pkey_cache_entry_t *e;
+    md_pkey_t *pkey = NULL;
+    
+    pkey_cache_lock(cache);
+    if ((e = apr_hash_get(cache->entries, fname, APR_HASH_KEY_STRING))) {
+        if (e->mtime != finfo->mtime || e->size != finfo->size 
+            || e->expires <= apr_time_now()) {
+            pkey_cache_drop(cache, fname, e);
+        }
+        else {
+            pkey = md_pkey_share(e->pkey, p);
+        }
+    }
+    pkey_cache_unlock(cache);
+    return pkey;
+}
+
+static void pkey_cache_add(md_pkey_cache_t *cache, const char *fname, 
+                           const apr_finfo_t *finfo, md_pkey_t *pkey)
+{
+    pkey_cache_entry_t *e;
+    apr_pool_t *ep;
+    apr_time_t now = apr_time_now();
+    
+    pkey_cache_lock(cache);
+    pkey_cache_expire(cache, now);
+    if (!apr_hash_get(cache->entries, fname, APR_HASH_KEY_STRING)
+        && APR_SUCCESS == apr_pool_create(&ep, cache->p)) {
+        e = apr_pcalloc(ep, sizeof(*e));
+        e->p = ep;
+        e->mtime = finfo->mtime;
+        e->size = finfo->size;
+        e->expires = now + cache->ttl;
+        if ((e->pkey = md_pkey_share(pkey, ep))) {
+            apr_hash_set(cache->entries, apr_pstrdup(ep, fname), APR_HASH_KEY_STRING, e);
+        }
+        else {
+            apr_pool_destroy(ep);
+        }
+    }
+    pkey_cache_unlock(cache);
+}
+
 apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p, 
                            const char *key, apr_size_t key_len,
                            const char *fname)
 {
     apr_status_t rv = APR_ENOENT;
+    md_pkey_cache_t *cache = key? pkey_cache : NULL;
+    apr_finfo_t finfo;
     md_pkey_t *pkey;
     BIO *bf;
     passwd_ctx ctx;
     
+    if (cache) {
+        if (APR_SUCCESS != apr_stat(&finfo, fname, APR_FINFO_MTIME|APR_FINFO_SIZE, p)) {
+            cache = NULL;
+        }
+        else if ((pkey = pkey_cache_get(cache, fname, &finfo, p))) {
+            *ppkey = pkey;
+            return APR_SUCCESS;
+        }
+    }
+    
     pkey =  make_pkey(p);
     if (NULL != (bf = BIO_new_file(fname, "r"))) {
         ctx.pass_phrase = key;
@@ -364,6 +683,9 @@ apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p,
         if (pkey->pkey != NULL) {
             rv = APR_SUCCESS;
             apr_pool_cleanup_register(p, pkey, pkey_cleanup, apr_pool_cleanup_null);
+            if (cache) {
+                pkey_cache_add(cache, fname, &finfo, pkey);
+            }
         }
         else {
             unsigned long err = ERR_get_error();
@@ -440,6 +762,57 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
     return rv;
 }
 
+apr_status_t md_pkey_to_pem(const char **ppem, apr_size_t *plen, md_pkey_t *pkey, apr_pool_t *p,
+                            const char *pass_phrase, apr_size_t pass_len)
+{
+    buffer_rec buffer;
+    apr_status_t rv;
+    
+    buffer.data = NULL;
+    buffer.len = 0;
+    rv = pkey_to_buffer(&buffer, pkey, p, pass_phrase, pass_len);
+    *ppem = (APR_SUCCESS == rv)? buffer.data : NULL;
+    *plen = (APR_SUCCESS == rv)? buffer.len : 0;
+    return rv;
+}
+
+apr_status_t md_pkey_from_pem(md_pkey_t **ppkey, apr_pool_t *p, const char *pem, apr_size_t len,
+                              const char *pass_phrase, apr_size_t pass_len)
+{
+    apr_status_t rv = APR_EINVAL;
+    md_pkey_t *pkey;
+    BIO *bf;
+    passwd_ctx ctx;
+    
+    *ppkey = NULL;
+    if (len > INT_MAX || pass_len > INT_MAX) {
+        return APR_EINVAL;
+    }
+    if (NULL == (bf = BIO_new_mem_buf(pem, (int)len))) {
+        return APR_ENOMEM;
+    }
+    pkey =  make_pkey(p);
+    ctx.pass_phrase = pass_phrase;
+    ctx.pass_len = (int)pass_len;
+    
+    ERR_clear_error();
+    pkey->pkey = PEM_read_bio_PrivateKey(bf, NULL, pem_passwd, &ctx);
+    BIO_free(bf);
+    
+    if (pkey->pkey != NULL) {
+        rv = APR_SUCCESS;
+        apr_pool_cleanup_register(p, pkey, pkey_cleanup, apr_pool_cleanup_null);
+        *ppkey = pkey;
+    }
+    else {
+        unsigned long err = ERR_get_error();
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "error reading pkey: %s (pass phrase was %snull)",
+                      ERR_error_string(err, NULL), pass_phrase? "not " : ""); 
+    }
+    return rv;
+}
+
 static apr_status_t gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, unsigned int bits)
 {
     EVP_PKEY_CTX *ctx = NULL;
@@ -465,17 +838,76 @@ static apr_status_t gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, unsigned int bits)
     return rv;
 }
 
+static apr_status_t gen_ec(md_pkey_t **ppkey, apr_pool_t *p, const char *curve_name)
+{
+    EVP_PKEY_CTX *ctx = NULL, *kctx = NULL;
+    EVP_PKEY *params = NULL;
+    const ec_curve_t *curve;
+    apr_status_t rv;
+    
+    if (!(curve = ec_curve_get(curve_name? curve_name : MD_PKEY_EC_CURVE_DEF))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, APR_ENOTIMPL, p, 
+                      "unsupported EC curve %s", curve_name); 
+        *ppkey = NULL;
+        return APR_ENOTIMPL;
+    }
+    
+    *ppkey = make_pkey(p);
+    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (ctx 
+        && EVP_PKEY_paramgen_init(ctx) >= 0
+        && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, curve->nid) >= 0
+#ifdef EVP_PKEY_CTX_set_ec_param_enc
+        /* certificates need to name the curve, not just give its parameters */
+        && EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE) >= 0
+#endif
+        && EVP_PKEY_paramgen(ctx, &params) >= 0
+        && NULL != (kctx = EVP_PKEY_CTX_new(params, NULL))
+        && EVP_PKEY_keygen_init(kctx) >= 0
+        && EVP_PKEY_keygen(kctx, &(*ppkey)->pkey) >= 0) {
+        rv = APR_SUCCESS;
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "error generate pkey EC %s", 
+                      curve->name); 
+        *ppkey = NULL;
+        rv = APR_EGENERAL;
+    }
+    
+    if (kctx != NULL) {
+        EVP_PKEY_CTX_free(kctx);
+    }
+    if (params != NULL) {
+        EVP_PKEY_free(params);
+    }
+    if (ctx != NULL) {
+        EVP_PKEY_CTX_free(ctx);
+    }
+    return rv;
+}
+
 apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec)
 {
     md_pkey_type_t ptype = spec? spec->type : MD_PKEY_TYPE_DEFAULT;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv;
+    
     switch (ptype) {
         case MD_PKEY_TYPE_DEFAULT:
-            return gen_rsa(ppkey, p, MD_PKEY_RSA_BITS_DEF);
+            rv = gen_rsa(ppkey, p, MD_PKEY_RSA_BITS_DEF);
+            break;
         case MD_PKEY_TYPE_RSA:
-            return gen_rsa(ppkey, p, spec->params.rsa.bits);
+            rv = gen_rsa(ppkey, p, spec->params.rsa.bits);
+            break;
+        case MD_PKEY_TYPE_EC:
+            rv = gen_ec(ppkey, p, spec->params.ec.curve);
+            break;
         default:
             return APR_ENOTIMPL;
     }
+    md_metrics_record(MD_METRICS_KEYGEN, md_pkey_spec_name(spec, p), 
+                      apr_time_now() - start, APR_SUCCESS != rv);
+    return rv;
 }
 
 #if MD_USE_OPENSSL_PRE_1_1_API || (defined(LIBRESSL_VERSION_NUMBER) && \
@@ -496,6 +928,14 @@ static void RSA_get0_key(const RSA *r,
         *d = r->d;
 }
 
+static void ECDSA_SIG_get0(const ECDSA_SIG *sig, const BIGNUM **pr, const BIGNUM **ps)
+{
+    if (pr != NULL)
+        *pr = sig->r;
+    if (ps != NULL)
+        *ps = sig->s;
+}
+
 #endif
 
 static const char *bn64(const BIGNUM *b, apr_pool_t *p) 
@@ -514,57 +954,171 @@ static const char *bn64(const BIGNUM *b, apr_pool_t *p)
 const char *md_pkey_get_rsa_e64(md_pkey_t *pkey, apr_pool_t *p)
 {
     const BIGNUM *e;
+    const char *e64;
     RSA *rsa = EVP_PKEY_get1_RSA(pkey->pkey);
     
     if (!rsa) {
         return NULL;
     }
     RSA_get0_key(rsa, NULL, &e, NULL);
-    return bn64(e, p);
+    e64 = bn64(e, p);
+    RSA_free(rsa);
+    return e64;
 }
 
 const char *md_pkey_get_rsa_n64(md_pkey_t *pkey, apr_pool_t *p)
 {
     const BIGNUM *n;
+    const char *n64;
     RSA *rsa = EVP_PKEY_get1_RSA(pkey->pkey);
     
     if (!rsa) {
         return NULL;
     }
     RSA_get0_key(rsa, &n, NULL, NULL);
-    return bn64(n, p);
+    n64 = bn64(n, p);
+    RSA_free(rsa);
+    return n64;
+}
+
+/* big endian, left padded with zeros to len bytes */
+static int bn_to_bin_pad(const BIGNUM *b, unsigned char *buf, apr_size_t len)
+{
+    apr_size_t blen = (apr_size_t)BN_num_bytes(b);
+    
+    if (blen > len) {
+        return 0;
+    }
+    memset(buf, 0, len - blen);
+    BN_bn2bin(b, buf + (len - blen));
+    return 1;
+}
+
+md_pkey_type_t md_pkey_get_type(md_pkey_t *pkey)
+{
+    switch (EVP_PKEY_base_id(pkey->pkey)) {
+        case EVP_PKEY_EC:
+            return MD_PKEY_TYPE_EC;
+        default:
+            return MD_PKEY_TYPE_RSA;
+    }
+}
+
+static const ec_curve_t *pkey_ec_curve(md_pkey_t *pkey)
+{
+    const ec_curve_t *curve = NULL;
+    EC_KEY *ec;
+    
+    if (EVP_PKEY_EC == EVP_PKEY_base_id(pkey->pkey)
+        && NULL != (ec = EVP_PKEY_get1_EC_KEY(pkey->pkey))) {
+        curve = ec_curve_by_nid(EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)));
+        EC_KEY_free(ec);
+    }
+    return curve;
+}
+
+apr_status_t md_pkey_get_ec_params(md_pkey_t *pkey, apr_pool_t *p, const char **pcurve, 
+                                   const char **px64, const char **py64)
+{
+    const ec_curve_t *curve;
+    EC_KEY *ec = NULL;
+    BIGNUM *x = NULL, *y = NULL;
+    unsigned char *buffer;
+    apr_status_t rv = APR_EINVAL;
+    
+    *pcurve = *px64 = *py64 = NULL;
+    if (NULL == (curve = pkey_ec_curve(pkey))
+        || NULL == (ec = EVP_PKEY_get1_EC_KEY(pkey->pkey))) {
+        goto out;
+    }
+    x = BN_new();
+    y = BN_new();
+    buffer = apr_pcalloc(p, curve->bytes);
+    if (x && y 
+        && EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(ec), 
+                                               EC_KEY_get0_public_key(ec), x, y, NULL)
+        && bn_to_bin_pad(x, buffer, curve->bytes)) {
+        *px64 = md_util_base64url_encode((const char *)buffer, curve->bytes, p);
+        if (bn_to_bin_pad(y, buffer, curve->bytes)) {
+            *py64 = md_util_base64url_encode((const char *)buffer, curve->bytes, p);
+            *pcurve = curve->name;
+            rv = APR_SUCCESS;
+        }
+    }
+out:
+    if (x) BN_free(x);
+    if (y) BN_free(y);
+    if (ec) EC_KEY_free(ec);
+    return rv;
+}
+
+/* JWS wants ECDSA signatures as R and S, each padded to the curve size, 
+ * OpenSSL gives them DER encoded. */
+static const char *ec_sig64(const unsigned char *der, unsigned int der_len, 
+                            apr_size_t bytes, apr_pool_t *p)
+{
+    ECDSA_SIG *sig;
+    const BIGNUM *r, *s;
+    unsigned char *buffer;
+    const char *sign64 = NULL;
+    
+    if (NULL != (sig = d2i_ECDSA_SIG(NULL, &der, (long)der_len))) {
+        ECDSA_SIG_get0(sig, &r, &s);
+        buffer = apr_pcalloc(p, 2 * bytes);
+        if (bn_to_bin_pad(r, buffer, bytes)
+            && bn_to_bin_pad(s, buffer + bytes, bytes)) {
+            sign64 = md_util_base64url_encode((const char *)buffer, 2 * bytes, p);
+        }
+        ECDSA_SIG_free(sig);
+    }
+    return sign64;
 }
 
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
                              const char *d, size_t dlen)
 {
-    EVP_MD_CTX *ctx = NULL;
+    const ec_curve_t *curve;
     char *buffer;
     unsigned int blen;
     const char *sign64 = NULL;
     apr_status_t rv = APR_ENOMEM;
     
+    *psign64 = NULL;
+    if (!pkey->sign_ctx) {
+        /* the digest and context only depend on the key, keep them for the next signature */
+        pkey->sign_digest = EVP_sha256();
+        pkey->sign_ec_bytes = 0;
+        if (MD_PKEY_TYPE_EC == md_pkey_get_type(pkey)) {
+            if (NULL == (curve = pkey_ec_curve(pkey))) {
+                rv = APR_ENOTIMPL;
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "signing, unsupported EC curve"); 
+                return rv;
+            }
+            pkey->sign_digest = (curve->digest_bits == 384)? EVP_sha384() : EVP_sha256();
+            pkey->sign_ec_bytes = curve->bytes;
+        }
+        if (NULL == (pkey->sign_ctx = EVP_MD_CTX_create())) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "signing"); 
+            return rv;
+        }
+    }
+    
     buffer = apr_pcalloc(p, (apr_size_t)EVP_PKEY_size(pkey->pkey));
     if (buffer) {
-        ctx = EVP_MD_CTX_create();
-        if (ctx) {
-            rv = APR_ENOTIMPL;
-            if (EVP_SignInit_ex(ctx, EVP_sha256(), NULL)) {
-                rv = APR_EGENERAL;
-                if (EVP_SignUpdate(ctx, d, dlen)) {
-                    if (EVP_SignFinal(ctx, (unsigned char*)buffer, &blen, pkey->pkey)) {
-                        sign64 = md_util_base64url_encode(buffer, blen, p);
-                        if (sign64) {
-                            rv = APR_SUCCESS;
-                        }
+        rv = APR_ENOTIMPL;
+        if (EVP_SignInit_ex(pkey->sign_ctx, pkey->sign_digest, NULL)) {
+            rv = APR_EGENERAL;
+            if (EVP_SignUpdate(pkey->sign_ctx, d, dlen)) {
+                if (EVP_SignFinal(pkey->sign_ctx, (unsigned char*)buffer, &blen, pkey->pkey)) {
+                    sign64 = pkey->sign_ec_bytes? 
+                        ec_sig64((unsigned char*)buffer, blen, pkey->sign_ec_bytes, p)
+                        : md_util_base64url_encode(buffer, blen, p);
+                    if (sign64) {
+                        rv = APR_SUCCESS;
                     }
                 }
             }
         }
-        
-        if (ctx) {
-            EVP_MD_CTX_destroy(ctx);
-        }
     }
     
     if (rv != APR_SUCCESS) {
@@ -683,6 +1237,7 @@ struct md_cert_t {
     apr_pool_t *pool;
     X509 *x509;
     apr_array_header_t *alt_names;
+    md_str_set_t *alt_set;          /* alt_names for lookups */
 };
 
 static apr_status_t cert_cleanup(void *data)
@@ -710,6 +1265,19 @@ void md_cert_free(md_cert_t *cert)
     cert_cleanup(cert);
 }
 
+md_cert_t *md_cert_share(md_cert_t *cert, apr_pool_t *p)
+{
+    if (!cert->x509) {
+        return NULL;
+    }
+#if MD_USE_OPENSSL_PRE_1_1_API
+    CRYPTO_add(&cert->x509->references, 1, CRYPTO_LOCK_X509);
+#else
+    X509_up_ref(cert->x509);
+#endif
+    return make_cert(p, cert->x509);
+}
+
 void *md_cert_get_X509(struct md_cert_t *cert)
 {
     return cert->x509;
@@ -736,31 +1304,36 @@ apr_time_t md_cert_get_not_before(md_cert_t *cert)
     return md_asn1_time_get(X509_get_notBefore(cert->x509));
 }
 
-int md_cert_covers_domain(md_cert_t *cert, const char *domain_name)
+static md_str_set_t *cert_alt_set(md_cert_t *cert)
 {
     if (!cert->alt_names) {
         md_cert_get_alt_names(&cert->alt_names, cert, cert->pool);
     }
-    if (cert->alt_names) {
-        return md_array_str_index(cert->alt_names, domain_name, 0, 0) >= 0;
+    if (cert->alt_names && !cert->alt_set) {
+        cert->alt_set = md_str_set_from_array(cert->pool, cert->alt_names, 0);
     }
-    return 0;
+    return cert->alt_set;
+}
+
+int md_cert_covers_domain(md_cert_t *cert, const char *domain_name)
+{
+    md_str_set_t *alt_set = cert_alt_set(cert);
+    
+    return alt_set && md_str_set_contains(alt_set, domain_name);
 }
 
 int md_cert_covers_md(md_cert_t *cert, const md_t *md)
 {
+    md_str_set_t *alt_set = cert_alt_set(cert);
     const char *name;
     int i;
     
-    if (!cert->alt_names) {
-        md_cert_get_alt_names(&cert->alt_names, cert, cert->pool);
-    }
-    if (cert->alt_names) {
+    if (alt_set) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, cert->pool, "cert has %d alt names",
                       cert->alt_names->nelts); 
         for (i = 0; i < md->domains->nelts; ++i) {
             name = APR_ARRAY_IDX(md->domains, i, const char *);
-            if (md_array_str_index(cert->alt_names, name, 0, 0) < 0) {
+            if (!md_str_set_contains(alt_set, name)) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, cert->pool, 
                               "md domain %s not covered by cert", name);
                 return 0;
@@ -774,7 +1347,13 @@ int md_cert_covers_md(md_cert_t *cert, const md_t *md)
     return 0;
 }
 
-apr_status_t md_cert_get_issuers_uri(const char **puri, md_cert_t *cert, apr_pool_t *p)
+int md_cert_matches_pkey(md_cert_t *cert, md_pkey_t *pkey)
+{
+    return X509_check_private_key(cert->x509, pkey->pkey) == 1;
+}
+
+static apr_status_t get_info_access_uri(const char **puri, md_cert_t *cert, int method, 
+                                        apr_pool_t *p)
 {
     apr_status_t rv = APR_ENOENT;
     STACK_OF(ACCESS_DESCRIPTION) *xinfos;
@@ -786,7 +1365,7 @@ apr_status_t md_cert_get_issuers_uri(const char **puri, md_cert_t *cert, apr_poo
     if (xinfos) {
         for (i = 0; i < sk_ACCESS_DESCRIPTION_num(xinfos); i++) {
             ACCESS_DESCRIPTION *val = sk_ACCESS_DESCRIPTION_value(xinfos, i);
-            if (OBJ_obj2nid(val->method) == NID_ad_ca_issuers
+            if (OBJ_obj2nid(val->method) == method
                     && val->location && val->location->type == GEN_URI) {
                 ASN1_STRING_to_UTF8(&buf, val->location->d.uniformResourceIdentifier);
                 uri = apr_pstrdup(p, (char *)buf);
@@ -801,6 +1380,16 @@ apr_status_t md_cert_get_issuers_uri(const char **puri, md_cert_t *cert, apr_poo
     return rv;
 }
 
+apr_status_t md_cert_get_issuers_uri(const char **puri, md_cert_t *cert, apr_pool_t *p)
+{
+    return get_info_access_uri(puri, cert, NID_ad_ca_issuers, p);
+}
+
+apr_status_t md_cert_get_ocsp_uri(const char **puri, md_cert_t *cert, apr_pool_t *p)
+{
+    return get_info_access_uri(puri, cert, NID_ad_OCSP, p);
+}
+
 apr_status_t md_cert_get_alt_names(apr_array_header_t **pnames, md_cert_t *cert, apr_pool_t *p)
 {
     apr_array_header_t *names;
@@ -900,14 +1489,30 @@ apr_status_t md_cert_fsave(md_cert_t *cert, apr_pool_t *p,
 
 apr_status_t md_cert_to_base64url(const char **ps64, md_cert_t *cert, apr_pool_t *p)
 {
-    buffer_rec buffer;
-    apr_status_t rv;
+    BIO *bio;
+    char *s64;
+    apr_size_t len;
+    int i;
+    apr_status_t rv = APR_EINVAL;
     
-    if (APR_SUCCESS == (rv = cert_to_buffer(&buffer, cert, p))) {
-        *ps64 = md_util_base64url_encode(buffer.data, buffer.len, p);
-        return APR_SUCCESS;
-    }
+    /* read the PEM right into the end of the base64url buffer and encode it in place */
     *ps64 = NULL;
+    if (!(bio = BIO_new(BIO_s_mem()))) {
+        return APR_ENOMEM;
+    }
+    ERR_clear_error();
+    PEM_write_bio_X509(bio, cert->x509);
+    if (ERR_get_error() == 0) {
+        i = BIO_pending(bio);
+        len = (i > 0)? (apr_size_t)i : 0;
+        s64 = apr_palloc(p, MD_BASE64URL_LEN(len) + 1);
+        if (i <= 0 || BIO_read(bio, s64 + MD_BASE64URL_INPLACE(len), i) == i) {
+            md_util_base64url_encode_to(s64, s64 + MD_BASE64URL_INPLACE(len), len);
+            *ps64 = s64;
+            rv = APR_SUCCESS;
+        }
+    }
+    BIO_free(bio);
     return rv;
 }
 
@@ -1039,6 +1644,256 @@ md_cert_state_t md_cert_state_get(md_cert_t *cert)
     return MD_CERT_UNKNOWN;
 }
 
+/**************************************************************************************************/
+/* intermediate certificate cache */
+
+/* The chains of many MDs share the same few intermediate certificates. With the cache
+ * enabled, certificates after the first one of a chain are looked up by the SHA-256 of
+ * their PEM encoding and only parsed when not seen before. Chains retrieved from a
+ * CA are also kept by the url they were found at, so that other MDs do not download
+ * them again. A CA may serve another chain at the same url later, so kept chains
+ * expire after a day, or earlier when one of their certificates does, and are only
+ * handed out for certificates issued by their first one. When full, the cache 
+ * starts over. */
+#define MD_CERT_CACHE_MAX       512
+#define MD_CERT_CHAIN_TTL       apr_time_from_sec(MD_SECS_PER_DAY)
+
+typedef struct {
+    apr_pool_t *p;                     /* pool of the cached certificates */
+    apr_hash_t *certs;                 /* sha256 hex of PEM -> md_cert_t* */
+    apr_hash_t *chains;                /* url -> cert_cache_chain_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} md_cert_cache_t;
+
+typedef struct {
+    apr_array_header_t *certs;         /* of md_cert_t* */
+    apr_time_t expires;
+} cert_cache_chain_t;
+
+static md_cert_cache_t *cert_cache;
+
+static void cert_cache_lock(md_cert_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    if (cache->mutex) apr_thread_mutex_lock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static void cert_cache_unlock(md_cert_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    if (cache->mutex) apr_thread_mutex_unlock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static apr_status_t cert_cache_cleanup(void *data)
+{
+    if (cert_cache == data) {
+        cert_cache = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/* call with lock held */
+static void cert_cache_make_room(md_cert_cache_t *cache)
+{
+    if (apr_hash_count(cache->certs) + apr_hash_count(cache->chains) >= MD_CERT_CACHE_MAX) {
+        apr_pool_clear(cache->p);
+        cache->certs = apr_hash_make(cache->p);
+        cache->chains = apr_hash_make(cache->p);
+    }
+}
+
+apr_status_t md_cert_cache_enable(apr_pool_t *p)
+{
+    md_cert_cache_t *cache;
+    apr_status_t rv;
+    
+    cache = apr_pcalloc(p, sizeof(*cache));
+    if (APR_SUCCESS != (rv = apr_pool_create(&cache->p, p))) {
+        return rv;
+    }
+    apr_pool_tag(cache->p, "md_cert_cache");
+    cache->certs = apr_hash_make(cache->p);
+    cache->chains = apr_hash_make(cache->p);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&cache->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        return rv;
+    }
+#endif
+    apr_pool_cleanup_register(p, cache, cert_cache_cleanup, apr_pool_cleanup_null);
+    cert_cache = cache;
+    return APR_SUCCESS;
+}
+
+static md_cert_t *cert_cache_parse(md_cert_cache_t *cache, const char *pem, apr_size_t len, 
+                                   int lookup, apr_pool_t *p)
+{
+    md_cert_t *cert = NULL, *cached;
+    const char *key = NULL;
+    X509 *x509;
+    BIO *bf;
+    
+    if (lookup && APR_SUCCESS == md_crypt_sha256_digest_hex(&key, p, pem, len)) {
+        cert_cache_lock(cache);
+        if ((cached = apr_hash_get(cache->certs, key, APR_HASH_KEY_STRING))) {
+            cert = md_cert_share(cached, p);
+        }
+        cert_cache_unlock(cache);
+        if (cert) {
+            return cert;
+        }
+    }
+    
+    if (NULL == (bf = BIO_new_mem_buf(pem, (int)len))) {
+        return NULL;
+    }
+    if (NULL != (x509 = PEM_read_bio_X509(bf, NULL, NULL, NULL))) {
+        cert = make_cert(p, x509);
+        if (key) {
+            cert_cache_lock(cache);
+            cert_cache_make_room(cache);
+            if (!apr_hash_get(cache->certs, key, APR_HASH_KEY_STRING)
+                && (cached = md_cert_share(cert, cache->p))) {
+                apr_hash_set(cache->certs, apr_pstrdup(cache->p, key), APR_HASH_KEY_STRING, 
+                             cached);
+            }
+            cert_cache_unlock(cache);
+        }
+    }
+    BIO_free(bf);
+    return cert;
+}
+
+#define PEM_CERT_BEGIN      "-----BEGIN CERTIFICATE-----"
+#define PEM_CERT_END        "-----END CERTIFICATE-----"
+
+/* Parse the certificates in pem using the cache, APR_ENOTIMPL if pem has more
+ * than certificates in it. */
+static apr_status_t cert_cache_chain_parse(md_cert_cache_t *cache, apr_array_header_t *certs, 
+                                           apr_pool_t *p, const char *pem, apr_size_t len)
+{
+    const char *s, *end, *pem_end = pem + len;
+    md_cert_t *cert;
+    int n = 0;
+    
+    if (memchr(pem, '\0', len)) {
+        return APR_ENOTIMPL;
+    }
+    for (s = strstr(pem, "-----BEGIN "); s && s < pem_end; s = strstr(end, "-----BEGIN ")) {
+        if (strncmp(PEM_CERT_BEGIN, s, sizeof(PEM_CERT_BEGIN) - 1) 
+            || !(end = strstr(s, PEM_CERT_END)) || end >= pem_end) {
+            return APR_ENOTIMPL;
+        }
+        end += sizeof(PEM_CERT_END) - 1;
+        /* the first is the MD's own certificate, no use in caching that */
+        if (!(cert = cert_cache_parse(cache, s, (apr_size_t)(end - s), n > 0, p))) {
+            return APR_EINVAL;
+        }
+        APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+        ++n;
+    }
+    return APR_SUCCESS;
+}
+
+int md_cert_cache_chain_get(apr_array_header_t *certs, const char *url, md_cert_t *issued,
+                            apr_pool_t *p)
+{
+    cert_cache_chain_t *chain;
+    md_cert_t *cert;
+    int i, n = 0;
+    
+    if (!cert_cache || !url || !issued) {
+        return 0;
+    }
+    cert_cache_lock(cert_cache);
+    if ((chain = apr_hash_get(cert_cache->chains, url, APR_HASH_KEY_STRING))) {
+        if (chain->expires <= apr_time_now() || chain->certs->nelts <= 0
+            || X509_V_OK != X509_check_issued(APR_ARRAY_IDX(chain->certs, 0, md_cert_t *)->x509,
+                                              issued->x509)) {
+            /* stale or for another issuer, fetch again */
+            apr_hash_set(cert_cache->chains, url, APR_HASH_KEY_STRING, NULL);
+            goto leave;
+        }
+        for (i = 0; i < chain->certs->nelts; ++i) {
+            if ((cert = md_cert_share(APR_ARRAY_IDX(chain->certs, i, md_cert_t *), p))) {
+                APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+                ++n;
+            }
+        }
+    }
+leave:
+    cert_cache_unlock(cert_cache);
+    return n;
+}
+
+void md_cert_cache_chain_set(const char *url, apr_array_header_t *certs, int offset)
+{
+    cert_cache_chain_t *chain;
+    md_cert_t *cert;
+    apr_time_t not_after;
+    int i;
+    
+    if (!cert_cache || !url || offset >= certs->nelts) {
+        return;
+    }
+    cert_cache_lock(cert_cache);
+    cert_cache_make_room(cert_cache);
+    chain = apr_pcalloc(cert_cache->p, sizeof(*chain));
+    chain->certs = apr_array_make(cert_cache->p, certs->nelts - offset, sizeof(md_cert_t *));
+    chain->expires = apr_time_now() + MD_CERT_CHAIN_TTL;
+    for (i = offset; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, md_cert_t *);
+        not_after = md_cert_get_not_after(cert);
+        if (not_after && not_after < chain->expires) {
+            chain->expires = not_after;
+        }
+        if ((cert = md_cert_share(cert, cert_cache->p))) {
+            APR_ARRAY_PUSH(chain->certs, md_cert_t *) = cert;
+        }
+    }
+    apr_hash_set(cert_cache->chains, apr_pstrdup(cert_cache->p, url), APR_HASH_KEY_STRING, 
+                 chain);
+    cert_cache_unlock(cert_cache);
+}
+
+static apr_status_t chain_fappend_cached(md_cert_cache_t *cache, apr_array_header_t *certs, 
+                                         apr_pool_t *p, const char *fname)
+{
+    apr_file_t *f;
+    apr_finfo_t info;
+    apr_size_t len;
+    char *pem;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_file_open(&f, fname, APR_FOPEN_READ, 0, p))) {
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = apr_file_info_get(&info, APR_FINFO_SIZE, f))) {
+        if (info.size > 1024 * 1024) {
+            rv = APR_ENOTIMPL;
+        }
+        else {
+            len = (apr_size_t)info.size;
+            pem = apr_palloc(p, len + 1);
+            rv = apr_file_read_full(f, pem, len, &len);
+            if (APR_SUCCESS == rv || APR_STATUS_IS_EOF(rv)) {
+                pem[len] = '\0';
+                rv = cert_cache_chain_parse(cache, certs, p, pem, len);
+            }
+        }
+    }
+    apr_file_close(f);
+    return rv;
+}
+
 apr_status_t md_chain_fappend(struct apr_array_header_t *certs, apr_pool_t *p, const char *fname)
 {
     FILE *f;
@@ -1046,6 +1901,19 @@ apr_status_t md_chain_fappend(struct apr_array_header_t *certs, apr_pool_t *p, c
     X509 *x509;
     md_cert_t *cert;
     unsigned long err;
+    int start = certs->nelts;
+    
+    if (cert_cache) {
+        rv = chain_fappend_cached(cert_cache, certs, p, fname);
+        if (APR_SUCCESS == rv && certs->nelts > start) {
+            goto out;
+        }
+        else if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOTIMPL(rv) && !APR_STATUS_IS_EINVAL(rv)) {
+            goto out;
+        }
+        /* leave anything unusual to OpenSSL */
+        certs->nelts = start;
+    }
     
     rv = md_util_fopen(&f, fname, "r");
     if (rv == APR_SUCCESS) {
@@ -1127,6 +1995,162 @@ apr_status_t md_chain_fsave(apr_array_header_t *certs, apr_pool_t *p,
     return rv;
 }
 
+/* The DER encodings of the certificates, one after the other. Reading this takes no 
+ * base64 decoding and no search for PEM boundaries, only the ASN.1 parsing. */
+typedef struct {
+    const char *der;
+    apr_size_t len;
+} der_buffer;
+
+static apr_status_t der_write(void *baton, apr_file_t *f, apr_pool_t *p)
+{
+    der_buffer *buffer = baton;
+    
+    (void)p;
+    return apr_file_write_full(f, buffer->der, buffer->len, NULL);
+}
+
+apr_status_t md_chain_fsave_der(apr_array_header_t *certs, apr_pool_t *p, 
+                                const char *fname, apr_fileperms_t perms)
+{
+    der_buffer buffer;
+    const md_cert_t *cert;
+    unsigned char *der, *s;
+    int i, len;
+    
+    buffer.len = 0;
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        if ((len = i2d_X509(cert->x509, NULL)) <= 0) {
+            return APR_EINVAL;
+        }
+        buffer.len += (apr_size_t)len;
+    }
+    s = der = apr_palloc(p, buffer.len + 1);
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        /* advances s behind the encoding */
+        if (i2d_X509(cert->x509, &s) <= 0) {
+            return APR_EINVAL;
+        }
+    }
+    buffer.der = (const char *)der;
+    return md_util_freplace(fname, perms, p, der_write, &buffer);
+}
+
+apr_status_t md_chain_fload_der(apr_array_header_t **pcerts, apr_pool_t *p, const char *fname)
+{
+    apr_array_header_t *certs;
+    apr_file_t *f;
+    apr_finfo_t info;
+    apr_size_t len;
+    const unsigned char *s, *end;
+    unsigned char *der;
+    X509 *x509;
+    apr_status_t rv;
+    
+    *pcerts = NULL;
+    if (APR_SUCCESS != (rv = apr_file_open(&f, fname, APR_FOPEN_READ|APR_FOPEN_BINARY, 0, p))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_file_info_get(&info, APR_FINFO_SIZE, f))) {
+        goto out;
+    }
+    if (info.size <= 0 || info.size > 1024 * 1024) {
+        rv = APR_EINVAL;
+        goto out;
+    }
+    len = (apr_size_t)info.size;
+    der = apr_palloc(p, len);
+    if (APR_SUCCESS != (rv = apr_file_read_full(f, der, len, &len))) {
+        goto out;
+    }
+    certs = apr_array_make(p, 5, sizeof(md_cert_t *));
+    for (s = der, end = der + len; s < end; ) {
+        /* advances s behind the parsed encoding */
+        if (NULL == (x509 = d2i_X509(NULL, &s, (long)(end - s)))) {
+            rv = APR_EINVAL;
+            goto out;
+        }
+        APR_ARRAY_PUSH(certs, md_cert_t *) = make_cert(p, x509);
+    }
+    *pcerts = certs;
+out:
+    apr_file_close(f);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, p, "read DER chain file %s", fname);
+    return rv;
+}
+
+apr_status_t md_chain_to_pem(const char **ppem, apr_size_t *plen, 
+                             apr_array_header_t *certs, apr_pool_t *p)
+{
+    BIO *bio;
+    const md_cert_t *cert;
+    char *data = NULL;
+    int i, n;
+    
+    *ppem = NULL;
+    *plen = 0;
+    if (NULL == (bio = BIO_new(BIO_s_mem()))) {
+        return APR_ENOMEM;
+    }
+    ERR_clear_error();
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        assert(cert->x509);
+        PEM_write_bio_X509(bio, cert->x509);
+    }
+    if (ERR_get_error() > 0) {
+        BIO_free(bio);
+        return APR_EINVAL;
+    }
+    
+    n = BIO_pending(bio);
+    data = apr_palloc(p, (apr_size_t)(n > 0? n : 0) + 1);
+    n = (n > 0)? BIO_read(bio, data, n) : 0;
+    data[n > 0? n : 0] = '\0';
+    BIO_free(bio);
+    
+    *ppem = data;
+    *plen = (apr_size_t)(n > 0? n : 0);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_chain_from_pem(apr_array_header_t **pcerts, apr_pool_t *p, 
+                               const char *pem, apr_size_t len)
+{
+    apr_array_header_t *certs;
+    BIO *bf;
+    X509 *x509;
+    unsigned long err;
+    
+    *pcerts = NULL;
+    if (len > INT_MAX) {
+        return APR_EINVAL;
+    }
+    certs = apr_array_make(p, 5, sizeof(md_cert_t *));
+    if (len == 0) {
+        *pcerts = certs;
+        return APR_SUCCESS;
+    }
+    if (NULL == (bf = BIO_new_mem_buf(pem, (int)len))) {
+        return APR_ENOMEM;
+    }
+    ERR_clear_error();
+    while (NULL != (x509 = PEM_read_bio_X509(bf, NULL, NULL, NULL))) {
+        APR_ARRAY_PUSH(certs, md_cert_t *) = make_cert(p, x509);
+    }
+    BIO_free(bf);
+    
+    if (0 < (err =  ERR_get_error())
+        && !(ERR_GET_LIB(err) == ERR_LIB_PEM && ERR_GET_REASON(err) == PEM_R_NO_START_LINE)) {
+        /* not the expected one when no more PEM encodings are found */
+        return APR_EINVAL;
+    }
+    *pcerts = certs;
+    return APR_SUCCESS;
+}
+
 /**************************************************************************************************/
 /* certificate signing requests */
 
@@ -1236,7 +2260,8 @@ static apr_status_t add_must_staple(STACK_OF(X509_EXTENSION) *exts, const md_t *
 apr_status_t md_cert_req_create(const char **pcsr_der_64, const md_t *md, 
                                 md_pkey_t *pkey, apr_pool_t *p)
 {
-    const char *s, *csr_der, *csr_der_64 = NULL;
+    const char *s, *csr_der;
+    char *csr_der_64 = NULL;
     const unsigned char *domain;
     X509_REQ *csr;
     X509_NAME *n = NULL;
@@ -1293,12 +2318,15 @@ apr_status_t md_cert_req_create(const char **pcsr_der_64, const md_t *md,
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: der length", md->name);
         rv = APR_EGENERAL; goto out;
     }
-    s = csr_der = apr_pcalloc(p, (apr_size_t)csr_der_len + 1);
+    /* der encode at the end of the base64url buffer and encode it in place */
+    csr_der_64 = apr_palloc(p, MD_BASE64URL_LEN((apr_size_t)csr_der_len) + 1);
+    s = csr_der = csr_der_64 + MD_BASE64URL_INPLACE((apr_size_t)csr_der_len);
     if (i2d_X509_REQ(csr, (unsigned char**)&s) != csr_der_len) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: csr der enc", md->name);
+        csr_der_64 = NULL;
         rv = APR_EGENERAL; goto out;
     }
-    csr_der_64 = md_util_base64url_encode(csr_der, (apr_size_t)csr_der_len, p);
+    md_util_base64url_encode_to(csr_der_64, csr_der, (apr_size_t)csr_der_len);
     rv = APR_SUCCESS;
     
 out:
@@ -24,12 +24,21 @@ struct md_t;
 struct md_http_response_t;
 struct md_cert_t;
 struct md_pkey_t;
+struct asn1_string_st;
 
 /**************************************************************************************************/
 /* random */
 
 apr_status_t md_rand_bytes(unsigned char *buf, apr_size_t len, apr_pool_t *p);
 
+/**************************************************************************************************/
+/* date time things */
+
+/**
+ * Get the apr time from an ASN1_TIME, as found in certificates and OCSP responses.
+ */
+apr_time_t md_asn1_time_get(const struct asn1_string_st *time);
+
 /**************************************************************************************************/
 /* digests */
 apr_status_t md_crypt_sha256_digest64(const char **pdigest64, apr_pool_t *p, 
@@ -45,27 +54,58 @@ typedef struct md_pkey_t md_pkey_t;
 typedef enum {
     MD_PKEY_TYPE_DEFAULT,
     MD_PKEY_TYPE_RSA,
+    MD_PKEY_TYPE_EC,
 } md_pkey_type_t;
 
 typedef struct md_pkey_rsa_spec_t {
     apr_uint32_t bits;
 } md_pkey_rsa_spec_t;
 
+typedef struct md_pkey_ec_spec_t {
+    const char *curve;              /* JOSE name of the curve, e.g. "P-256" */
+} md_pkey_ec_spec_t;
+
 typedef struct md_pkey_spec_t {
     md_pkey_type_t type;
     union {
         md_pkey_rsa_spec_t rsa;
+        md_pkey_ec_spec_t ec;
     } params;
 } md_pkey_spec_t;
 
+/**
+ * Get the JOSE name ("P-256", "P-384") of a supported EC curve, given by that
+ * or its SECG/X9.62 name, or NULL if the curve is not supported.
+ */
+const char *md_pkey_ec_curve_name(const char *name);
+
 apr_status_t md_crypt_init(apr_pool_t *pool);
 
 apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec);
 void md_pkey_free(md_pkey_t *pkey);
 
+md_pkey_type_t md_pkey_get_type(md_pkey_t *pkey);
+
 const char *md_pkey_get_rsa_e64(md_pkey_t *pkey, apr_pool_t *p);
 const char *md_pkey_get_rsa_n64(md_pkey_t *pkey, apr_pool_t *p);
 
+/**
+ * Get the curve (JOSE name) and the base64url encoded coordinates of the 
+ * public point of an EC key, as used in a JWK.
+ */
+apr_status_t md_pkey_get_ec_params(md_pkey_t *pkey, apr_pool_t *p, const char **pcurve, 
+                                   const char **px64, const char **py64);
+
+/**
+ * Enable a process wide cache of private keys decrypted with a pass phrase for the
+ * lifetime of pool p, or disable it with a ttl of 0. Loading such a key again within 
+ * ttl gives the same key, unless its file changed. md_pkey_cache_clear() forgets all,
+ * md_pkey_cache_forget() the key of one file, e.g. when it is written.
+ */
+apr_status_t md_pkey_cache_enable(apr_pool_t *p, apr_interval_time_t ttl);
+void md_pkey_cache_clear(void);
+void md_pkey_cache_forget(const char *fname);
+
 apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p, 
                            const char *pass_phrase, apr_size_t pass_len,
                            const char *fname);
@@ -73,16 +113,52 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
                            const char *pass_phrase, apr_size_t pass_len, 
                            const char *fname, apr_fileperms_t perms);
 
+/**
+ * The PEM encoding of the key in memory, as md_pkey_fsave() writes it to a file. 
+ */
+apr_status_t md_pkey_to_pem(const char **ppem, apr_size_t *plen, md_pkey_t *pkey, apr_pool_t *p,
+                            const char *pass_phrase, apr_size_t pass_len);
+apr_status_t md_pkey_from_pem(md_pkey_t **ppkey, apr_pool_t *p, const char *pem, apr_size_t len,
+                              const char *pass_phrase, apr_size_t pass_len);
+
+/**
+ * Sign the data with the key, using SHA-256 for RSA and the digest matching the
+ * curve for EC keys. EC signatures are in the JWS format, the concatenated R and S. 
+ * The signing context is kept with the key and reused for its next signature.
+ */
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
                              const char *d, size_t dlen);
 
 void *md_cert_get_X509(struct md_cert_t *cert);
 void *md_pkey_get_EVP_PKEY(struct md_pkey_t *pkey);
 
+/**
+ * Get another reference to the same key or certificate that stays valid for the
+ * lifetime of pool p, independent of the original. Returns NULL when freed already.
+ */
+struct md_pkey_t *md_pkey_share(struct md_pkey_t *pkey, apr_pool_t *p);
+
+/**
+ * Values derived from a key, like its JSON Web Key, can be kept with the key
+ * under a name for as long as it lives, so they need not be computed again.
+ * The data must be allocated from md_pkey_get_pool(). Like all use of a key,
+ * this is not thread safe. Shared keys do not see each others values.
+ */
+void *md_pkey_derived_get(md_pkey_t *pkey, const char *name);
+void md_pkey_derived_set(md_pkey_t *pkey, const char *name, void *data);
+apr_pool_t *md_pkey_get_pool(md_pkey_t *pkey);
+struct md_cert_t *md_cert_share(struct md_cert_t *cert, apr_pool_t *p);
+
 struct md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p);
 md_pkey_spec_t *md_pkey_spec_from_json(struct md_json_t *json, apr_pool_t *p);
 int md_pkey_spec_eq(md_pkey_spec_t *spec1, md_pkey_spec_t *spec2);
 
+/**
+ * Get a short name for the spec, suitable for file names, e.g. "rsa-2048".
+ * A NULL or default spec gives the name of the key type used for it.
+ */
+const char *md_pkey_spec_name(const md_pkey_spec_t *spec, apr_pool_t *p);
+
 /**************************************************************************************************/
 /* X509 certificates */
 
@@ -122,11 +198,13 @@ int md_cert_is_valid_now(const md_cert_t *cert);
 int md_cert_has_expired(const md_cert_t *cert);
 int md_cert_covers_domain(md_cert_t *cert, const char *domain_name);
 int md_cert_covers_md(md_cert_t *cert, const struct md_t *md);
+int md_cert_matches_pkey(md_cert_t *cert, struct md_pkey_t *pkey);
 int md_cert_must_staple(md_cert_t *cert);
 apr_time_t md_cert_get_not_after(md_cert_t *cert);
 apr_time_t md_cert_get_not_before(md_cert_t *cert);
 
 apr_status_t md_cert_get_issuers_uri(const char **puri, md_cert_t *cert, apr_pool_t *p);
+apr_status_t md_cert_get_ocsp_uri(const char **puri, md_cert_t *cert, apr_pool_t *p);
 apr_status_t md_cert_get_alt_names(apr_array_header_t **pnames, md_cert_t *cert, apr_pool_t *p);
 
 apr_status_t md_cert_to_base64url(const char **ps64, md_cert_t *cert, apr_pool_t *p);
@@ -139,6 +217,44 @@ apr_status_t md_chain_fsave(struct apr_array_header_t *certs,
 apr_status_t md_chain_fappend(struct apr_array_header_t *certs, 
                               apr_pool_t *p, const char *fname);
 
+/**
+ * Save/load certificates as their DER encodings, one after the other. This is faster
+ * to load than PEM and meant for copies of PEM files that are kept alongside.
+ */
+apr_status_t md_chain_fsave_der(struct apr_array_header_t *certs, 
+                                apr_pool_t *p, const char *fname, apr_fileperms_t perms);
+apr_status_t md_chain_fload_der(struct apr_array_header_t **pcerts, 
+                                apr_pool_t *p, const char *fname);
+
+/**
+ * The PEM encoding of the certificates in memory, as md_chain_fsave() writes them to a file. 
+ */
+apr_status_t md_chain_to_pem(const char **ppem, apr_size_t *plen, 
+                             struct apr_array_header_t *certs, apr_pool_t *p);
+apr_status_t md_chain_from_pem(struct apr_array_header_t **pcerts, apr_pool_t *p, 
+                               const char *pem, apr_size_t len);
+
+/**
+ * Enable a process wide cache of intermediate certificates for the lifetime of pool p.
+ * Loading a chain then parses only the certificates not seen before, all others
+ * are shared with the chains loaded earlier.
+ */
+apr_status_t md_cert_cache_enable(apr_pool_t *p);
+
+/**
+ * Append the certificates cached for url to certs, returns the number appended.
+ * Without the cache enabled, nothing known for url, a chain that has expired or whose
+ * first certificate did not issue cert issued, this is 0.
+ */
+int md_cert_cache_chain_get(struct apr_array_header_t *certs, const char *url, 
+                            md_cert_t *issued, apr_pool_t *p);
+
+/**
+ * Remember the certificates from offset on as the chain found at url. It is kept
+ * for a day at most and not beyond the expiry of any of its certificates.
+ */
+void md_cert_cache_chain_set(const char *url, struct apr_array_header_t *certs, int offset);
+
 apr_status_t md_cert_req_create(const char **pcsr_der_64, const struct md_t *md, 
                                 md_pkey_t *pkey, apr_pool_t *p);
 
@@ -19,8 +19,10 @@
 #include <curl/curl.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
+#include <apr_thread_mutex.h>
 
 #include "md_http.h"
 #include "md_log.h"
@@ -49,6 +51,22 @@ static apr_status_t curl_status(int curl_code)
     }
 }
 
+typedef struct {
+    md_http_request_t **reqs;           /* requests of the batch, NULL once done */
+    int pending;                        /* number of requests not done yet */
+    apr_status_t rv;                    /* status of the first failed request */
+} md_curl_batch_t;
+
+typedef struct {
+    CURL *curl;
+    CURLM *multi;                       /* multi handle the request was added to */
+    struct curl_slist *req_hdrs;
+    md_http_response_t *response;
+    apr_off_t body_len;                 /* response body bytes received so far */
+    md_curl_batch_t *batch;
+    int batch_idx;
+} md_curl_internals_t;
+
 static size_t req_data_cb(void *data, size_t len, size_t nmemb, void *baton)
 {
     apr_bucket_brigade *body = baton;
@@ -92,23 +110,24 @@ static size_t req_data_cb(void *data, size_t len, size_t nmemb, void *baton)
 
 static size_t resp_data_cb(void *data, size_t len, size_t nmemb, void *baton)
 {
-    md_http_response_t *res = baton;
+    md_curl_internals_t *internals = baton;
+    md_http_response_t *res = internals->response;
     size_t blen = len * nmemb;
     apr_status_t rv;
     
     if (res->body) {
-        if (res->req->resp_limit) {
-            apr_off_t body_len = 0;
-            apr_brigade_length(res->body, 0, &body_len);
-            if (body_len + (apr_off_t)len > res->req->resp_limit) {
-                return 0; /* signal curl failure */
-            }
+        /* counted here, as measuring the brigade on every call makes large
+         * responses quadratic in the number of buckets */
+        if (res->req->resp_limit 
+            && internals->body_len + (apr_off_t)blen > res->req->resp_limit) {
+            return 0; /* signal curl failure */
         }
         rv = apr_brigade_write(res->body, NULL, NULL, (const char *)data, blen);
         if (rv != APR_SUCCESS) {
             /* returning anything != blen will make CURL fail this */
             return 0;
         }
+        internals->body_len += (apr_off_t)blen;
     }
     return blen;
 }
@@ -142,8 +161,143 @@ static size_t header_cb(void *buffer, size_t elen, size_t nmemb, void *baton)
     return clen;
 }
 
+/**************************************************************************************************/
+/* process wide share of DNS and TLS session caches */
+
+/* A multi handle lives only as long as its md_http_t, which is one per MD drive. 
+ * All easy handles of the process are therefore also attached to one curl share, 
+ * so that a renewal run does not resolve the CA and do full handshakes with it again
+ * for every MD. curl calls the lock functions for each kind of data it shares. 
+ * Connections are not shared: drives run in parallel threads, each with its own 
+ * multi handle, and curl does not support one connection cache used by several 
+ * of those at the same time. Each multi handle reuses its own connections. */
+
+typedef struct {
+    apr_pool_t *pool;
+    CURLSH *share;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *locks[CURL_LOCK_DATA_LAST];
+#endif
+} curl_share_t;
+
+static curl_share_t *curl_share;
+
+static apr_interval_time_t connect_timeout;
+static apr_interval_time_t stall_timeout;
+static apr_interval_time_t keepalive;
+
+void md_curl_timeouts_set(apr_interval_time_t connect, apr_interval_time_t stall,
+                          apr_interval_time_t keep_alive)
+{
+    connect_timeout = connect;
+    stall_timeout = stall;
+    keepalive = keep_alive;
+}
+
+static void share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *baton)
+{
+    curl_share_t *cs = baton;
+
+    (void)curl;
+    (void)access;
+#if APR_HAS_THREADS
+    if (data < CURL_LOCK_DATA_LAST && cs->locks[data]) {
+        apr_thread_mutex_lock(cs->locks[data]);
+    }
+#else
+    (void)cs;
+    (void)data;
+#endif
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *baton)
+{
+    curl_share_t *cs = baton;
+
+    (void)curl;
+#if APR_HAS_THREADS
+    if (data < CURL_LOCK_DATA_LAST && cs->locks[data]) {
+        apr_thread_mutex_unlock(cs->locks[data]);
+    }
+#else
+    (void)cs;
+    (void)data;
+#endif
+}
+
+static apr_status_t share_cleanup(void *data)
+{
+    curl_share_t *cs = data;
+    
+    if (cs->share) {
+        curl_share_cleanup(cs->share);
+        cs->share = NULL;
+    }
+    if (curl_share == cs) {
+        curl_share = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t share_init(apr_pool_t *p)
+{
+    curl_share_t *cs;
+    apr_status_t rv = APR_SUCCESS;
+#if APR_HAS_THREADS
+    int i;
+#endif
+
+    if (curl_share || !p) return APR_SUCCESS;
+    
+    cs = apr_pcalloc(p, sizeof(*cs));
+    cs->pool = p;
+#if APR_HAS_THREADS
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+        if (APR_SUCCESS != (rv = apr_thread_mutex_create(&cs->locks[i], 
+                                                         APR_THREAD_MUTEX_DEFAULT, p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "creating curl share locks");
+            return rv;
+        }
+    }
+#endif
+    if (NULL == (cs->share = curl_share_init())) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "creating curl share");
+        return APR_EGENERAL;
+    }
+    curl_share_setopt(cs->share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(cs->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(cs->share, CURLSHOPT_USERDATA, cs);
+    curl_share_setopt(cs->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(cs->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    apr_pool_cleanup_register(p, cs, share_cleanup, apr_pool_cleanup_null);
+    curl_share = cs;
+    return rv;
+}
+
+/**************************************************************************************************/
+/* requests */
+
+/* Requests are run via a curl multi handle that is kept with the md_http_t instance. 
+ * Subsequent requests to the same CA reuse its connections. Where curl supports it, requests to the same host are 
+ * multiplexed over a HTTP/2 connection. */
+
+
+static CURLM *multi_get(md_http_t *http)
+{
+    CURLM *multi = md_http_get_internals(http);
+    
+    if (!multi && NULL != (multi = curl_multi_init())) {
+#ifdef CURLPIPE_MULTIPLEX
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+        md_http_set_internals(http, multi);
+    }
+    return multi;
+}
+
 static apr_status_t curl_init(md_http_request_t *req)
 {
+    md_curl_internals_t *internals;
     CURL *curl = curl_easy_init();
     if (!curl) {
         return APR_EGENERAL;
@@ -155,8 +309,31 @@ static apr_status_t curl_init(md_http_request_t *req)
     curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_data_cb);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, req);
+#ifdef CURLPIPE_MULTIPLEX
+    /* rather wait for a connection that can be multiplexed than open another one */
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+    if (curl_share && curl_share->share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, curl_share->share);
+    }
+    if (connect_timeout > 0) {
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)apr_time_as_msec(connect_timeout));
+    }
+    if (stall_timeout > 0) {
+        /* abort transfers that make no progress at all for that long */
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)apr_time_sec(stall_timeout));
+    }
+    if (keepalive > 0) {
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, (long)apr_time_sec(keepalive));
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, (long)apr_time_sec(keepalive));
+    }
     
-    req->internals = curl;
+    internals = apr_pcalloc(req->pool, sizeof(*internals));
+    internals->curl = curl;
+    req->internals = internals;
     return APR_SUCCESS;
 }
 
@@ -181,16 +358,16 @@ static int curlify_headers(void *baton, const char *key, const char *value)
     return 1;
 }
 
-static apr_status_t curl_perform(md_http_request_t *req)
+static apr_status_t req_setup(md_http_request_t *req)
 {
     apr_status_t rv = APR_SUCCESS;
-    CURLcode curle;
+    md_curl_internals_t *internals;
     md_http_response_t *res;
     CURL *curl;
-    struct curl_slist *req_hdrs = NULL;
 
     if (APR_SUCCESS != (rv = curl_init(req))) return rv;
-    curl = req->internals;
+    internals = req->internals;
+    curl = internals->curl;
     
     res = apr_pcalloc(req->pool, sizeof(*res));
     
@@ -199,6 +376,7 @@ static apr_status_t curl_perform(md_http_request_t *req)
     res->status = 400;
     res->headers = apr_table_make(req->pool, 5);
     res->body = apr_brigade_create(req->pool, req->bucket_alloc);
+    internals->response = res;
     
     curl_easy_setopt(curl, CURLOPT_URL, req->url);
     if (!apr_strnatcasecmp("GET", req->method)) {
@@ -215,7 +393,7 @@ static apr_status_t curl_perform(md_http_request_t *req)
     }
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, res);
     curl_easy_setopt(curl, CURLOPT_READDATA, req->body);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, res);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, internals);
     
     if (req->user_agent) {
         curl_easy_setopt(curl, CURLOPT_USERAGENT, req->user_agent);
@@ -230,9 +408,9 @@ static apr_status_t curl_perform(md_http_request_t *req)
         ctx.hdrs = NULL;
         ctx.rv = APR_SUCCESS;
         apr_table_do(curlify_headers, &ctx, req->headers, NULL);
-        req_hdrs = ctx.hdrs;
+        internals->req_hdrs = ctx.hdrs;
         if (ctx.rv == APR_SUCCESS) {
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req_hdrs);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, internals->req_hdrs);
         }
     }
     
@@ -242,13 +420,20 @@ static apr_status_t curl_perform(md_http_request_t *req)
     if (md_log_is_level(req->pool, MD_LOG_TRACE3)) {
         curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
     }
+    return rv;
+}
+
+static apr_status_t req_done(md_http_request_t *req, CURLcode curle)
+{
+    md_curl_internals_t *internals = req->internals;
+    md_http_response_t *res = internals->response;
+    md_curl_batch_t *batch = internals->batch;
+    apr_status_t rv;
     
-    curle = curl_easy_perform(curl);
     res->rv = curl_status(curle);
-    
     if (APR_SUCCESS == res->rv) {
         long l;
-        res->rv = curl_status(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &l));
+        res->rv = curl_status(curl_easy_getinfo(internals->curl, CURLINFO_RESPONSE_CODE, &l));
         if (APR_SUCCESS == res->rv) {
             res->status = (int)l;
         }
@@ -266,19 +451,121 @@ static apr_status_t curl_perform(md_http_request_t *req)
     }
     
     rv = res->rv;
+    if (batch) {
+        batch->reqs[internals->batch_idx] = NULL;
+        --batch->pending;
+        if (APR_SUCCESS == batch->rv) {
+            batch->rv = rv;
+        }
+    }
     md_http_req_destroy(req);
-    if (req_hdrs) {
-        curl_slist_free_all(req_hdrs);
+    return rv;
+}
+
+static apr_status_t batch_perform(md_http_t *http, md_http_request_t **reqs, int nreqs)
+{
+    md_curl_batch_t batch;
+    md_curl_internals_t *internals;
+    md_http_request_t *req;
+    CURLMcode mc = CURLM_OK;
+    CURLMsg *msg;
+    CURLM *multi;
+    char *priv;
+    int i, running, left;
+    
+    batch.reqs = reqs;
+    batch.pending = 0;
+    batch.rv = APR_SUCCESS;
+    
+    multi = multi_get(http);
+    for (i = 0; i < nreqs; ++i) {
+        req = reqs[i];
+        if (!multi || APR_SUCCESS != req_setup(req)) {
+            reqs[i] = NULL;
+            md_http_req_destroy(req);
+            if (APR_SUCCESS == batch.rv) {
+                batch.rv = APR_EGENERAL;
+            }
+            continue;
+        }
+        internals = req->internals;
+        internals->batch = &batch;
+        internals->batch_idx = i;
+        ++batch.pending;
+        if (CURLM_OK != (mc = curl_multi_add_handle(multi, internals->curl))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_EGENERAL, req->pool, 
+                          "adding request to curl multi handle: %s", 
+                          curl_multi_strerror(mc));
+            req_done(req, CURLE_FAILED_INIT);
+            continue;
+        }
+        internals->multi = multi;
+    }
+    
+    while (batch.pending > 0) {
+        if (CURLM_OK != (mc = curl_multi_perform(multi, &running))) {
+            break;
+        }
+        /* Done requests may be from another batch, when callbacks perform requests 
+         * of their own. Each request is accounted for with the batch it belongs to. */
+        while (NULL != (msg = curl_multi_info_read(multi, &left))) {
+            if (CURLMSG_DONE == msg->msg) {
+                priv = NULL;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+                if (priv) {
+                    req_done((md_http_request_t *)priv, msg->data.result);
+                }
+            }
+        }
+        if (batch.pending > 0 && running > 0
+            && CURLM_OK != (mc = curl_multi_wait(multi, NULL, 0, 1000, NULL))) {
+            break;
+        }
+    }
+    
+    for (i = 0; batch.pending > 0 && i < nreqs; ++i) {
+        if (reqs[i]) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EGENERAL, reqs[i]->pool, 
+                          "curl multi handle failed: %s", curl_multi_strerror(mc));
+            req_done(reqs[i], CURLE_FAILED_INIT);
+        }
     }
+    return batch.rv;
+}
+
+static apr_status_t curl_perform(md_http_request_t *req)
+{
+    md_http_request_t *reqs[1];
     
+    reqs[0] = req;
+    return batch_perform(req->http, reqs, 1);
+}
+
+static apr_status_t curl_multi_perform_reqs(md_http_t *http, apr_array_header_t *reqs)
+{
+    md_http_request_t **batch_reqs;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (reqs->nelts <= 0) {
+        return APR_SUCCESS;
+    }
+    /* the batch keeps track of its requests in a copy of the array */
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, reqs->pool))) {
+        return rv;
+    }
+    batch_reqs = apr_pmemdup(ptemp, reqs->elts, (apr_size_t)reqs->nelts * sizeof(*batch_reqs));
+    rv = batch_perform(http, batch_reqs, reqs->nelts);
+    apr_pool_destroy(ptemp);
     return rv;
 }
 
-static int initialized;
+static volatile apr_uint32_t initialized;
 
+/* curl_global_init() is not thread-safe. md_curl_get_impl() triggers it while the 
+ * process is single threaded, later calls from md_http_create() only see it done. */
 static apr_status_t md_curl_init(void) {
-    if (!initialized) {
-        initialized = 1;
+    if (apr_atomic_cas32(&initialized, 1, 0) == 0) {
         curl_global_init(CURL_GLOBAL_DEFAULT);
     }
     return APR_SUCCESS;
@@ -286,22 +573,42 @@ static apr_status_t md_curl_init(void) {
 
 static void curl_req_cleanup(md_http_request_t *req) 
 {
-    if (req->internals) {
-        curl_easy_cleanup(req->internals);
+    md_curl_internals_t *internals = req->internals;
+    
+    if (internals) {
+        if (internals->multi) {
+            curl_multi_remove_handle(internals->multi, internals->curl);
+        }
+        curl_easy_cleanup(internals->curl);
+        if (internals->req_hdrs) {
+            curl_slist_free_all(internals->req_hdrs);
+        }
         req->internals = NULL;
     }
 }
 
+static void curl_cleanup(md_http_t *http) 
+{
+    CURLM *multi = md_http_get_internals(http);
+    
+    if (multi) {
+        curl_multi_cleanup(multi);
+        md_http_set_internals(http, NULL);
+    }
+}
+
 static md_http_impl_t impl = {
     md_curl_init,
     curl_req_cleanup,
-    curl_perform
+    curl_perform,
+    curl_multi_perform_reqs,
+    curl_cleanup,
 };
 
 md_http_impl_t * md_curl_get_impl(apr_pool_t *p)
 {
     /* trigger early global curl init, before we are down a rabbit hole */
-    (void)p;
     md_curl_init();
+    share_init(p);
     return &impl;
 }
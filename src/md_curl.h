@@ -19,6 +19,17 @@
 
 struct md_http_impl;
 
+/**
+ * Get the curl implementation of md_http. All requests made with it share the DNS,
+ * TLS session and connection cache of curl, held in pool p.
+ */
 struct md_http_impl_t * md_curl_get_impl(apr_pool_t *p);
 
+/**
+ * Set the connect timeout, the time a transfer may make no progress and the TCP
+ * keepalive interval of all curl requests. A value of 0 leaves the curl default.
+ */
+void md_curl_timeouts_set(apr_interval_time_t connect, apr_interval_time_t stall,
+                          apr_interval_time_t keep_alive);
+
 #endif /* md_curl_h */
@@ -30,6 +30,7 @@ struct md_http_t {
     md_http_impl_t *impl;
     const char *user_agent;
     const char *proxy_url;
+    void *internals;
 };
 
 static md_http_impl_t *cur_impl;
@@ -43,6 +44,17 @@ void md_http_use_implementation(md_http_impl_t *impl)
     }
 }
 
+static apr_status_t http_cleanup(void *data)
+{
+    md_http_t *http = data;
+    
+    if (http->internals && http->impl->cleanup) {
+        http->impl->cleanup(http);
+    }
+    http->internals = NULL;
+    return APR_SUCCESS;
+}
+
 apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_agent,
                             const char *proxy_url)
 {
@@ -72,6 +84,7 @@ apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_a
     if (!http->bucket_alloc) {
         return APR_EGENERAL;
     }
+    apr_pool_cleanup_register(p, http, http_cleanup, apr_pool_cleanup_null);
     *phttp = http;
     return APR_SUCCESS;
 }
@@ -81,6 +94,16 @@ void md_http_set_response_limit(md_http_t *http, apr_off_t resp_limit)
     http->resp_limit = resp_limit;
 }
 
+void *md_http_get_internals(md_http_t *http)
+{
+    return http->internals;
+}
+
+void md_http_set_internals(md_http_t *http, void *internals)
+{
+    http->internals = internals;
+}
+
 static apr_status_t req_create(md_http_request_t **preq, md_http_t *http, 
                                const char *method, const char *url, struct apr_table_t *headers,
                                md_http_cb *cb, void *baton)
@@ -120,8 +143,8 @@ void md_http_req_destroy(md_http_request_t *req)
     apr_pool_destroy(req->pool);
 }
 
-static apr_status_t schedule(md_http_request_t *req, 
-                             apr_bucket_brigade *body, int detect_clen) 
+static apr_status_t req_prepare(md_http_request_t *req, 
+                                apr_bucket_brigade *body, int detect_clen) 
 {
     apr_status_t rv;
     
@@ -142,10 +165,58 @@ static apr_status_t schedule(md_http_request_t *req,
     else if (req->body_len > 0) {
         apr_table_setn(req->headers, "Content-Length", apr_off_t_toa(req->pool, req->body_len));
     }
+    return APR_SUCCESS;
+}
+
+static apr_status_t schedule(md_http_request_t *req, 
+                             apr_bucket_brigade *body, int detect_clen) 
+{
+    apr_status_t rv;
     
+    if (APR_SUCCESS != (rv = req_prepare(req, body, detect_clen))) {
+        return rv;
+    }
+    return req->http->impl->perform(req);
+}
+
+apr_status_t md_http_perform(md_http_request_t *req)
+{
     return req->http->impl->perform(req);
 }
 
+apr_status_t md_http_multi_perform(md_http_t *http, apr_array_header_t *reqs)
+{
+    md_http_request_t *req;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int i;
+    
+    if (http->impl->multi_perform) {
+        return http->impl->multi_perform(http, reqs);
+    }
+    for (i = 0; i < reqs->nelts; ++i) {
+        req = APR_ARRAY_IDX(reqs, i, md_http_request_t *);
+        rv2 = http->impl->perform(req);
+        if (APR_SUCCESS == rv) {
+            rv = rv2;
+        }
+    }
+    return rv;
+}
+
+apr_status_t md_http_GET_create(md_http_request_t **preq, md_http_t *http, 
+                                const char *url, struct apr_table_t *headers,
+                                md_http_cb *cb, void *baton)
+{
+    apr_status_t rv;
+    
+    *preq = NULL;
+    if (APR_SUCCESS == (rv = req_create(preq, http, "GET", url, headers, cb, baton))
+        && APR_SUCCESS != (rv = req_prepare(*preq, NULL, 0))) {
+        *preq = NULL;
+    }
+    return rv;
+}
+
 apr_status_t md_http_GET(struct md_http_t *http, 
                          const char *url, struct apr_table_t *headers,
                          md_http_cb *cb, void *baton)
@@ -153,12 +224,12 @@ apr_status_t md_http_GET(struct md_http_t *http,
     md_http_request_t *req;
     apr_status_t rv;
     
-    rv = req_create(&req, http, "GET", url, headers, cb, baton);
+    rv = md_http_GET_create(&req, http, url, headers, cb, baton);
     if (rv != APR_SUCCESS) {
         return rv;
     }
     
-    return schedule(req, NULL, 0);
+    return req->http->impl->perform(req);
 }
 
 apr_status_t md_http_HEAD(struct md_http_t *http, 
@@ -168,12 +239,26 @@ apr_status_t md_http_HEAD(struct md_http_t *http,
     md_http_request_t *req;
     apr_status_t rv;
     
-    rv = req_create(&req, http, "HEAD", url, headers, cb, baton);
+    rv = md_http_HEAD_create(&req, http, url, headers, cb, baton);
     if (rv != APR_SUCCESS) {
         return rv;
     }
     
-    return schedule(req, NULL, 0);
+    return req->http->impl->perform(req);
+}
+
+apr_status_t md_http_HEAD_create(md_http_request_t **preq, md_http_t *http, 
+                                 const char *url, struct apr_table_t *headers,
+                                 md_http_cb *cb, void *baton)
+{
+    apr_status_t rv;
+    
+    *preq = NULL;
+    if (APR_SUCCESS == (rv = req_create(preq, http, "HEAD", url, headers, cb, baton))
+        && APR_SUCCESS != (rv = req_prepare(*preq, NULL, 0))) {
+        *preq = NULL;
+    }
+    return rv;
 }
 
 apr_status_t md_http_POST(struct md_http_t *http, const char *url, 
@@ -195,23 +280,25 @@ apr_status_t md_http_POST(struct md_http_t *http, const char *url,
     return schedule(req, body, 1);
 }
 
-apr_status_t md_http_POSTd(md_http_t *http, const char *url, 
-                           struct apr_table_t *headers, const char *content_type, 
-                           const char *data, size_t data_len, 
-                           md_http_cb *cb, void *baton)
+apr_status_t md_http_POSTw_create(md_http_request_t **preq, md_http_t *http, 
+                                  const char *url, struct apr_table_t *headers, 
+                                  const char *content_type, 
+                                  md_http_body_cb *body_cb, void *body_baton, 
+                                  md_http_cb *cb, void *baton)
 {
     md_http_request_t *req;
     apr_status_t rv;
     apr_bucket_brigade *body = NULL;
     
+    *preq = NULL;
     rv = req_create(&req, http, "POST", url, headers, cb, baton);
     if (rv != APR_SUCCESS) {
         return rv;
     }
 
-    if (data && data_len > 0) {
+    if (body_cb) {
         body = apr_brigade_create(req->pool, req->http->bucket_alloc);
-        rv = apr_brigade_write(body, NULL, NULL, data, data_len);
+        rv = body_cb(body_baton, body);
         if (rv != APR_SUCCESS) {
             md_http_req_destroy(req);
             return rv;
@@ -221,6 +308,52 @@ apr_status_t md_http_POSTd(md_http_t *http, const char *url,
     if (content_type) {
         apr_table_set(req->headers, "Content-Type", content_type); 
     }
-     
-    return schedule(req, body, 1);
+    
+    if (APR_SUCCESS == (rv = req_prepare(req, body, 1))) {
+        *preq = req;
+    }
+    return rv;
+}
+
+typedef struct {
+    const char *data;
+    size_t len;
+} post_data_ctx;
+
+static apr_status_t post_data_write(void *baton, apr_bucket_brigade *body)
+{
+    post_data_ctx *ctx = baton;
+    
+    return apr_brigade_write(body, NULL, NULL, ctx->data, ctx->len);
+}
+
+apr_status_t md_http_POSTd_create(md_http_request_t **preq, md_http_t *http, 
+                                  const char *url, struct apr_table_t *headers, 
+                                  const char *content_type, 
+                                  const char *data, size_t data_len, 
+                                  md_http_cb *cb, void *baton)
+{
+    post_data_ctx ctx;
+    
+    ctx.data = data;
+    ctx.len = data_len;
+    return md_http_POSTw_create(preq, http, url, headers, content_type, 
+                                (data && data_len > 0)? post_data_write : NULL, &ctx,
+                                cb, baton);
+}
+
+apr_status_t md_http_POSTd(md_http_t *http, const char *url, 
+                           struct apr_table_t *headers, const char *content_type, 
+                           const char *data, size_t data_len, 
+                           md_http_cb *cb, void *baton)
+{
+    md_http_request_t *req;
+    apr_status_t rv;
+    
+    rv = md_http_POSTd_create(&req, http, url, headers, content_type, data, data_len, cb, baton);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    
+    return req->http->impl->perform(req);
 }
@@ -17,6 +17,7 @@
 #ifndef mod_md_md_http_h
 #define mod_md_md_http_h
 
+struct apr_array_header_t;
 struct apr_table_t;
 struct apr_bucket_brigade;
 struct apr_bucket_alloc_t;
@@ -78,22 +79,79 @@ apr_status_t md_http_POSTd(md_http_t *http, const char *url,
 
 void md_http_req_destroy(md_http_request_t *req);
 
+/**
+ * Create requests without performing them, so that several of them can be
+ * handed to md_http_multi_perform(). On failure, the request is destroyed.
+ */
+apr_status_t md_http_GET_create(md_http_request_t **preq, md_http_t *http, 
+                                const char *url, struct apr_table_t *headers,
+                                md_http_cb *cb, void *baton);
+
+apr_status_t md_http_HEAD_create(md_http_request_t **preq, md_http_t *http, 
+                                 const char *url, struct apr_table_t *headers,
+                                 md_http_cb *cb, void *baton);
+
+apr_status_t md_http_POSTd_create(md_http_request_t **preq, md_http_t *http, 
+                                  const char *url, struct apr_table_t *headers, 
+                                  const char *content_type, 
+                                  const char *data, size_t data_len, 
+                                  md_http_cb *cb, void *baton);
+
+/**
+ * Callback that writes the body of a request into the given brigade.
+ */
+typedef apr_status_t md_http_body_cb(void *baton, struct apr_bucket_brigade *body);
+
+/**
+ * Create a POST request whose body is written by body_cb directly into the
+ * request brigade, without assembling a copy of it beforehand.
+ */
+apr_status_t md_http_POSTw_create(md_http_request_t **preq, md_http_t *http, 
+                                  const char *url, struct apr_table_t *headers, 
+                                  const char *content_type, 
+                                  md_http_body_cb *body_cb, void *body_baton, 
+                                  md_http_cb *cb, void *baton);
+
+/**
+ * Perform a request made by one of the *_create() functions. The request is
+ * destroyed afterwards.
+ */
+apr_status_t md_http_perform(md_http_request_t *req);
+
+/**
+ * Perform all requests in the array (of md_http_request_t*) and return when all 
+ * are done. Implementations may run them at the same time, in which case the 
+ * callbacks are invoked in the order the responses arrive. All requests are destroyed 
+ * afterwards.
+ * @return APR_SUCCESS if all requests succeeded, otherwise the status of the
+ *         first one that failed
+ */
+apr_status_t md_http_multi_perform(md_http_t *http, struct apr_array_header_t *reqs);
+
 /**************************************************************************************************/
 /* interface to implementation */
 
 typedef apr_status_t md_http_init_cb(void);
+typedef void md_http_cleanup_cb(md_http_t *http);
 typedef void md_http_req_cleanup_cb(md_http_request_t *req);
 typedef apr_status_t md_http_perform_cb(md_http_request_t *req);
+typedef apr_status_t md_http_multi_perform_cb(md_http_t *http, struct apr_array_header_t *reqs);
 
 typedef struct md_http_impl_t md_http_impl_t;
 struct md_http_impl_t {
     md_http_init_cb *init;
     md_http_req_cleanup_cb *req_cleanup;
     md_http_perform_cb *perform;
+    md_http_multi_perform_cb *multi_perform;    /* optional */
+    md_http_cleanup_cb *cleanup;                /* optional, invoked if internals are set */
 };
 
 void md_http_use_implementation(md_http_impl_t *impl);
 
+/* Data an implementation keeps with a md_http_t instance, e.g. connections for reuse */
+void *md_http_get_internals(md_http_t *http);
+void md_http_set_internals(md_http_t *http, void *internals);
+
 
 
 #endif /* md_http_h */
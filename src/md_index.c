@@ -0,0 +1,206 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_tables.h>
+
+#include "md.h"
+#include "md_util.h"
+#include "md_index.h"
+
+/* DNS names are at most 253 characters. Lookups make their lower case
+ * key copy in a buffer of this size instead of a pool. */
+#define MD_IDX_KEY_MAX      256
+
+struct md_index_t {
+    apr_pool_t *p;
+    apr_hash_t *names;                 /* md name -> md_t* */
+    apr_hash_t *domains;               /* lower case dns name -> md_t* */
+};
+
+md_index_t *md_index_create(apr_pool_t *p)
+{
+    md_index_t *idx;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->p = p;
+    idx->names = apr_hash_make(p);
+    idx->domains = apr_hash_make(p);
+    return idx;
+}
+
+apr_status_t md_index_make(md_index_t **pidx, apr_pool_t *p, apr_array_header_t *mds,
+                           md_t **pother, const char **pdomain)
+{
+    md_index_t *idx;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+    
+    idx = md_index_create(p);
+    for (i = 0; i < mds->nelts && APR_SUCCESS == rv; ++i) {
+        rv = md_index_add(idx, APR_ARRAY_IDX(mds, i, md_t*), pother, pdomain);
+    }
+    *pidx = idx;
+    return rv;
+}
+
+static const char *lc_key(char *buf, const char *s)
+{
+    apr_size_t i;
+    
+    for (i = 0; s[i]; ++i) {
+        if (i+1 >= MD_IDX_KEY_MAX) return NULL;
+        buf[i] = (char)apr_tolower(s[i]);
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+static md_t *get_exact(md_index_t *idx, const char *domain)
+{
+    char buf[MD_IDX_KEY_MAX];
+    const char *key;
+    
+    key = lc_key(buf, domain);
+    return key? apr_hash_get(idx->domains, key, APR_HASH_KEY_STRING) : NULL;
+}
+
+static void remove_domains(md_index_t *idx, const md_t *md)
+{
+    char buf[MD_IDX_KEY_MAX];
+    const char *key;
+    int i;
+    
+    for (i = 0; md->domains && i < md->domains->nelts; ++i) {
+        key = lc_key(buf, APR_ARRAY_IDX(md->domains, i, const char*));
+        if (key && apr_hash_get(idx->domains, key, APR_HASH_KEY_STRING) == md) {
+            apr_hash_set(idx->domains, key, APR_HASH_KEY_STRING, NULL);
+        }
+    }
+}
+
+apr_status_t md_index_add(md_index_t *idx, md_t *md, md_t **pother, const char **pdomain)
+{
+    const char *domain;
+    md_t *old, *other;
+    int i;
+    
+    assert(md->name);
+    for (i = 0; md->domains && i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        other = get_exact(idx, domain);
+        if (other && strcmp(other->name, md->name)) {
+            if (pother) *pother = other;
+            if (pdomain) *pdomain = domain;
+            return APR_EEXIST;
+        }
+    }
+    
+    if ((old = apr_hash_get(idx->names, md->name, APR_HASH_KEY_STRING))) {
+        remove_domains(idx, old);
+    }
+    apr_hash_set(idx->names, apr_pstrdup(idx->p, md->name), APR_HASH_KEY_STRING, md);
+    for (i = 0; md->domains && i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        domain = md_util_str_tolower(apr_pstrdup(idx->p, domain));
+        apr_hash_set(idx->domains, domain, APR_HASH_KEY_STRING, md);
+    }
+    return APR_SUCCESS;
+}
+
+void md_index_remove(md_index_t *idx, const char *name)
+{
+    md_t *old;
+    
+    if ((old = apr_hash_get(idx->names, name, APR_HASH_KEY_STRING))) {
+        remove_domains(idx, old);
+        apr_hash_set(idx->names, name, APR_HASH_KEY_STRING, NULL);
+    }
+}
+
+int md_index_count(md_index_t *idx)
+{
+    return (int)apr_hash_count(idx->names);
+}
+
+int md_index_do(md_index_t *idx, md_index_do_cb *cb, void *baton)
+{
+    apr_hash_index_t *hi;
+    md_t *md;
+    
+    for (hi = apr_hash_first(NULL, idx->names); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, (void**)&md);
+        if (!cb(baton, md)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+md_t *md_index_get_by_name(md_index_t *idx, const char *name)
+{
+    return apr_hash_get(idx->names, name, APR_HASH_KEY_STRING);
+}
+
+md_t *md_index_get_by_domain(md_index_t *idx, const char *domain)
+{
+    char buf[MD_IDX_KEY_MAX];
+    const char *parent;
+    md_t *md;
+    
+    if ((md = get_exact(idx, domain))) {
+        return md;
+    }
+    /* A wildcard matches exactly one label: 'a.example.org' is covered 
+     * by '*.example.org', but 'a.b.example.org' is not. */
+    if (domain[0] != '*' && (parent = strchr(domain, '.')) && parent[1]) {
+        if (strlen(parent) + 2 > MD_IDX_KEY_MAX) {
+            return NULL;
+        }
+        buf[0] = '*';
+        if (lc_key(buf + 1, parent)) {
+            return apr_hash_get(idx->domains, buf, APR_HASH_KEY_STRING);
+        }
+    }
+    return NULL;
+}
+
+md_t *md_index_get_by_domain_exact(md_index_t *idx, const char *domain)
+{
+    return get_exact(idx, domain);
+}
+
+md_t *md_index_get_by_dns_overlap(md_index_t *idx, const md_t *md, const char **pdomain)
+{
+    const char *domain;
+    md_t *other;
+    int i;
+    
+    for (i = 0; md->domains && i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        other = get_exact(idx, domain);
+        if (other && strcmp(other->name, md->name)) {
+            if (pdomain) *pdomain = domain;
+            return other;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,94 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_index_h
+#define mod_md_md_index_h
+
+struct apr_array_header_t;
+struct md_t;
+
+/**
+ * An index over a set of managed domains, answering lookups by MD name
+ * and by DNS name without scanning all MDs. DNS names are indexed case
+ * insensitive. A DNS name not found itself is matched against a
+ * wildcard '*.<parent>' entry, should one exist.
+ * 
+ * The index does not copy the md_t records, they need to live at least
+ * as long as the index.
+ */
+typedef struct md_index_t md_index_t;
+
+md_index_t *md_index_create(apr_pool_t *p);
+
+/**
+ * Create an index for all md_t* in the array. If MDs overlap, the first one
+ * added wins and the conflict is reported via the pother/pdomain of the
+ * md_index_add() that failed, if non-NULL.
+ */
+apr_status_t md_index_make(md_index_t **pidx, apr_pool_t *p, 
+                           struct apr_array_header_t *mds,
+                           struct md_t **pother, const char **pdomain);
+
+/**
+ * Add a managed domain to the index, replacing any MD with the same name. 
+ * Fails with APR_EEXIST if another MD already owns one of the domain names. 
+ * That MD and the domain name are then returned in pother/pdomain, if not NULL.
+ */
+apr_status_t md_index_add(md_index_t *idx, struct md_t *md, 
+                          struct md_t **pother, const char **pdomain);
+
+/**
+ * Remove the MD with the given name, if it is indexed.
+ */
+void md_index_remove(md_index_t *idx, const char *name);
+
+/**
+ * Get the number of MDs in the index.
+ */
+int md_index_count(md_index_t *idx);
+
+/**
+ * Invoke the callback for every MD in the index, in no particular order,
+ * until it returns 0. Returns 0 if a callback did, 1 otherwise.
+ */
+typedef int md_index_do_cb(void *baton, struct md_t *md);
+int md_index_do(md_index_t *idx, md_index_do_cb *cb, void *baton);
+
+/**
+ * Look up a managed domain by its name.
+ */
+struct md_t *md_index_get_by_name(md_index_t *idx, const char *name);
+
+/**
+ * Look up the managed domain containing the DNS name, exactly or via a 
+ * wildcard domain name.
+ */
+struct md_t *md_index_get_by_domain(md_index_t *idx, const char *domain);
+
+/**
+ * Look up the managed domain containing exactly this DNS name. Wildcards
+ * are not considered.
+ */
+struct md_t *md_index_get_by_domain_exact(md_index_t *idx, const char *domain);
+
+/**
+ * Find a managed domain, different from the given one, that has one of
+ * its domains names. Wildcards are not considered, only exact matches.
+ */
+struct md_t *md_index_get_by_dns_overlap(md_index_t *idx, const struct md_t *md,
+                                         const char **pdomain);
+
+#endif /* mod_md_md_index_h */
@@ -39,6 +39,13 @@ void md_json_destroy(md_json_t *json);
 md_json_t *md_json_copy(apr_pool_t *pool, md_json_t *json);
 md_json_t *md_json_clone(apr_pool_t *pool, md_json_t *json);
 
+/**
+ * Get another reference to the same JSON value that lives as long as pool, without
+ * copying it. Changes show in both. Use this instead of md_json_clone() to keep a
+ * value longer that is not modified otherwise, like a parsed response.
+ */
+md_json_t *md_json_share(apr_pool_t *pool, md_json_t *json);
+
 int md_json_has_key(md_json_t *json, ...);
 
 /* boolean manipulation */
@@ -89,6 +96,10 @@ apr_status_t md_json_seta(apr_array_header_t *a, md_json_to_cb *cb,
 typedef int md_json_itera_cb(void *baton, size_t index, md_json_t *json);
 int md_json_itera(md_json_itera_cb *cb, void *baton, md_json_t *json, ...);
 
+/* Iteration on the keys of an object */
+typedef int md_json_iterkey_cb(void *baton, const char *key, md_json_t *json);
+int md_json_iterkey(md_json_iterkey_cb *cb, void *baton, md_json_t *json, ...);
+
 /* Manipulating Object String values */
 apr_status_t md_json_gets_dict(apr_table_t *dict, md_json_t *json, ...);
 apr_status_t md_json_sets_dict(apr_table_t *dict, md_json_t *json, ...);
@@ -108,6 +119,10 @@ apr_status_t md_json_fcreatex(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt,
 apr_status_t md_json_freplace(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt, 
                               const char *fpath, apr_fileperms_t perms);
 
+/**
+ * Parse the JSON from the brigade, consuming its buckets one at a time while 
+ * the parser goes, so the data is never flattened into a single buffer.
+ */
 apr_status_t md_json_readb(md_json_t **pjson, apr_pool_t *pool, struct apr_bucket_brigade *bb);
 apr_status_t md_json_readd(md_json_t **pjson, apr_pool_t *pool, const char *data, size_t data_len);
 apr_status_t md_json_readf(md_json_t **pjson, apr_pool_t *pool, const char *fpath);
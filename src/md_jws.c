@@ -31,13 +31,73 @@ static int header_set(void *data, const char *key, const char *val)
     return 1;
 }
 
+typedef struct {
+    const char *alg;
+    md_json_t *jwk;             /* the public key as JSON Web Key */
+    const char *thumb64;        /* its RFC 7638 thumbprint */
+} jws_key_t;
+
+#define JWS_KEY_DERIVED     "md_jws.key"
+
+/* The JWK and its thumbprint never change for a key, but deriving them from the 
+ * BIGNUMs every time costs, so they are kept with the key. */
+static apr_status_t jws_key_get(jws_key_t **pjkey, struct md_pkey_t *pkey)
+{
+    jws_key_t *jkey;
+    apr_pool_t *p;
+    const char *curve, *x64, *y64, *e64, *n64, *s;
+    apr_status_t rv;
+    
+    if (NULL != (*pjkey = md_pkey_derived_get(pkey, JWS_KEY_DERIVED))) {
+        return APR_SUCCESS;
+    }
+    
+    p = md_pkey_get_pool(pkey);
+    jkey = apr_pcalloc(p, sizeof(*jkey));
+    jkey->jwk = md_json_create(p);
+    /* whitespace and order is relevant, since we hand out a digest of this (RFC 7638) */
+    if (MD_PKEY_TYPE_EC == md_pkey_get_type(pkey)) {
+        if (APR_SUCCESS != (rv = md_pkey_get_ec_params(pkey, p, &curve, &x64, &y64))) {
+            return rv;
+        }
+        jkey->alg = strcmp("P-384", curve)? "ES256" : "ES384";
+        md_json_sets(curve, jkey->jwk, "crv", NULL);
+        md_json_sets("EC", jkey->jwk, "kty", NULL);
+        md_json_sets(x64, jkey->jwk, "x", NULL);
+        md_json_sets(y64, jkey->jwk, "y", NULL);
+        s = apr_psprintf(p, "{\"crv\":\"%s\",\"kty\":\"EC\",\"x\":\"%s\",\"y\":\"%s\"}", 
+                         curve, x64, y64);
+    }
+    else {
+        e64 = md_pkey_get_rsa_e64(pkey, p);
+        n64 = md_pkey_get_rsa_n64(pkey, p);
+        if (!e64 || !n64) {
+            return APR_EINVAL;
+        }
+        jkey->alg = "RS256";
+        md_json_sets(e64, jkey->jwk, "e", NULL);
+        md_json_sets("RSA", jkey->jwk, "kty", NULL);
+        md_json_sets(n64, jkey->jwk, "n", NULL);
+        s = apr_psprintf(p, "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}", e64, n64);
+    }
+    if (APR_SUCCESS != (rv = md_crypt_sha256_digest64(&jkey->thumb64, p, s, strlen(s)))) {
+        return rv;
+    }
+    md_pkey_derived_set(pkey, JWS_KEY_DERIVED, jkey);
+    *pjkey = jkey;
+    return APR_SUCCESS;
+}
+
 apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
                          const char *payload, size_t len, 
                          struct apr_table_t *protected, 
                          struct md_pkey_t *pkey, const char *key_id)
 {
     md_json_t *msg, *jprotected;
-    const char *prot64, *pay64, *sign64, *sign, *prot;
+    jws_key_t *jkey;
+    const char *prot64, *pay64, *sign64, *prot;
+    char *sign;
+    apr_size_t prot_len, sign_len;
     apr_status_t rv = APR_SUCCESS;
 
     *pmsg = NULL;
@@ -45,14 +105,17 @@ apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
     msg = md_json_create(p);
 
     jprotected = md_json_create(p);
-    md_json_sets("RS256", jprotected, "alg", NULL);
+    if (APR_SUCCESS != (rv = jws_key_get(&jkey, pkey))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "jws key parameters");
+        return rv;
+    }
+    md_json_sets(jkey->alg, jprotected, "alg", NULL);
+    /* the key itself is only sent when there is no key id for it yet */
     if (key_id) {
         md_json_sets(key_id, jprotected, "kid", NULL);
     }
     else {
-        md_json_sets(md_pkey_get_rsa_e64(pkey, p), jprotected, "jwk", "e", NULL);
-        md_json_sets("RSA", jprotected, "jwk", "kty", NULL);
-        md_json_sets(md_pkey_get_rsa_n64(pkey, p), jprotected, "jwk", "n", NULL);
+        md_json_setj(jkey->jwk, jprotected, "jwk", NULL);
     }
     apr_table_do(header_set, jprotected, protected, NULL);
     prot = md_json_writep(jprotected, p, MD_JSON_FMT_COMPACT);
@@ -64,14 +127,20 @@ apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
     }
     
     if (rv == APR_SUCCESS) {
-        prot64 = md_util_base64url_encode(prot, strlen(prot), p);
-        md_json_sets(prot64, msg, "protected", NULL);
-        pay64 = md_util_base64url_encode(payload, len, p);
+        /* encode both parts into the signing input "prot64.pay64" and split it
+         * afterwards, instead of encoding them separately and joining copies */
+        prot_len = strlen(prot);
+        sign = apr_palloc(p, MD_BASE64URL_LEN(prot_len) + MD_BASE64URL_LEN(len) + 2);
+        prot_len = md_util_base64url_encode_to(sign, prot, prot_len);
+        sign[prot_len] = '.';
+        sign_len = prot_len + 1 + md_util_base64url_encode_to(sign + prot_len + 1, payload, len);
 
+        rv = md_crypt_sign64(&sign64, pkey, p, sign, sign_len);
+        sign[prot_len] = '\0';
+        prot64 = sign;
+        pay64 = sign + prot_len + 1;
+        md_json_sets(prot64, msg, "protected", NULL);
         md_json_sets(pay64, msg, "payload", NULL);
-        sign = apr_psprintf(p, "%s.%s", prot64, pay64);
-
-        rv = md_crypt_sign64(&sign64, pkey, p, sign, strlen(sign));
     }
 
     if (rv == APR_SUCCESS) {
@@ -90,17 +159,13 @@ apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
 
 apr_status_t md_jws_pkey_thumb(const char **pthumb, apr_pool_t *p, struct md_pkey_t *pkey)
 {
-    const char *e64, *n64, *s;
+    jws_key_t *jkey;
     apr_status_t rv;
     
-    e64 = md_pkey_get_rsa_e64(pkey, p);
-    n64 = md_pkey_get_rsa_n64(pkey, p);
-    if (!e64 || !n64) {
-        return APR_EINVAL;
+    (void)p;
+    *pthumb = NULL;
+    if (APR_SUCCESS == (rv = jws_key_get(&jkey, pkey))) {
+        *pthumb = jkey->thumb64;
     }
-
-    /* whitespace and order is relevant, since we hand out a digest of this */
-    s = apr_psprintf(p, "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}", e64, n64);
-    rv = md_crypt_sha256_digest64(pthumb, p, s, strlen(s));
     return rv;
 }
@@ -0,0 +1,212 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_strings.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_util.h"
+#include "md_keypool.h"
+
+#define MD_KEYPOOL_ID_LEN       9
+
+static const char *spec_pattern(md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    return apr_pstrcat(p, md_pkey_spec_name(spec, p), "-*", NULL);
+}
+
+static apr_status_t new_name(const char **pname, md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    unsigned char id[MD_KEYPOOL_ID_LEN];
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = md_rand_bytes(id, sizeof(id), p))) {
+        *pname = apr_pstrcat(p, md_pkey_spec_name(spec, p), "-",  
+                             md_util_base64url_encode((const char *)id, sizeof(id), p), NULL);
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* taking keys */
+
+/* Parallel drivers, or servers sharing the store, may try to take the same key. 
+ * Whoever creates the claim file of a key first gets it, others go on to the next
+ * one. A claimed key is not counted as part of the pool. Taking a key removes it
+ * right after the claim, so a claim older than MD_KEYPOOL_CLAIM_TIMEOUT was left
+ * behind by a crash and md_keypool_fill() removes its key. */
+#define MD_FN_KEY_CLAIM         "claim.txt"
+#define MD_KEYPOOL_CLAIM_TIMEOUT    apr_time_from_sec(10 * 60)
+
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *names;
+} take_ctx;
+
+static int collect_name(void *baton, const char *name, const char *aspect,
+                        md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    take_ctx *ctx = baton;
+    
+    (void)aspect;
+    (void)vtype;
+    (void)value;
+    (void)ptemp;
+    APR_ARRAY_PUSH(ctx->names, const char *) = apr_pstrdup(ctx->p, name);
+    return 1;
+}
+
+apr_status_t md_keypool_take(md_pkey_t **ppkey, md_store_t *store, 
+                             md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    take_ctx ctx;
+    const char *name;
+    apr_status_t rv;
+    int i;
+    
+    *ppkey = NULL;
+    ctx.p = p;
+    ctx.names = apr_array_make(p, 5, sizeof(const char *));
+    /* no need to decrypt keys we may not get */
+    rv = md_store_iter(collect_name, &ctx, store, p, MD_SG_KEYS, spec_pattern(spec, p), 
+                       MD_FN_PRIVKEY, MD_SV_TEXT);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_EOF(rv) && !APR_STATUS_IS_ENOENT(rv)) {
+        return rv;
+    }
+    
+    for (i = 0; i < ctx.names->nelts; ++i) {
+        name = APR_ARRAY_IDX(ctx.names, i, const char *);
+        rv = md_store_save(store, p, MD_SG_KEYS, name, MD_FN_KEY_CLAIM, 
+                           MD_SV_TEXT, (void*)"claimed", 1);
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, p, "keypool: key %s taken", name);
+            continue;
+        }
+        rv = md_store_load(store, MD_SG_KEYS, name, MD_FN_PRIVKEY, MD_SV_PKEY, 
+                           (void**)ppkey, p);
+        /* the key must not be handed out again */
+        md_store_purge(store, p, MD_SG_KEYS, name);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "keypool: took key %s", name);
+        if (APR_SUCCESS == rv) {
+            return rv;
+        }
+        *ppkey = NULL;
+    }
+    return APR_ENOENT;
+}
+
+apr_status_t md_keypool_get(md_pkey_t **ppkey, md_store_t *store, 
+                            md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    rv = md_keypool_take(ppkey, store, spec, p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "keypool: no %s key available, "
+                      "generating one", md_pkey_spec_name(spec, p));
+        rv = md_pkey_gen(ppkey, p, spec);
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* filling */
+
+typedef struct {
+    md_store_t *store;
+    int count;
+    apr_array_header_t *stale;         /* names with an expired claim, if collected */
+    apr_time_t now;
+} count_ctx;
+
+static int count_key(void *baton, const char *name, const char *aspect,
+                     md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    count_ctx *ctx = baton;
+    apr_time_t claimed;
+    
+    (void)aspect;
+    (void)vtype;
+    (void)value;
+    claimed = md_store_get_modified(ctx->store, MD_SG_KEYS, name, MD_FN_KEY_CLAIM, ptemp);
+    if (!claimed) {
+        ++ctx->count;
+    }
+    else if (ctx->stale && ctx->now - claimed > MD_KEYPOOL_CLAIM_TIMEOUT) {
+        APR_ARRAY_PUSH(ctx->stale, const char *) = 
+            apr_pstrdup(ctx->stale->pool, name);
+    }
+    return 1;
+}
+
+static int count_keys(md_store_t *store, md_pkey_spec_t *spec, 
+                      apr_array_header_t *stale, apr_pool_t *p)
+{
+    count_ctx ctx;
+    
+    ctx.store = store;
+    ctx.count = 0;
+    ctx.stale = stale;
+    ctx.now = apr_time_now();
+    /* no need to decrypt the keys for counting them */
+    md_store_iter(count_key, &ctx, store, p, MD_SG_KEYS, spec_pattern(spec, p), 
+                  MD_FN_PRIVKEY, MD_SV_TEXT);
+    return ctx.count;
+}
+
+int md_keypool_count(md_store_t *store, md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    return count_keys(store, spec, NULL, p);
+}
+
+apr_status_t md_keypool_fill(md_store_t *store, md_pkey_spec_t *spec, 
+                             int max, apr_pool_t *p)
+{
+    apr_array_header_t *stale;
+    md_pkey_t *pkey;
+    const char *name;
+    apr_status_t rv;
+    int i, count;
+    MD_CHK_VARS;
+    
+    stale = apr_array_make(p, 5, sizeof(const char *));
+    count = count_keys(store, spec, stale, p);
+    for (i = 0; i < stale->nelts; ++i) {
+        name = APR_ARRAY_IDX(stale, i, const char *);
+        rv = md_store_purge(store, p, MD_SG_KEYS, name);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "keypool: removed key %s with a stale claim", name);
+    }
+    if (count >= max) {
+        return APR_EEXIST;
+    }
+    if (   MD_OK(new_name(&name, spec, p))
+        && MD_OK(md_pkey_gen(&pkey, p, spec))
+        && MD_OK(md_pkey_save(store, p, MD_SG_KEYS, name, pkey, 1))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "keypool: added key %s", name);
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "keypool: adding %s key, call %s", 
+                      md_pkey_spec_name(spec, p), MD_LAST_CHK);
+    }
+    return rv;
+}
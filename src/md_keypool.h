@@ -0,0 +1,58 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_keypool_h
+#define mod_md_md_keypool_h
+
+struct md_pkey_t;
+struct md_pkey_spec_t;
+struct md_store_t;
+
+/**
+ * A pool of private keys generated ahead of time, so that neither renewals nor
+ * the setup of fallback certificates have to wait for key generation. The keys
+ * are kept, encrypted like all private keys outside of the domains, in the store 
+ * group MD_SG_KEYS, one directory per key named after its md_pkey_spec_t.
+ * A key taken from the pool is removed from the store.
+ */
+
+/**
+ * Take a key for the spec from the pool. Returns APR_ENOENT if there is none.
+ */
+apr_status_t md_keypool_take(struct md_pkey_t **ppkey, struct md_store_t *store, 
+                             struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**
+ * Take a key for the spec from the pool or, if there is none, generate a new one.
+ */
+apr_status_t md_keypool_get(struct md_pkey_t **ppkey, struct md_store_t *store, 
+                            struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**
+ * Get the number of keys for the spec in the pool, not counting keys claimed
+ * by a md_keypool_take() in progress.
+ */
+int md_keypool_count(struct md_store_t *store, struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**
+ * Generate a key for the spec and add it to the pool, if it holds less than max keys.
+ * Returns APR_EEXIST if the pool already has max keys. Keys whose claim was left
+ * behind by a crash are removed from the store.
+ */
+apr_status_t md_keypool_fill(struct md_store_t *store, struct md_pkey_spec_t *spec, 
+                             int max, apr_pool_t *p);
+
+#endif /* mod_md_md_keypool_h */
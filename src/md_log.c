@@ -15,6 +15,7 @@
  */
  
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
 
@@ -46,33 +47,63 @@ const char *md_log_level_name(md_log_level_t level)
     return level_names[level];
 }
 
-static md_log_print_cb *log_printv;
-static md_log_level_cb *log_level;
-static void *log_baton;
+/* Logging happens from all threads driving MDs. The callbacks and their baton are 
+ * published together, so a thread never calls a print callback with the baton of 
+ * another. md_log_set() fills the slot not in use and swaps it in. */
+typedef struct {
+    md_log_print_cb *printv;
+    md_log_level_cb *level;
+    void *baton;
+} log_sink_t;
+
+static log_sink_t sinks[2];
+static log_sink_t * volatile sink;
+
+int md_log_max_level = -1;
+
+void md_log_update_level(void)
+{
+    const log_sink_t *ls = sink;
+    int level;
+    
+    for (level = MD_LOG_TRACE8; level >= 0; --level) {
+        if (ls && ls->level && ls->level(ls->baton, NULL, (md_log_level_t)level)) {
+            break;
+        }
+    }
+    md_log_max_level = (ls && ls->printv)? level : -1;
+}
 
 void md_log_set(md_log_level_cb *level_cb, md_log_print_cb *print_cb, void *baton)
 {
-    log_printv = print_cb;
-    log_level = level_cb;
-    log_baton = baton;
+    log_sink_t *ls = (sink == &sinks[0])? &sinks[1] : &sinks[0];
+    
+    ls->printv = print_cb;
+    ls->level = level_cb;
+    ls->baton = baton;
+    apr_atomic_xchgptr((volatile void **)&sink, ls);
+    md_log_update_level();
 }
 
 int md_log_is_level(apr_pool_t *p, md_log_level_t level)
 {
-    if (!log_level) {
+    const log_sink_t *ls = sink;
+    
+    if (!ls || !ls->level || !MD_LOG_ENABLED(level)) {
         return 0;
     }
-    return log_level(log_baton, p, level);
+    return ls->level(ls->baton, p, level);
 }
 
-void md_log_perror(const char *file, int line, md_log_level_t level, 
-                   apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
+void (md_log_perror)(const char *file, int line, md_log_level_t level, 
+                     apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
 {
+    const log_sink_t *ls = sink;
     va_list ap;
 
     va_start(ap, fmt);
-    if (log_printv) {
-        log_printv(file, line, level, rv, log_baton, p, fmt, ap);
+    if (ls && ls->printv) {
+        ls->printv(file, line, level, rv, ls->baton, p, fmt, ap);
     }
     va_end(ap);
 }
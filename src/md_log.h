@@ -40,12 +40,22 @@ typedef enum {
 
 const char *md_log_level_name(md_log_level_t level);
 
+/* The most verbose level that is logged, as last told by the level callback. */
+extern int md_log_max_level;
+
+#define MD_LOG_ENABLED(level)   ((int)(level) <= md_log_max_level)
+
 int md_log_is_level(apr_pool_t *p, md_log_level_t level);
 
 void md_log_perror(const char *file, int line, md_log_level_t level, 
                    apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
                                 __attribute__((format(printf,6,7)));
 
+/* Levels not enabled cost a compare, the arguments are not evaluated. Callers
+ * pass MD_LOG_MARK for file and line. */
+#define md_log_perror(mark, level, ...) \
+    (MD_LOG_ENABLED(level)? md_log_perror(mark, level, __VA_ARGS__) : (void)0)
+
 typedef int md_log_level_cb(void *baton, apr_pool_t *p, md_log_level_t level);
 
 typedef void md_log_print_cb(const char *file, int line, md_log_level_t level, 
@@ -53,4 +63,10 @@ typedef void md_log_print_cb(const char *file, int line, md_log_level_t level,
 
 void md_log_set(md_log_level_cb *level_cb, md_log_print_cb *print_cb, void *baton);
 
+/**
+ * Ask the level callback again for the most verbose level enabled. Call this
+ * when the levels change after md_log_set().
+ */
+void md_log_update_level(void);
+
 #endif /* md_log_h */
@@ -0,0 +1,165 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+
+#include "md.h"
+#include "md_json.h"
+#include "md_metrics.h"
+
+/* upper bounds of the histogram buckets in milliseconds, the last one takes the rest */
+static const long BUCKET_MS[] = { 10, 50, 100, 500, 1000, 5000, 10000, 30000 };
+
+#define MD_METRICS_BUCKETS      ((sizeof(BUCKET_MS)/sizeof(BUCKET_MS[0])) + 1)
+
+typedef struct {
+    long count;
+    long errors;
+    apr_interval_time_t total;
+    apr_interval_time_t max;
+    long buckets[MD_METRICS_BUCKETS];
+} md_metric_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *groups;                /* group -> apr_hash_t of name -> md_metric_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} md_metrics_t;
+
+static md_metrics_t *metrics;
+
+static apr_status_t metrics_cleanup(void *dummy)
+{
+    (void)dummy;
+    metrics = NULL;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_metrics_init(apr_pool_t *p)
+{
+    md_metrics_t *m;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (metrics) {
+        return APR_SUCCESS;
+    }
+    m = apr_pcalloc(p, sizeof(*m));
+    m->p = p;
+    m->groups = apr_hash_make(p);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&m->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    if (APR_SUCCESS == rv) {
+        metrics = m;
+        apr_pool_cleanup_register(p, NULL, metrics_cleanup, apr_pool_cleanup_null);
+    }
+    return rv;
+}
+
+void md_metrics_record(const char *group, const char *name,
+                       apr_interval_time_t duration, int failed)
+{
+    md_metrics_t *m = metrics;
+    apr_hash_t *names;
+    md_metric_t *metric;
+    long ms;
+    apr_size_t i;
+
+    if (!m) {
+        return;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(m->mutex);
+#endif
+    if (!(names = apr_hash_get(m->groups, group, APR_HASH_KEY_STRING))) {
+        names = apr_hash_make(m->p);
+        apr_hash_set(m->groups, apr_pstrdup(m->p, group), APR_HASH_KEY_STRING, names);
+    }
+    if (!(metric = apr_hash_get(names, name, APR_HASH_KEY_STRING))) {
+        metric = apr_pcalloc(m->p, sizeof(*metric));
+        apr_hash_set(names, apr_pstrdup(m->p, name), APR_HASH_KEY_STRING, metric);
+    }
+
+    ++metric->count;
+    if (failed) {
+        ++metric->errors;
+    }
+    metric->total += duration;
+    if (duration > metric->max) {
+        metric->max = duration;
+    }
+    ms = (long)apr_time_as_msec(duration);
+    for (i = 0; i < MD_METRICS_BUCKETS - 1 && ms > BUCKET_MS[i]; ++i);
+    ++metric->buckets[i];
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(m->mutex);
+#endif
+}
+
+static md_json_t *metric_to_json(const md_metric_t *metric, apr_pool_t *p)
+{
+    md_json_t *json;
+    const char *label;
+    apr_size_t i;
+
+    json = md_json_create(p);
+    md_json_setl(metric->count, json, MD_KEY_COUNT, NULL);
+    md_json_setl(metric->errors, json, MD_KEY_ERRORS, NULL);
+    md_json_setl((long)apr_time_as_msec(metric->total), json, MD_KEY_TOTAL_MS, NULL);
+    md_json_setl((long)apr_time_as_msec(metric->max), json, MD_KEY_MAX_MS, NULL);
+    for (i = 0; i < MD_METRICS_BUCKETS; ++i) {
+        label = (i < MD_METRICS_BUCKETS - 1)?
+            apr_psprintf(p, "<=%ldms", BUCKET_MS[i]) : "more";
+        md_json_setl(metric->buckets[i], json, MD_KEY_HISTOGRAM, label, NULL);
+    }
+    return json;
+}
+
+md_json_t *md_metrics_to_json(apr_pool_t *p)
+{
+    md_metrics_t *m = metrics;
+    md_json_t *json;
+    apr_hash_index_t *gi, *ni;
+    const void *group, *name;
+    void *names, *metric;
+
+    json = md_json_create(p);
+    if (!m) {
+        return json;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(m->mutex);
+#endif
+    for (gi = apr_hash_first(p, m->groups); gi; gi = apr_hash_next(gi)) {
+        apr_hash_this(gi, &group, NULL, &names);
+        for (ni = apr_hash_first(p, names); ni; ni = apr_hash_next(ni)) {
+            apr_hash_this(ni, &name, NULL, &metric);
+            md_json_setj(metric_to_json(metric, p), json, group, name, NULL);
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(m->mutex);
+#endif
+    return json;
+}
@@ -0,0 +1,50 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_metrics_h
+#define mod_md_md_metrics_h
+
+struct md_json_t;
+
+/**
+ * Counters and latency histograms of the operations a process performs, like ACME
+ * requests by endpoint, store operations and key generation. Each operation is 
+ * recorded under a group and a name, e.g. "acme" and "new-order". Nothing is 
+ * recorded before md_metrics_init() has been called.
+ */
+#define MD_METRICS_ACME         "acme"
+#define MD_METRICS_STORE        "store"
+#define MD_METRICS_KEYGEN       "keygen"
+
+/**
+ * Start recording metrics in this process, kept for the lifetime of pool p.
+ */
+apr_status_t md_metrics_init(apr_pool_t *p);
+
+/**
+ * Record an operation that took duration and failed or not.
+ */
+void md_metrics_record(const char *group, const char *name, 
+                       apr_interval_time_t duration, int failed);
+
+/**
+ * Get the metrics recorded so far, an object of groups, each an object of names with 
+ * their counts, error counts, total and maximum milliseconds and the histogram of
+ * durations.
+ */
+struct md_json_t *md_metrics_to_json(apr_pool_t *p);
+
+#endif /* mod_md_md_metrics_h */
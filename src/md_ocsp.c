@@ -0,0 +1,558 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_buckets.h>
+#include <apr_strings.h>
+
+#include <openssl/ocsp.h>
+#include <openssl/x509v3.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_http.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_util.h"
+#include "md_ocsp.h"
+
+/* responses larger than this are not accepted */
+#define MD_OCSP_RESP_LIMIT      (64 * 1024)
+/* allowed difference between our clock and the responder's */
+#define MD_OCSP_CLOCK_SKEW      300
+/* how long a response without nextUpdate is used before a new one is fetched */
+#define MD_OCSP_DEF_REFRESH     apr_time_from_sec(60 * 60)
+/* when to try again after fetching failed */
+#define MD_OCSP_RETRY_DELAY     apr_time_from_sec(10 * 60)
+
+const char *md_ocsp_fingerprint(void *x509, apr_pool_t *p)
+{
+    const char *fingerprint = NULL;
+    unsigned char *der, *buf;
+    int len;
+
+    if ((len = i2d_X509(x509, NULL)) > 0) {
+        buf = der = apr_palloc(p, (apr_size_t)len);
+        if (i2d_X509(x509, &buf) == len) {
+            md_crypt_sha256_digest_hex(&fingerprint, p, (const char *)der, (size_t)len);
+        }
+    }
+    return fingerprint;
+}
+
+/**************************************************************************************************/
+/* storage */
+
+static apr_status_t resp_to_json(void *value, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    md_ocsp_resp_t *resp = value;
+    md_json_t *jresp;
+
+    (void)baton;
+    jresp = md_json_create(p);
+    md_json_sets(resp->fingerprint, jresp, MD_KEY_FINGERPRINT, NULL);
+    md_json_sets(resp->status, jresp, MD_KEY_STATUS, NULL);
+    md_json_setl((long)apr_time_sec(resp->this_update), jresp, MD_KEY_THIS_UPDATE, NULL);
+    md_json_setl((long)apr_time_sec(resp->next_update), jresp, MD_KEY_NEXT_UPDATE, NULL);
+    md_json_sets(md_util_base64url_encode((const char *)resp->der, resp->der_len, p),
+                 jresp, MD_KEY_RESPONSE, NULL);
+    return md_json_setj(jresp, json, NULL);
+}
+
+static apr_status_t resp_from_json(void **pvalue, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    md_ocsp_resp_t *resp;
+    const char *s64, *der;
+
+    (void)baton;
+    resp = apr_pcalloc(p, sizeof(*resp));
+    resp->fingerprint = md_json_dups(p, json, MD_KEY_FINGERPRINT, NULL);
+    resp->status = md_json_dups(p, json, MD_KEY_STATUS, NULL);
+    resp->this_update = apr_time_from_sec(md_json_getl(json, MD_KEY_THIS_UPDATE, NULL));
+    resp->next_update = apr_time_from_sec(md_json_getl(json, MD_KEY_NEXT_UPDATE, NULL));
+    if ((s64 = md_json_gets(json, MD_KEY_RESPONSE, NULL))) {
+        resp->der_len = md_util_base64url_decode(&der, s64, p);
+        resp->der = (const unsigned char *)der;
+    }
+    *pvalue = (resp->fingerprint && resp->der_len)? resp : NULL;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_ocsp_load(apr_array_header_t **presps, md_store_t *store,
+                          const char *name, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_array_header_t *resps;
+    apr_status_t rv;
+
+    *presps = NULL;
+    if (APR_SUCCESS == (rv = md_store_load_json(store, MD_SG_OCSP, name, MD_FN_OCSP, &json, p))) {
+        resps = apr_array_make(p, 5, sizeof(md_ocsp_resp_t *));
+        if (APR_SUCCESS == (rv = md_json_geta(resps, resp_from_json, NULL, json,
+                                              MD_KEY_OCSP, NULL))) {
+            *presps = resps;
+        }
+    }
+    return rv;
+}
+
+apr_status_t md_ocsp_save(md_store_t *store, const char *name,
+                          apr_array_header_t *resps, apr_pool_t *p)
+{
+    md_json_t *json;
+    json = md_json_create(p);
+    md_json_seta(resps, resp_to_json, NULL, json, MD_KEY_OCSP, NULL);
+    return md_store_save_json(store, p, MD_SG_OCSP, name, MD_FN_OCSP, json, 0);
+}
+
+static md_ocsp_resp_t *resp_get(apr_array_header_t *resps, const char *fingerprint)
+{
+    md_ocsp_resp_t *resp;
+    int i;
+
+    for (i = 0; resps && fingerprint && i < resps->nelts; ++i) {
+        resp = APR_ARRAY_IDX(resps, i, md_ocsp_resp_t *);
+        if (!strcmp(fingerprint, resp->fingerprint)) {
+            return resp;
+        }
+    }
+    return NULL;
+}
+
+static int resp_is_valid(const md_ocsp_resp_t *resp, apr_time_t now)
+{
+    return !resp->next_update || now < resp->next_update;
+}
+
+const md_ocsp_resp_t *md_ocsp_find(apr_array_header_t *resps, void *x509, apr_pool_t *p)
+{
+    md_ocsp_resp_t *resp;
+
+    resp = resp_get(resps, md_ocsp_fingerprint(x509, p));
+    return (resp && resp_is_valid(resp, apr_time_now()))? resp : NULL;
+}
+
+/**************************************************************************************************/
+/* fetching */
+
+typedef struct {
+    apr_pool_t *p;
+    const char *data;
+    apr_size_t len;
+} fetch_ctx_t;
+
+static apr_status_t on_response(const md_http_response_t *res)
+{
+    fetch_ctx_t *ctx = res->req->baton;
+    const char *ct;
+    char *data;
+    apr_size_t len;
+    apr_status_t rv;
+
+    ct = apr_table_get(res->headers, "Content-Type");
+    if (res->status != 200 || !res->body || !ct
+        || strcmp("application/ocsp-response", ct)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ctx->p, "ocsp: %s answered %d (%s)",
+                      res->req->url, res->status, ct? ct : "no content-type");
+        return APR_EINVAL;
+    }
+    if (APR_SUCCESS == (rv = apr_brigade_pflatten(res->body, &data, &len, ctx->p))) {
+        ctx->data = data;
+        ctx->len = len;
+    }
+    return rv;
+}
+
+static apr_status_t ocsp_request_create(md_http_request_t **preq, fetch_ctx_t *ctx, 
+                                        md_http_t *http, const char *url, OCSP_CERTID *id)
+{
+    OCSP_REQUEST *req;
+    unsigned char *der, *buf;
+    apr_status_t rv = APR_ENOMEM;
+    int len;
+
+    if (!(req = OCSP_REQUEST_new())) goto out;
+    if (!OCSP_request_add0_id(req, OCSP_CERTID_dup(id))
+        || (len = i2d_OCSP_REQUEST(req, NULL)) <= 0) goto out;
+    buf = der = apr_palloc(ctx->p, (apr_size_t)len);
+    if (i2d_OCSP_REQUEST(req, &buf) != len) goto out;
+
+    rv = md_http_POSTd_create(preq, http, url, NULL, "application/ocsp-request",
+                              (const char *)der, (size_t)len, on_response, ctx);
+out:
+    if (req) OCSP_REQUEST_free(req);
+    return rv;
+}
+
+/* The response must be signed by the issuer, or a responder the issuer delegated to */
+static apr_status_t resp_verify(OCSP_BASICRESP *bs, X509 *issuer)
+{
+    STACK_OF(X509) *chain = NULL;
+    X509_STORE *trusted = NULL;
+    apr_status_t rv = APR_ENOMEM;
+
+    if (!(chain = sk_X509_new_null()) || !sk_X509_push(chain, issuer)
+        || !(trusted = X509_STORE_new()) || !X509_STORE_add_cert(trusted, issuer)) goto out;
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+    X509_STORE_set_flags(trusted, X509_V_FLAG_PARTIAL_CHAIN);
+#endif
+    rv = (OCSP_basic_verify(bs, chain, trusted, OCSP_TRUSTOTHER) > 0)? APR_SUCCESS : APR_EINVAL;
+out:
+    if (trusted) X509_STORE_free(trusted);
+    if (chain) sk_X509_free(chain);
+    return rv;
+}
+
+static apr_status_t resp_parse(md_ocsp_resp_t *resp, const char *data, apr_size_t len,
+                               OCSP_CERTID *id, X509 *issuer)
+{
+    OCSP_RESPONSE *ocsp_resp = NULL;
+    OCSP_BASICRESP *bs = NULL;
+    ASN1_GENERALIZEDTIME *this_upd, *next_upd, *rev_time;
+    const unsigned char *der = (const unsigned char *)data;
+    int status, reason;
+    apr_status_t rv = APR_EINVAL;
+
+    if (len > MD_OCSP_RESP_LIMIT
+        || !(ocsp_resp = d2i_OCSP_RESPONSE(NULL, &der, (long)len))
+        || OCSP_RESPONSE_STATUS_SUCCESSFUL != OCSP_response_status(ocsp_resp)
+        || !(bs = OCSP_response_get1_basic(ocsp_resp))) goto out;
+    if (APR_SUCCESS != (rv = resp_verify(bs, issuer))) goto out;
+    if (!OCSP_resp_find_status(bs, id, &status, &reason, &rev_time, &this_upd, &next_upd)) {
+        rv = APR_ENOENT;
+        goto out;
+    }
+    if (!OCSP_check_validity(this_upd, next_upd, MD_OCSP_CLOCK_SKEW, -1)) {
+        rv = APR_EINVAL;
+        goto out;
+    }
+    resp->status = OCSP_cert_status_str(status);
+    resp->this_update = md_asn1_time_get(this_upd);
+    resp->next_update = next_upd? md_asn1_time_get(next_upd) : 0;
+    resp->der = (const unsigned char *)data;
+    resp->der_len = len;
+    rv = APR_SUCCESS;
+out:
+    if (bs) OCSP_BASICRESP_free(bs);
+    if (ocsp_resp) OCSP_RESPONSE_free(ocsp_resp);
+    return rv;
+}
+
+apr_status_t md_ocsp_resp_parse(md_ocsp_resp_t **presp, const char *der, apr_size_t der_len,
+                                md_cert_t *cert, md_cert_t *issuer, apr_pool_t *p)
+{
+    md_ocsp_resp_t *resp;
+    OCSP_CERTID *id;
+    apr_status_t rv;
+
+    *presp = NULL;
+    if (!(id = OCSP_cert_to_id(NULL, md_cert_get_X509(cert), md_cert_get_X509(issuer)))) {
+        return APR_ENOMEM;
+    }
+    resp = apr_pcalloc(p, sizeof(*resp));
+    if (!(resp->fingerprint = md_ocsp_fingerprint(md_cert_get_X509(cert), p))) {
+        rv = APR_ENOMEM;
+    }
+    else {
+        rv = resp_parse(resp, apr_pmemdup(p, der, der_len), der_len, id, 
+                        md_cert_get_X509(issuer));
+    }
+    OCSP_CERTID_free(id);
+    if (APR_SUCCESS == rv) {
+        *presp = resp;
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* renewal */
+
+/* All MDs given to md_ocsp_renew_all() are looked at first, collecting the responses
+ * that need fetching. Those are then requested at the same time, so that a slow 
+ * responder holds up the watchdog only once and not once per certificate. */
+
+typedef struct {
+    md_ocsp_renewal_t *renewal;
+    apr_array_header_t *stored;     /* the responses we have, or NULL */
+    apr_array_header_t *renewed;    /* the responses to keep */
+    int changed;
+} renew_md_t;
+
+typedef struct {
+    renew_md_t *md;
+    md_cert_t *cert;
+    md_cert_t *issuer;
+    const char *fingerprint;
+    md_ocsp_resp_t *stored;         /* the response we have for cert, or NULL */
+    const char *url;
+    OCSP_CERTID *id;
+    fetch_ctx_t fetch;
+    apr_status_t rv;                /* of creating the request */
+} renew_pending_t;
+
+static apr_time_t resp_refresh_at(const md_ocsp_resp_t *resp)
+{
+    if (!resp->next_update) {
+        return resp->this_update + MD_OCSP_DEF_REFRESH;
+    }
+    return resp->this_update + (resp->next_update - resp->this_update) / 2;
+}
+
+static void renewal_next_run(md_ocsp_renewal_t *renewal, apr_time_t refresh_at)
+{
+    if (!renewal->next_run || refresh_at < renewal->next_run) {
+        renewal->next_run = refresh_at;
+    }
+}
+
+static int pending_has(apr_array_header_t *pendings, renew_md_t *md, const char *fingerprint)
+{
+    renew_pending_t *pending;
+    int i;
+
+    for (i = 0; i < pendings->nelts; ++i) {
+        pending = APR_ARRAY_IDX(pendings, i, renew_pending_t *);
+        if (pending->md == md && !strcmp(fingerprint, pending->fingerprint)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void renew_collect(apr_array_header_t *pendings, apr_array_header_t *reqs, 
+                          renew_md_t *md, md_http_t *http, apr_time_t now, apr_pool_t *p)
+{
+    md_ocsp_renewal_t *renewal = md->renewal;
+    apr_array_header_t *certs;
+    renew_pending_t *pending;
+    md_http_request_t *req;
+    md_ocsp_resp_t *resp;
+    md_cert_t *cert, *issuer;
+    const char *fingerprint, *url;
+    apr_time_t refresh_at;
+    apr_status_t rv;
+    int i;
+
+    for (i = 0; i < renewal->pubcerts->nelts; ++i) {
+        certs = APR_ARRAY_IDX(renewal->pubcerts, i, apr_array_header_t *);
+        if (!certs || certs->nelts < 2) {
+            /* without the issuer, there is no asking */
+            continue;
+        }
+        cert = APR_ARRAY_IDX(certs, 0, md_cert_t *);
+        issuer = APR_ARRAY_IDX(certs, 1, md_cert_t *);
+        fingerprint = md_ocsp_fingerprint(md_cert_get_X509(cert), p);
+        if (!fingerprint || resp_get(md->renewed, fingerprint) 
+            || pending_has(pendings, md, fingerprint)) {
+            continue;
+        }
+        resp = resp_get(md->stored, fingerprint);
+        if (resp && now < (refresh_at = resp_refresh_at(resp))) {
+            APR_ARRAY_PUSH(md->renewed, md_ocsp_resp_t *) = resp;
+            renewal_next_run(renewal, refresh_at);
+            continue;
+        }
+        if (APR_SUCCESS != (rv = md_cert_get_ocsp_uri(&url, cert, p))) {
+            /* no responder for this certificate */
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p,
+                          "%s: certificate names no OCSP responder", renewal->name);
+            continue;
+        }
+        pending = apr_pcalloc(p, sizeof(*pending));
+        pending->md = md;
+        pending->cert = cert;
+        pending->issuer = issuer;
+        pending->fingerprint = fingerprint;
+        pending->stored = resp;
+        pending->url = url;
+        pending->fetch.p = p;
+        APR_ARRAY_PUSH(pendings, renew_pending_t *) = pending;
+        
+        if (!(pending->id = OCSP_cert_to_id(NULL, md_cert_get_X509(cert), 
+                                            md_cert_get_X509(issuer)))) {
+            pending->rv = APR_ENOMEM;
+        }
+        else if (APR_SUCCESS == (pending->rv = ocsp_request_create(&req, &pending->fetch, 
+                                                                   http, url, pending->id))) {
+            APR_ARRAY_PUSH(reqs, md_http_request_t *) = req;
+        }
+        if (APR_SUCCESS != pending->rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, pending->rv, p,
+                          "%s: requesting OCSP response from %s", renewal->name, url);
+        }
+    }
+}
+
+static void renew_finish(renew_pending_t *pending, apr_time_t now, apr_pool_t *p)
+{
+    md_ocsp_renewal_t *renewal = pending->md->renewal;
+    md_ocsp_resp_t *resp = NULL;
+    apr_time_t refresh_at;
+    apr_status_t rv = pending->rv;
+
+    if (APR_SUCCESS == rv) {
+        if (!pending->fetch.data) {
+            rv = APR_EINVAL;
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p,
+                          "%s: no OCSP response from %s", renewal->name, pending->url);
+        }
+        else {
+            resp = apr_pcalloc(p, sizeof(*resp));
+            resp->fingerprint = pending->fingerprint;
+            rv = resp_parse(resp, pending->fetch.data, pending->fetch.len, pending->id, 
+                            md_cert_get_X509(pending->issuer));
+            if (APR_SUCCESS != rv) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p,
+                              "%s: OCSP response from %s is not usable", 
+                              renewal->name, pending->url);
+            }
+        }
+    }
+    
+    if (APR_SUCCESS == rv && resp) {
+        md_log_perror(MD_LOG_MARK, strcmp("good", resp->status)? MD_LOG_WARNING : MD_LOG_DEBUG,
+                      0, p, "%s: OCSP status of certificate is %s", renewal->name, resp->status);
+        APR_ARRAY_PUSH(pending->md->renewed, md_ocsp_resp_t *) = resp;
+        pending->md->changed = 1;
+        refresh_at = resp_refresh_at(resp);
+    }
+    else {
+        if (pending->stored && resp_is_valid(pending->stored, now)) {
+            /* better than nothing */
+            APR_ARRAY_PUSH(pending->md->renewed, md_ocsp_resp_t *) = pending->stored;
+        }
+        refresh_at = now + MD_OCSP_RETRY_DELAY;
+        if (APR_SUCCESS == renewal->rv) {
+            renewal->rv = rv;
+        }
+    }
+    renewal_next_run(renewal, refresh_at);
+}
+
+static void renew_save(md_store_t *store, renew_md_t *md, apr_pool_t *p)
+{
+    md_ocsp_renewal_t *renewal = md->renewal;
+    apr_status_t rv;
+
+    if (md->changed || (md->stored && md->renewed->nelts != md->stored->nelts)) {
+        if (md->renewed->nelts > 0) {
+            rv = md_ocsp_save(store, renewal->name, md->renewed, p);
+        }
+        else {
+            rv = md_store_remove(store, MD_SG_OCSP, renewal->name, MD_FN_OCSP, p, 1);
+        }
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving OCSP responses", 
+                          renewal->name);
+            renewal->rv = rv;
+        }
+    }
+}
+
+apr_status_t md_ocsp_renew_all(md_store_t *store, md_http_t *http, 
+                               apr_array_header_t *renewals, apr_pool_t *p)
+{
+    apr_array_header_t *mds, *pendings, *reqs;
+    md_ocsp_renewal_t *renewal;
+    renew_pending_t *pending;
+    renew_md_t *md;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    mds = apr_array_make(p, renewals->nelts, sizeof(renew_md_t *));
+    pendings = apr_array_make(p, renewals->nelts, sizeof(renew_pending_t *));
+    reqs = apr_array_make(p, renewals->nelts, sizeof(md_http_request_t *));
+    md_http_set_response_limit(http, MD_OCSP_RESP_LIMIT);
+
+    for (i = 0; i < renewals->nelts; ++i) {
+        renewal = APR_ARRAY_IDX(renewals, i, md_ocsp_renewal_t *);
+        renewal->next_run = 0;
+        renewal->rv = APR_SUCCESS;
+        md = apr_pcalloc(p, sizeof(*md));
+        md->renewal = renewal;
+        md_ocsp_load(&md->stored, store, renewal->name, p);
+        md->renewed = apr_array_make(p, 5, sizeof(md_ocsp_resp_t *));
+        APR_ARRAY_PUSH(mds, renew_md_t *) = md;
+        renew_collect(pendings, reqs, md, http, now, p);
+    }
+    
+    if (reqs->nelts > 0) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "fetching %d OCSP responses", 
+                      reqs->nelts);
+        md_http_multi_perform(http, reqs);
+    }
+    now = apr_time_now();
+    for (i = 0; i < pendings->nelts; ++i) {
+        pending = APR_ARRAY_IDX(pendings, i, renew_pending_t *);
+        renew_finish(pending, now, p);
+        if (pending->id) OCSP_CERTID_free(pending->id);
+    }
+    
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, renew_md_t *);
+        renew_save(store, md, p);
+        if (APR_SUCCESS == rv) {
+            rv = md->renewal->rv;
+        }
+    }
+    return rv;
+}
+
+apr_status_t md_ocsp_renew(md_store_t *store, md_http_t *http, const char *name,
+                           apr_array_header_t *pubcerts, apr_time_t *pnext_run,
+                           apr_pool_t *p)
+{
+    apr_array_header_t *renewals;
+    md_ocsp_renewal_t renewal;
+    apr_status_t rv;
+
+    memset(&renewal, 0, sizeof(renewal));
+    renewal.name = name;
+    renewal.pubcerts = pubcerts;
+    renewals = apr_array_make(p, 1, sizeof(md_ocsp_renewal_t *));
+    APR_ARRAY_PUSH(renewals, md_ocsp_renewal_t *) = &renewal;
+    rv = md_ocsp_renew_all(store, http, renewals, p);
+    *pnext_run = renewal.next_run;
+    return rv;
+}
+
+apr_time_t md_ocsp_due(md_store_t *store, const char *name, apr_time_t certs_modified,
+                       apr_pool_t *p)
+{
+    apr_array_header_t *resps;
+    md_ocsp_resp_t *resp;
+    apr_time_t due = 0, refresh_at;
+    int i;
+
+    if (APR_SUCCESS != md_ocsp_load(&resps, store, name, p)
+        || certs_modified > md_store_get_modified(store, MD_SG_OCSP, name, MD_FN_OCSP, p)) {
+        /* nothing for the certificates we have */
+        return 0;
+    }
+    for (i = 0; i < resps->nelts; ++i) {
+        resp = APR_ARRAY_IDX(resps, i, md_ocsp_resp_t *);
+        refresh_at = resp_refresh_at(resp);
+        if (!due || refresh_at < due) {
+            due = refresh_at;
+        }
+    }
+    return due;
+}
@@ -0,0 +1,114 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_ocsp_h
+#define mod_md_md_ocsp_h
+
+struct apr_array_header_t;
+struct md_cert_t;
+struct md_http_t;
+struct md_store_t;
+
+/**
+ * OCSP responses for the certificates of Managed Domains. They are fetched from the
+ * responder named in the certificate and kept in the store group MD_SG_OCSP, all responses
+ * of one MD in MD_FN_OCSP. TLS modules staple them from there, without network I/O of
+ * their own.
+ */
+#define MD_FN_OCSP              "ocsp.json"
+
+typedef struct md_ocsp_resp_t md_ocsp_resp_t;
+struct md_ocsp_resp_t {
+    const char *fingerprint;        /* SHA-256 of the certificate, hex encoded */
+    const char *status;             /* of the certificate: "good", "revoked" or "unknown" */
+    apr_time_t this_update;
+    apr_time_t next_update;         /* 0 if the responder gave none */
+    const unsigned char *der;       /* the response, DER encoded */
+    apr_size_t der_len;
+};
+
+/**
+ * Get the fingerprint identifying a certificate, an X509*, in md_ocsp_resp_t.
+ */
+const char *md_ocsp_fingerprint(void *x509, apr_pool_t *p);
+
+/**
+ * Load the stored responses of an MD, an array of md_ocsp_resp_t*.
+ * Returns APR_ENOENT if there are none.
+ */
+apr_status_t md_ocsp_load(struct apr_array_header_t **presps, struct md_store_t *store,
+                          const char *name, apr_pool_t *p);
+
+/**
+ * Save the responses of an MD, an array of md_ocsp_resp_t*, replacing those stored.
+ */
+apr_status_t md_ocsp_save(struct md_store_t *store, const char *name,
+                          struct apr_array_header_t *resps, apr_pool_t *p);
+
+/**
+ * Parse an OCSP response for cert, issued by issuer. The response must be successful,
+ * signed by the issuer or its delegated responder, carry the status of cert and be 
+ * valid now. Returns APR_ENOENT if it says nothing about cert, APR_EINVAL for all
+ * other problems.
+ */
+apr_status_t md_ocsp_resp_parse(md_ocsp_resp_t **presp, const char *der, apr_size_t der_len,
+                                struct md_cert_t *cert, struct md_cert_t *issuer, 
+                                apr_pool_t *p);
+
+/**
+ * Find the response for the certificate, an X509*. Returns NULL if there is none
+ * or it is no longer valid.
+ */
+const md_ocsp_resp_t *md_ocsp_find(struct apr_array_header_t *resps, void *x509,
+                                   apr_pool_t *p);
+
+/**
+ * Renew the stored responses of MD name for the given pubcerts, an array of arrays of
+ * md_cert_t*, each starting with the certificate followed by its issuer. A response is
+ * fetched again when half of its validity has passed. Responses for certificates not
+ * given are removed.
+ * @param pnext_run   on return, when the responses should be renewed again
+ */
+apr_status_t md_ocsp_renew(struct md_store_t *store, struct md_http_t *http, const char *name,
+                           struct apr_array_header_t *pubcerts, apr_time_t *pnext_run,
+                           apr_pool_t *p);
+
+typedef struct md_ocsp_renewal_t md_ocsp_renewal_t;
+struct md_ocsp_renewal_t {
+    const char *name;                       /* of the MD */
+    struct apr_array_header_t *pubcerts;    /* as for md_ocsp_renew() */
+    apr_time_t next_run;                    /* on return, when to renew again or 0 */
+    apr_status_t rv;                        /* on return, how renewing went */
+};
+
+/**
+ * Renew the stored responses of several MDs, an array of md_ocsp_renewal_t*, like
+ * md_ocsp_renew() does for one. The responses needed by all of them are fetched
+ * via md_http_multi_perform(), at the same time where the http implementation can.
+ * @return APR_SUCCESS or the first error of a renewal
+ */
+apr_status_t md_ocsp_renew_all(struct md_store_t *store, struct md_http_t *http, 
+                               struct apr_array_header_t *renewals, apr_pool_t *p);
+
+/**
+ * Get when the stored responses of MD name need renewal, from their update times alone
+ * and without looking at the certificates. Returns 0, meaning now, if there are none 
+ * or they were stored before certs_modified.
+ */
+apr_time_t md_ocsp_due(struct md_store_t *store, const char *name, apr_time_t certs_modified,
+                       apr_pool_t *p);
+
+#endif /* mod_md_md_ocsp_h */
@@ -20,12 +20,16 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_date.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 #include <apr_uri.h>
 
 #include "md.h"
 #include "md_crypt.h"
+#include "md_index.h"
 #include "md_log.h"
 #include "md_json.h"
 #include "md_reg.h"
@@ -36,13 +40,43 @@
 #include "md_acme_acct.h"
 
 struct md_reg_t {
+    apr_pool_t *p;
     struct md_store_t *store;
     struct apr_hash_t *protos;
     int can_http;
     int can_https;
     const char *proxy_url;
+    apr_pool_t *cache_p;            /* views and index, only allocated from under the mutex */
+    apr_pool_t *index_p;            /* subpool of cache_p, holds domains and goes with it */
+    struct md_index_t *domains;     /* index of the MDs in store, made on first lookup */
+    int index_puts;                 /* updates of domains since it was made */
+    struct apr_hash_t *views;       /* md name -> reg_view_t, read-only copies of MDs in store */
+#if APR_HAS_THREADS
+    struct apr_thread_mutex_t *mutex;        /* guards views and domains */
+    struct apr_thread_mutex_t *staged_mutex; /* serializes updates of MD_FN_STAGED */
+#endif
 };
 
+/* Renewals may be driven in parallel, lookups and updates of the cached views and
+ * the index need to be serialized. */
+static void reg_lock(md_reg_t *reg)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(reg->mutex);
+#else
+    (void)reg;
+#endif
+}
+
+static void reg_unlock(md_reg_t *reg)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(reg->mutex);
+#else
+    (void)reg;
+#endif
+}
+
 /**************************************************************************************************/
 /* life cycle */
 
@@ -74,15 +108,30 @@ apr_status_t md_reg_init(md_reg_t **preg, apr_pool_t *p, struct md_store_t *stor
     apr_status_t rv;
     
     reg = apr_pcalloc(p, sizeof(*reg));
+    reg->p = p;
     reg->store = store;
     reg->protos = apr_hash_make(p);
     reg->can_http = 1;
     reg->can_https = 1;
     reg->proxy_url = proxy_url? apr_pstrdup(p, proxy_url) : NULL;
+    if (APR_SUCCESS != (rv = apr_pool_create(&reg->cache_p, p))) {
+        goto out;
+    }
+    apr_pool_tag(reg->cache_p, "md_reg_cache");
+    reg->views = apr_hash_make(reg->cache_p);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&reg->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))
+        || APR_SUCCESS != (rv = apr_thread_mutex_create(&reg->staged_mutex, 
+                                                        APR_THREAD_MUTEX_DEFAULT, p))) {
+        goto out;
+    }
+#endif
     
     if (APR_SUCCESS == (rv = md_acme_protos_add(reg->protos, p))) {
         rv = load_props(reg, p);
     }
+out:
     
     *preg = (rv == APR_SUCCESS)? reg : NULL;
     return rv;
@@ -93,6 +142,16 @@ struct md_store_t *md_reg_store_get(md_reg_t *reg)
     return reg->store;
 }
 
+int md_reg_is_concurrent(md_reg_t *reg)
+{
+#if APR_HAS_THREADS
+    return reg->mutex && reg->store->concurrent;
+#else
+    (void)reg;
+    return 0;
+#endif
+}
+
 /**************************************************************************************************/
 /* checks */
 
@@ -175,13 +234,195 @@ static apr_status_t check_values(md_reg_t *reg, apr_pool_t *p, const md_t *md, i
     return rv;
 }
 
+/**************************************************************************************************/
+/* assessment record */
+
+/* Assessing an MD parses its key and certificate chain and inspects validity, alt names
+ * and extensions of every certificate. The findings that depend neither on the MD's
+ * configuration nor on the current time are saved next to md.json, together with the
+ * fingerprint of the certificate file and the modification time of the key. As long
+ * as both are unchanged, the state is assessed from this record, skipping all parsing. */
+
+static const char *ts_str(apr_time_t t, apr_pool_t *p)
+{
+    char *ts = apr_pcalloc(p, APR_RFC822_DATE_LEN);
+    apr_rfc822_date(ts, t);
+    return ts;
+}
+
+static apr_time_t ts_get(md_json_t *json, const char *key, const char *key2)
+{
+    const char *s = md_json_gets(json, key, key2, NULL);
+    return (s && *s)? apr_date_parse_rfc(s) : 0;
+}
+
+static apr_status_t assessment_key(const char **pfprint, const char **pkey_modified,
+                                   md_reg_t *reg, const char *name, apr_pool_t *p)
+{
+    const char *pem;
+    apr_time_t modified;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = md_store_load(reg->store, MD_SG_DOMAINS, name, MD_FN_PUBCERT, 
+                                           MD_SV_TEXT, (void**)&pem, p))
+        && APR_SUCCESS == (rv = md_crypt_sha256_digest_hex(pfprint, p, pem, strlen(pem)))) {
+        modified = md_store_get_modified(reg->store, MD_SG_DOMAINS, name, MD_FN_PRIVKEY, p);
+        if (!modified) {
+            return APR_ENOENT;
+        }
+        *pkey_modified = apr_psprintf(p, "%" APR_TIME_T_FMT, modified);
+    }
+    return rv;
+}
+
+static void assessment_save(md_reg_t *reg, const md_t *md, const md_creds_t *creds, 
+                            apr_pool_t *p)
+{
+    const char *fprint, *key_modified;
+    md_json_t *json;
+    apr_array_header_t *names;
+    md_cert_t *cert;
+    apr_time_t t, chain_valid_from = 0, chain_expires = 0;
+    int i;
+    
+    if (APR_SUCCESS != assessment_key(&fprint, &key_modified, reg, md->name, p)) {
+        return;
+    }
+    if (APR_SUCCESS == md_store_load_json(reg->store, MD_SG_DOMAINS, md->name, 
+                                          MD_FN_ASSESSMENT, &json, p)
+        && md_json_gets(json, MD_KEY_FINGERPRINT, NULL)
+        && !strcmp(fprint, md_json_gets(json, MD_KEY_FINGERPRINT, NULL))
+        && md_json_gets(json, MD_KEY_PKEY, MD_KEY_MODIFIED, NULL)
+        && !strcmp(key_modified, md_json_gets(json, MD_KEY_PKEY, MD_KEY_MODIFIED, NULL))) {
+        /* up to date */
+        return;
+    }
+    if (APR_SUCCESS != md_cert_get_alt_names(&names, creds->cert, p)) {
+        names = apr_array_make(p, 1, sizeof(const char *));
+    }
+    for (i = 1; i < creds->pubcert->nelts; ++i) {
+        cert = APR_ARRAY_IDX(creds->pubcert, i, md_cert_t *);
+        t = md_cert_get_not_before(cert);
+        if (t > chain_valid_from) chain_valid_from = t;
+        t = md_cert_get_not_after(cert);
+        if (!chain_expires || t < chain_expires) chain_expires = t;
+    }
+    
+    json = md_json_create(p);
+    md_json_sets(fprint, json, MD_KEY_FINGERPRINT, NULL);
+    md_json_sets(key_modified, json, MD_KEY_PKEY, MD_KEY_MODIFIED, NULL);
+    md_json_setsa(names, json, MD_KEY_DOMAINS, NULL);
+    md_json_setb(md_cert_must_staple(creds->cert), json, MD_KEY_MUST_STAPLE, NULL);
+    md_json_sets(ts_str(md_cert_get_not_before(creds->cert), p), 
+                 json, MD_KEY_CERT, MD_KEY_VALID_FROM, NULL);
+    md_json_sets(ts_str(md_cert_get_not_after(creds->cert), p), 
+                 json, MD_KEY_CERT, MD_KEY_EXPIRES, NULL);
+    if (chain_expires) {
+        md_json_sets(ts_str(chain_valid_from, p), json, MD_KEY_CHAIN, MD_KEY_VALID_FROM, NULL);
+        md_json_sets(ts_str(chain_expires, p), json, MD_KEY_CHAIN, MD_KEY_EXPIRES, NULL);
+    }
+    md_store_save_json(reg->store, p, MD_SG_DOMAINS, md->name, MD_FN_ASSESSMENT, json, 0);
+}
+
+/* Assess the state of md from its record, if there is one for the current credentials. */
+static apr_status_t assessment_apply(md_state_t *pstate, apr_time_t *pvalid_from, 
+                                     apr_time_t *pexpires, md_reg_t *reg, const md_t *md, 
+                                     apr_pool_t *p)
+{
+    const char *fprint, *key_modified, *s;
+    md_json_t *json;
+    apr_array_header_t *names;
+    md_str_set_t *alt_set;
+    apr_time_t now, chain_valid_from, chain_expires;
+    apr_status_t rv;
+    int i;
+    
+    if (APR_SUCCESS != (rv = assessment_key(&fprint, &key_modified, reg, md->name, p))
+        || APR_SUCCESS != (rv = md_store_load_json(reg->store, MD_SG_DOMAINS, md->name, 
+                                                   MD_FN_ASSESSMENT, &json, p))) {
+        return rv;
+    }
+    if (!(s = md_json_gets(json, MD_KEY_FINGERPRINT, NULL)) || strcmp(fprint, s)
+        || !(s = md_json_gets(json, MD_KEY_PKEY, MD_KEY_MODIFIED, NULL)) 
+        || strcmp(key_modified, s)) {
+        return APR_ENOENT;
+    }
+    
+    *pvalid_from = ts_get(json, MD_KEY_CERT, MD_KEY_VALID_FROM);
+    *pexpires = ts_get(json, MD_KEY_CERT, MD_KEY_EXPIRES);
+    chain_valid_from = ts_get(json, MD_KEY_CHAIN, MD_KEY_VALID_FROM);
+    chain_expires = ts_get(json, MD_KEY_CHAIN, MD_KEY_EXPIRES);
+    names = apr_array_make(p, 5, sizeof(const char *));
+    md_json_dupsa(names, p, json, MD_KEY_DOMAINS, NULL);
+    alt_set = md_str_set_from_array(p, names, 0);
+    now = apr_time_now();
+    
+    if (!*pexpires || *pexpires <= now) {
+        *pstate = MD_S_EXPIRED;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                      "md{%s}: expired, certificate has expired", md->name);
+        return APR_SUCCESS;
+    }
+    if (*pvalid_from > now) {
+        *pstate = MD_S_ERROR;
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p, 
+                      "md{%s}: error, certificate valid in future (clock wrong?)", md->name);
+        return APR_SUCCESS;
+    }
+    for (i = 0; i < md->domains->nelts; ++i) {
+        if (!md_str_set_contains(alt_set, APR_ARRAY_IDX(md->domains, i, const char *))) {
+            *pstate = MD_S_INCOMPLETE;
+            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, 
+                          "md{%s}: incomplete, cert no longer covers all domains, "
+                          "needs sign up for a new certificate", md->name);
+            return APR_SUCCESS;
+        }
+    }
+    if (!md->must_staple != !md_json_getb(json, MD_KEY_MUST_STAPLE, NULL)) {
+        *pstate = MD_S_INCOMPLETE;
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, 
+                      "md{%s}: OCSP Stapling is%s requested, but certificate "
+                      "has it%s enabled. Need to get a new certificate.", md->name,
+                      md->must_staple? "" : " not", !md->must_staple? "" : " not");
+        return APR_SUCCESS;
+    }
+    if (chain_valid_from > now || (chain_expires && chain_expires <= now)) {
+        *pstate = MD_S_ERROR;
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p, 
+                      "md{%s}: error, the certificate itself is valid, however a "
+                      "certificate in the chain is not valid now (clock wrong?).", md->name);
+        return APR_SUCCESS;
+    }
+    *pstate = MD_S_COMPLETE;
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "md{%s}: is complete (assessment record)", 
+                  md->name);
+    return APR_SUCCESS;
+}
+
 /**************************************************************************************************/
 /* state assessment */
 
-static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_changes)
+static apr_status_t state_set(md_reg_t *reg, apr_pool_t *p, md_t *md, md_state_t state,
+                              apr_time_t valid_from, apr_time_t expires, int save_changes)
+{
+    if (save_changes && md->state == state
+        && md->valid_from == valid_from && md->expires == expires) {
+        save_changes = 0;
+    }
+    md->state = state;
+    md->valid_from = valid_from;
+    md->expires = expires;
+    if (save_changes) {
+        return md_save(reg->store, p, MD_SG_DOMAINS, md, 0);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t state_init_creds(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_changes,
+                                     const md_creds_t **pcreds)
 {
     md_state_t state = MD_S_UNKNOWN;
-    const md_creds_t *creds;
+    const md_creds_t *creds = NULL;
     const md_cert_t *cert;
     apr_time_t expires = 0, valid_from = 0;
     apr_status_t rv;
@@ -248,22 +489,29 @@ static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_
     }
 
 out:    
+    if (pcreds) {
+        *pcreds = creds;
+    }
     if (APR_SUCCESS != rv) {
-        state = MD_S_ERROR;
         md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "md{%s}: error", md->name);
+        state_set(reg, p, md, MD_S_ERROR, valid_from, expires, 0);
+        return rv;
     }
-    
-    if (save_changes && md->state == state
-        && md->valid_from == valid_from && md->expires == expires) {
-        save_changes = 0;
+    if (creds && creds->privkey && creds->cert) {
+        assessment_save(reg, md, creds, p);
     }
-    md->state = state;
-    md->valid_from = valid_from;
-    md->expires = expires;
-    if (save_changes && APR_SUCCESS == rv) {
-        return md_save(reg->store, p, MD_SG_DOMAINS, md, 0);
+    return state_set(reg, p, md, state, valid_from, expires, save_changes);
+}
+
+static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_changes)
+{
+    md_state_t state;
+    apr_time_t valid_from, expires;
+    
+    if (APR_SUCCESS == assessment_apply(&state, &valid_from, &expires, reg, md, p)) {
+        return state_set(reg, p, md, state, valid_from, expires, save_changes);
     }
-    return rv;
+    return state_init_creds(reg, p, md, save_changes, NULL);
 }
 
 apr_status_t md_reg_assess(md_reg_t *reg, md_t *md, int *perrored, int *prenew, apr_pool_t *p)
@@ -364,6 +612,247 @@ md_t *md_reg_get(md_reg_t *reg, const char *name, apr_pool_t *p)
     return NULL;
 }
 
+/* Parsing an MD with its credentials is costly, as key and certificates are read and
+ * checked. For read-only access, the registry keeps the results around. A view is
+ * for a particular state of the files in the store: whenever one of them is modified,
+ * by this registry or anyone else, the view is made anew. */
+
+static const char *ViewFiles[] = { MD_FN_MD, MD_FN_PRIVKEY, MD_FN_PUBCERT };
+#define VIEW_FILES_COUNT    (sizeof(ViewFiles)/sizeof(ViewFiles[0]))
+
+typedef struct {
+    apr_pool_t *p;                  /* pool of the view, destroyed when it is dropped */
+    const md_t *md;
+    const md_creds_t *creds;
+    apr_time_t mtimes[VIEW_FILES_COUNT]; /* modification times of ViewFiles */
+} reg_view_t;
+
+static void view_mtimes_get(apr_time_t *mtimes, md_reg_t *reg, const char *name, apr_pool_t *p)
+{
+    size_t i;
+    
+    for (i = 0; i < VIEW_FILES_COUNT; ++i) {
+        mtimes[i] = md_store_get_modified(reg->store, MD_SG_DOMAINS, name, ViewFiles[i], p);
+    }
+}
+
+static void view_drop(md_reg_t *reg, const char *name)
+{
+    reg_view_t *view;
+    
+    if (NULL != (view = apr_hash_get(reg->views, name, APR_HASH_KEY_STRING))) {
+        apr_hash_set(reg->views, name, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(view->p);
+    }
+}
+
+static void reg_view_drop(md_reg_t *reg, const char *name)
+{
+    reg_lock(reg);
+    view_drop(reg, name);
+    reg_unlock(reg);
+}
+
+static int view_is_current(md_reg_t *reg, const reg_view_t *view, apr_pool_t *p)
+{
+    apr_time_t mtimes[VIEW_FILES_COUNT];
+    
+    if (view->md->state == MD_S_ERROR) {
+        /* always look again, the cause might be gone */
+        return 0;
+    }
+    if (view->md->state == MD_S_COMPLETE && view->md->expires 
+        && view->md->expires <= apr_time_now()) {
+        /* state is no longer what it was */
+        return 0;
+    }
+    view_mtimes_get(mtimes, reg, view->md->name, p);
+    return (!memcmp(mtimes, view->mtimes, sizeof(mtimes)) && mtimes[0] != 0);
+}
+
+static reg_view_t *reg_view_make(md_reg_t *reg, const char *name, apr_pool_t *p)
+{
+    reg_view_t *view;
+    apr_pool_t *vp;
+    md_t *md;
+    apr_status_t rv;
+    
+    apr_pool_create(&vp, reg->cache_p);
+    view = apr_pcalloc(vp, sizeof(*view));
+    view->p = vp;
+    if (APR_SUCCESS != (rv = md_load(reg->store, MD_SG_DOMAINS, name, &md, vp))
+        || APR_SUCCESS != (rv = state_init_creds(reg, vp, md, 1, &view->creds))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, p, "md{%s}: no view", name);
+        apr_pool_destroy(vp);
+        return NULL;
+    }
+    view->md = md;
+    /* states might have been saved, take the times afterwards */
+    view_mtimes_get(view->mtimes, reg, md->name, p);
+    return view;
+}
+
+apr_status_t md_reg_get_view(const md_t **pmd, const md_creds_t **pcreds, 
+                             md_reg_t *reg, const char *name, apr_pool_t *p)
+{
+    reg_view_t *view;
+    apr_status_t rv = APR_SUCCESS;
+    
+    reg_lock(reg);
+    view = apr_hash_get(reg->views, name, APR_HASH_KEY_STRING);
+    if (view && !view_is_current(reg, view, p)) {
+        view_drop(reg, name);
+        view = NULL;
+    }
+    if (!view && NULL != (view = reg_view_make(reg, name, p))) {
+        apr_hash_set(reg->views, view->md->name, APR_HASH_KEY_STRING, view);
+    }
+    if (view) {
+        *pmd = view->md;
+        if (pcreds) *pcreds = view->creds;
+    }
+    else {
+        *pmd = NULL;
+        if (pcreds) *pcreds = NULL;
+        rv = APR_ENOENT;
+    }
+    reg_unlock(reg);
+    return rv;
+}
+
+/* The registry keeps an index of the names and domains of all MDs in its store, so
+ * that lookups by domain do not need to load every md.json. The index is made on 
+ * first use and kept up to date by the changes done via the registry. Every update
+ * allocates from the index pool, so after MD_REG_INDEX_MAX_PUTS of them the live
+ * entries are copied into a fresh pool and the old one is destroyed. */
+
+#define MD_REG_INDEX_MAX_PUTS   100
+
+static void index_drop(md_reg_t *reg)
+{
+    if (reg->index_p) {
+        apr_pool_destroy(reg->index_p);
+        reg->index_p = NULL;
+    }
+    reg->domains = NULL;
+    reg->index_puts = 0;
+}
+
+static apr_status_t index_add(md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    md_t *imd, *other;
+    const char *domain;
+    apr_status_t rv;
+    
+    imd = md_create_empty(reg->index_p);
+    imd->name = apr_pstrdup(reg->index_p, md->name);
+    imd->domains = md->domains? md_array_str_clone(reg->index_p, md->domains) : NULL;
+    if (APR_SUCCESS != (rv = md_index_add(reg->domains, imd, &other, &domain))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "md %s shares domain '%s' with md %s in store", 
+                      md->name, domain, other->name);
+    }
+    return rv;
+}
+
+typedef struct {
+    md_reg_t *reg;
+    apr_pool_t *p;
+} index_copy_ctx;
+
+static int index_copy_md(void *baton, md_t *md)
+{
+    index_copy_ctx *ctx = baton;
+    
+    index_add(ctx->reg, md, ctx->p);
+    return 1;
+}
+
+static apr_status_t index_recycle(md_reg_t *reg, apr_pool_t *p)
+{
+    index_copy_ctx ctx;
+    md_index_t *old;
+    apr_pool_t *old_p;
+    apr_status_t rv;
+    
+    old = reg->domains;
+    old_p = reg->index_p;
+    if (APR_SUCCESS != (rv = apr_pool_create(&reg->index_p, reg->cache_p))) {
+        reg->index_p = old_p;
+        return rv;
+    }
+    apr_pool_tag(reg->index_p, "md_reg_index");
+    reg->domains = md_index_create(reg->index_p);
+    ctx.reg = reg;
+    ctx.p = p;
+    md_index_do(old, index_copy_md, &ctx);
+    apr_pool_destroy(old_p);
+    reg->index_puts = 0;
+    return APR_SUCCESS;
+}
+
+static void index_put(md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    if (reg->domains) {
+        if (++reg->index_puts > MD_REG_INDEX_MAX_PUTS 
+            && APR_SUCCESS != index_recycle(reg, p)) {
+            index_drop(reg);
+        }
+        else if (APR_SUCCESS != index_add(reg, md, p)) {
+            /* the entry of md still carries its old domains, make the index anew
+             * from the store, the same way as on first lookup */
+            index_drop(reg);
+        }
+    }
+}
+
+static void reg_index_put(md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    reg_lock(reg);
+    index_put(reg, md, p);
+    reg_unlock(reg);
+}
+
+static void reg_index_remove(md_reg_t *reg, const char *name)
+{
+    reg_lock(reg);
+    if (reg->domains) {
+        md_index_remove(reg->domains, name);
+    }
+    reg_unlock(reg);
+}
+
+static int idx_add_md(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
+{
+    md_reg_t *reg = baton;
+    
+    (void)store;
+    index_add(reg, md, ptemp);
+    return 1;
+}
+
+/* Get the index, made on first use, with the registry locked. */
+static md_index_t *index_get(md_reg_t *reg, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    if (!reg->domains) {
+        if (APR_SUCCESS != (rv = apr_pool_create(&reg->index_p, reg->cache_p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "creating index pool");
+            reg->index_p = NULL;
+            return NULL;
+        }
+        apr_pool_tag(reg->index_p, "md_reg_index");
+        reg->domains = md_index_create(reg->index_p);
+        rv = md_store_md_iter(idx_add_md, reg, reg->store, p, MD_SG_DOMAINS, "*");
+        if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "indexing mds in store");
+            index_drop(reg);
+        }
+    }
+    return reg->domains;
+}
+
 typedef struct {
     const char *domain;
     md_t *md;
@@ -384,7 +873,19 @@ static int find_domain(void *baton, md_reg_t *reg, md_t *md)
 md_t *md_reg_find(md_reg_t *reg, const char *domain, apr_pool_t *p)
 {
     find_domain_ctx ctx;
+    md_index_t *idx;
+    md_t *md;
+    const char *name = NULL;
 
+    reg_lock(reg);
+    if ((idx = index_get(reg, p)) && (md = md_index_get_by_domain_exact(idx, domain))) {
+        name = apr_pstrdup(p, md->name);
+    }
+    reg_unlock(reg);
+    if (idx) {
+        return name? md_reg_get(reg, name, p) : NULL;
+    }
+    
     ctx.domain = domain;
     ctx.md = NULL;
     
@@ -418,6 +919,18 @@ static int find_overlap(void *baton, md_reg_t *reg, md_t *md)
 md_t *md_reg_find_overlap(md_reg_t *reg, const md_t *md, const char **pdomain, apr_pool_t *p)
 {
     find_overlap_ctx ctx;
+    md_index_t *idx;
+    md_t *other;
+    const char *name = NULL;
+    
+    reg_lock(reg);
+    if ((idx = index_get(reg, p)) && (other = md_index_get_by_dns_overlap(idx, md, pdomain))) {
+        name = apr_pstrdup(p, other->name);
+    }
+    reg_unlock(reg);
+    if (idx) {
+        return name? md_reg_get(reg, name, p) : NULL;
+    }
     
     ctx.md_checked = md;
     ctx.md = NULL;
@@ -459,6 +972,8 @@ static apr_status_t p_md_add(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     if (APR_SUCCESS == (rv = check_values(reg, ptemp, md, MD_UPD_ALL))
         && APR_SUCCESS == (rv = state_init(reg, ptemp, mine, 0))
         && APR_SUCCESS == (rv = md_save(reg->store, p, MD_SG_DOMAINS, mine, 1))) {
+        reg_view_drop(reg, mine->name);
+        reg_index_put(reg, mine, ptemp);
     }
     return rv;
 }
@@ -556,6 +1071,10 @@ static apr_status_t p_md_update(void *baton, apr_pool_t *p, apr_pool_t *ptemp, v
     }
     
     if (fields && APR_SUCCESS == (rv = md_save(reg->store, p, MD_SG_DOMAINS, nmd, 0))) {
+        reg_view_drop(reg, nmd->name);
+        if (MD_UPD_DOMAINS & fields) {
+            reg_index_put(reg, nmd, ptemp);
+        }
         rv = state_init(reg, ptemp, nmd, 0);
     }
     return rv;
@@ -574,6 +1093,7 @@ apr_status_t md_reg_delete_acct(md_reg_t *reg, apr_pool_t *p, const char *acct_i
     rv = md_store_remove(reg->store, MD_SG_ACCOUNTS, acct_id, MD_FN_ACCOUNT, p, 1);
     if (APR_SUCCESS == rv) {
         md_store_remove(reg->store, MD_SG_ACCOUNTS, acct_id, MD_FN_ACCT_KEY, p, 1);
+        md_acme_acct_index_remove(reg->store, p, acct_id);
     }
     return rv;
 }
@@ -645,9 +1165,33 @@ apr_status_t md_reg_creds_get(const md_creds_t **pcreds, md_reg_t *reg,
 /**************************************************************************************************/
 /* synching */
 
+/* Sync reads all MDs in the store, indexes them by name and domain and compares 
+ * them with the configured ones. The changes this requires are collected and only
+ * written to the store once all configured MDs have been checked. A configuration 
+ * that cannot be synced leaves the store as it was. */
+
+#define MD_SYNC_READ_MIN        64  /* read MDs in parallel when the store has that many */
+#define MD_SYNC_READ_WORKERS    8
+
+typedef enum {
+    MD_SYNC_ADD,
+    MD_SYNC_UPDATE,
+    MD_SYNC_REMOVE,
+} md_sync_op_t;
+
+typedef struct {
+    md_sync_op_t op;
+    md_t *md;                       /* copy of the md as it is to be written */
+    int fields;                     /* MD_UPD_* flags for MD_SYNC_UPDATE */
+} sync_change_t;
+
 typedef struct {
     apr_pool_t *p;
     apr_array_header_t *store_mds;
+    md_index_t *idx;                /* store_mds by name and domain */
+    apr_array_header_t *conflicts;  /* store_mds sharing a domain with an indexed md */
+    apr_hash_t *config_mds;         /* name -> configured md_t* */
+    apr_array_header_t *changes;    /* sync_change_t*, in the order they are to be made */
 } sync_ctx;
 
 static int do_add_md(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
@@ -660,18 +1204,281 @@ static int do_add_md(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp
     return 1;
 }
 
+static int do_add_name(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    apr_array_header_t *names = baton;
+    
+    (void)ptemp;
+    APR_ARRAY_PUSH(names, const char*) = apr_pstrdup(names->pool, name);
+    return 1;
+}
+
+#if APR_HAS_THREADS
+
+typedef struct {
+    md_reg_t *reg;
+    apr_array_header_t *names;
+    md_t **mds;                     /* md loaded for names[i], if any */
+    int next;
+    apr_status_t rv;                /* first error encountered */
+    apr_thread_mutex_t *mutex;
+} sync_read_queue;
+
+typedef struct {
+    sync_read_queue *queue;
+    apr_pool_t *p;
+} sync_reader;
+
+static void sync_read_all(sync_read_queue *queue, apr_pool_t *p)
+{
+    apr_status_t rv;
+    md_t *md;
+    int i;
+    
+    while (1) {
+        apr_thread_mutex_lock(queue->mutex);
+        i = (queue->next < queue->names->nelts && APR_SUCCESS == queue->rv)? queue->next++ : -1;
+        apr_thread_mutex_unlock(queue->mutex);
+        if (i < 0) break;
+        
+        rv = md_load(queue->reg->store, MD_SG_DOMAINS, 
+                     APR_ARRAY_IDX(queue->names, i, const char*), &md, p);
+        if (APR_SUCCESS == rv) {
+            queue->mds[i] = md;
+        }
+        else if (!APR_STATUS_IS_ENOENT(rv)) {
+            apr_thread_mutex_lock(queue->mutex);
+            if (APR_SUCCESS == queue->rv) queue->rv = rv;
+            apr_thread_mutex_unlock(queue->mutex);
+        }
+    }
+}
+
+static void * APR_THREAD_FUNC sync_read_run(apr_thread_t *thread, void *baton)
+{
+    sync_reader *reader = baton;
+    
+    sync_read_all(reader->queue, reader->p);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t read_mds_parallel(md_reg_t *reg, sync_ctx *ctx, apr_array_header_t *names)
+{
+    sync_read_queue *queue;
+    sync_reader *readers;
+    apr_thread_t **threads;
+    apr_allocator_t *allocator;
+    apr_status_t rv, rv2;
+    int i;
+    
+    queue = apr_pcalloc(ctx->p, sizeof(*queue));
+    queue->reg = reg;
+    queue->names = names;
+    queue->mds = apr_pcalloc(ctx->p, (apr_size_t)names->nelts * sizeof(md_t*));
+    rv = apr_thread_mutex_create(&queue->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->p);
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    
+    readers = apr_pcalloc(ctx->p, MD_SYNC_READ_WORKERS * sizeof(*readers));
+    threads = apr_pcalloc(ctx->p, MD_SYNC_READ_WORKERS * sizeof(*threads));
+    for (i = 0; i < MD_SYNC_READ_WORKERS; ++i) {
+        readers[i].queue = queue;
+        /* readers run concurrently, each needs its own allocator */
+        if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+            break;
+        }
+        if (APR_SUCCESS != (rv = apr_pool_create_ex(&readers[i].p, ctx->p, NULL, allocator))) {
+            apr_allocator_destroy(allocator);
+            break;
+        }
+        apr_allocator_owner_set(allocator, readers[i].p);
+        apr_pool_tag(readers[i].p, "md_sync_reader");
+        if (APR_SUCCESS != (rv = apr_thread_create(&threads[i], NULL, 
+                                                   sync_read_run, &readers[i], ctx->p))) {
+            break;
+        }
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, 
+                  "sync: reading %d mds with %d threads", names->nelts, i);
+    if (i == 0) {
+        /* no thread could be started, read them here */
+        sync_read_all(queue, ctx->p);
+    }
+    while (i > 0) {
+        apr_thread_join(&rv2, threads[--i]);
+    }
+
+    /* the mds live in the reader pools, which are destroyed together with ctx->p */
+    if (APR_SUCCESS == (rv = queue->rv)) {
+        for (i = 0; i < names->nelts; ++i) {
+            if (queue->mds[i]) {
+                APR_ARRAY_PUSH(ctx->store_mds, const md_t*) = queue->mds[i];
+            }
+        }
+    }
+    return rv;
+}
+
+#endif /* APR_HAS_THREADS */
+
 static apr_status_t read_store_mds(md_reg_t *reg, sync_ctx *ctx)
 {
-    int rv;
+    apr_array_header_t *names;
+    apr_status_t rv;
+    md_t *md;
+    int i;
     
     apr_array_clear(ctx->store_mds);
-    rv = md_store_md_iter(do_add_md, ctx, reg->store, ctx->p, MD_SG_DOMAINS, "*");
+    names = apr_array_make(ctx->p, 100, sizeof(const char*));
+    rv = md_store_iter_names(do_add_name, names, reg->store, ctx->p, MD_SG_DOMAINS, "*");
+    if (APR_ENOTIMPL == rv) {
+        rv = md_store_md_iter(do_add_md, ctx, reg->store, ctx->p, MD_SG_DOMAINS, "*");
+    }
+#if APR_HAS_THREADS
+    else if (APR_SUCCESS == rv && names->nelts >= MD_SYNC_READ_MIN) {
+        rv = read_mds_parallel(reg, ctx, names);
+    }
+#endif
+    else if (APR_SUCCESS == rv) {
+        for (i = 0; i < names->nelts && APR_SUCCESS == rv; ++i) {
+            rv = md_load(reg->store, MD_SG_DOMAINS, APR_ARRAY_IDX(names, i, const char*), 
+                         &md, ctx->p);
+            if (APR_SUCCESS == rv) {
+                APR_ARRAY_PUSH(ctx->store_mds, const md_t*) = md;
+            }
+            else if (APR_STATUS_IS_ENOENT(rv)) {
+                /* not an md directory */
+                rv = APR_SUCCESS;
+            }
+        }
+    }
     if (APR_STATUS_IS_ENOENT(rv)) {
         rv = APR_SUCCESS;
     }
     return rv;
 }
 
+static void sync_index_put(sync_ctx *ctx, md_t *md)
+{
+    md_t *other;
+    const char *domain;
+    int i;
+    
+    if (APR_SUCCESS != md_index_add(ctx->idx, md, &other, &domain)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_EEXIST, ctx->p, 
+                      "md %s shares domain '%s' with md %s in store", 
+                      md->name, domain, other->name);
+        md_index_remove(ctx->idx, md->name);
+        for (i = 0; i < ctx->conflicts->nelts; ++i) {
+            if (md == APR_ARRAY_IDX(ctx->conflicts, i, md_t*)) return;
+        }
+        APR_ARRAY_PUSH(ctx->conflicts, md_t*) = md;
+    }
+}
+
+static int sync_is_indexed(sync_ctx *ctx, const md_t *md)
+{
+    return md_index_get_by_name(ctx->idx, md->name) == md;
+}
+
+/* Same as md_find_closest_match(), using the index */
+static md_t *sync_closest_match(sync_ctx *ctx, const md_t *md)
+{
+    md_t *candidate, *m;
+    apr_size_t cand_n, n;
+    int i, j;
+    
+    if ((candidate = md_index_get_by_name(ctx->idx, md->name))) {
+        return candidate;
+    }
+    if (md->domains && md->domains->nelts > 0) {
+        /* an md that contains all domain names from md owns the first one */
+        m = md_index_get_by_domain_exact(ctx->idx, APR_ARRAY_IDX(md->domains, 0, const char*));
+        if (m && md_contains_domains(m, md)) {
+            return m;
+        }
+        /* otherwise, take the one that has most domain names in common */
+        cand_n = 0;
+        for (i = 0; i < md->domains->nelts; ++i) {
+            m = md_index_get_by_domain_exact(ctx->idx, APR_ARRAY_IDX(md->domains, i, const char*));
+            if (!m || m == candidate) continue;
+            for (j = 0; j < i; ++j) {
+                if (m == md_index_get_by_domain_exact(ctx->idx, 
+                                                      APR_ARRAY_IDX(md->domains, j, const char*))) {
+                    break;
+                }
+            }
+            if (j < i) continue; /* counted already */
+            n = md_common_name_count(md, m);
+            if (n > cand_n) {
+                candidate = m;
+                cand_n = n;
+            }
+        }
+    }
+    if (!candidate && !apr_is_empty_array(ctx->conflicts)) {
+        candidate = md_find_closest_match(ctx->conflicts, md);
+    }
+    return candidate;
+}
+
+static md_t *sync_overlap(sync_ctx *ctx, const md_t *md, const char **pcommon)
+{
+    md_t *omd;
+    
+    if ((omd = md_index_get_by_dns_overlap(ctx->idx, md, pcommon))) {
+        return omd;
+    }
+    if (!apr_is_empty_array(ctx->conflicts) 
+        && (omd = md_get_by_dns_overlap(ctx->conflicts, md))) {
+        *pcommon = md_common_name(md, omd);
+        return omd;
+    }
+    return NULL;
+}
+
+static void sync_change(sync_ctx *ctx, md_sync_op_t op, const md_t *md, int fields)
+{
+    sync_change_t *change;
+    
+    change = apr_pcalloc(ctx->p, sizeof(*change));
+    change->op = op;
+    change->md = md_clone(ctx->p, md);
+    change->fields = fields;
+    APR_ARRAY_PUSH(ctx->changes, sync_change_t*) = change;
+}
+
+static apr_status_t sync_apply(md_reg_t *reg, sync_ctx *ctx, apr_pool_t *p)
+{
+    sync_change_t *change;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                  "sync: %d changes to the store", ctx->changes->nelts);
+    for (i = 0; i < ctx->changes->nelts && APR_SUCCESS == rv; ++i) {
+        change = APR_ARRAY_IDX(ctx->changes, i, sync_change_t*);
+        switch (change->op) {
+            case MD_SYNC_ADD:
+                rv = md_reg_add(reg, change->md, ctx->p);
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "new md %s added", 
+                              change->md->name);
+                break;
+            case MD_SYNC_UPDATE:
+                rv = md_reg_update(reg, ctx->p, change->md->name, change->md, change->fields);
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "md %s updated", 
+                              change->md->name);
+                break;
+            case MD_SYNC_REMOVE:
+                md_reg_remove(reg, ctx->p, change->md->name, 1); /* best effort */
+                break;
+        }
+    }
+    return rv;
+}
+
 apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int can_https)
 {
     if (reg->can_http != can_http || reg->can_https != can_https) {
@@ -689,6 +1496,126 @@ apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int ca
     return APR_SUCCESS;
 }
  
+/**************************************************************************************************/
+/* sync digests */
+
+/* The outcome of a sync depends on the configured mds and on what is in the store.
+ * When the configuration of each md hashes to what it did at the last sync, and
+ * no md in the store was added, removed or changed since, syncing again changes
+ * nothing. Looking at the store then only takes a stat() per md. */
+
+static const char *sync_digest(const md_t *md, apr_pool_t *p)
+{
+    md_json_t *json;
+    const char *s, *digest;
+    
+    json = md_json_create(p);
+    md_json_setsa(md->domains, json, MD_KEY_DOMAINS, NULL);
+    md_json_setsa(md->contacts, json, MD_KEY_CONTACTS, NULL);
+    md_json_sets(md->ca_url, json, MD_KEY_CA, MD_KEY_URL, NULL);
+    md_json_sets(md->ca_proto, json, MD_KEY_CA, MD_KEY_PROTO, NULL);
+    md_json_sets(md->ca_agreement, json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL);
+    if (md->ca_challenges) {
+        md_json_setsa(md->ca_challenges, json, MD_KEY_CA, MD_KEY_CHALLENGES, NULL);
+    }
+    if (md->pkey_spec) {
+        md_json_setj(md_pkey_spec_to_json(md->pkey_spec, p), json, MD_KEY_PKEY, NULL);
+    }
+    md_json_setl(md->transitive, json, MD_KEY_TRANSITIVE, NULL);
+    md_json_setl(md->drive_mode, json, MD_KEY_DRIVE_MODE, NULL);
+    md_json_setl((long)apr_time_sec(md->renew_norm), json, MD_KEY_RENEW_WINDOW, "norm", NULL);
+    md_json_setl((long)apr_time_sec(md->renew_window), json, MD_KEY_RENEW_WINDOW, "len", NULL);
+    md_json_setl(md->require_https, json, MD_KEY_REQUIRE_HTTPS, NULL);
+    md_json_setl(md->must_staple, json, MD_KEY_MUST_STAPLE, NULL);
+    md_json_setb(md->can_acme_tls_1, json, MD_KEY_PROTO, MD_KEY_ACME_TLS_1, NULL);
+    
+    if (!(s = md_json_writep(json, p, MD_JSON_FMT_COMPACT))
+        || APR_SUCCESS != md_crypt_sha256_digest_hex(&digest, p, s, strlen(s))) {
+        return NULL;
+    }
+    return digest;
+}
+
+static const char *sync_store_modified(md_reg_t *reg, const char *name, apr_pool_t *p)
+{
+    return apr_psprintf(p, "%" APR_TIME_T_FMT, 
+                        md_store_get_modified(reg->store, MD_SG_DOMAINS, name, MD_FN_MD, p));
+}
+
+/* Return != 0 iff the last sync was for the same configuration and store content. 
+ * Configured mds then get the names they have in the store. */
+static int sync_unchanged(md_reg_t *reg, apr_array_header_t *master_mds, 
+                          const char **digests, apr_array_header_t *store_names, 
+                          apr_pool_t *p)
+{
+    md_json_t *json;
+    md_t *md;
+    const char *name, *s;
+    int i;
+    
+    if (APR_SUCCESS != md_store_load_json(reg->store, MD_SG_NONE, NULL, MD_FN_SYNC, &json, p)
+        || md_json_getl(json, MD_KEY_STORE, MD_KEY_COUNT, NULL) != store_names->nelts
+        || md_json_getl(json, MD_KEY_MDS, MD_KEY_COUNT, NULL) != master_mds->nelts) {
+        return 0;
+    }
+    for (i = 0; i < store_names->nelts; ++i) {
+        name = APR_ARRAY_IDX(store_names, i, const char*);
+        if (!(s = md_json_gets(json, MD_KEY_STORE, MD_KEY_MODIFIED, name, NULL))
+            || strcmp(sync_store_modified(reg, name, p), s)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < master_mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(master_mds, i, md_t *);
+        if (!digests[i] 
+            || !(s = md_json_gets(json, MD_KEY_MDS, MD_KEY_DIGEST, md->name, NULL)) 
+            || strcmp(digests[i], s)
+            || !md_json_gets(json, MD_KEY_MDS, MD_KEY_NAME, md->name, NULL)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < master_mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(master_mds, i, md_t *);
+        name = md_json_gets(json, MD_KEY_MDS, MD_KEY_NAME, md->name, NULL);
+        if (strcmp(md->name, name)) {
+            md->name = apr_pstrdup(reg->p, name);
+        }
+    }
+    return 1;
+}
+
+static void sync_save(md_reg_t *reg, apr_array_header_t *master_mds, 
+                      const char **config_names, const char **digests, apr_pool_t *p)
+{
+    apr_array_header_t *store_names;
+    md_json_t *json;
+    const char *name;
+    int i;
+    
+    store_names = apr_array_make(p, master_mds->nelts + 1, sizeof(const char*));
+    if (APR_SUCCESS != md_store_iter_names(do_add_name, store_names, reg->store, p, 
+                                           MD_SG_DOMAINS, "*")) {
+        return;
+    }
+    json = md_json_create(p);
+    md_json_setl(store_names->nelts, json, MD_KEY_STORE, MD_KEY_COUNT, NULL);
+    for (i = 0; i < store_names->nelts; ++i) {
+        name = APR_ARRAY_IDX(store_names, i, const char*);
+        md_json_sets(sync_store_modified(reg, name, p), 
+                     json, MD_KEY_STORE, MD_KEY_MODIFIED, name, NULL);
+    }
+    md_json_setl(master_mds->nelts, json, MD_KEY_MDS, MD_KEY_COUNT, NULL);
+    for (i = 0; i < master_mds->nelts; ++i) {
+        if (!digests[i]) {
+            return;
+        }
+        md_json_sets(digests[i], json, MD_KEY_MDS, MD_KEY_DIGEST, config_names[i], NULL);
+        md_json_sets(APR_ARRAY_IDX(master_mds, i, md_t *)->name, 
+                     json, MD_KEY_MDS, MD_KEY_NAME, config_names[i], NULL);
+    }
+    md_store_save_json(reg->store, p, MD_SG_NONE, NULL, MD_FN_SYNC, json, 0);
+}
+
 /**
  * Procedure:
  * 1. Collect all defined "managed domains" (MD). It does not matter where a MD is defined. 
@@ -709,26 +1636,62 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                          apr_array_header_t *master_mds) 
 {
     sync_ctx ctx;
+    apr_array_header_t *store_names;
+    const char **digests, **config_names;
     apr_status_t rv;
+    int i;
+
+    /* names in the store are listed cheaply, their number tells of mds added
+     * or removed by others */
+    store_names = apr_array_make(ptemp, master_mds->nelts + 1, sizeof(const char*));
+    digests = apr_pcalloc(ptemp, (apr_size_t)(master_mds->nelts + 1) * sizeof(const char*));
+    config_names = apr_pcalloc(ptemp, (apr_size_t)(master_mds->nelts + 1) * sizeof(const char*));
+    for (i = 0; i < master_mds->nelts; ++i) {
+        config_names[i] = APR_ARRAY_IDX(master_mds, i, md_t *)->name;
+        digests[i] = sync_digest(APR_ARRAY_IDX(master_mds, i, md_t *), ptemp);
+    }
+    if (APR_SUCCESS == md_store_iter_names(do_add_name, store_names, reg->store, ptemp, 
+                                           MD_SG_DOMAINS, "*")
+        && sync_unchanged(reg, master_mds, digests, store_names, ptemp)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                      "sync: %d mds unchanged since last sync", master_mds->nelts);
+        return APR_SUCCESS;
+    }
 
     ctx.p = ptemp;
     ctx.store_mds = apr_array_make(ptemp,100, sizeof(md_t *));
+    ctx.idx = md_index_create(ptemp);
+    ctx.conflicts = apr_array_make(ptemp, 5, sizeof(md_t *));
+    ctx.config_mds = apr_hash_make(ptemp);
+    ctx.changes = apr_array_make(ptemp, 10, sizeof(sync_change_t *));
     rv = read_store_mds(reg, &ctx);
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
                   "sync: found %d mds in store", ctx.store_mds->nelts);
     if (APR_SUCCESS == rv) {
-        int i, fields;
+        int fields, indexed;
         md_t *md, *config_md, *smd, *omd;
         const char *common;
         
+        for (i = 0; i < ctx.store_mds->nelts; ++i) {
+            sync_index_put(&ctx, APR_ARRAY_IDX(ctx.store_mds, i, md_t *));
+        }
         for (i = 0; i < master_mds->nelts; ++i) {
             md = APR_ARRAY_IDX(master_mds, i, md_t *);
+            apr_hash_set(ctx.config_mds, md->name, APR_HASH_KEY_STRING, md);
+        }
+        
+        for (i = 0; i < master_mds->nelts && APR_SUCCESS == rv; ++i) {
+            md = APR_ARRAY_IDX(master_mds, i, md_t *);
             
             /* find the store md that is closest match for the configured md */
-            smd = md_find_closest_match(ctx.store_mds, md);
+            smd = sync_closest_match(&ctx, md);
             if (smd) {
                 fields = 0;
+                /* the index needs to drop domains before they change */
+                if ((indexed = sync_is_indexed(&ctx, smd))) {
+                    md_index_remove(ctx.idx, smd->name);
+                }
                 
                 /* Once stored, we keep the name */
                 if (strcmp(md->name, smd->name)) {
@@ -745,13 +1708,12 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                 }
                 
                 /* Look for other store mds which have domains now being part of smd */
-                while (APR_SUCCESS == rv && (omd = md_get_by_dns_overlap(ctx.store_mds, md))) {
-                    /* find the name now duplicate */
-                    common = md_common_name(md, omd);
+                while (APR_SUCCESS == rv && (omd = sync_overlap(&ctx, md, &common))) {
+                    /* the name now duplicate */
                     assert(common);
                     
                     /* Is this md still configured or has it been abandoned in the config? */
-                    config_md = md_get_by_name(master_mds, omd->name);
+                    config_md = apr_hash_get(ctx.config_mds, omd->name, APR_HASH_KEY_STRING);
                     if (config_md && md_contains(config_md, common, 0)) {
                         /* domain used in two configured mds, not allowed */
                         rv = APR_EINVAL;
@@ -762,18 +1724,29 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                     else {
                         /* remove it from the other md and update store, or, if it
                          * is now empty, move it into the archive */
+                        int oindexed = sync_is_indexed(&ctx, omd);
+                        
+                        if (oindexed) {
+                            md_index_remove(ctx.idx, omd->name);
+                        }
                         omd->domains = md_array_str_remove(ptemp, omd->domains, common, 0);
                         if (apr_is_empty_array(omd->domains)) {
                             md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
                                           "All domains of the MD %s have moved elsewhere, "
                                           " moving it to the archive. ", omd->name);
-                            md_reg_remove(reg, ptemp, omd->name, 1); /* best effort */
+                            sync_change(&ctx, MD_SYNC_REMOVE, omd, 0);
                         }
                         else {
-                            rv = md_reg_update(reg, ptemp, omd->name, omd, MD_UPD_DOMAINS);
+                            if (oindexed) {
+                                sync_index_put(&ctx, omd);
+                            }
+                            sync_change(&ctx, MD_SYNC_UPDATE, omd, MD_UPD_DOMAINS);
                         }
                     }
                 }
+                if (indexed) {
+                    sync_index_put(&ctx, smd);
+                }
 
                 if (MD_SVAL_UPDATE(md, smd, ca_url)) {
                     smd->ca_url = md->ca_url;
@@ -842,16 +1815,21 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                 }
                 
                 if (fields) {
-                    rv = md_reg_update(reg, ptemp, smd->name, smd, fields);
-                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "md %s updated", smd->name);
+                    sync_change(&ctx, MD_SYNC_UPDATE, smd, fields);
                 }
             }
             else {
                 /* new managed domain */
-                rv = md_reg_add(reg, md, ptemp);
-                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "new md %s added", md->name);
+                sync_change(&ctx, MD_SYNC_ADD, md, 0);
             }
         }
+        
+        if (APR_SUCCESS == rv) {
+            rv = sync_apply(reg, &ctx, p);
+        }
+        if (APR_SUCCESS == rv) {
+            sync_save(reg, master_mds, config_names, digests, ptemp);
+        }
     }
     else {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "loading mds");
@@ -862,7 +1840,14 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
 
 apr_status_t md_reg_remove(md_reg_t *reg, apr_pool_t *p, const char *name, int archive)
 {
-    return md_store_move(reg->store, p, MD_SG_DOMAINS, MD_SG_ARCHIVE, name, archive);
+    apr_status_t rv;
+    
+    rv = md_store_move(reg->store, p, MD_SG_DOMAINS, MD_SG_ARCHIVE, name, archive);
+    reg_view_drop(reg, name);
+    if (APR_SUCCESS == rv) {
+        reg_index_remove(reg, name);
+    }
+    return rv;
 }
 
 
@@ -892,6 +1877,106 @@ static apr_status_t init_proto_driver(md_proto_driver_t *driver, const md_proto_
     return rv;
 }
 
+/**************************************************************************************************/
+/* staged sets */
+
+/* The names of mds with a staged set are kept in MD_FN_STAGED, so that loading at
+ * startup does not have to look into the staging area of every md. Where the file
+ * does not exist yet, the staging area is listed once to make it. Entries for sets
+ * that are gone are dropped at the next load. */
+
+static int staged_add_name(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    md_json_t *json = baton;
+    
+    (void)ptemp;
+    md_json_sets(name, json, MD_KEY_STAGED, name, NULL);
+    return 1;
+}
+
+static apr_status_t staged_load(md_json_t **pjson, md_reg_t *reg, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    rv = md_store_load_json(reg->store, MD_SG_NONE, NULL, MD_FN_STAGED, pjson, p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        *pjson = md_json_create(p);
+        md_json_setj(md_json_create(p), *pjson, MD_KEY_STAGED, NULL);
+        rv = md_store_iter_names(staged_add_name, *pjson, reg->store, p, MD_SG_STAGING, "*");
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_SUCCESS;
+        }
+        if (APR_SUCCESS == rv) {
+            rv = md_store_save_json(reg->store, p, MD_SG_NONE, NULL, MD_FN_STAGED, *pjson, 0);
+        }
+    }
+    return rv;
+}
+
+static void staged_update(md_reg_t *reg, const char *name, int staged, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_status_t rv;
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(reg->staged_mutex);
+#endif
+    if (APR_SUCCESS == (rv = staged_load(&json, reg, p))
+        && staged != md_json_has_key(json, MD_KEY_STAGED, name, NULL)) {
+        if (staged) {
+            md_json_sets(name, json, MD_KEY_STAGED, name, NULL);
+        }
+        else {
+            md_json_del(json, MD_KEY_STAGED, name, NULL);
+        }
+        rv = md_store_save_json(reg->store, p, MD_SG_NONE, NULL, MD_FN_STAGED, json, 0);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(reg->staged_mutex);
+#endif
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "%s: recording staged set", name);
+    }
+}
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *names;
+} staged_ctx;
+
+static int staged_collect(void *baton, const char *key, md_json_t *json)
+{
+    staged_ctx *ctx = baton;
+    
+    (void)json;
+    key = apr_pstrdup(ctx->p, key);
+    apr_hash_set(ctx->names, key, APR_HASH_KEY_STRING, key);
+    return 1;
+}
+
+apr_status_t md_reg_get_staged(apr_hash_t **pnames, md_reg_t *reg, apr_pool_t *p)
+{
+    md_json_t *json;
+    staged_ctx ctx;
+    apr_status_t rv;
+    
+    *pnames = NULL;
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(reg->staged_mutex);
+#endif
+    rv = staged_load(&json, reg, p);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(reg->staged_mutex);
+#endif
+    if (APR_SUCCESS == rv) {
+        ctx.p = p;
+        ctx.names = apr_hash_make(p);
+        md_json_iterkey(staged_collect, &ctx, json, MD_KEY_STAGED, NULL);
+        *pnames = ctx.names;
+    }
+    return rv;
+}
+
 static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_reg_t *reg = baton;
@@ -900,7 +1985,8 @@ static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     int reset;
     md_proto_driver_t *driver;
     const char *challenge;
-    apr_time_t *pvalid_from;
+    apr_interval_time_t max_block;
+    apr_time_t *presume_at, *pvalid_from;
     apr_status_t rv;
     
     (void)p;
@@ -908,26 +1994,36 @@ static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     md = va_arg(ap, const md_t *);
     challenge = va_arg(ap, const char *);
     reset = va_arg(ap, int); 
+    max_block = va_arg(ap, apr_interval_time_t);
+    presume_at = va_arg(ap, apr_time_t*);
     pvalid_from = va_arg(ap, apr_time_t*);
     
     driver = apr_pcalloc(ptemp, sizeof(*driver));
     rv = init_proto_driver(driver, proto, reg, md, challenge, reset, ptemp);
+    driver->max_block = max_block;
     if (APR_SUCCESS == rv && 
         APR_SUCCESS == (rv = proto->init(driver))) {
         
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "%s: run staging", md->name);
         rv = proto->stage(driver);
 
+        if (APR_SUCCESS == rv) {
+            staged_update(reg, md->name, 1, ptemp);
+        }
         if (APR_SUCCESS == rv && pvalid_from) {
             *pvalid_from = driver->stage_valid_from;
         }
+        else if (APR_STATUS_IS_EAGAIN(rv) && presume_at) {
+            *presume_at = driver->resume_at;
+        }
     }
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: staging done", md->name);
     return rv;
 }
 
 apr_status_t md_reg_stage(md_reg_t *reg, const md_t *md, const char *challenge, 
-                          int reset, apr_time_t *pvalid_from, apr_pool_t *p)
+                          int reset, apr_interval_time_t max_block, apr_time_t *presume_at,
+                          apr_time_t *pvalid_from, apr_pool_t *p)
 {
     const md_proto_t *proto;
     
@@ -945,7 +2041,26 @@ apr_status_t md_reg_stage(md_reg_t *reg, const md_t *md, const char *challenge,
         return APR_EINVAL;
     }
     
-    return md_util_pool_vdo(run_stage, reg, p, proto, md, challenge, reset, pvalid_from, NULL);
+    if (presume_at) {
+        *presume_at = 0;
+    }
+    return md_util_pool_vdo(run_stage, reg, p, proto, md, challenge, reset, 
+                            max_block, presume_at, pvalid_from, NULL);
+}
+
+apr_status_t md_reg_stage_check(md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    const md_proto_t *proto;
+    md_proto_driver_t *driver;
+    
+    proto = md->ca_proto? 
+        apr_hash_get(reg->protos, md->ca_proto, (apr_ssize_t)strlen(md->ca_proto)) : NULL;
+    if (!proto || !proto->check) {
+        return APR_ENOTIMPL;
+    }
+    driver = apr_pcalloc(p, sizeof(*driver));
+    init_proto_driver(driver, proto, reg, md, NULL, 0, p);
+    return proto->check(driver);
 }
 
 static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
@@ -967,6 +2082,7 @@ static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     
     if (APR_STATUS_IS_ENOENT(rv = md_load(reg->store, MD_SG_STAGING, name, NULL, ptemp))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, ptemp, "%s: nothing staged", name);
+        staged_update(reg, name, 0, ptemp);
         return APR_ENOENT;
     }
     
@@ -998,6 +2114,7 @@ static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
         if (APR_SUCCESS == (rv = proto->preload(driver, MD_SG_TMP))) {
             /* swap */
             rv = md_store_move(reg->store, p, MD_SG_TMP, MD_SG_DOMAINS, md->name, 1);
+            reg_view_drop(reg, md->name);
             if (APR_SUCCESS == rv) {
                 /* load again */
                 nmd = md_reg_get(reg, md->name, p);
@@ -1005,13 +2122,17 @@ static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
                     rv = APR_ENOENT;
                     md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "loading md after staging");
                 }
-                else if (nmd->state != MD_S_COMPLETE) {
-                    md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
-                                  "md has state %d after load", nmd->state);
+                else {
+                    reg_index_put(reg, nmd, ptemp);
+                    if (nmd->state != MD_S_COMPLETE) {
+                        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                                      "md has state %d after load", nmd->state);
+                    }
                 }
                 
                 md_store_purge(reg->store, p, MD_SG_STAGING, md->name);
                 md_store_purge(reg->store, p, MD_SG_CHALLENGES, md->name);
+                staged_update(reg, md->name, 0, ptemp);
             }
         }
     }
@@ -38,6 +38,12 @@ apr_status_t md_reg_init(md_reg_t **preg, apr_pool_t *pm, struct md_store_t *sto
 
 struct md_store_t *md_reg_store_get(md_reg_t *reg);
 
+/**
+ * Return != 0 if the registry and its store may be used by several threads at
+ * once, as parallel drivers do. Otherwise mds need to be driven one after the other.
+ */
+int md_reg_is_concurrent(md_reg_t *reg);
+
 apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int can_https);
 
 /**
@@ -47,7 +53,9 @@ apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int ca
 apr_status_t md_reg_add(md_reg_t *reg, md_t *md, apr_pool_t *p);
 
 /**
- * Find the md, if any, that contains the given domain name. 
+ * Find the md, if any, that contains the given domain name. Names are matched
+ * exactly (ignoring case), a wildcard domain '*.example.org' of an md does not
+ * match 'www.example.org' here.
  * NULL if none found.
  */
 md_t *md_reg_find(md_reg_t *reg, const char *domain, apr_pool_t *p);
@@ -65,6 +73,17 @@ md_t *md_reg_find_overlap(md_reg_t *reg, const md_t *md, const char **pdomain, a
  */
 md_t *md_reg_get(md_reg_t *reg, const char *name, apr_pool_t *p);
 
+/**
+ * Get a read-only view of the md with the given name and its credentials, either
+ * may be NULL. The view is kept in the registry and only made anew when the md
+ * files in the store have been modified. The data remains valid until the md 
+ * is changed via the registry or found outdated by another call for the same
+ * name, callers must not modify it.
+ * @return APR_ENOENT if the md does not exist
+ */
+apr_status_t md_reg_get_view(const md_t **pmd, const md_creds_t **pcreds, 
+                             md_reg_t *reg, const char *name, apr_pool_t *p);
+
 /**
  * Assess the capability and need to driving this managed domain.
  */
@@ -152,28 +171,43 @@ struct md_proto_driver_t {
     int reset;
     apr_time_t stage_valid_from;
     const char *proxy_url;
+    apr_interval_time_t max_block;  /* max time to wait on the CA in one go, 0 for no limit */
+    apr_time_t resume_at;           /* staging gave APR_EAGAIN: when it should continue */
 };
 
 typedef apr_status_t md_proto_init_cb(md_proto_driver_t *driver);
 typedef apr_status_t md_proto_stage_cb(md_proto_driver_t *driver);
 typedef apr_status_t md_proto_preload_cb(md_proto_driver_t *driver, md_store_group_t group);
+typedef apr_status_t md_proto_check_cb(md_proto_driver_t *driver);
 
 struct md_proto_t {
     const char *protocol;
     md_proto_init_cb *init;
     md_proto_stage_cb *stage;
     md_proto_preload_cb *preload;
+    md_proto_check_cb *check;       /* optional */
 };
 
 
 /**
  * Stage a new credentials set for the given managed domain in a separate location
  * without interfering with any existing credentials.
+ * With a max_block > 0, staging does not wait longer than that for the CA. If it
+ * is not done then, APR_EAGAIN is returned and *presume_at (if not NULL) is set
+ * to the time staging should be continued (or 0 if unknown).
  */
 apr_status_t md_reg_stage(md_reg_t *reg, const md_t *md, 
                           const char *challenge, int reset, 
+                          apr_interval_time_t max_block, apr_time_t *presume_at,
                           apr_time_t *pvalid_from, apr_pool_t *p);
 
+/**
+ * Check that what a previous md_reg_stage() left in the staging area is intact, so
+ * that staging can resume from it. APR_ENOENT if nothing is staged, APR_ENOTIMPL
+ * if the protocol of the md has no check, another error if something is damaged.
+ */
+apr_status_t md_reg_stage_check(md_reg_t *reg, const md_t *md, apr_pool_t *p);
+
 /**
  * Load a staged set of new credentials for the managed domain. This will archive
  * any existing credential data and make the staged set the new live one.
@@ -182,4 +216,11 @@ apr_status_t md_reg_stage(md_reg_t *reg, const md_t *md,
  */
 apr_status_t md_reg_load(md_reg_t *reg, const char *name, apr_pool_t *p);
 
+/**
+ * Get the names of the managed domains that have a staged set waiting to be loaded,
+ * as keys of *pnames. Staged sets of other mds do not exist, md_reg_load() for them
+ * can be skipped.
+ */
+apr_status_t md_reg_get_staged(struct apr_hash_t **pnames, md_reg_t *reg, apr_pool_t *p);
+
 #endif /* mod_md_md_reg_h */
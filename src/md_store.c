@@ -30,6 +30,7 @@
 #include "md_crypt.h"
 #include "md_log.h"
 #include "md_json.h"
+#include "md_metrics.h"
 #include "md_store.h"
 #include "md_util.h"
 
@@ -55,6 +56,9 @@ static const char *GROUP_NAME[] = {
     "staging",
     "archive",
     "tmp",
+    "keys",
+    "ocsp",
+    "cache",
     NULL
 };
 
@@ -71,12 +75,21 @@ void md_store_destroy(md_store_t *store)
     if (store->destroy) store->destroy(store);
 }
 
+/* a value or name that is not there is an answer, not a failure */
+static apr_status_t store_record(const char *op, apr_time_t start, apr_status_t rv)
+{
+    md_metrics_record(MD_METRICS_STORE, op, apr_time_now() - start, 
+                      APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv));
+    return rv;
+}
+
 apr_status_t md_store_load(md_store_t *store, md_store_group_t group, 
                            const char *name, const char *aspect, 
                            md_store_vtype_t vtype, void **pdata, 
                            apr_pool_t *p)
 {
-    return store->load(store, group, name, aspect, vtype, pdata, p);
+    apr_time_t start = apr_time_now();
+    return store_record("load", start, store->load(store, group, name, aspect, vtype, pdata, p));
 }
 
 apr_status_t md_store_save(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
@@ -84,27 +97,103 @@ apr_status_t md_store_save(md_store_t *store, apr_pool_t *p, md_store_group_t gr
                            md_store_vtype_t vtype, void *data, 
                            int create)
 {
-    return store->save(store, p, group, name, aspect, vtype, data, create);
+    apr_time_t start = apr_time_now();
+    return store_record("save", start, 
+                        store->save(store, p, group, name, aspect, vtype, data, create));
+}
+
+/**************************************************************************************************/
+/* batched saves */
+
+struct md_store_batch_t {
+    md_store_t *store;
+    apr_pool_t *p;
+    apr_array_header_t *writes;     /* md_store_write_t* in order of first save */
+    apr_hash_t *index;              /* "group/name/aspect" -> md_store_write_t* */
+};
+
+apr_status_t md_store_batch_begin(md_store_batch_t **pbatch, md_store_t *store, apr_pool_t *p)
+{
+    md_store_batch_t *batch;
+    
+    batch = apr_pcalloc(p, sizeof(*batch));
+    batch->store = store;
+    batch->p = p;
+    batch->writes = apr_array_make(p, 5, sizeof(md_store_write_t*));
+    batch->index = apr_hash_make(p);
+    *pbatch = batch;
+    return APR_SUCCESS;
+}
+
+void md_store_batch_save(md_store_batch_t *batch, md_store_group_t group, 
+                         const char *name, const char *aspect, 
+                         md_store_vtype_t vtype, void *data, int create)
+{
+    md_store_write_t *w;
+    const char *key;
+    
+    key = apr_psprintf(batch->p, "%d/%s/%s", group, name? name : "", aspect);
+    if (NULL == (w = apr_hash_get(batch->index, key, APR_HASH_KEY_STRING))) {
+        w = apr_pcalloc(batch->p, sizeof(*w));
+        w->group = group;
+        w->name = name;
+        w->aspect = aspect;
+        w->create = create;
+        apr_hash_set(batch->index, key, APR_HASH_KEY_STRING, w);
+        APR_ARRAY_PUSH(batch->writes, md_store_write_t*) = w;
+    }
+    w->vtype = vtype;
+    w->value = data;
+}
+
+apr_status_t md_store_batch_commit(md_store_batch_t *batch)
+{
+    md_store_t *store = batch->store;
+    md_store_write_t *w;
+    apr_time_t start;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+    
+    if (batch->writes->nelts > 0) {
+        if (store->save_batch) {
+            start = apr_time_now();
+            rv = store_record("save", start, store->save_batch(store, batch->p, batch->writes));
+        }
+        else {
+            for (i = 0; i < batch->writes->nelts && APR_SUCCESS == rv; ++i) {
+                w = APR_ARRAY_IDX(batch->writes, i, md_store_write_t*);
+                rv = md_store_save(store, batch->p, w->group, w->name, w->aspect, 
+                                   w->vtype, w->value, w->create);
+            }
+        }
+    }
+    apr_array_clear(batch->writes);
+    apr_hash_clear(batch->index);
+    return rv;
 }
 
 apr_status_t md_store_remove(md_store_t *store, md_store_group_t group, 
                              const char *name, const char *aspect, 
                              apr_pool_t *p, int force)
 {
-    return store->remove(store, group, name, aspect, p, force);
+    apr_time_t start = apr_time_now();
+    return store_record("remove", start, store->remove(store, group, name, aspect, p, force));
 }
 
 apr_status_t md_store_purge(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
                              const char *name)
 {
-    return store->purge(store, p, group, name);
+    apr_time_t start = apr_time_now();
+    return store_record("purge", start, store->purge(store, p, group, name));
 }
 
 apr_status_t md_store_iter(md_store_inspect *inspect, void *baton, md_store_t *store, 
                            apr_pool_t *p, md_store_group_t group, const char *pattern, 
                            const char *aspect, md_store_vtype_t vtype)
 {
-    return store->iterate(inspect, baton, store, p, group, pattern, aspect, vtype);
+    apr_time_t start = apr_time_now();
+    return store_record("iterate", start, 
+                        store->iterate(inspect, baton, store, p, group, pattern, aspect, vtype));
 }
 
 apr_status_t md_store_load_json(md_store_t *store, md_store_group_t group, 
@@ -125,7 +214,8 @@ apr_status_t md_store_move(md_store_t *store, apr_pool_t *p,
                            md_store_group_t from, md_store_group_t to,
                            const char *name, int archive)
 {
-    return store->move(store, p, from, to, name, archive);
+    apr_time_t start = apr_time_now();
+    return store_record("move", start, store->move(store, p, from, to, name, archive));
 }
 
 apr_status_t md_store_get_fname(const char **pfname, 
@@ -145,6 +235,50 @@ int md_store_is_newer(md_store_t *store, md_store_group_t group1, md_store_group
     return store->is_newer(store, group1, group2, name, aspect, p);
 }
 
+apr_time_t md_store_get_modified(md_store_t *store, md_store_group_t group,  
+                                 const char *name, const char *aspect, apr_pool_t *p)
+{
+    if (store->get_modified) {
+        return store->get_modified(store, group, name, aspect, p);
+    }
+    return 0;
+}
+
+apr_status_t md_store_iter_names(md_store_inspect_name *inspect, void *baton, md_store_t *store, 
+                                 apr_pool_t *p, md_store_group_t group, const char *pattern)
+{
+    if (store->iterate_names) {
+        return store->iterate_names(inspect, baton, store, p, group, pattern);
+    }
+    return APR_ENOTIMPL;
+}
+
+apr_status_t md_store_lease(md_store_t *store, apr_pool_t *p, const char *name, 
+                            const char *owner, apr_interval_time_t duration)
+{
+    if (store->lease) {
+        return store->lease(store->lease_baton, p, name, owner, duration);
+    }
+    return APR_ENOTIMPL;
+}
+
+apr_status_t md_store_release(md_store_t *store, apr_pool_t *p, const char *name, 
+                              const char *owner)
+{
+    if (store->release) {
+        return store->release(store->lease_baton, p, name, owner);
+    }
+    return APR_ENOTIMPL;
+}
+
+void md_store_lease_impl_set(md_store_t *store, md_store_lease_cb *lease, 
+                             md_store_release_cb *release, void *baton)
+{
+    store->lease = lease;
+    store->release = release;
+    store->lease_baton = baton;
+}
+
 /**************************************************************************************************/
 /* convenience */
 
@@ -291,3 +425,258 @@ apr_status_t md_store_md_iter(md_store_md_inspect *inspect, void *baton, md_stor
     return md_store_iter(insp_md, &ctx, store, p, group, pattern, MD_FN_MD, MD_SV_JSON);
 }
 
+
+/**************************************************************************************************/
+/* archive */
+
+int md_store_archive_number(const char *aname, const char *name)
+{
+    apr_size_t len = strlen(name);
+    const char *s;
+    int n = 0;
+    
+    if (strncmp(aname, name, len) || aname[len] != '.' || !aname[len+1]) {
+        return 0;
+    }
+    for (s = aname + len + 1; *s; ++s) {
+        if (!apr_isdigit(*s) || n > 100000000) {
+            return 0;
+        }
+        n = n * 10 + (*s - '0');
+    }
+    return n;
+}
+
+typedef struct {
+    const char *name;
+    apr_array_header_t *numbers;
+} archive_ctx;
+
+static int insp_archive(void *baton, const char *aname, apr_pool_t *ptemp)
+{
+    archive_ctx *ctx = baton;
+    int n;
+    
+    (void)ptemp;
+    if ((n = md_store_archive_number(aname, ctx->name)) > 0) {
+        APR_ARRAY_PUSH(ctx->numbers, int) = n;
+    }
+    return 1;
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+    int n1 = *(const int*)a, n2 = *(const int*)b;
+    return (n1 < n2)? -1 : (n1 > n2);
+}
+
+static apr_status_t p_archive_prune(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_t *store = baton;
+    archive_ctx ctx;
+    const char *aname;
+    apr_status_t rv, rv2;
+    int i, keep, *ppruned;
+    
+    (void)p;
+    ctx.name = va_arg(ap, const char *);
+    keep = va_arg(ap, int);
+    ppruned = va_arg(ap, int *);
+    ctx.numbers = apr_array_make(ptemp, 10, sizeof(int));
+    
+    /* the archive is shared by all names, the pattern only narrows it down */
+    rv = md_store_iter_names(insp_archive, &ctx, store, ptemp, MD_SG_ARCHIVE, "*.[0-9]*");
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        /* nothing archived yet */
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS == rv && ctx.numbers->nelts > keep) {
+        qsort(ctx.numbers->elts, (size_t)ctx.numbers->nelts, sizeof(int), int_cmp);
+        for (i = 0; i < ctx.numbers->nelts - keep; ++i) {
+            aname = apr_psprintf(ptemp, "%s.%d", ctx.name, APR_ARRAY_IDX(ctx.numbers, i, int));
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "pruning archive %s", aname);
+            if (APR_SUCCESS == (rv2 = md_store_purge(store, ptemp, MD_SG_ARCHIVE, aname))) {
+                ++(*ppruned);
+            }
+            else if (APR_SUCCESS == rv) {
+                /* try the others, but tell */
+                rv = rv2;
+            }
+        }
+    }
+    return rv;
+}
+
+apr_status_t md_store_archive_prune(md_store_t *store, apr_pool_t *p, const char *name, 
+                                    int keep, int *ppruned)
+{
+    int pruned = 0;
+    apr_status_t rv;
+    
+    rv = md_util_pool_vdo(p_archive_prune, store, p, name, keep, &pruned, NULL);
+    if (ppruned) {
+        *ppruned = pruned;
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* maintenance */
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *archived;       /* name -> apr_array_header_t* of archive numbers */
+    apr_array_header_t *names;
+} gc_ctx;
+
+static int gc_collect_archive(void *baton, const char *aname, apr_pool_t *ptemp)
+{
+    gc_ctx *ctx = baton;
+    apr_array_header_t *numbers;
+    const char *dot, *name;
+    int n;
+    
+    (void)ptemp;
+    if ((dot = strrchr(aname, '.')) && dot > aname) {
+        name = apr_pstrndup(ctx->p, aname, (apr_size_t)(dot - aname));
+        if ((n = md_store_archive_number(aname, name)) > 0) {
+            if (!(numbers = apr_hash_get(ctx->archived, name, APR_HASH_KEY_STRING))) {
+                numbers = apr_array_make(ctx->p, 5, sizeof(int));
+                apr_hash_set(ctx->archived, name, APR_HASH_KEY_STRING, numbers);
+            }
+            APR_ARRAY_PUSH(numbers, int) = n;
+        }
+    }
+    return 1;
+}
+
+static int gc_collect_name(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    gc_ctx *ctx = baton;
+    
+    (void)ptemp;
+    APR_ARRAY_PUSH(ctx->names, const char *) = apr_pstrdup(ctx->p, name);
+    return 1;
+}
+
+/* Purge name, counting it when it is gone and remembering the first error in prv.
+ * Stores may report success on a purge that left files behind, so look again. */
+static void gc_purge(md_store_t *store, apr_pool_t *ptemp, md_store_group_t group, 
+                     const char *name, int *pcount, apr_status_t *prv)
+{
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = md_store_purge(store, ptemp, group, name))
+        && md_store_get_modified(store, group, name, NULL, ptemp)) {
+        rv = APR_EEXIST;
+    }
+    if (APR_SUCCESS == rv) {
+        ++(*pcount);
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "removing %s/%s", 
+                      md_store_group_name(group), name);
+        if (APR_SUCCESS == *prv) {
+            *prv = rv;
+        }
+    }
+}
+
+static apr_status_t gc_archive(md_store_t *store, apr_pool_t *ptemp, int keep, int *pcount)
+{
+    gc_ctx ctx;
+    apr_hash_index_t *hi;
+    apr_array_header_t *numbers;
+    const void *name;
+    void *val;
+    apr_status_t rv;
+    int i;
+    
+    ctx.p = ptemp;
+    ctx.archived = apr_hash_make(ptemp);
+    /* one listing of the archive for all names */
+    rv = md_store_iter_names(gc_collect_archive, &ctx, store, ptemp, MD_SG_ARCHIVE, "*.[0-9]*");
+    if (APR_SUCCESS != rv) goto out;
+    
+    for (hi = apr_hash_first(ptemp, ctx.archived); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &name, NULL, &val);
+        numbers = val;
+        if (numbers->nelts <= keep) continue;
+        qsort(numbers->elts, (size_t)numbers->nelts, sizeof(int), int_cmp);
+        for (i = 0; i < numbers->nelts - keep; ++i) {
+            gc_purge(store, ptemp, MD_SG_ARCHIVE, 
+                     apr_psprintf(ptemp, "%s.%d", (const char *)name, 
+                                  APR_ARRAY_IDX(numbers, i, int)), pcount, &rv);
+        }
+    }
+out:
+    return rv;
+}
+
+static apr_status_t gc_aged(md_store_t *store, apr_pool_t *ptemp, md_store_group_t group,
+                            apr_interval_time_t age, int *pcount)
+{
+    gc_ctx ctx;
+    const char *name;
+    apr_time_t mtime, now;
+    apr_status_t rv;
+    int i;
+    
+    ctx.p = ptemp;
+    ctx.names = apr_array_make(ptemp, 10, sizeof(const char *));
+    rv = md_store_iter_names(gc_collect_name, &ctx, store, ptemp, group, "*");
+    if (APR_SUCCESS != rv) goto out;
+    
+    now = apr_time_now();
+    for (i = 0; i < ctx.names->nelts; ++i) {
+        name = APR_ARRAY_IDX(ctx.names, i, const char *);
+        mtime = md_store_get_modified(store, group, name, NULL, ptemp);
+        if (mtime > 0 && now - mtime > age) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "removing stale %s/%s", 
+                          md_store_group_name(group), name);
+            gc_purge(store, ptemp, group, name, pcount, &rv);
+        }
+    }
+out:
+    return rv;
+}
+
+static apr_status_t p_gc(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_t *store = baton;
+    const md_store_gc_policy_t *policy;
+    md_store_gc_stats_t *stats;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    
+    (void)p;
+    policy = va_arg(ap, const md_store_gc_policy_t *);
+    stats = va_arg(ap, md_store_gc_stats_t *);
+    
+    /* a group that does not exist (yet) has nothing to collect */
+    if (policy->archive_keep >= 0) {
+        rv2 = gc_archive(store, ptemp, policy->archive_keep, &stats->archives);
+        rv = (APR_SUCCESS == rv && !APR_STATUS_IS_ENOENT(rv2))? rv2 : rv;
+    }
+    if (policy->tmp_age > 0) {
+        rv2 = gc_aged(store, ptemp, MD_SG_TMP, policy->tmp_age, &stats->tmp);
+        rv = (APR_SUCCESS == rv && !APR_STATUS_IS_ENOENT(rv2))? rv2 : rv;
+    }
+    if (policy->challenges_age > 0) {
+        rv2 = gc_aged(store, ptemp, MD_SG_CHALLENGES, policy->challenges_age, &stats->challenges);
+        rv = (APR_SUCCESS == rv && !APR_STATUS_IS_ENOENT(rv2))? rv2 : rv;
+    }
+    return rv;
+}
+
+apr_status_t md_store_gc(md_store_t *store, apr_pool_t *p, 
+                         const md_store_gc_policy_t *policy, md_store_gc_stats_t *stats)
+{
+    md_store_gc_stats_t st;
+    
+    memset(&st, 0, sizeof(st));
+    if (!stats) {
+        stats = &st;
+    }
+    memset(stats, 0, sizeof(*stats));
+    return md_util_pool_vdo(p_gc, store, p, policy, stats, NULL);
+}
@@ -49,6 +49,12 @@ typedef apr_status_t md_store_iter_cb(md_store_inspect *inspect, void *baton, md
                                       apr_pool_t *p, md_store_group_t group, const char *pattern,
                                       const char *aspect, md_store_vtype_t vtype);
 
+typedef int md_store_inspect_name(void *baton, const char *name, apr_pool_t *ptemp);
+
+typedef apr_status_t md_store_iter_names_cb(md_store_inspect_name *inspect, void *baton, 
+                                            md_store_t *store, apr_pool_t *p, 
+                                            md_store_group_t group, const char *pattern);
+
 typedef apr_status_t md_store_move_cb(md_store_t *store, apr_pool_t *p, md_store_group_t from, 
                                       md_store_group_t to, const char *name, int archive);
 
@@ -61,6 +67,43 @@ typedef int md_store_is_newer_cb(md_store_t *store,
                                  md_store_group_t group1, md_store_group_t group2,  
                                  const char *name, const char *aspect, apr_pool_t *p);
 
+typedef apr_time_t md_store_get_modified_cb(md_store_t *store, md_store_group_t group,  
+                                            const char *name, const char *aspect, apr_pool_t *p);
+
+/**
+ * Take or extend the lease on name for owner, valid for duration. Several processes, 
+ * possibly on different hosts sharing the store, use leases to agree on which of 
+ * them works on name.
+ * @return APR_SUCCESS when owner holds the lease, APR_EAGAIN when someone else does
+ */
+typedef apr_status_t md_store_lease_cb(void *baton, apr_pool_t *p, const char *name, 
+                                       const char *owner, apr_interval_time_t duration);
+
+/**
+ * Give up the lease on name, if owner holds it.
+ */
+typedef apr_status_t md_store_release_cb(void *baton, apr_pool_t *p, const char *name, 
+                                         const char *owner);
+
+/**
+ * A value to save, as collected in a batch.
+ */
+typedef struct md_store_write_t md_store_write_t;
+struct md_store_write_t {
+    md_store_group_t group;
+    const char *name;
+    const char *aspect;
+    md_store_vtype_t vtype;
+    void *value;
+    int create;
+};
+
+/**
+ * Save all writes, an array of md_store_write_t*, in the given order.
+ */
+typedef apr_status_t md_store_save_batch_cb(md_store_t *store, apr_pool_t *p, 
+                                            struct apr_array_header_t *writes);
+
 struct md_store_t {
     md_store_destroy_cb *destroy;
 
@@ -72,6 +115,13 @@ struct md_store_t {
     md_store_purge_cb *purge;
     md_store_get_fname_cb *get_fname;
     md_store_is_newer_cb *is_newer;
+    md_store_get_modified_cb *get_modified;
+    md_store_iter_names_cb *iterate_names;
+    md_store_lease_cb *lease;
+    md_store_release_cb *release;
+    void *lease_baton;
+    md_store_save_batch_cb *save_batch; /* optional, writes are saved one by one without */
+    int concurrent;                 /* != 0 if callbacks may be called from several threads */
 };
 
 void md_store_destroy(md_store_t *store);
@@ -98,11 +148,36 @@ apr_status_t md_store_remove(md_store_t *store, md_store_group_t group,
 apr_status_t md_store_purge(md_store_t *store, apr_pool_t *p, 
                             md_store_group_t group, const char *name);
 
+/**
+ * Saves collected in a batch go to the store together at md_store_batch_commit().
+ * Repeated saves of the same aspect only write the last value, with the create
+ * flag of the first. Values are written as they are at commit time. A store that 
+ * can, writes the values of one MD under one lock and makes them durable once.
+ */
+typedef struct md_store_batch_t md_store_batch_t;
+
+apr_status_t md_store_batch_begin(md_store_batch_t **pbatch, md_store_t *store, apr_pool_t *p);
+void md_store_batch_save(md_store_batch_t *batch, md_store_group_t group, 
+                         const char *name, const char *aspect, 
+                         md_store_vtype_t vtype, void *data, int create);
+/**
+ * Save all values of the batch, stopping at the first failure. The batch is empty
+ * afterwards and may collect more saves.
+ */
+apr_status_t md_store_batch_commit(md_store_batch_t *batch);
+
 
 apr_status_t md_store_iter(md_store_inspect *inspect, void *baton, md_store_t *store, 
                            apr_pool_t *p, md_store_group_t group, const char *pattern, 
                            const char *aspect, md_store_vtype_t vtype);
 
+/**
+ * Iterate over the names in the group that match the pattern, without loading
+ * any of their values. Returns APR_ENOTIMPL if the store does not support it.
+ */
+apr_status_t md_store_iter_names(md_store_inspect_name *inspect, void *baton, md_store_t *store, 
+                                 apr_pool_t *p, md_store_group_t group, const char *pattern);
+
 apr_status_t md_store_move(md_store_t *store, apr_pool_t *p,
                            md_store_group_t from, md_store_group_t to,
                            const char *name, int archive);
@@ -115,6 +190,29 @@ apr_status_t md_store_get_fname(const char **pfname,
 int md_store_is_newer(md_store_t *store, md_store_group_t group1, md_store_group_t group2,  
                       const char *name, const char *aspect, apr_pool_t *p);
 
+/**
+ * Get the time the value was last modified in the store or 0 if it does not exist 
+ * or the store does not keep track of modifications.
+ */
+apr_time_t md_store_get_modified(md_store_t *store, md_store_group_t group,  
+                                 const char *name, const char *aspect, apr_pool_t *p);
+
+/**
+ * Take or extend the lease on name for owner. Returns APR_ENOTIMPL if the store
+ * has no leases, in which case the caller is on its own.
+ */
+apr_status_t md_store_lease(md_store_t *store, apr_pool_t *p, const char *name, 
+                            const char *owner, apr_interval_time_t duration);
+apr_status_t md_store_release(md_store_t *store, apr_pool_t *p, const char *name, 
+                              const char *owner);
+
+/**
+ * Replace the leases of the store, e.g. by those of an external coordinator. The
+ * baton is passed to the callbacks.
+ */
+void md_store_lease_impl_set(md_store_t *store, md_store_lease_cb *lease, 
+                             md_store_release_cb *release, void *baton);
+
 /**************************************************************************************************/
 /* Storage handling utils */
 
@@ -146,4 +244,55 @@ apr_status_t md_pubcert_save(md_store_t *store, apr_pool_t *p,
                              struct apr_array_header_t *pubcert, int create);
 
 
+/**************************************************************************************************/
+/* archive */
+
+/**
+ * Get the number of the archived copy "aname" of name, as in "<name>.<n>", or 0 if
+ * aname is no archive of name.
+ */
+int md_store_archive_number(const char *aname, const char *name);
+
+/**
+ * Purge all but the keep most recent archived copies of name. The archive belongs
+ * to the server's start user, call this with its privileges. A copy that could not
+ * be removed is not counted, the first error is returned.
+ * @param ppruned   if not NULL, the number of archived copies removed
+ */
+apr_status_t md_store_archive_prune(md_store_t *store, apr_pool_t *p, const char *name, 
+                                    int keep, int *ppruned);
+
+/**************************************************************************************************/
+/* maintenance */
+
+/**
+ * What md_store_gc() leaves in place. Ages are measured from the last modification,
+ * 0 keeps everything in the group.
+ */
+typedef struct md_store_gc_policy_t md_store_gc_policy_t;
+struct md_store_gc_policy_t {
+    int archive_keep;                   /* archived copies kept per name, < 0 for all */
+    apr_interval_time_t tmp_age;        /* sets left in tmp by an interrupted load */
+    apr_interval_time_t challenges_age; /* challenge data left by an interrupted renewal */
+};
+
+typedef struct md_store_gc_stats_t md_store_gc_stats_t;
+struct md_store_gc_stats_t {
+    int archives;                       /* archived copies removed */
+    int tmp;                            /* tmp sets removed */
+    int challenges;                     /* challenge dirs removed */
+};
+
+/**
+ * Remove what accumulates in the store over time: archived copies beyond the
+ * policy, for all names including those no longer configured, and leftovers in
+ * the tmp and challenges groups. Domains, staging, accounts and keys are not
+ * touched. A removal that fails is not counted, the first error is returned once 
+ * all others have been tried.
+ * @param stats     if not NULL, what was removed
+ */
+apr_status_t md_store_gc(md_store_t *store, apr_pool_t *p, 
+                         const md_store_gc_policy_t *policy, md_store_gc_stats_t *stats);
+
+
 #endif /* mod_md_md_store_h */
@@ -25,6 +25,7 @@
 #include <apr_fnmatch.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
 #include "md.h"
 #include "md_crypt.h"
@@ -61,6 +62,14 @@ struct md_store_fs_t {
     
     int port_80;
     int port_443;
+    
+    md_util_dcache_t *dcache;   /* directory listing cache, optional */
+    int sync;                   /* != 0 iff saves are synced to disk */
+#if APR_HAS_THREADS
+    apr_pool_t *lock_pool;          /* where the name locks live */
+    apr_thread_mutex_t *lock_mutex; /* guards name_locks */
+    apr_hash_t *name_locks;         /* md name -> apr_thread_mutex_t*, serializes changes */
+#endif
 };
 
 #define FS_STORE(store)     (md_store_fs_t*)(((char*)store)-offsetof(md_store_fs_t, s))
@@ -84,6 +93,9 @@ static apr_status_t fs_move(md_store_t *store, apr_pool_t *p,
 static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_t *store, 
                                apr_pool_t *p, md_store_group_t group,  const char *pattern,
                                const char *aspect, md_store_vtype_t vtype);
+static apr_status_t fs_iterate_names(md_store_inspect_name *inspect, void *baton, 
+                                     md_store_t *store, apr_pool_t *p, 
+                                     md_store_group_t group, const char *pattern);
 
 static apr_status_t fs_get_fname(const char **pfname, 
                                  md_store_t *store, md_store_group_t group, 
@@ -91,6 +103,14 @@ static apr_status_t fs_get_fname(const char **pfname,
                                  apr_pool_t *p);
 static int fs_is_newer(md_store_t *store, md_store_group_t group1, md_store_group_t group2,  
                        const char *name, const char *aspect, apr_pool_t *p);
+static apr_time_t fs_get_modified(md_store_t *store, md_store_group_t group,  
+                                  const char *name, const char *aspect, apr_pool_t *p);
+
+static apr_status_t fs_lease(void *baton, apr_pool_t *p, const char *name, 
+                             const char *owner, apr_interval_time_t duration);
+static apr_status_t fs_release(void *baton, apr_pool_t *p, const char *name, 
+                               const char *owner);
+static apr_status_t fs_save_batch(md_store_t *store, apr_pool_t *p, apr_array_header_t *writes);
 
 static apr_status_t init_store_file(md_store_fs_t *s_fs, const char *fname, 
                                     apr_pool_t *p, apr_pool_t *ptemp)
@@ -286,6 +306,12 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     s_fs->s.iterate = fs_iterate;
     s_fs->s.get_fname = fs_get_fname;
     s_fs->s.is_newer = fs_is_newer;
+    s_fs->s.get_modified = fs_get_modified;
+    s_fs->s.iterate_names = fs_iterate_names;
+    s_fs->s.lease = fs_lease;
+    s_fs->s.release = fs_release;
+    s_fs->s.lease_baton = s_fs;
+    s_fs->s.save_batch = fs_save_batch;
     
     /* by default, everything is only readable by the current user */ 
     s_fs->def_perms.dir = MD_FPROT_D_UONLY;
@@ -300,8 +326,24 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     /* challenges dir and files are readable by all, no secrets involved */ 
     s_fs->group_perms[MD_SG_CHALLENGES].dir = MD_FPROT_D_UALL_WREAD;
     s_fs->group_perms[MD_SG_CHALLENGES].file = MD_FPROT_F_UALL_WREAD;
+    /* OCSP responses are public as well, they are sent to every client */ 
+    s_fs->group_perms[MD_SG_OCSP].dir = MD_FPROT_D_UALL_WREAD;
+    s_fs->group_perms[MD_SG_OCSP].file = MD_FPROT_F_UALL_WREAD;
 
     s_fs->base = apr_pstrdup(p, path);
+#if APR_HAS_THREADS
+    if (MD_OK(apr_pool_create(&s_fs->lock_pool, p))
+        && MD_OK(apr_thread_mutex_create(&s_fs->lock_mutex, APR_THREAD_MUTEX_DEFAULT, p))) {
+        apr_pool_tag(s_fs->lock_pool, "md_store_locks");
+        s_fs->name_locks = apr_hash_make(s_fs->lock_pool);
+        s_fs->s.concurrent = 1;
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "init fs store locks");
+        *pstore = NULL;
+        return rv;
+    }
+#endif
     
     if (MD_IS_ERR(md_util_is_dir(s_fs->base, p), ENOENT)
         && MD_OK(apr_dir_make_recursive(s_fs->base, s_fs->def_perms.dir, p))) {
@@ -352,6 +394,76 @@ apr_status_t md_store_fs_set_event_cb(struct md_store_t *store, md_store_fs_cb *
     return APR_SUCCESS;
 }
 
+apr_status_t md_store_fs_listing_cache_set(struct md_store_t *store, apr_pool_t *p, int enabled)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+    if (!enabled) {
+        s_fs->dcache = NULL;
+        return APR_SUCCESS;
+    }
+    if (s_fs->dcache) {
+        return APR_SUCCESS;
+    }
+    return md_util_dcache_create(&s_fs->dcache, p);
+}
+
+/**************************************************************************************************/
+/* per md locking */
+
+/* Drivers for different MDs may run in parallel threads. Changes to the files of one
+ * MD - saving, removing, purging and moving it between groups - are serialized by a 
+ * lock per name, so a move never sees a half written directory. The locks are nested,
+ * as store callbacks may call the store again for the same MD. Changes to different
+ * MDs do not wait for each other. */
+
+static void *name_lock(md_store_fs_t *s_fs, const char *name)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+    
+    if (!s_fs->lock_mutex) return NULL;
+    if (!name) name = "";
+    apr_thread_mutex_lock(s_fs->lock_mutex);
+    lock = apr_hash_get(s_fs->name_locks, name, APR_HASH_KEY_STRING);
+    if (!lock) {
+        if (APR_SUCCESS == apr_thread_mutex_create(&lock, APR_THREAD_MUTEX_NESTED, 
+                                                   s_fs->lock_pool)) {
+            apr_hash_set(s_fs->name_locks, apr_pstrdup(s_fs->lock_pool, name), 
+                         APR_HASH_KEY_STRING, lock);
+        }
+        else {
+            lock = NULL;
+        }
+    }
+    apr_thread_mutex_unlock(s_fs->lock_mutex);
+    if (lock) apr_thread_mutex_lock(lock);
+    return lock;
+#else
+    (void)s_fs;
+    (void)name;
+    return NULL;
+#endif
+}
+
+static void name_unlock(void *lock)
+{
+#if APR_HAS_THREADS
+    if (lock) apr_thread_mutex_unlock((apr_thread_mutex_t *)lock);
+#else
+    (void)lock;
+#endif
+}
+
+apr_status_t md_store_fs_sync_set(struct md_store_t *store, int enabled)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+    s_fs->sync = enabled;
+    md_util_fsync_set(enabled);
+    return APR_SUCCESS;
+}
+
 static const perms_t *gperms(md_store_fs_t *s_fs, md_store_group_t group)
 {
     if (group >= (sizeof(s_fs->group_perms)/sizeof(s_fs->group_perms[0]))
@@ -438,6 +550,43 @@ static apr_status_t fs_fload(void **pvalue, md_store_fs_t *s_fs, const char *fpa
     return rv;
 }
 
+/* pubcert.pem is loaded for every assessment and OCSP renewal. When saved, a DER copy 
+ * is kept next to it and loaded instead, as long as pubcert.pem has not been changed 
+ * after the copy was written. The copy is never used for anything else. */
+static apr_status_t pubcert_der_load(apr_array_header_t **pcerts, md_store_fs_t *s_fs, 
+                                     md_store_group_t group, const char *name, 
+                                     const char *fpath, apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_finfo_t pem_info, der_info;
+    const char *fder;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (   MD_OK(fs_get_fname(&fder, &s_fs->s, group, name, MD_FN_PUBCERT_DER, ptemp))
+        && MD_OK(apr_stat(&der_info, fder, APR_FINFO_MTIME, ptemp))
+        && MD_OK(apr_stat(&pem_info, fpath, APR_FINFO_MTIME|APR_FINFO_CTIME, ptemp))) {
+        if (pem_info.mtime > der_info.mtime || pem_info.ctime > der_info.mtime) {
+            return APR_ENOENT;
+        }
+        rv = md_chain_fload_der(pcerts, p, fder);
+    }
+    return rv;
+}
+
+static void pubcert_der_save(apr_array_header_t *certs, const char *dir, 
+                             apr_fileperms_t perms, apr_pool_t *ptemp)
+{
+    const char *fder;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (MD_OK(md_util_path_merge(&fder, ptemp, dir, MD_FN_PUBCERT_DER, NULL))
+        && !MD_OK(md_chain_fsave_der(certs, ptemp, fder, perms))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "saving %s, removing it", fder);
+        apr_file_remove(fder, ptemp);
+    }
+}
+
 static apr_status_t pfs_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_store_fs_t *s_fs = baton;
@@ -455,6 +604,11 @@ static apr_status_t pfs_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     pvalue= va_arg(ap, void **);
         
     if (MD_OK(fs_get_fname(&fpath, &s_fs->s, group, name, aspect, ptemp))) {
+        if (pvalue && MD_SV_CHAIN == vtype && !strcmp(MD_FN_PUBCERT, aspect)
+            && APR_SUCCESS == pubcert_der_load((apr_array_header_t **)pvalue, s_fs, group, 
+                                               name, fpath, p, ptemp)) {
+            return APR_SUCCESS;
+        }
         rv = fs_fload(pvalue, s_fs, fpath, group, vtype, p, ptemp);
     }
     return rv;
@@ -463,9 +617,8 @@ static apr_status_t pfs_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
 static apr_status_t dispatch(md_store_fs_t *s_fs, md_store_fs_ev_t ev, unsigned int group, 
                              const char *fname, apr_filetype_e ftype, apr_pool_t *p)
 {
-    (void)ev;
     if (s_fs->event_cb) {
-        return s_fs->event_cb(s_fs->event_baton, &s_fs->s, MD_S_FS_EV_CREATED, 
+        return s_fs->event_cb(s_fs->event_baton, &s_fs->s, ev, 
                               group, fname, ftype, p);
     }
     return APR_SUCCESS;
@@ -542,6 +695,45 @@ static int fs_is_newer(md_store_t *store, md_store_group_t group1, md_store_grou
     return 0;
 }
 
+static apr_status_t pfs_get_modified(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *fname, *name, *aspect;
+    md_store_group_t group;
+    apr_finfo_t inf;
+    apr_time_t *pmtime;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    aspect = va_arg(ap, const char*);
+    pmtime = va_arg(ap, apr_time_t*);
+    
+    *pmtime = 0;
+    if (   MD_OK(fs_get_fname(&fname, &s_fs->s, group, name, aspect, ptemp))
+        && MD_OK(apr_stat(&inf, fname, APR_FINFO_MTIME, ptemp))) {
+        *pmtime = inf.mtime;
+    }
+
+    return rv;
+}
+
+static apr_time_t fs_get_modified(md_store_t *store, md_store_group_t group,  
+                                  const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_time_t mtime;
+    apr_status_t rv;
+    
+    rv = md_util_pool_vdo(pfs_get_modified, s_fs, p, group, name, aspect, &mtime, NULL);
+    if (APR_SUCCESS == rv) {
+        return mtime;
+    }
+    return 0;
+}
+
 static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_store_fs_t *s_fs = baton;
@@ -549,7 +741,7 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     md_store_vtype_t vtype;
     md_store_group_t group;
     void *value;
-    int create;
+    int create, sync_dir;
     apr_status_t rv;
     const perms_t *perms;
     const char *pass;
@@ -562,6 +754,7 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     vtype = (md_store_vtype_t)va_arg(ap, int);
     value = va_arg(ap, void *);
     create = va_arg(ap, int);
+    sync_dir = va_arg(ap, int);
     
     perms = gperms(s_fs, group);
     
@@ -590,13 +783,21 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
                 get_pass(&pass, &pass_len, s_fs, group);
                 rv = md_pkey_fsave((md_pkey_t *)value, ptemp, pass, pass_len, 
                                    fpath, (pass && pass_len)? perms->file : MD_FPROT_F_UONLY);
+                /* mtime and size of the new file may be the same as the old one's */
+                md_pkey_cache_forget(fpath);
                 break;
             case MD_SV_CHAIN:
                 rv = md_chain_fsave((apr_array_header_t*)value, ptemp, fpath, perms->file);
+                if (APR_SUCCESS == rv && !strcmp(MD_FN_PUBCERT, aspect)) {
+                    pubcert_der_save((apr_array_header_t*)value, dir, perms->file, ptemp);
+                }
                 break;
             default:
                 return APR_ENOTIMPL;
         }
+        if (APR_SUCCESS == rv && sync_dir) {
+            rv = md_util_dir_sync(dir, ptemp);
+        }
         if (APR_SUCCESS == rv) {
             rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, fpath, APR_REG, p);
         }
@@ -635,7 +836,14 @@ static apr_status_t pfs_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va
         }
     
         rv = apr_file_remove(fpath, ptemp);
-        if (APR_ENOENT == rv && force) {
+        if (APR_SUCCESS == rv) {
+            rv = dispatch(s_fs, MD_S_FS_EV_REMOVED, group, fpath, APR_REG, ptemp);
+        }
+        if (!strcmp(MD_FN_PUBCERT, aspect)
+            && APR_SUCCESS == md_util_path_merge(&fpath, ptemp, dir, MD_FN_PUBCERT_DER, NULL)) {
+            apr_file_remove(fpath, ptemp);
+        }
+        else if (APR_ENOENT == rv && force) {
             rv = APR_SUCCESS;
         }
     }
@@ -655,8 +863,62 @@ static apr_status_t fs_save(md_store_t *store, apr_pool_t *p, md_store_group_t g
                             md_store_vtype_t vtype, void *value, int create)
 {
     md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_save, s_fs, p, group, name, aspect, 
-                            vtype, value, create, NULL);
+    void *lock;
+    apr_status_t rv;
+    
+    lock = name_lock(s_fs, name);
+    rv = md_util_pool_vdo(pfs_save, s_fs, p, group, name, aspect, 
+                          vtype, value, create, s_fs->sync, NULL);
+    name_unlock(lock);
+    return rv;
+}
+
+static int same_name(const char *n1, const char *n2)
+{
+    return (n1 == n2) || (n1 && n2 && !strcmp(n1, n2));
+}
+
+static apr_status_t fs_save_batch(md_store_t *store, apr_pool_t *p, apr_array_header_t *writes)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    md_store_write_t *w;
+    apr_hash_t *dirs = NULL;
+    apr_hash_index_t *hi;
+    const char *dir, *lock_name = NULL;
+    void *lock = NULL;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int i, locked = 0;
+    
+    if (s_fs->sync) {
+        dirs = apr_hash_make(p);
+    }
+    for (i = 0; i < writes->nelts && APR_SUCCESS == rv; ++i) {
+        w = APR_ARRAY_IDX(writes, i, md_store_write_t*);
+        /* consecutive writes for the same MD are done under one lock */
+        if (!locked || !same_name(lock_name, w->name)) {
+            if (locked) name_unlock(lock);
+            lock = name_lock(s_fs, w->name);
+            lock_name = w->name;
+            locked = 1;
+        }
+        rv = md_util_pool_vdo(pfs_save, s_fs, p, w->group, w->name, w->aspect, 
+                              w->vtype, w->value, w->create, 0, NULL);
+        if (APR_SUCCESS == rv && dirs
+            && APR_SUCCESS == fs_get_dname(&dir, store, w->group, w->name, p)) {
+            apr_hash_set(dirs, dir, APR_HASH_KEY_STRING, dir);
+        }
+    }
+    if (locked) name_unlock(lock);
+    
+    /* the files are synced, their directories need it only once */
+    for (hi = dirs? apr_hash_first(p, dirs) : NULL; hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, (void**)&dir);
+        rv2 = md_util_dir_sync(dir, p);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv2, p, "sync of %s", dir);
+        if (APR_SUCCESS == rv) rv = rv2;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, p, "saved batch of %d values", writes->nelts);
+    return rv;
 }
 
 static apr_status_t fs_remove(md_store_t *store, md_store_group_t group, 
@@ -664,7 +926,13 @@ static apr_status_t fs_remove(md_store_t *store, md_store_group_t group,
                               apr_pool_t *p, int force)
 {
     md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_remove, s_fs, p, group, name, aspect, force, NULL);
+    void *lock;
+    apr_status_t rv;
+    
+    lock = name_lock(s_fs, name);
+    rv = md_util_pool_vdo(pfs_remove, s_fs, p, group, name, aspect, force, NULL);
+    name_unlock(lock);
+    return rv;
 }
 
 static apr_status_t pfs_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
@@ -684,6 +952,7 @@ static apr_status_t pfs_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     if (MD_OK(md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))) {
         /* Remove all files in dir, there should be no sub-dirs */
         rv = md_util_rm_recursive(dir, ptemp, 1);
+        dispatch(s_fs, MD_S_FS_EV_REMOVED, group, dir, APR_DIR, ptemp);
     }
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, ptemp, "purge %s/%s (%s)", groupname, name, dir);
     return APR_SUCCESS;
@@ -693,7 +962,14 @@ static apr_status_t fs_purge(md_store_t *store, apr_pool_t *p,
                              md_store_group_t group, const char *name)
 {
     md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_purge, s_fs, p, group, name, NULL);
+    void *lock;
+    apr_status_t rv;
+    
+    lock = name_lock(s_fs, name);
+    md_pkey_cache_clear();
+    rv = md_util_pool_vdo(pfs_purge, s_fs, p, group, name, NULL);
+    name_unlock(lock);
+    return rv;
 }
 
 /**************************************************************************************************/
@@ -766,14 +1042,111 @@ static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_
     ctx.baton = baton;
     groupname = md_store_group_name(group);
 
-    rv = md_util_files_do(insp_dir, &ctx, p, ctx.s_fs->base, groupname, pattern, NULL);
+    rv = md_util_files_do_cached(ctx.s_fs->dcache, insp_dir, &ctx, p, 
+                                 ctx.s_fs->base, groupname, pattern, NULL);
     
     return rv;
 }
 
+typedef struct {
+    md_store_inspect_name *inspect;
+    void *baton;
+} inspect_names_ctx;
+
+static apr_status_t insp_name(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                              const char *dir, const char *name, apr_filetype_e ftype)
+{
+    inspect_names_ctx *ctx = baton;
+    
+    (void)p;
+    (void)dir;
+    if (APR_DIR == ftype && !ctx->inspect(ctx->baton, name, ptemp)) {
+        return APR_EOF;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t fs_iterate_names(md_store_inspect_name *inspect, void *baton, 
+                                     md_store_t *store, apr_pool_t *p, 
+                                     md_store_group_t group, const char *pattern)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    inspect_names_ctx ctx;
+    apr_status_t rv;
+    
+    ctx.inspect = inspect;
+    ctx.baton = baton;
+    rv = md_util_files_do_cached(s_fs->dcache, insp_name, &ctx, p, s_fs->base, 
+                                 md_store_group_name(group), pattern, NULL);
+    return APR_STATUS_IS_EOF(rv)? APR_SUCCESS : rv;
+}
+
 /**************************************************************************************************/
 /* moving */
 
+typedef struct {
+    const char *name;
+    int max;
+} archive_max_ctx;
+
+static apr_status_t insp_archive(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                 const char *dir, const char *name, apr_filetype_e ftype)
+{
+    archive_max_ctx *ctx = baton;
+    int n;
+    
+    (void)p;
+    (void)ptemp;
+    (void)dir;
+    (void)ftype;
+    if ((n = md_store_archive_number(name, ctx->name)) > ctx->max) {
+        ctx->max = n;
+    }
+    return APR_SUCCESS;
+}
+
+/* The next archive number of name is kept in "archive/<name>.gen", so that moves 
+ * do not need to look at the archive. Files are not seen when iterating names. The 
+ * number is only a hint, archive dirs are still created exclusively. */
+#define FS_ARCHIVE_GEN      ".gen"
+
+static apr_status_t archive_gen_fname(const char **pfname, md_store_fs_t *s_fs, 
+                                      const char *name, apr_pool_t *p)
+{
+    return md_util_path_merge(pfname, p, s_fs->base, md_store_group_name(MD_SG_ARCHIVE), 
+                              apr_pstrcat(p, name, FS_ARCHIVE_GEN, NULL), NULL);
+}
+
+static void archive_gen_set(md_store_fs_t *s_fs, const char *name, int n, apr_pool_t *ptemp)
+{
+    const char *fname;
+    
+    if (APR_SUCCESS == archive_gen_fname(&fname, s_fs, name, ptemp)) {
+        md_text_freplace(fname, MD_FPROT_F_UONLY, ptemp, apr_itoa(ptemp, n));
+    }
+}
+
+/* The number after the highest one archived for name. Without a generation file,
+ * found in a single listing of the archive instead of probing one number after 
+ * the other. */
+static int next_archive_number(md_store_fs_t *s_fs, const char *name, apr_pool_t *ptemp)
+{
+    archive_max_ctx ctx;
+    const char *fname, *text;
+    int n;
+    
+    if (APR_SUCCESS == archive_gen_fname(&fname, s_fs, name, ptemp)
+        && APR_SUCCESS == md_text_fread8k(&text, ptemp, fname)
+        && (n = atoi(text)) > 0) {
+        return n;
+    }
+    ctx.name = name;
+    ctx.max = 0;
+    md_util_files_do_cached(s_fs->dcache, insp_archive, &ctx, ptemp, s_fs->base, 
+                            md_store_group_name(MD_SG_ARCHIVE), "*", NULL);
+    return ctx.max + 1;
+}
+
 static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_store_fs_t *s_fs = baton;
@@ -806,8 +1179,8 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     }
     
     if (MD_OK(archive? md_util_is_dir(to_dir, ptemp) : APR_ENOENT)) {
-        int n = 1;
-        const char *narch_dir;
+        int n, n_max;
+        const char *narch_dir = NULL;
 
         if (    !MD_OK(md_util_path_merge(&dir, ptemp, s_fs->base, 
                                           md_store_group_name(MD_SG_ARCHIVE), NULL))
@@ -815,11 +1188,13 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
             || !MD_OK(md_util_path_merge(&arch_dir, ptemp, dir, name, NULL))) {
             goto out;
         }
+        n = next_archive_number(s_fs, name, ptemp);
+        n_max = n + 1000;
         
 #ifdef WIN32
         /* WIN32 and handling of files/dirs. What can one say? */
         
-        while (n < 1000) {
+        while (n < n_max) {
             narch_dir = apr_psprintf(ptemp, "%s.%d", arch_dir, n);
             rv = md_util_is_dir(narch_dir, ptemp);
             if (APR_STATUS_IS_ENOENT(rv)) {
@@ -835,7 +1210,7 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
 
 #else   /* ifdef WIN32 */
 
-        while (n < 1000) {
+        while (n < n_max) {
             narch_dir = apr_psprintf(ptemp, "%s.%d", arch_dir, n);
             if (MD_OK(apr_dir_make(narch_dir, MD_FPROT_D_UONLY, ptemp))) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, ptemp, "using archive dir: %s", 
@@ -856,10 +1231,10 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
 #endif   /* ifdef WIN32 (else part) */
         
         if (!narch_dir) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "ran out of numbers less than 1000 "
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "ran out of numbers up to %d "
                           "while looking for an available one in %s to archive the data "
                           "from %s. Either something is generally wrong or you need to "
-                          "clean up some of those directories.", arch_dir, from_dir);
+                          "clean up some of those directories.", n_max, arch_dir, from_dir);
             rv = APR_EGENERAL;
             goto out;
         }
@@ -875,6 +1250,7 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
             apr_file_rename(narch_dir, to_dir, ptemp);
             goto out;
         }
+        archive_gen_set(s_fs, name, n + 1, ptemp);
         if (MD_OK(dispatch(s_fs, MD_S_FS_EV_MOVED, to, to_dir, APR_DIR, ptemp))) {
             rv = dispatch(s_fs, MD_S_FS_EV_MOVED, MD_SG_ARCHIVE, narch_dir, APR_DIR, ptemp);
         }
@@ -900,5 +1276,209 @@ static apr_status_t fs_move(md_store_t *store, apr_pool_t *p,
                             const char *name, int archive)
 {
     md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_move, s_fs, p, from, to, name, archive, NULL);
+    void *lock;
+    apr_status_t rv;
+    
+    lock = name_lock(s_fs, name);
+    md_pkey_cache_clear();
+    rv = md_util_pool_vdo(pfs_move, s_fs, p, from, to, name, archive, NULL);
+    name_unlock(lock);
+    return rv;
+}
+
+/**************************************************************************************************/
+/* leases */
+
+/* A lease is a file in the lease directory of the store, "<name>.<gen>.json", holding
+ * the owner and the time the lease runs out. The file with the highest generation
+ * is the lease. Taking or extending a lease creates the next generation exclusively,
+ * so that of all processes seeing the same lease free, only one succeeds. Files are
+ * never replaced: the holder only removes its own generation, others only add new
+ * ones. Afterwards the new holder checks that no higher generation appeared, as a 
+ * process counting from an empty directory would make, and removes the older ones.
+ * This works on shared file systems with exclusive creates, an external coordinator 
+ * can do better. */
+
+static apr_status_t lease_fname(const char **pfname, md_store_fs_t *s_fs, 
+                                const char *name, int gen, apr_pool_t *p)
+{
+    return md_util_path_merge(pfname, p, s_fs->base, MD_STORE_FS_LEASE_DIR, 
+                              apr_psprintf(p, "%s.%d.json", name, gen), NULL);
+}
+
+/* the generation of lease file fname for name, 0 if it is none */
+static int lease_gen(const char *fname, const char *name)
+{
+    apr_size_t len = strlen(name);
+    const char *s;
+    int n = 0;
+    
+    if (strncmp(fname, name, len) || fname[len] != '.') {
+        return 0;
+    }
+    for (s = fname + len + 1; apr_isdigit(*s) && n < 100000000; ++s) {
+        n = n * 10 + (*s - '0');
+    }
+    return strcmp(".json", s)? 0 : n;
+}
+
+/* Find the highest generation of the lease on name, 0 if there is none. With 
+ * below > 0, remove all generations lower than that. */
+static apr_status_t lease_scan(int *pgen, md_store_fs_t *s_fs, const char *name,
+                               int below, apr_pool_t *p)
+{
+    apr_dir_t *d;
+    apr_finfo_t finfo;
+    const char *dir, *fpath;
+    apr_status_t rv;
+    int n;
+    
+    *pgen = 0;
+    if (APR_SUCCESS != (rv = md_util_path_merge(&dir, p, s_fs->base, 
+                                                MD_STORE_FS_LEASE_DIR, NULL))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, dir, p))) {
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    while (APR_SUCCESS == apr_dir_read(&finfo, APR_FINFO_NAME, d)) {
+        if ((n = lease_gen(finfo.name, name)) <= 0) continue;
+        if (n > *pgen) {
+            *pgen = n;
+        }
+        if (n < below && APR_SUCCESS == md_util_path_merge(&fpath, p, dir, finfo.name, NULL)) {
+            apr_file_remove(fpath, p);
+        }
+    }
+    apr_dir_close(d);
+    return APR_SUCCESS;
+}
+
+static apr_status_t lease_read(const char **powner, apr_time_t *puntil, 
+                               const char *fpath, apr_pool_t *p)
+{
+    md_json_t *json;
+    const char *s;
+    apr_status_t rv;
+    
+    *powner = NULL;
+    *puntil = 0;
+    if (APR_SUCCESS == (rv = md_json_readf(&json, p, fpath))) {
+        *powner = md_json_gets(json, MD_KEY_OWNER, NULL);
+        if ((s = md_json_gets(json, MD_KEY_UNTIL, NULL))) {
+            *puntil = (apr_time_t)apr_atoi64(s);
+        }
+        if (!*powner) {
+            *powner = "";
+        }
+    }
+    return rv;
+}
+
+static apr_status_t pfs_lease(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *dir, *fpath, *name, *owner, *holder;
+    apr_interval_time_t duration;
+    apr_time_t now, until;
+    md_json_t *json;
+    apr_status_t rv;
+    int gen, max;
+    MD_CHK_VARS;
+    
+    (void)p;
+    name = va_arg(ap, const char*);
+    owner = va_arg(ap, const char*);
+    duration = va_arg(ap, apr_interval_time_t);
+    
+    /* the server makes the directory accessible to its watchdog at startup */
+    if (!MD_OK(md_util_path_merge(&dir, ptemp, s_fs->base, MD_STORE_FS_LEASE_DIR, NULL))) {
+        return rv;
+    }
+    if (!MD_OK(md_util_is_dir(dir, ptemp)) 
+        && !MD_OK(apr_dir_make_recursive(dir, s_fs->def_perms.dir, ptemp))) {
+        return rv;
+    }
+    
+    now = apr_time_now();
+    if (!MD_OK(lease_scan(&gen, s_fs, name, 0, ptemp))) {
+        return rv;
+    }
+    if (gen > 0) {
+        if (   !MD_OK(lease_fname(&fpath, s_fs, name, gen, ptemp))
+            || !MD_OK(lease_read(&holder, &until, fpath, ptemp))) {
+            /* released or taken over while we looked, try again later */
+            return (APR_STATUS_IS_ENOENT(rv) || APR_STATUS_IS_EINVAL(rv))? APR_EAGAIN : rv;
+        }
+        if (strcmp(owner, holder) && until > now) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ptemp, 
+                          "lease %s held by %s", name, holder);
+            return APR_EAGAIN;
+        }
+    }
+    
+    json = md_json_create(ptemp);
+    md_json_sets(owner, json, MD_KEY_OWNER, NULL);
+    md_json_sets(apr_psprintf(ptemp, "%" APR_TIME_T_FMT, now + duration), 
+                 json, MD_KEY_UNTIL, NULL);
+    ++gen;
+    if (!MD_OK(lease_fname(&fpath, s_fs, name, gen, ptemp))) {
+        return rv;
+    }
+    rv = md_json_fcreatex(json, ptemp, MD_JSON_FMT_INDENT, fpath, s_fs->def_perms.file);
+    if (APR_STATUS_IS_EEXIST(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ptemp, "lease %s taken by another", name);
+        return APR_EAGAIN;
+    }
+    else if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    
+    if (!MD_OK(lease_scan(&max, s_fs, name, gen, ptemp)) || max != gen) {
+        apr_file_remove(fpath, ptemp);
+        return (APR_SUCCESS == rv)? APR_EAGAIN : rv;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, ptemp, "lease %s for %s", name, owner);
+    return rv;
+}
+
+static apr_status_t fs_lease(void *baton, apr_pool_t *p, const char *name, 
+                             const char *owner, apr_interval_time_t duration)
+{
+    md_store_fs_t *s_fs = baton;
+    return md_util_pool_vdo(pfs_lease, s_fs, p, name, owner, duration, NULL);
+}
+
+static apr_status_t pfs_release(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *fpath, *name, *owner, *holder;
+    apr_time_t until;
+    apr_status_t rv;
+    int gen;
+    MD_CHK_VARS;
+    
+    (void)p;
+    name = va_arg(ap, const char*);
+    owner = va_arg(ap, const char*);
+    
+    /* A takeover adds a generation and leaves ours alone, removing the file
+     * we hold never removes a lease of someone else. */
+    if (   MD_OK(lease_scan(&gen, s_fs, name, 0, ptemp)) && gen > 0
+        && MD_OK(lease_fname(&fpath, s_fs, name, gen, ptemp))
+        && MD_OK(lease_read(&holder, &until, fpath, ptemp))
+        && !strcmp(owner, holder)) {
+        rv = apr_file_remove(fpath, ptemp);
+    }
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        rv = APR_SUCCESS;
+    }
+    return rv;
+}
+
+static apr_status_t fs_release(void *baton, apr_pool_t *p, const char *name, 
+                               const char *owner)
+{
+    md_store_fs_t *s_fs = baton;
+    return md_util_pool_vdo(pfs_release, s_fs, p, name, owner, NULL);
 }
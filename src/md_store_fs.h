@@ -38,6 +38,11 @@ struct md_store_t;
 #define MD_FPROT_F_UALL_WREAD (MD_FPROT_F_UALL_GREAD|APR_FPROT_WREAD)
 #define MD_FPROT_D_UALL_WREAD (MD_FPROT_D_UALL_GREAD|APR_FPROT_WREAD|APR_FPROT_WEXECUTE)
 
+/**
+ * Directory below the store base where leases are kept. 
+ */
+#define MD_STORE_FS_LEASE_DIR "leases"
+
 apr_status_t md_store_fs_init(struct md_store_t **pstore, apr_pool_t *p, 
                               const char *path);
 
@@ -53,6 +58,7 @@ apr_status_t md_store_fs_group_perms_set(struct md_store_t *store,
 typedef enum {
     MD_S_FS_EV_CREATED,
     MD_S_FS_EV_MOVED,
+    MD_S_FS_EV_REMOVED,                /* file removed or directory purged */
 } md_store_fs_ev_t; 
 
 typedef apr_status_t md_store_fs_cb(void *baton, struct md_store_t *store,
@@ -62,4 +68,17 @@ typedef apr_status_t md_store_fs_cb(void *baton, struct md_store_t *store,
                                     
 apr_status_t md_store_fs_set_event_cb(struct md_store_t *store, md_store_fs_cb *cb, void *baton);
 
+/**
+ * Enable/disable caching of directory listings, allocated from p, when iterating 
+ * the store. A cached listing is used as long as the modification time of its 
+ * directory does not change.
+ */
+apr_status_t md_store_fs_listing_cache_set(struct md_store_t *store, apr_pool_t *p, int enabled);
+
+/**
+ * Enable/disable syncing saved files and their directories to disk before a save 
+ * returns. A batch of saves syncs each directory once, when it is committed. 
+ */
+apr_status_t md_store_fs_sync_set(struct md_store_t *store, int enabled);
+
 #endif /* mod_md_md_store_fs_h */
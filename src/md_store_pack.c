@@ -0,0 +1,1445 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_fnmatch.h>
+#include <apr_hash.h>
+#include <apr_mmap.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_mutex.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_store_pack.h"
+#include "md_util.h"
+
+/**************************************************************************************************/
+/* single file implementation of md_store_t */
+
+/* The file starts with PACK_HDR, followed by records. A record has a header of
+ * PACK_RMAGIC, the length of its payload, the FNV-1a checksum of magic and length
+ * and the FNV-1a checksum of the payload. The payload starts with op, groups, value
+ * type, sequence number and modification time, followed by name, aspect and value,
+ * each prefixed by its length. Numbers are in network byte order.
+ *
+ * A record that is incomplete or fails its checksum at the end of the file is the
+ * remains of an interrupted write, or one still in progress. Reading stops there and
+ * the next write overwrites it. That is only the case when no other record can 
+ * follow it: its intact header says it reaches the end of the file, or there are 
+ * only zeroes after it. A bad record anywhere else is corruption, the file is then 
+ * not used at all. */
+#define PACK_HDR            "MDPACK\0\2"
+#define PACK_HDR_LEN        8
+#define PACK_RMAGIC         "MDPR"
+#define PACK_RHDR_LEN       16
+#define PACK_FIXED_LEN      20
+#define PACK_MAX_PAYLOAD    (16*1024*1024)
+
+#define PACK_MAP_ALIGN      (64*1024)
+#define PACK_COMPACT_MIN    (64*1024)
+#define PACK_OPEN_TRIES     10
+
+#define PACK_KEY_ASPECT     "md_store.json"
+#define PACK_KLEN           48
+
+#define PACK_NAME(s)        ((s)? (s) : "")
+
+typedef enum {
+    PACK_OP_NONE,
+    PACK_OP_PUT,
+    PACK_OP_DEL,
+    PACK_OP_PURGE,
+    PACK_OP_MOVE,                   /* aspect, if not empty, is the name to archive to */
+} pack_op_t;
+
+typedef struct {
+    pack_op_t op;
+    md_store_group_t group;
+    md_store_group_t group2;
+    md_store_vtype_t vtype;
+    apr_uint64_t seq;
+    apr_time_t mtime;
+    const char *name;
+    apr_size_t name_len;
+    const char *aspect;
+    apr_size_t aspect_len;
+    const char *data;
+    apr_size_t len;
+} pack_rec_t;
+
+typedef struct {
+    md_store_group_t group;
+    const char *name;
+    const char *aspect;
+    md_store_vtype_t vtype;
+    const char *data;               /* NUL terminated, not counted in len */
+    apr_size_t len;
+    apr_size_t rlen;                /* length of the record holding it */
+    apr_uint64_t seq;
+    apr_time_t mtime;
+} pack_entry_t;
+
+typedef struct md_store_pack_t md_store_pack_t;
+struct md_store_pack_t {
+    md_store_t s;
+
+    const char *base;               /* directory of the store */
+    const char *fname;              /* the pack file */
+    apr_pool_t *p;                  /* own allocator, only used with the mutex held */
+    apr_pool_t *ep;                 /* entries, replaced when reading the file anew */
+    apr_hash_t *groups[MD_SG_COUNT];/* name -> apr_hash_t of aspect -> pack_entry_t* */
+
+    int have_file;
+    apr_ino_t inode;
+    apr_dev_t device;
+    apr_off_t offset;               /* end of the valid records read */
+    apr_off_t live;                 /* length of the records holding current entries */
+    apr_uint64_t seq;               /* highest sequence number seen */
+
+    const unsigned char *key;
+    apr_size_t key_len;
+    int plain_pkey[MD_SG_COUNT];
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+#define PACK_STORE(store)   (md_store_pack_t*)(((char*)store)-offsetof(md_store_pack_t, s))
+
+static void pack_lock(md_store_pack_t *pack)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(pack->mutex);
+#else
+    (void)pack;
+#endif
+}
+
+static void pack_unlock(md_store_pack_t *pack)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(pack->mutex);
+#else
+    (void)pack;
+#endif
+}
+
+/**************************************************************************************************/
+/* records */
+
+static void put_u32(unsigned char *buf, apr_uint32_t n)
+{
+    buf[0] = (unsigned char)(n >> 24);
+    buf[1] = (unsigned char)(n >> 16);
+    buf[2] = (unsigned char)(n >> 8);
+    buf[3] = (unsigned char)n;
+}
+
+static apr_uint32_t get_u32(const unsigned char *buf)
+{
+    return ((apr_uint32_t)buf[0] << 24) | ((apr_uint32_t)buf[1] << 16)
+            | ((apr_uint32_t)buf[2] << 8) | (apr_uint32_t)buf[3];
+}
+
+static void put_u64(unsigned char *buf, apr_uint64_t n)
+{
+    put_u32(buf, (apr_uint32_t)(n >> 32));
+    put_u32(buf + 4, (apr_uint32_t)n);
+}
+
+static apr_uint64_t get_u64(const unsigned char *buf)
+{
+    return ((apr_uint64_t)get_u32(buf) << 32) | get_u32(buf + 4);
+}
+
+static apr_uint32_t fnv1a(const unsigned char *data, apr_size_t len)
+{
+    apr_uint32_t h = 2166136261u;
+    apr_size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned char *put_str(unsigned char *d, const char *s, apr_size_t len)
+{
+    put_u32(d, (apr_uint32_t)len);
+    if (len) {
+        memcpy(d + 4, s, len);
+    }
+    return d + 4 + len;
+}
+
+static int get_str(const unsigned char **pd, const unsigned char *end,
+                   const char **ps, apr_size_t *plen)
+{
+    apr_size_t len;
+
+    if (end - *pd < 4) {
+        return 0;
+    }
+    len = get_u32(*pd);
+    if ((apr_size_t)(end - *pd - 4) < len) {
+        return 0;
+    }
+    *ps = (const char*)(*pd + 4);
+    *plen = len;
+    *pd += 4 + len;
+    return 1;
+}
+
+static apr_status_t rec_encode(unsigned char **pbuf, apr_size_t *plen,
+                               const pack_rec_t *rec, apr_pool_t *p)
+{
+    unsigned char *buf, *d;
+    apr_size_t len;
+
+    len = PACK_FIXED_LEN + 12 + rec->name_len + rec->aspect_len + rec->len;
+    if (len > PACK_MAX_PAYLOAD) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, p,
+                      "value for %s/%s too large for the store", rec->name, rec->aspect);
+        return APR_EINVAL;
+    }
+
+    buf = apr_palloc(p, PACK_RHDR_LEN + len);
+    memcpy(buf, PACK_RMAGIC, 4);
+    put_u32(buf + 4, (apr_uint32_t)len);
+    d = buf + PACK_RHDR_LEN;
+    d[0] = (unsigned char)rec->op;
+    d[1] = (unsigned char)rec->group;
+    d[2] = (unsigned char)rec->group2;
+    d[3] = (unsigned char)rec->vtype;
+    put_u64(d + 4, rec->seq);
+    put_u64(d + 12, (apr_uint64_t)rec->mtime);
+    d += PACK_FIXED_LEN;
+    d = put_str(d, rec->name, rec->name_len);
+    d = put_str(d, rec->aspect, rec->aspect_len);
+    put_str(d, rec->data, rec->len);
+    put_u32(buf + 8, fnv1a(buf, 8));
+    put_u32(buf + 12, fnv1a(buf + PACK_RHDR_LEN, len));
+
+    *pbuf = buf;
+    *plen = PACK_RHDR_LEN + len;
+    return APR_SUCCESS;
+}
+
+/* If the record header at the start of data, with its length, is intact. */
+static int rhdr_is_intact(const unsigned char *data, apr_size_t len)
+{
+    return len >= PACK_RHDR_LEN && !memcmp(data, PACK_RMAGIC, 4)
+        && fnv1a(data, 8) == get_u32(data + 8);
+}
+
+/* Decode the record at the start of data, fails with APR_INCOMPLETE
+ * unless there is a complete and intact one. */
+static apr_status_t rec_decode(pack_rec_t *rec, apr_size_t *prlen,
+                               const unsigned char *data, apr_size_t len)
+{
+    const unsigned char *d, *end;
+    apr_size_t plen;
+
+    if (!rhdr_is_intact(data, len)) {
+        return APR_INCOMPLETE;
+    }
+    plen = get_u32(data + 4);
+    if (plen < PACK_FIXED_LEN + 12 || plen > len - PACK_RHDR_LEN
+        || fnv1a(data + PACK_RHDR_LEN, plen) != get_u32(data + 12)) {
+        return APR_INCOMPLETE;
+    }
+    d = data + PACK_RHDR_LEN;
+    end = d + plen;
+
+    rec->op = (pack_op_t)d[0];
+    rec->group = (md_store_group_t)d[1];
+    rec->group2 = (md_store_group_t)d[2];
+    rec->vtype = (md_store_vtype_t)d[3];
+    rec->seq = get_u64(d + 4);
+    rec->mtime = (apr_time_t)get_u64(d + 12);
+    d += PACK_FIXED_LEN;
+    if (rec->group >= MD_SG_COUNT || rec->group2 >= MD_SG_COUNT
+        || !get_str(&d, end, &rec->name, &rec->name_len)
+        || !get_str(&d, end, &rec->aspect, &rec->aspect_len)
+        || !get_str(&d, end, &rec->data, &rec->len)) {
+        return APR_INCOMPLETE;
+    }
+    *prlen = PACK_RHDR_LEN + plen;
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* entries */
+
+static apr_status_t pack_reset(md_store_pack_t *pack)
+{
+    apr_pool_t *ep;
+    apr_status_t rv;
+    int i;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(&ep, pack->p))) {
+        return rv;
+    }
+    apr_pool_tag(ep, "md_store_pack");
+    if (pack->ep) {
+        apr_pool_destroy(pack->ep);
+    }
+    pack->ep = ep;
+    for (i = 0; i < MD_SG_COUNT; ++i) {
+        pack->groups[i] = apr_hash_make(ep);
+    }
+    pack->have_file = 0;
+    pack->offset = 0;
+    pack->live = 0;
+    return APR_SUCCESS;
+}
+
+static apr_hash_t *pack_aspects(md_store_pack_t *pack, md_store_group_t group, const char *name)
+{
+    return apr_hash_get(pack->groups[group], name, APR_HASH_KEY_STRING);
+}
+
+static pack_entry_t *pack_entry(md_store_pack_t *pack, md_store_group_t group,
+                                const char *name, const char *aspect)
+{
+    apr_hash_t *aspects = pack_aspects(pack, group, name);
+    return aspects? apr_hash_get(aspects, aspect, APR_HASH_KEY_STRING) : NULL;
+}
+
+static void entry_del(md_store_pack_t *pack, md_store_group_t group,
+                      const char *name, const char *aspect)
+{
+    apr_hash_t *aspects;
+    pack_entry_t *e;
+
+    if ((aspects = pack_aspects(pack, group, name))
+        && (e = apr_hash_get(aspects, aspect, APR_HASH_KEY_STRING))) {
+        pack->live -= (apr_off_t)e->rlen;
+        apr_hash_set(aspects, aspect, APR_HASH_KEY_STRING, NULL);
+        if (!apr_hash_count(aspects)) {
+            apr_hash_set(pack->groups[group], name, APR_HASH_KEY_STRING, NULL);
+        }
+    }
+}
+
+static void name_del(md_store_pack_t *pack, md_store_group_t group, const char *name)
+{
+    apr_hash_t *aspects;
+    apr_hash_index_t *hi;
+    pack_entry_t *e;
+
+    if ((aspects = pack_aspects(pack, group, name))) {
+        for (hi = apr_hash_first(NULL, aspects); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, NULL, NULL, (void**)&e);
+            pack->live -= (apr_off_t)e->rlen;
+        }
+        apr_hash_set(pack->groups[group], name, APR_HASH_KEY_STRING, NULL);
+    }
+}
+
+static void name_move(md_store_pack_t *pack, md_store_group_t from, const char *from_name,
+                      md_store_group_t to, const char *to_name)
+{
+    apr_hash_t *aspects;
+    apr_hash_index_t *hi;
+    pack_entry_t *e;
+
+    if ((aspects = pack_aspects(pack, from, from_name))) {
+        apr_hash_set(pack->groups[from], from_name, APR_HASH_KEY_STRING, NULL);
+        name_del(pack, to, to_name);
+        for (hi = apr_hash_first(NULL, aspects); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, NULL, NULL, (void**)&e);
+            e->group = to;
+            e->name = to_name;
+        }
+        apr_hash_set(pack->groups[to], to_name, APR_HASH_KEY_STRING, aspects);
+    }
+}
+
+static void rec_apply(md_store_pack_t *pack, const pack_rec_t *rec, apr_size_t rlen)
+{
+    const char *name, *aspect;
+    apr_hash_t *aspects;
+    pack_entry_t *e;
+
+    if (rec->seq > pack->seq) {
+        pack->seq = rec->seq;
+    }
+    name = apr_pstrmemdup(pack->ep, rec->name, rec->name_len);
+    aspect = apr_pstrmemdup(pack->ep, rec->aspect, rec->aspect_len);
+    switch (rec->op) {
+        case PACK_OP_PUT:
+            entry_del(pack, rec->group, name, aspect);
+            e = apr_pcalloc(pack->ep, sizeof(*e));
+            e->group = rec->group;
+            e->name = name;
+            e->aspect = aspect;
+            e->vtype = rec->vtype;
+            e->data = apr_pstrmemdup(pack->ep, rec->data, rec->len);
+            e->len = rec->len;
+            e->rlen = rlen;
+            e->seq = rec->seq;
+            e->mtime = rec->mtime;
+            if (!(aspects = pack_aspects(pack, rec->group, name))) {
+                aspects = apr_hash_make(pack->ep);
+                apr_hash_set(pack->groups[rec->group], name, APR_HASH_KEY_STRING, aspects);
+            }
+            apr_hash_set(aspects, aspect, APR_HASH_KEY_STRING, e);
+            pack->live += (apr_off_t)rlen;
+            break;
+        case PACK_OP_DEL:
+            entry_del(pack, rec->group, name, aspect);
+            break;
+        case PACK_OP_PURGE:
+            name_del(pack, rec->group, name);
+            break;
+        case PACK_OP_MOVE:
+            if (*aspect) {
+                name_move(pack, rec->group2, name, MD_SG_ARCHIVE, aspect);
+            }
+            name_move(pack, rec->group, name, rec->group2, name);
+            break;
+        default:
+            break;
+    }
+}
+
+/**************************************************************************************************/
+/* reading */
+
+static apr_status_t read_range(const unsigned char **pdata, apr_size_t *plen, apr_file_t *f,
+                               apr_off_t start, apr_size_t len, apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+    char *buf;
+#if APR_HAS_MMAP
+    apr_mmap_t *mm;
+
+    if (APR_SUCCESS == apr_mmap_create(&mm, f, start, len, APR_MMAP_READ, ptemp)) {
+        /* unmapped on destruction of ptemp */
+        *pdata = mm->mm;
+        *plen = mm->size;
+        return APR_SUCCESS;
+    }
+#endif
+    buf = apr_palloc(ptemp, len);
+    if (APR_SUCCESS == (rv = apr_file_seek(f, APR_SET, &start))) {
+        rv = apr_file_read_full(f, buf, len, plen);
+        if (APR_STATUS_IS_EOF(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    *pdata = (const unsigned char*)buf;
+    return rv;
+}
+
+/* If the bad record at data is one torn by an interrupted write and the tail of
+ * the file: too short for a header, its intact header says it reaches the end of
+ * the file, or it is followed only by the zeroes a crash may leave. */
+static int rec_is_torn(const unsigned char *data, apr_size_t len)
+{
+    apr_size_t i = 0;
+    
+    if (len < PACK_RHDR_LEN) {
+        return 1;
+    }
+    if (rhdr_is_intact(data, len)) {
+        if (get_u32(data + 4) >= len - PACK_RHDR_LEN) {
+            return 1;
+        }
+        i = PACK_RHDR_LEN + get_u32(data + 4);
+    }
+    for (; i < len && !data[i]; ++i);
+    return i == len;
+}
+
+/* Apply the valid records from pack->offset up to size. */
+static apr_status_t pack_read(md_store_pack_t *pack, apr_file_t *f, apr_off_t size,
+                              apr_pool_t *ptemp)
+{
+    const unsigned char *data;
+    apr_size_t len, pos, rlen;
+    apr_off_t start;
+    pack_rec_t rec;
+    apr_status_t rv;
+
+    if (pack->offset == 0 && size < PACK_HDR_LEN) {
+        /* new file, or its header has not been written completely */
+        return APR_SUCCESS;
+    }
+    /* mapping requires the offset to be a multiple of the page size */
+    start = pack->offset - (pack->offset % PACK_MAP_ALIGN);
+    if (APR_SUCCESS != (rv = read_range(&data, &len, f, start, (apr_size_t)(size - start),
+                                        ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "reading %s", pack->fname);
+        return rv;
+    }
+
+    pos = (apr_size_t)(pack->offset - start);
+    if (pack->offset == 0) {
+        if (len < PACK_HDR_LEN || memcmp(data, PACK_HDR, PACK_HDR_LEN)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, ptemp,
+                          "%s is not a store file of this version", pack->fname);
+            return APR_EINVAL;
+        }
+        pos = PACK_HDR_LEN;
+    }
+    while (pos < len && APR_SUCCESS == rec_decode(&rec, &rlen, data + pos, len - pos)) {
+        rec_apply(pack, &rec, rlen);
+        pos += rlen;
+    }
+    pack->offset = start + (apr_off_t)pos;
+    if (pos < len && !rec_is_torn(data + pos, len - pos)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, ptemp, "%s is corrupt at offset %"
+                      APR_OFF_T_FMT ", leaving it untouched", pack->fname, pack->offset);
+        return APR_EINVAL;
+    }
+    return APR_SUCCESS;
+}
+
+/* Bring the entries up to date with the opened file. */
+static apr_status_t pack_update(md_store_pack_t *pack, apr_file_t *f,
+                                const apr_finfo_t *finfo, apr_pool_t *ptemp)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!pack->have_file || finfo->inode != pack->inode || finfo->device != pack->device
+        || finfo->size < pack->offset) {
+        /* new, or replaced by compaction: start over */
+        if (APR_SUCCESS != (rv = pack_reset(pack))) {
+            return rv;
+        }
+    }
+    if (finfo->size > pack->offset) {
+        rv = pack_read(pack, f, finfo->size, ptemp);
+    }
+    if (APR_SUCCESS == rv) {
+        pack->have_file = 1;
+        pack->inode = finfo->inode;
+        pack->device = finfo->device;
+    }
+    return rv;
+}
+
+static apr_status_t pack_sync(md_store_pack_t *pack, apr_pool_t *ptemp)
+{
+    apr_finfo_t finfo;
+    apr_file_t *f;
+    apr_status_t rv;
+
+    /* not all platforms know inodes, leave them the same then */
+    memset(&finfo, 0, sizeof(finfo));
+    rv = apr_stat(&finfo, pack->fname, APR_FINFO_SIZE|APR_FINFO_IDENT, ptemp);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        return pack->have_file? pack_reset(pack) : APR_SUCCESS;
+    }
+    else if (APR_SUCCESS != rv && APR_INCOMPLETE != rv) {
+        return rv;
+    }
+    if (pack->have_file && finfo.inode == pack->inode && finfo.device == pack->device
+        && finfo.size == pack->offset) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_file_open(&f, pack->fname, APR_FOPEN_READ|APR_FOPEN_BINARY,
+                       APR_FPROT_OS_DEFAULT, ptemp);
+    if (APR_SUCCESS == rv) {
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_IDENT, f);
+        if (APR_SUCCESS == rv || APR_INCOMPLETE == rv) {
+            rv = pack_update(pack, f, &finfo, ptemp);
+        }
+        apr_file_close(f);
+    }
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+/**************************************************************************************************/
+/* writing */
+
+typedef struct {
+    md_store_pack_t *pack;
+    md_store_group_t group;
+    const char *name;
+    const char *aspect;
+    md_store_vtype_t vtype;
+    void *value;
+    const char *data;
+    apr_size_t len;
+    int create;
+    int force;
+    md_store_group_t to;
+    int archive;
+} pack_ctx_t;
+
+/* Fill in the change to make, with the entries up to date. Leaving op at
+ * PACK_OP_NONE writes nothing. */
+typedef apr_status_t pack_prep_cb(pack_rec_t *rec, pack_ctx_t *ctx, apr_pool_t *ptemp);
+
+static apr_status_t pack_open_locked(apr_file_t **pf, apr_finfo_t *finfo,
+                                     md_store_pack_t *pack, apr_pool_t *ptemp)
+{
+    apr_finfo_t sinfo;
+    apr_file_t *f;
+    apr_status_t rv;
+    int i;
+
+    memset(finfo, 0, sizeof(*finfo));
+    memset(&sinfo, 0, sizeof(sinfo));
+    for (i = 0; i < PACK_OPEN_TRIES; ++i) {
+        rv = apr_file_open(&f, pack->fname, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_CREATE
+                           |APR_FOPEN_BINARY, MD_FPROT_F_UONLY, ptemp);
+        if (APR_SUCCESS != rv) {
+            return rv;
+        }
+        if (APR_SUCCESS != (rv = apr_file_lock(f, APR_FLOCK_EXCLUSIVE))) {
+            apr_file_close(f);
+            return rv;
+        }
+        rv = apr_file_info_get(finfo, APR_FINFO_SIZE|APR_FINFO_IDENT, f);
+        if (APR_SUCCESS == rv || APR_INCOMPLETE == rv) {
+            rv = apr_stat(&sinfo, pack->fname, APR_FINFO_IDENT, ptemp);
+            if ((APR_SUCCESS == rv || APR_INCOMPLETE == rv)
+                && sinfo.inode == finfo->inode && sinfo.device == finfo->device) {
+                *pf = f;
+                return APR_SUCCESS;
+            }
+        }
+        /* replaced by a compaction while we waited for the lock */
+        apr_file_close(f);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EBUSY, ptemp, "unable to lock %s", pack->fname);
+    return APR_EBUSY;
+}
+
+static apr_status_t write_data(apr_file_t *f, apr_off_t offset,
+                               const void *data, apr_size_t len)
+{
+    apr_status_t rv;
+
+    if (APR_SUCCESS == (rv = apr_file_seek(f, APR_SET, &offset))) {
+        rv = apr_file_write_full(f, data, len, NULL);
+    }
+    return rv;
+}
+
+static apr_status_t pack_compact(md_store_pack_t *pack, apr_pool_t *ptemp)
+{
+    apr_hash_index_t *hi, *hj;
+    apr_hash_t *aspects;
+    const char *tmp;
+    unsigned char *buf;
+    apr_size_t len;
+    apr_off_t offset;
+    apr_file_t *f;
+    pack_entry_t *e;
+    pack_rec_t rec;
+    apr_status_t rv;
+    int i;
+
+    tmp = apr_pstrcat(ptemp, pack->fname, ".tmp", NULL);
+    rv = apr_file_open(&f, tmp, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_TRUNCATE
+                       |APR_FOPEN_BINARY, MD_FPROT_F_UONLY, ptemp);
+    if (APR_SUCCESS != rv) {
+        goto out;
+    }
+
+    rv = write_data(f, 0, PACK_HDR, PACK_HDR_LEN);
+    offset = PACK_HDR_LEN;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = PACK_OP_PUT;
+    for (i = 0; i < MD_SG_COUNT && APR_SUCCESS == rv; ++i) {
+        for (hi = apr_hash_first(ptemp, pack->groups[i]); hi && APR_SUCCESS == rv;
+             hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, NULL, NULL, (void**)&aspects);
+            for (hj = apr_hash_first(ptemp, aspects); hj && APR_SUCCESS == rv;
+                 hj = apr_hash_next(hj)) {
+                apr_hash_this(hj, NULL, NULL, (void**)&e);
+                rec.group = e->group;
+                rec.vtype = e->vtype;
+                rec.seq = e->seq;
+                rec.mtime = e->mtime;
+                rec.name = e->name;
+                rec.name_len = strlen(e->name);
+                rec.aspect = e->aspect;
+                rec.aspect_len = strlen(e->aspect);
+                rec.data = e->data;
+                rec.len = e->len;
+                if (APR_SUCCESS == (rv = rec_encode(&buf, &len, &rec, ptemp))
+                    && APR_SUCCESS == (rv = write_data(f, offset, buf, len))) {
+                    offset += (apr_off_t)len;
+                }
+            }
+        }
+    }
+    if (APR_SUCCESS == rv && APR_SUCCESS == (rv = apr_file_flush(f))) {
+        rv = apr_file_datasync(f);
+    }
+    apr_file_close(f);
+
+    if (APR_SUCCESS == rv && APR_SUCCESS == (rv = apr_file_rename(tmp, pack->fname, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "compacted %s from %"
+                      APR_OFF_T_FMT " to %" APR_OFF_T_FMT " bytes",
+                      pack->fname, pack->offset, offset);
+        /* read the new file on next access */
+        pack_reset(pack);
+    }
+    else {
+        apr_file_remove(tmp, ptemp);
+    }
+out:
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "compacting %s", pack->fname);
+    }
+    return rv;
+}
+
+static apr_status_t pack_write(pack_ctx_t *ctx, pack_prep_cb *prep, apr_pool_t *ptemp)
+{
+    md_store_pack_t *pack = ctx->pack;
+    unsigned char *buf;
+    apr_size_t len, rlen;
+    apr_finfo_t finfo;
+    apr_file_t *f;
+    pack_rec_t rec;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (!MD_OK(pack_open_locked(&f, &finfo, pack, ptemp))) {
+        goto out;
+    }
+    if (!MD_OK(pack_update(pack, f, &finfo, ptemp))) {
+        goto leave;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    if (!MD_OK(prep(&rec, ctx, ptemp)) || PACK_OP_NONE == rec.op) {
+        goto leave;
+    }
+    rec.seq = pack->seq + 1;
+    rec.mtime = apr_time_now();
+    if (!MD_OK(rec_encode(&buf, &len, &rec, ptemp))) {
+        goto leave;
+    }
+
+    if (pack->offset < PACK_HDR_LEN) {
+        if (!MD_OK(apr_file_trunc(f, 0)) || !MD_OK(write_data(f, 0, PACK_HDR, PACK_HDR_LEN))) {
+            goto leave;
+        }
+        pack->offset = PACK_HDR_LEN;
+    }
+    else if (finfo.size > pack->offset && !MD_OK(apr_file_trunc(f, pack->offset))) {
+        /* a torn record at the end, pack_update fails on anything else */
+        goto leave;
+    }
+    if (   !MD_OK(write_data(f, pack->offset, buf, len))
+        || !MD_OK(apr_file_flush(f))
+        || !MD_OK(apr_file_datasync(f))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "writing to %s", pack->fname);
+        goto leave;
+    }
+
+    /* apply what is in the file now, the same way it is read back */
+    if (MD_OK(rec_decode(&rec, &rlen, buf, len))) {
+        rec_apply(pack, &rec, rlen);
+    }
+    pack->offset += (apr_off_t)len;
+
+    if (pack->offset > PACK_COMPACT_MIN && pack->offset > 2 * pack->live) {
+        pack_compact(pack, ptemp);
+    }
+    rv = APR_SUCCESS;
+
+leave:
+    apr_file_unlock(f);
+    apr_file_close(f);
+out:
+    return rv;
+}
+
+/**************************************************************************************************/
+/* values */
+
+static void get_pass(const char **ppass, apr_size_t *plen,
+                     md_store_pack_t *pack, md_store_group_t group)
+{
+    if (pack->plain_pkey[group]) {
+        *ppass = NULL;
+        *plen = 0;
+    }
+    else {
+        *ppass = (const char *)pack->key;
+        *plen = pack->key_len;
+    }
+}
+
+static apr_status_t value_to_data(const char **pdata, apr_size_t *plen, md_store_pack_t *pack,
+                                  md_store_group_t group, md_store_vtype_t vtype, void *value,
+                                  apr_pool_t *p)
+{
+    apr_array_header_t *chain;
+    const char *pass;
+    apr_size_t pass_len;
+
+    switch (vtype) {
+        case MD_SV_TEXT:
+            *pdata = value;
+            *plen = strlen(*pdata);
+            return APR_SUCCESS;
+        case MD_SV_JSON:
+            if (!(*pdata = md_json_writep((md_json_t *)value, p, MD_JSON_FMT_INDENT))) {
+                return APR_EINVAL;
+            }
+            *plen = strlen(*pdata);
+            return APR_SUCCESS;
+        case MD_SV_CERT:
+            chain = apr_array_make(p, 1, sizeof(md_cert_t *));
+            APR_ARRAY_PUSH(chain, md_cert_t *) = value;
+            return md_chain_to_pem(pdata, plen, chain, p);
+        case MD_SV_PKEY:
+            get_pass(&pass, &pass_len, pack, group);
+            return md_pkey_to_pem(pdata, plen, (md_pkey_t *)value, p, pass, pass_len);
+        case MD_SV_CHAIN:
+            return md_chain_to_pem(pdata, plen, (apr_array_header_t*)value, p);
+        default:
+            return APR_ENOTIMPL;
+    }
+}
+
+static apr_status_t data_to_value(void **pvalue, md_store_pack_t *pack, md_store_group_t group,
+                                  md_store_vtype_t vtype, const char *data, apr_size_t len,
+                                  apr_pool_t *p)
+{
+    apr_array_header_t *chain;
+    const char *pass;
+    apr_size_t pass_len;
+    apr_status_t rv;
+
+    switch (vtype) {
+        case MD_SV_TEXT:
+            *pvalue = apr_pstrmemdup(p, data, len);
+            return APR_SUCCESS;
+        case MD_SV_JSON:
+            return md_json_readd((md_json_t **)pvalue, p, data, len);
+        case MD_SV_CERT:
+            if (APR_SUCCESS == (rv = md_chain_from_pem(&chain, p, data, len))) {
+                if (chain->nelts < 1) {
+                    return APR_EINVAL;
+                }
+                *pvalue = APR_ARRAY_IDX(chain, 0, md_cert_t *);
+            }
+            return rv;
+        case MD_SV_PKEY:
+            get_pass(&pass, &pass_len, pack, group);
+            return md_pkey_from_pem((md_pkey_t **)pvalue, p, data, len, pass, pass_len);
+        case MD_SV_CHAIN:
+            return md_chain_from_pem((apr_array_header_t **)pvalue, p, data, len);
+        default:
+            return APR_ENOTIMPL;
+    }
+}
+
+/**************************************************************************************************/
+/* store operations */
+
+static apr_status_t ppack_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_pack_t *pack = baton;
+    const char *name, *aspect, *data = NULL;
+    md_store_vtype_t vtype;
+    md_store_group_t group;
+    pack_entry_t *e;
+    apr_size_t len = 0;
+    void **pvalue;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    group = (md_store_group_t)va_arg(ap, int);
+    name = PACK_NAME(va_arg(ap, const char *));
+    aspect = PACK_NAME(va_arg(ap, const char *));
+    vtype = (md_store_vtype_t)va_arg(ap, int);
+    pvalue= va_arg(ap, void **);
+
+    pack_lock(pack);
+    if (MD_OK(pack_sync(pack, ptemp))) {
+        if (!(e = pack_entry(pack, group, name, aspect))) {
+            rv = APR_ENOENT;
+        }
+        else if (pvalue) {
+            /* the entry is gone once the file is read anew */
+            data = apr_pstrmemdup(ptemp, e->data, e->len);
+            len = e->len;
+        }
+    }
+    pack_unlock(pack);
+
+    if (APR_SUCCESS == rv && pvalue) {
+        rv = data_to_value(pvalue, pack, group, vtype, data, len, p);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, ptemp,
+                      "loading type %d from %s/%s/%s", vtype,
+                      md_store_group_name(group), name, aspect);
+    }
+    return rv;
+}
+
+static apr_status_t pack_load(md_store_t *store, md_store_group_t group,
+                              const char *name, const char *aspect,
+                              md_store_vtype_t vtype, void **pvalue, apr_pool_t *p)
+{
+    md_store_pack_t *pack = PACK_STORE(store);
+    return md_util_pool_vdo(ppack_load, pack, p, group, name, aspect, vtype, pvalue, NULL);
+}
+
+static apr_status_t prep_put(pack_rec_t *rec, pack_ctx_t *ctx, apr_pool_t *ptemp)
+{
+    (void)ptemp;
+    if (ctx->create && (MD_SV_TEXT == ctx->vtype || MD_SV_JSON == ctx->vtype)
+        && pack_entry(ctx->pack, ctx->group, ctx->name, ctx->aspect)) {
+        return APR_EEXIST;
+    }
+    rec->op = PACK_OP_PUT;
+    rec->group = ctx->group;
+    rec->vtype = ctx->vtype;
+    rec->name = ctx->name;
+    rec->name_len = strlen(ctx->name);
+    rec->aspect = ctx->aspect;
+    rec->aspect_len = strlen(ctx->aspect);
+    rec->data = ctx->data;
+    rec->len = ctx->len;
+    return APR_SUCCESS;
+}
+
+static apr_status_t ppack_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp)
+{
+    pack_ctx_t *ctx = baton;
+    apr_status_t rv;
+
+    (void)p;
+    rv = value_to_data(&ctx->data, &ctx->len, ctx->pack, ctx->group, ctx->vtype,
+                       ctx->value, ptemp);
+    if (APR_SUCCESS == rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "storing %s/%s/%s",
+                      md_store_group_name(ctx->group), ctx->name, ctx->aspect);
+        pack_lock(ctx->pack);
+        rv = pack_write(ctx, prep_put, ptemp);
+        pack_unlock(ctx->pack);
+    }
+    return rv;
+}
+
+static apr_status_t pack_save(md_store_t *store, apr_pool_t *p, md_store_group_t group,
+                              const char *name, const char *aspect,
+                              md_store_vtype_t vtype, void *value, int create)
+{
+    pack_ctx_t ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pack = PACK_STORE(store);
+    ctx.group = group;
+    ctx.name = PACK_NAME(name);
+    ctx.aspect = PACK_NAME(aspect);
+    ctx.vtype = vtype;
+    ctx.value = value;
+    ctx.create = create;
+    return md_util_pool_do(ppack_save, &ctx, p);
+}
+
+static apr_status_t prep_remove(pack_rec_t *rec, pack_ctx_t *ctx, apr_pool_t *ptemp)
+{
+    (void)ptemp;
+    if (!pack_entry(ctx->pack, ctx->group, ctx->name, ctx->aspect)) {
+        return ctx->force? APR_SUCCESS : APR_ENOENT;
+    }
+    rec->op = PACK_OP_DEL;
+    rec->group = ctx->group;
+    rec->name = ctx->name;
+    rec->name_len = strlen(ctx->name);
+    rec->aspect = ctx->aspect;
+    rec->aspect_len = strlen(ctx->aspect);
+    return APR_SUCCESS;
+}
+
+static apr_status_t prep_purge(pack_rec_t *rec, pack_ctx_t *ctx, apr_pool_t *ptemp)
+{
+    (void)ptemp;
+    if (pack_aspects(ctx->pack, ctx->group, ctx->name)) {
+        rec->op = PACK_OP_PURGE;
+        rec->group = ctx->group;
+        rec->name = ctx->name;
+        rec->name_len = strlen(ctx->name);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t ppack_change(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    pack_ctx_t *ctx = baton;
+    pack_prep_cb *prep;
+    apr_status_t rv;
+
+    (void)p;
+    prep = va_arg(ap, pack_prep_cb*);
+    pack_lock(ctx->pack);
+    rv = pack_write(ctx, prep, ptemp);
+    pack_unlock(ctx->pack);
+    return rv;
+}
+
+static apr_status_t pack_remove(md_store_t *store, md_store_group_t group,
+                                const char *name, const char *aspect,
+                                apr_pool_t *p, int force)
+{
+    pack_ctx_t ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pack = PACK_STORE(store);
+    ctx.group = group;
+    ctx.name = PACK_NAME(name);
+    ctx.aspect = PACK_NAME(aspect);
+    ctx.force = force;
+    return md_util_pool_vdo(ppack_change, &ctx, p, prep_remove, NULL);
+}
+
+static apr_status_t pack_purge(md_store_t *store, apr_pool_t *p,
+                               md_store_group_t group, const char *name)
+{
+    pack_ctx_t ctx;
+    apr_status_t rv;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pack = PACK_STORE(store);
+    ctx.group = group;
+    ctx.name = PACK_NAME(name);
+    rv = md_util_pool_vdo(ppack_change, &ctx, p, prep_purge, NULL);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, p, "purge %s/%s",
+                  md_store_group_name(group), ctx.name);
+    return rv;
+}
+
+static apr_status_t prep_move(pack_rec_t *rec, pack_ctx_t *ctx, apr_pool_t *ptemp)
+{
+    const char *arch_name = "";
+    int n;
+
+    if (!pack_aspects(ctx->pack, ctx->group, ctx->name)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_ENOENT, ptemp, "source does not exist: %s/%s",
+                      md_store_group_name(ctx->group), ctx->name);
+        return APR_ENOENT;
+    }
+    if (pack_aspects(ctx->pack, ctx->to, ctx->name)) {
+        if (!ctx->archive) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_EEXIST, ptemp, "target exists: %s/%s",
+                          md_store_group_name(ctx->to), ctx->name);
+            return APR_EEXIST;
+        }
+        for (n = 1; n < 1000; ++n) {
+            arch_name = apr_psprintf(ptemp, "%s.%d", ctx->name, n);
+            if (!pack_aspects(ctx->pack, MD_SG_ARCHIVE, arch_name)) {
+                break;
+            }
+        }
+        if (n >= 1000) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EGENERAL, ptemp, "ran out of numbers "
+                          "less than 1000 while looking for an available one to archive "
+                          "%s/%s.", md_store_group_name(ctx->to), ctx->name);
+            return APR_EGENERAL;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ptemp, "using archive name: %s", arch_name);
+    }
+    rec->op = PACK_OP_MOVE;
+    rec->group = ctx->group;
+    rec->group2 = ctx->to;
+    rec->name = ctx->name;
+    rec->name_len = strlen(ctx->name);
+    rec->aspect = arch_name;
+    rec->aspect_len = strlen(arch_name);
+    return APR_SUCCESS;
+}
+
+static apr_status_t pack_move(md_store_t *store, apr_pool_t *p,
+                              md_store_group_t from, md_store_group_t to,
+                              const char *name, int archive)
+{
+    pack_ctx_t ctx;
+
+    if (from == to) {
+        return APR_EINVAL;
+    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pack = PACK_STORE(store);
+    ctx.group = from;
+    ctx.to = to;
+    ctx.name = PACK_NAME(name);
+    ctx.archive = archive;
+    return md_util_pool_vdo(ppack_change, &ctx, p, prep_move, NULL);
+}
+
+/**************************************************************************************************/
+/* iteration */
+
+typedef struct {
+    const char *name;
+    const char *aspect;
+    const char *data;
+    apr_size_t len;
+} pack_item_t;
+
+static int item_cmp(const void *a, const void *b)
+{
+    const pack_item_t *i1 = a, *i2 = b;
+    int n = strcmp(i1->name, i2->name);
+    return n? n : strcmp(i1->aspect, i2->aspect);
+}
+
+/* Copy the matching entries (or only their names, if aspect is NULL), sorted. */
+static apr_status_t pack_collect(apr_array_header_t **pitems, md_store_pack_t *pack,
+                                 md_store_group_t group, const char *pattern,
+                                 const char *aspect, apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_array_header_t *items;
+    apr_hash_index_t *hi, *hj;
+    apr_hash_t *aspects;
+    pack_entry_t *e;
+    pack_item_t *item;
+    const char *name;
+    apr_status_t rv;
+
+    items = apr_array_make(p, 10, sizeof(pack_item_t));
+    pack_lock(pack);
+    if (APR_SUCCESS == (rv = pack_sync(pack, ptemp))) {
+        for (hi = apr_hash_first(ptemp, pack->groups[group]); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, (const void**)&name, NULL, (void**)&aspects);
+            if (APR_SUCCESS != apr_fnmatch(pattern, name, 0)) {
+                continue;
+            }
+            if (!aspect) {
+                item = (pack_item_t*)apr_array_push(items);
+                memset(item, 0, sizeof(*item));
+                item->name = apr_pstrdup(p, name);
+                item->aspect = "";
+                continue;
+            }
+            for (hj = apr_hash_first(ptemp, aspects); hj; hj = apr_hash_next(hj)) {
+                apr_hash_this(hj, NULL, NULL, (void**)&e);
+                if (APR_SUCCESS == apr_fnmatch(aspect, e->aspect, 0)) {
+                    item = (pack_item_t*)apr_array_push(items);
+                    item->name = apr_pstrdup(p, e->name);
+                    item->aspect = apr_pstrdup(p, e->aspect);
+                    item->data = apr_pstrmemdup(p, e->data, e->len);
+                    item->len = e->len;
+                }
+            }
+        }
+    }
+    pack_unlock(pack);
+
+    qsort(items->elts, (size_t)items->nelts, sizeof(pack_item_t), item_cmp);
+    *pitems = items;
+    return rv;
+}
+
+static apr_status_t pack_iterate(md_store_inspect *inspect, void *baton, md_store_t *store,
+                                 apr_pool_t *p, md_store_group_t group, const char *pattern,
+                                 const char *aspect, md_store_vtype_t vtype)
+{
+    md_store_pack_t *pack = PACK_STORE(store);
+    apr_array_header_t *items;
+    pack_item_t *item;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    void *value;
+    int i;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+    rv = pack_collect(&items, pack, group, pattern, PACK_NAME(aspect), ptemp, ptemp);
+    for (i = 0; i < items->nelts && APR_SUCCESS == rv; ++i) {
+        item = &APR_ARRAY_IDX(items, i, pack_item_t);
+        if (APR_SUCCESS == (rv = data_to_value(&value, pack, group, vtype,
+                                               item->data, item->len, p))
+            && !inspect(baton, item->name, item->aspect, vtype, value, p)) {
+            rv = APR_EOF;
+        }
+    }
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+static apr_status_t pack_iterate_names(md_store_inspect_name *inspect, void *baton,
+                                       md_store_t *store, apr_pool_t *p,
+                                       md_store_group_t group, const char *pattern)
+{
+    md_store_pack_t *pack = PACK_STORE(store);
+    apr_array_header_t *items;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    int i;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = pack_collect(&items, pack, group, pattern, NULL, ptemp, ptemp))) {
+        for (i = 0; i < items->nelts; ++i) {
+            if (!inspect(baton, APR_ARRAY_IDX(items, i, pack_item_t).name, ptemp)) {
+                break;
+            }
+        }
+    }
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+/**************************************************************************************************/
+/* meta data */
+
+static int pack_is_newer(md_store_t *store, md_store_group_t group1, md_store_group_t group2,
+                         const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_pack_t *pack = PACK_STORE(store);
+    pack_entry_t *e1, *e2;
+    int newer = 0;
+
+    name = PACK_NAME(name);
+    aspect = PACK_NAME(aspect);
+    pack_lock(pack);
+    if (APR_SUCCESS == pack_sync(pack, p)
+        && (e1 = pack_entry(pack, group1, name, aspect))
+        && (e2 = pack_entry(pack, group2, name, aspect))) {
+        newer = e1->seq > e2->seq;
+    }
+    pack_unlock(pack);
+    return newer;
+}
+
+static apr_time_t pack_get_modified(md_store_t *store, md_store_group_t group,
+                                    const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_pack_t *pack = PACK_STORE(store);
+    apr_time_t mtime = 0;
+    pack_entry_t *e;
+
+    pack_lock(pack);
+    if (APR_SUCCESS == pack_sync(pack, p)
+        && (e = pack_entry(pack, group, PACK_NAME(name), PACK_NAME(aspect)))) {
+        mtime = e->mtime;
+    }
+    pack_unlock(pack);
+    return mtime;
+}
+
+typedef struct {
+    const char *data;
+    apr_size_t len;
+} pack_buf_t;
+
+static apr_status_t fwrite_buf(void *baton, apr_file_t *f, apr_pool_t *p)
+{
+    pack_buf_t *buf = baton;
+
+    (void)p;
+    return apr_file_write_full(f, buf->data, buf->len, NULL);
+}
+
+static apr_status_t ppack_export(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_pack_t *pack = baton;
+    const char *dir, *fpath, *name, *aspect;
+    md_store_group_t group;
+    apr_time_t mtime = 0;
+    apr_finfo_t finfo;
+    pack_entry_t *e;
+    pack_buf_t buf;
+    apr_status_t rv;
+
+    (void)p;
+    dir = va_arg(ap, const char *);
+    fpath = va_arg(ap, const char *);
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char *);
+    aspect = va_arg(ap, const char *);
+
+    memset(&buf, 0, sizeof(buf));
+    pack_lock(pack);
+    if (APR_SUCCESS == (rv = pack_sync(pack, ptemp))
+        && (e = pack_entry(pack, group, name, aspect))) {
+        buf.data = apr_pmemdup(ptemp, e->data, e->len);
+        buf.len = e->len;
+        mtime = e->mtime;
+    }
+    pack_unlock(pack);
+
+    if (APR_SUCCESS != rv || !buf.data
+        || (APR_SUCCESS == apr_stat(&finfo, fpath, APR_FINFO_MTIME|APR_FINFO_SIZE, ptemp)
+            && finfo.mtime == mtime && finfo.size == (apr_off_t)buf.len)) {
+        /* Nothing to write or still the same. Writes within the same second differ in
+         * their mtime below that, where the file system keeps less, we export again. */
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = apr_dir_make_recursive(dir, MD_FPROT_D_UONLY, ptemp))
+        && APR_SUCCESS == (rv = md_util_freplace(fpath, MD_FPROT_F_UONLY, ptemp,
+                                                 fwrite_buf, &buf))) {
+        rv = apr_file_mtime_set(fpath, mtime, ptemp);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, ptemp, "export to %s", fpath);
+    return rv;
+}
+
+static apr_status_t pack_get_fname(const char **pfname,
+                                   md_store_t *store, md_store_group_t group,
+                                   const char *name, const char *aspect,
+                                   apr_pool_t *p)
+{
+    md_store_pack_t *pack = PACK_STORE(store);
+    const char *dir;
+    apr_status_t rv;
+
+    if (group == MD_SG_NONE) {
+        dir = pack->base;
+        name = "";
+        rv = md_util_path_merge(pfname, p, dir, aspect, NULL);
+    }
+    else if (APR_SUCCESS == (rv = md_util_path_merge(&dir, p, pack->base,
+                                                     md_store_group_name(group), name, NULL))) {
+        rv = md_util_path_merge(pfname, p, dir, aspect, NULL);
+    }
+    if (APR_SUCCESS == rv && name && aspect) {
+        rv = md_util_pool_vdo(ppack_export, pack, p, dir, *pfname, group, name, aspect, NULL);
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* setup */
+
+static apr_status_t setup_key(void *baton, apr_pool_t *p, apr_pool_t *ptemp)
+{
+    md_store_pack_t *pack = baton;
+    md_json_t *json;
+    const char *key64, *key;
+    unsigned char *nkey;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+read:
+    if (MD_OK(md_store_load_json(&pack->s, MD_SG_NONE, NULL, PACK_KEY_ASPECT, &json, ptemp))) {
+        if (!(key64 = md_json_gets(json, MD_KEY_KEY, NULL))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p, "missing key: %s", MD_KEY_KEY);
+            return APR_EINVAL;
+        }
+        pack->key_len = md_util_base64url_decode(&key, key64, p);
+        pack->key = (const unsigned char*)key;
+        if (pack->key_len != PACK_KLEN) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p, "key length unexpected: %"
+                          APR_SIZE_T_FMT, pack->key_len);
+            return APR_EINVAL;
+        }
+    }
+    else if (APR_STATUS_IS_ENOENT(rv)) {
+        nkey = apr_pcalloc(ptemp, PACK_KLEN);
+        if (!MD_OK(md_rand_bytes(nkey, PACK_KLEN, ptemp))) {
+            return rv;
+        }
+        json = md_json_create(ptemp);
+        md_json_sets(md_util_base64url_encode((char *)nkey, PACK_KLEN, ptemp),
+                     json, MD_KEY_KEY, NULL);
+        if (MD_IS_ERR(md_store_save_json(&pack->s, ptemp, MD_SG_NONE, NULL,
+                                         PACK_KEY_ASPECT, json, 1), EEXIST)
+            || APR_SUCCESS == rv) {
+            goto read;
+        }
+    }
+    return rv;
+}
+
+apr_status_t md_store_pack_init(md_store_t **pstore, apr_pool_t *p, const char *path)
+{
+    md_store_pack_t *pack;
+    apr_allocator_t *allocator;
+    apr_status_t rv = APR_SUCCESS;
+    MD_CHK_VARS;
+
+    *pstore = NULL;
+    pack = apr_pcalloc(p, sizeof(*pack));
+
+    pack->s.load = pack_load;
+    pack->s.save = pack_save;
+    pack->s.remove = pack_remove;
+    pack->s.move = pack_move;
+    pack->s.purge = pack_purge;
+    pack->s.iterate = pack_iterate;
+    pack->s.get_fname = pack_get_fname;
+    pack->s.is_newer = pack_is_newer;
+    pack->s.get_modified = pack_get_modified;
+    pack->s.iterate_names = pack_iterate_names;
+
+    pack->plain_pkey[MD_SG_DOMAINS] = 1;
+    pack->plain_pkey[MD_SG_TMP] = 1;
+
+    pack->base = apr_pstrdup(p, path);
+    if (!MD_OK(md_util_path_merge(&pack->fname, p, pack->base, MD_FN_STORE_PACK, NULL))) {
+        goto out;
+    }
+    if (MD_IS_ERR(md_util_is_dir(pack->base, p), ENOENT)
+        && MD_OK(apr_dir_make_recursive(pack->base, MD_FPROT_D_UONLY, p))) {
+        rv = apr_file_perms_set(pack->base, MD_FPROT_D_UALL_WREAD);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    if (APR_SUCCESS != rv) goto out;
+
+    if (!MD_OK(apr_allocator_create(&allocator))) goto out;
+    if (!MD_OK(apr_pool_create_ex(&pack->p, p, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto out;
+    }
+    apr_allocator_owner_set(allocator, pack->p);
+    apr_pool_tag(pack->p, "md_store_pack");
+#if APR_HAS_THREADS
+    if (!MD_OK(apr_thread_mutex_create(&pack->mutex, APR_THREAD_MUTEX_DEFAULT, pack->p))) {
+        goto out;
+    }
+    pack->s.concurrent = 1;
+#endif
+    if (MD_OK(pack_reset(pack))) {
+        rv = md_util_pool_do(setup_key, pack, p);
+    }
+
+out:
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "init pack store at %s", path);
+    }
+    else {
+        *pstore = &pack->s;
+    }
+    return rv;
+}
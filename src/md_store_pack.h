@@ -0,0 +1,41 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_store_pack_h
+#define mod_md_md_store_pack_h
+
+struct md_store_t;
+
+/**
+ * The single file in the store directory that holds all values of a packed store.
+ */
+#define MD_FN_STORE_PACK      "md_store.pack"
+
+/**
+ * A store that keeps all groups in a single file, readable only by the user.
+ * Every change is appended to the file as one record, synced to disk before the
+ * call returns, which makes saves, removals and moves atomic. Records from
+ * other processes are picked up on the next access.
+ *
+ * The file is compacted once it is more than twice the size of the values it holds.
+ *
+ * Since other software, like mod_ssl, expects certificates and keys in files,
+ * md_store_get_fname() writes the value to the same location the file system store
+ * would have it, when a name and aspect are given and the value exists.
+ */
+apr_status_t md_store_pack_init(struct md_store_t **pstore, apr_pool_t *p, const char *path);
+
+#endif /* mod_md_md_store_pack_h */
@@ -17,11 +17,14 @@
 #include <stdio.h>
 
 #include <apr_lib.h>
+#include <apr_date.h>
 #include <apr_strings.h>
 #include <apr_portable.h>
 #include <apr_file_info.h>
 #include <apr_fnmatch.h>
+#include <apr_hash.h>
 #include <apr_tables.h>
+#include <apr_thread_mutex.h>
 #include <apr_uri.h>
 
 #include "md_log.h"
@@ -142,10 +145,14 @@ struct apr_array_header_t *md_array_str_compact(apr_pool_t *p, struct apr_array_
     if (dest) {
         const char *s;
         int i;
+        md_str_set_t *seen = md_str_set_make(p, case_sensitive);
+        char *lower;
         for (i = 0; i < src->nelts; ++i) {
             s = APR_ARRAY_IDX(src, i, const char *);
-            if (md_array_str_index(dest, s, 0, case_sensitive) < 0) {
-                APR_ARRAY_PUSH(dest, char *) = md_util_str_tolower(apr_pstrdup(p, s));
+            if (!md_str_set_contains(seen, s)) {
+                lower = md_util_str_tolower(apr_pstrdup(p, s));
+                APR_ARRAY_PUSH(dest, char *) = lower;
+                md_str_set_add(seen, lower);
             }
         }
     }
@@ -170,19 +177,140 @@ apr_array_header_t *md_array_str_remove(apr_pool_t *p, apr_array_header_t *src,
     return dest;
 }
 
+/* Below this many comparisons, a linear search is cheaper than making a set */
+#define MD_STR_SET_MIN          64
+
 int md_array_str_add_missing(apr_array_header_t *dest, apr_array_header_t *src, int case_sensitive)
 {
+    md_str_set_t *present;
     int i, added = 0;
+    
+    if (dest->nelts * src->nelts <= MD_STR_SET_MIN) {
+        for (i = 0; i < src->nelts; i++) {
+            const char *s = APR_ARRAY_IDX(src, i, const char *);
+            if (md_array_str_index(dest, s, 0, case_sensitive) < 0) {
+                APR_ARRAY_PUSH(dest, const char *) = s;
+                ++added; 
+            }
+        }
+        return added;
+    }
+    /* the set lives as long as dest, do not make one for few comparisons */
+    present = md_str_set_from_array(dest->pool, dest, case_sensitive);
     for (i = 0; i < src->nelts; i++) {
         const char *s = APR_ARRAY_IDX(src, i, const char *);
-        if (md_array_str_index(dest, s, 0, case_sensitive) < 0) {
+        if (!md_str_set_contains(present, s)) {
             APR_ARRAY_PUSH(dest, const char *) = s;
+            md_str_set_add(present, s);
             ++added; 
         }
     }
     return added;
 }
 
+int md_array_str_contains_all(const apr_array_header_t *a, const apr_array_header_t *b, 
+                              int case_sensitive)
+{
+    apr_pool_t *ptemp;
+    int i, rv;
+    
+    if (a->nelts * b->nelts <= MD_STR_SET_MIN || APR_SUCCESS != apr_pool_create(&ptemp, NULL)) {
+        for (i = 0; i < b->nelts; ++i) {
+            if (md_array_str_index(a, APR_ARRAY_IDX(b, i, const char *), 0, case_sensitive) < 0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    rv = md_str_set_contains_all(md_str_set_from_array(ptemp, a, case_sensitive), b);
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+/**************************************************************************************************/
+/* string sets */
+
+struct md_str_set_t {
+    apr_pool_t *p;
+    apr_hash_t *h;                     /* (lower cased) string -> "" */
+    int case_sensitive;
+};
+
+/* Domain names, the common content of sets, fit. Longer strings are copied. */
+#define MD_STR_SET_KEY_LEN      256
+
+static const char *set_key(const md_str_set_t *set, const char *s, char *buf, apr_size_t blen)
+{
+    apr_size_t i;
+    
+    if (set->case_sensitive) {
+        return s;
+    }
+    for (i = 0; s[i] && i < blen - 1; ++i) {
+        buf[i] = (char)apr_tolower(s[i]);
+    }
+    if (s[i]) {
+        return md_util_str_tolower(apr_pstrdup(set->p, s));
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+md_str_set_t *md_str_set_make(apr_pool_t *p, int case_sensitive)
+{
+    md_str_set_t *set = apr_palloc(p, sizeof(*set));
+    
+    set->p = p;
+    set->h = apr_hash_make(p);
+    set->case_sensitive = case_sensitive;
+    return set;
+}
+
+md_str_set_t *md_str_set_from_array(apr_pool_t *p, const apr_array_header_t *a, 
+                                    int case_sensitive)
+{
+    md_str_set_t *set = md_str_set_make(p, case_sensitive);
+    int i;
+    
+    for (i = 0; a && i < a->nelts; ++i) {
+        md_str_set_add(set, APR_ARRAY_IDX(a, i, const char *));
+    }
+    return set;
+}
+
+void md_str_set_add(md_str_set_t *set, const char *s)
+{
+    char buf[MD_STR_SET_KEY_LEN];
+    const char *key = set_key(set, s, buf, sizeof(buf));
+    
+    if (!apr_hash_get(set->h, key, APR_HASH_KEY_STRING)) {
+        apr_hash_set(set->h, apr_pstrdup(set->p, key), APR_HASH_KEY_STRING, "");
+    }
+}
+
+int md_str_set_contains(const md_str_set_t *set, const char *s)
+{
+    char buf[MD_STR_SET_KEY_LEN];
+    return apr_hash_get(set->h, set_key(set, s, buf, sizeof(buf)), APR_HASH_KEY_STRING) != NULL;
+}
+
+int md_str_set_contains_all(const md_str_set_t *set, const apr_array_header_t *a)
+{
+    int i;
+    
+    for (i = 0; a && i < a->nelts; ++i) {
+        if (!md_str_set_contains(set, APR_ARRAY_IDX(a, i, const char *))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int md_str_set_count(const md_str_set_t *set)
+{
+    return (int)apr_hash_count(set->h);
+}
+
 /**************************************************************************************************/
 /* file system related */
 
@@ -240,6 +368,26 @@ apr_status_t md_util_path_merge(const char **ppath, apr_pool_t *p, ...)
     return rv;
 }
 
+static int fsync_enabled;
+
+void md_util_fsync_set(int enabled)
+{
+    fsync_enabled = enabled;
+}
+
+apr_status_t md_util_dir_sync(const char *path, apr_pool_t *p)
+{
+    apr_file_t *f;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = apr_file_open(&f, path, APR_FOPEN_READ, APR_FPROT_OS_DEFAULT, p))) {
+        rv = apr_file_sync(f);
+        apr_file_close(f);
+    }
+    /* not all platforms are able to sync directories */
+    return (APR_STATUS_IS_EINVAL(rv) || APR_STATUS_IS_ENOTIMPL(rv))? APR_SUCCESS : rv;
+}
+
 apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
                               md_util_file_cb *write_cb, void *baton)
 {
@@ -264,6 +412,9 @@ creat:
     
     if (APR_SUCCESS == rv) {
         rv = write_cb(baton, f, p);
+        if (APR_SUCCESS == rv && fsync_enabled) {
+            rv = apr_file_sync(f);
+        }
         apr_file_close(f);
         
         if (APR_SUCCESS == rv) {
@@ -333,6 +484,7 @@ typedef struct {
     int follow_links;
     void *baton;
     md_util_fdo_cb *cb;
+    md_util_dcache_t *dcache;
 } md_util_fwalk_t;
 
 static apr_status_t rm_recursive(const char *fpath, apr_pool_t *p, int max_level)
@@ -391,54 +543,230 @@ apr_status_t md_util_rm_recursive(const char *fpath, apr_pool_t *p, int max_leve
     return md_util_pool_vdo(prm_recursive, (void*)fpath, p, max_level, NULL);
 }
 
+/* directory listings */
+
+typedef struct {
+    const char *name;
+    apr_filetype_e ftype;
+} dir_entry_t;
+
+static apr_array_header_t *entries_copy(apr_pool_t *p, const apr_array_header_t *src)
+{
+    apr_array_header_t *entries;
+    dir_entry_t *e;
+    int i;
+    
+    entries = apr_array_copy(p, src);
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, dir_entry_t);
+        e->name = apr_pstrdup(p, e->name);
+    }
+    return entries;
+}
+
+static apr_status_t dir_list(apr_array_header_t **pentries, const char *path, apr_pool_t *p)
+{
+    apr_array_header_t *entries;
+    apr_status_t rv;
+    apr_dir_t *d;
+    apr_finfo_t finfo;
+    dir_entry_t *e;
+    
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, path, p))) {
+        return rv;
+    }
+    entries = apr_array_make(p, 10, sizeof(dir_entry_t));
+    while (APR_SUCCESS == (rv = apr_dir_read(&finfo, APR_FINFO_TYPE, d))) {
+        if (!strcmp(".", finfo.name) || !strcmp("..", finfo.name)) {
+            continue;
+        } 
+        e = (dir_entry_t*)apr_array_push(entries);
+        e->name = apr_pstrdup(p, finfo.name);
+        e->ftype = finfo.filetype;
+    }
+    apr_dir_close(d);
+    
+    *pentries = entries;
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+/* The listing cache keeps the entries of a directory for as long as its modification 
+ * time stays the same. Since that time has limited resolution, directories modified 
+ * in the last MD_DCACHE_SETTLE are listed again every time. */
+#define MD_DCACHE_SETTLE    apr_time_from_sec(2)
+
+typedef struct {
+    apr_pool_t *p;
+    apr_time_t mtime;
+    apr_array_header_t *entries;    /* dir_entry_t */
+} dcache_dir_t;
+
+struct md_util_dcache_t {
+    apr_pool_t *p;                  /* own allocator, only used with the mutex held */
+    apr_hash_t *dirs;               /* path -> dcache_dir_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+apr_status_t md_util_dcache_create(md_util_dcache_t **pcache, apr_pool_t *p)
+{
+    md_util_dcache_t *cache;
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    *pcache = NULL;
+    cache = apr_pcalloc(p, sizeof(*cache));
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&cache->p, p, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, cache->p);
+    apr_pool_tag(cache->p, "md_dcache");
+    cache->dirs = apr_hash_make(cache->p);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&cache->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, cache->p))) {
+        apr_pool_destroy(cache->p);
+        return rv;
+    }
+#endif
+    *pcache = cache;
+    return APR_SUCCESS;
+}
+
+static void dcache_lock(md_util_dcache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static void dcache_unlock(md_util_dcache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static apr_status_t dcache_list(apr_array_header_t **pentries, md_util_dcache_t *cache, 
+                                const char *path, apr_pool_t *p)
+{
+    dcache_dir_t *dir;
+    apr_finfo_t finfo;
+    apr_pool_t *dp;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_stat(&finfo, path, APR_FINFO_MTIME, p))) {
+        return rv;
+    }
+    
+    dcache_lock(cache);
+    dir = apr_hash_get(cache->dirs, path, APR_HASH_KEY_STRING);
+    if (dir && dir->mtime == finfo.mtime) {
+        /* the cached dir may be replaced by someone else while the caller looks at it */
+        *pentries = entries_copy(p, dir->entries);
+        dcache_unlock(cache);
+        return APR_SUCCESS;
+    }
+    dcache_unlock(cache);
+    
+    if (APR_SUCCESS == (rv = dir_list(pentries, path, p)) 
+        && finfo.mtime + MD_DCACHE_SETTLE < apr_time_now()) {
+        dcache_lock(cache);
+        if ((dir = apr_hash_get(cache->dirs, path, APR_HASH_KEY_STRING))) {
+            apr_hash_set(cache->dirs, path, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(dir->p);
+        }
+        if (APR_SUCCESS == apr_pool_create(&dp, cache->p)) {
+            dir = apr_pcalloc(dp, sizeof(*dir));
+            dir->p = dp;
+            dir->mtime = finfo.mtime;
+            dir->entries = entries_copy(dp, *pentries);
+            apr_hash_set(cache->dirs, apr_pstrdup(dp, path), APR_HASH_KEY_STRING, dir);
+        }
+        dcache_unlock(cache);
+    }
+    return rv;
+}
+
+static apr_status_t match_and_do(md_util_fwalk_t *ctx, const char *path, int depth, 
+                                 apr_pool_t *p, apr_pool_t *ptemp);
+
+static apr_status_t match_entry(md_util_fwalk_t *ctx, const char *path, 
+                                const char *name, apr_filetype_e ftype, int depth, 
+                                apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_status_t rv = APR_SUCCESS;
+    const char *npath;
+    
+    if (depth < ctx->patterns->nelts) {
+        if (APR_DIR == ftype) { 
+            /* deeper and deeper, irgendwo in der tiefe leuchtet ein licht */
+            rv = md_util_path_merge(&npath, ptemp, path, name, NULL);
+            if (APR_SUCCESS == rv) {
+                rv = match_and_do(ctx, npath, depth, p, ptemp);
+            }
+        }
+    }
+    else {
+        rv = ctx->cb(ctx->baton, p, ptemp, path, name, ftype);
+    }
+    return rv;
+}
+
 static apr_status_t match_and_do(md_util_fwalk_t *ctx, const char *path, int depth, 
                                  apr_pool_t *p, apr_pool_t *ptemp)
 {
     apr_status_t rv = APR_SUCCESS;
     const char *pattern, *npath;
-    apr_dir_t *d;
+    apr_array_header_t *entries;
     apr_finfo_t finfo;
-    int ndepth = depth + 1;
-    apr_int32_t wanted = (APR_FINFO_TYPE);
+    dir_entry_t *e;
+    int i, ndepth = depth + 1;
 
     if (depth >= ctx->patterns->nelts) {
         return APR_SUCCESS;
     }
     pattern = APR_ARRAY_IDX(ctx->patterns, depth, const char *);
     
-    rv = apr_dir_open(&d, path, ptemp);
-    if (APR_SUCCESS != rv) {
-        return rv;
-    }
-    
-    while (APR_SUCCESS == (rv = apr_dir_read(&finfo, wanted, d))) {
-        if (!strcmp(".", finfo.name) || !strcmp("..", finfo.name)) {
-            continue;
-        } 
-        if (APR_SUCCESS == apr_fnmatch(pattern, finfo.name, 0)) {
-            if (ndepth < ctx->patterns->nelts) {
-                if (APR_DIR == finfo.filetype) { 
-                    /* deeper and deeper, irgendwo in der tiefe leuchtet ein licht */
-                    rv = md_util_path_merge(&npath, ptemp, path, finfo.name, NULL);
-                    if (APR_SUCCESS == rv) {
-                        rv = match_and_do(ctx, npath, ndepth, p, ptemp);
-                    }
-                }
-            }
-            else {
-                rv = ctx->cb(ctx->baton, p, ptemp, path, finfo.name, finfo.filetype);
-            }
+    if (!apr_fnmatch_test(pattern)) {
+        /* a literal name, no need to read the whole directory */
+        rv = md_util_path_merge(&npath, ptemp, path, pattern, NULL);
+        if (APR_SUCCESS == rv 
+            && APR_SUCCESS == (rv = apr_stat(&finfo, npath, APR_FINFO_TYPE|APR_FINFO_LINK, ptemp))) {
+            rv = match_entry(ctx, path, pattern, finfo.filetype, ndepth, p, ptemp);
+        }
+        else if (APR_STATUS_IS_ENOENT(rv) || APR_STATUS_IS_ENOTDIR(rv)) {
+            /* no match, fine as long as the directory is there */
+            rv = md_util_is_dir(path, ptemp);
+            return (APR_SUCCESS == rv || APR_STATUS_IS_ENOENT(rv))? rv : APR_ENOTDIR;
         }
+    }
+    else {
+        rv = (ctx->dcache? dcache_list(&entries, ctx->dcache, path, ptemp)
+              : dir_list(&entries, path, ptemp));
         if (APR_SUCCESS != rv) {
-            break;
+            return rv;
+        }
+        for (i = 0; i < entries->nelts && APR_SUCCESS == rv; ++i) {
+            e = &APR_ARRAY_IDX(entries, i, dir_entry_t);
+            if (APR_SUCCESS == apr_fnmatch(pattern, e->name, 0)) {
+                rv = match_entry(ctx, path, e->name, e->ftype, ndepth, p, ptemp);
+            }
         }
     }
 
     if (APR_STATUS_IS_ENOENT(rv)) {
         rv = APR_SUCCESS;
     }
-
-    apr_dir_close(d);
     return rv;
 }
 
@@ -478,6 +806,27 @@ apr_status_t md_util_files_do(md_util_fdo_cb *cb, void *baton, apr_pool_t *p,
     return rv;
 }
 
+apr_status_t md_util_files_do_cached(md_util_dcache_t *dcache, md_util_fdo_cb *cb, void *baton, 
+                                     apr_pool_t *p, const char *path, ...)
+{
+    apr_status_t rv;
+    va_list ap;
+    md_util_fwalk_t ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.path = path;
+    ctx.follow_links = 1;
+    ctx.cb = cb;
+    ctx.baton = baton;
+    ctx.dcache = dcache;
+    
+    va_start(ap, path);
+    rv = pool_vado(files_do_start, &ctx, p, ap);
+    va_end(ap);
+    
+    return rv;
+}
+
 static apr_status_t tree_do(void *baton, apr_pool_t *p, apr_pool_t *ptemp, const char *path)
 {
     md_util_fwalk_t *ctx = baton;
@@ -750,20 +1099,38 @@ apr_status_t md_util_abs_http_uri_check(apr_pool_t *p, const char *uri, const ch
 
 /* try and retry for a while **********************************************************************/
 
-apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs, 
-                         apr_interval_time_t timeout, apr_interval_time_t start_delay, 
-                         apr_interval_time_t max_delay, int backoff)
+void md_util_poll_init(md_util_poll_t *poll, apr_interval_time_t timeout, 
+                       apr_interval_time_t start_delay, apr_interval_time_t max_delay, 
+                       int backoff)
+{
+    memset(poll, 0, sizeof(*poll));
+    poll->giveup_at = timeout? apr_time_now() + timeout : 0;
+    poll->delay = start_delay? start_delay : apr_time_from_msec(100);
+    poll->max_delay = max_delay? max_delay : apr_time_from_sec(10);
+    poll->backoff = backoff;
+}
+
+apr_status_t md_util_poll(md_util_poll_fn *fn, void *baton, md_util_poll_t *poll, 
+                          int ignore_errs)
 {
     apr_status_t rv;
     apr_time_t now = apr_time_now();
-    apr_time_t giveup = now + timeout;
-    apr_interval_time_t nap_duration = start_delay? start_delay : apr_time_from_msec(100);
-    apr_interval_time_t nap_max = max_delay? max_delay : apr_time_from_sec(10);
-    apr_interval_time_t left;
-    int i = 0;
+    apr_time_t block_until = poll->max_block? now + poll->max_block : 0;
+    apr_interval_time_t nap_duration;
     
     while (1) {
-        if (APR_SUCCESS == (rv = fn(baton, i++))) {
+        if (poll->next_at > now) {
+            if (block_until && poll->next_at > block_until) {
+                /* not waiting that long, caller has to come back later */
+                return APR_EAGAIN;
+            }
+            apr_sleep(poll->next_at - now);
+        }
+        
+        poll->retry_after = 0;
+        rv = fn(baton, poll);
+        ++poll->attempts;
+        if (APR_SUCCESS == rv) {
             break;
         }
         else if (!APR_STATUS_IS_EAGAIN(rv) && !ignore_errs) {
@@ -771,27 +1138,80 @@ apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,
         }
         
         now = apr_time_now();
-        if (now > giveup) {
+        if (poll->giveup_at && now > poll->giveup_at) {
             rv = APR_TIMEUP;
             break;
         }
         
-        left = giveup - now;
-        if (nap_duration > left) {
-            nap_duration = left;
+        nap_duration = (poll->delay > poll->max_delay)? poll->max_delay : poll->delay;
+        poll->next_at = now + nap_duration;
+        if (poll->retry_after > poll->next_at) {
+            /* the server knows best */
+            poll->next_at = poll->retry_after;
         }
-        if (nap_duration > nap_max) {
-            nap_duration = nap_max;
+        if (poll->giveup_at && poll->next_at > poll->giveup_at) {
+            poll->next_at = poll->giveup_at;
         }
-        
-        apr_sleep(nap_duration);
-        if (backoff) {
-            nap_duration *= 2;
+        if (poll->backoff) {
+            poll->delay *= 2;
         } 
     }
+    poll->next_at = 0;
     return rv;
 }
 
+typedef struct {
+    md_util_try_fn *fn;
+    void *baton;
+} try_ctx;
+
+static apr_status_t try_poll(void *baton, md_util_poll_t *poll)
+{
+    try_ctx *ctx = baton;
+    return ctx->fn(ctx->baton, poll->attempts);
+}
+
+apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs, 
+                         apr_interval_time_t timeout, apr_interval_time_t start_delay, 
+                         apr_interval_time_t max_delay, int backoff)
+{
+    md_util_poll_t poll;
+    try_ctx ctx;
+    
+    ctx.fn = fn;
+    ctx.baton = baton;
+    md_util_poll_init(&poll, timeout, start_delay, max_delay, backoff);
+    return md_util_poll(try_poll, &ctx, &poll, ignore_errs);
+}
+
+apr_time_t md_util_parse_retry_after(const char *value, apr_time_t now)
+{
+    apr_int64_t secs;
+    char *end;
+    
+    if (!value) {
+        return 0;
+    }
+    while (apr_isspace(*value)) {
+        ++value;
+    }
+    if (apr_isdigit(*value)) {
+        secs = apr_strtoi64(value, &end, 10);
+        while (apr_isspace(*end)) {
+            ++end;
+        }
+        if (*end || secs < 0) {
+            return 0;
+        }
+        if (secs > MD_SECS_PER_DAY) {
+            secs = MD_SECS_PER_DAY;
+        }
+        return now + apr_time_from_sec(secs);
+    }
+    /* apr_date_parse_http() gives APR_DATE_BAD (0) if it does not recognize the date */
+    return apr_date_parse_http(value);
+}
+
 /* execute process ********************************************************************************/
 
 apr_status_t md_util_exec(apr_pool_t *p, const char *cmd, const char * const *argv,
@@ -832,6 +1252,43 @@ const char *md_print_duration(apr_pool_t *p, apr_interval_time_t duration)
                         (int)(secs%60));
 }
 
+apr_time_t md_util_parse_rfc3339(const char *s)
+{
+    apr_time_exp_t t;
+    apr_time_t result;
+    int n, offset = 0, oh, om;
+    
+    if (!s) {
+        return 0;
+    }
+    memset(&t, 0, sizeof(t));
+    if (sscanf(s, "%4d-%2d-%2d%*[Tt ]%2d:%2d:%2d%n", &t.tm_year, &t.tm_mon, &t.tm_mday, 
+               &t.tm_hour, &t.tm_min, &t.tm_sec, &n) != 6) {
+        return 0;
+    }
+    s += n;
+    if (*s == '.') {
+        /* fractions of a second do not matter here */
+        do {
+            ++s;
+        } while (apr_isdigit(*s));
+    }
+    if (*s == '+' || *s == '-') {
+        if (sscanf(s + 1, "%2d:%2d", &oh, &om) != 2) {
+            return 0;
+        }
+        offset = (*s == '-'? -1 : 1) * (oh * MD_SECS_PER_HOUR + om * 60);
+    }
+    else if (*s != 'Z' && *s != 'z') {
+        return 0;
+    }
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    if (APR_SUCCESS != apr_time_exp_gmt_get(&result, &t)) {
+        return 0;
+    }
+    return result - apr_time_from_sec(offset);
+}
 
 /* base64 url encoding ****************************************************************************/
 
@@ -868,82 +1325,106 @@ static const unsigned char BASE64URL_CHARS[] = {
 
 #define BASE64URL_CHAR(x)    BASE64URL_CHARS[ (unsigned int)(x) & 0x3fu ]
    
-apr_size_t md_util_base64url_decode(const char **decoded, const char *encoded, 
-                                    apr_pool_t *pool)
+/* Both directions work on whole 24 bit groups, loaded before anything is stored. 
+ * That lets the output overlap the input: decoding writes behind where it reads 
+ * and encoding may read its data from the end of the output buffer. */
+
+apr_size_t md_util_base64url_decode_to(char *buf, const char *encoded, apr_size_t elen)
 {
     const unsigned char *e = (const unsigned char *)encoded;
-    const unsigned char *p = e;
-    unsigned char *d;
+    unsigned char *d = (unsigned char *)buf;
     unsigned int n;
-    long len, mlen, remain, i;
+    apr_size_t len, mlen, i;
     
-    while (*p && BASE64URL_UINT6[ *p ] != N6) {
-        ++p;
+    for (len = 0; len < elen && BASE64URL_UINT6[ e[len] ] != N6; ++len) {
+        /* only the leading valid characters are decoded */
     }
-    len = (int)(p - e);
     mlen = (len/4)*4;
-    *decoded = apr_pcalloc(pool, (apr_size_t)len + 1);
-    
-    i = 0;
-    d = (unsigned char*)*decoded;
-    for (; i < mlen; i += 4) {
-        n = ((BASE64URL_UINT6[ e[i+0] ] << 18) +
-             (BASE64URL_UINT6[ e[i+1] ] << 12) +
-             (BASE64URL_UINT6[ e[i+2] ] << 6) +
+    for (i = 0; i < mlen; i += 4) {
+        n = ((BASE64URL_UINT6[ e[i+0] ] << 18) |
+             (BASE64URL_UINT6[ e[i+1] ] << 12) |
+             (BASE64URL_UINT6[ e[i+2] ] << 6) |
              (BASE64URL_UINT6[ e[i+3] ]));
         *d++ = (unsigned char)(n >> 16);
         *d++ = (unsigned char)(n >> 8 & 0xffu);
         *d++ = (unsigned char)(n & 0xffu);
     }
-    remain = len - mlen;
-    switch (remain) {
+    switch (len - mlen) {
         case 2:
-            n = ((BASE64URL_UINT6[ e[mlen+0] ] << 18) +
+            n = ((BASE64URL_UINT6[ e[mlen+0] ] << 18) |
                  (BASE64URL_UINT6[ e[mlen+1] ] << 12));
             *d++ = (unsigned char)(n >> 16);
-            remain = 1;
             break;
         case 3:
-            n = ((BASE64URL_UINT6[ e[mlen+0] ] << 18) +
-                 (BASE64URL_UINT6[ e[mlen+1] ] << 12) +
+            n = ((BASE64URL_UINT6[ e[mlen+0] ] << 18) |
+                 (BASE64URL_UINT6[ e[mlen+1] ] << 12) |
                  (BASE64URL_UINT6[ e[mlen+2] ] << 6));
             *d++ = (unsigned char)(n >> 16);
             *d++ = (unsigned char)(n >> 8 & 0xffu);
-            remain = 2;
             break;
         default: /* do nothing */
             break;
     }
-    return (apr_size_t)(mlen/4*3 + remain);
+    return (apr_size_t)(d - (unsigned char *)buf);
 }
 
-const char *md_util_base64url_encode(const char *data, apr_size_t dlen, apr_pool_t *pool)
+apr_size_t md_util_base64url_decode(const char **decoded, const char *encoded, 
+                                    apr_pool_t *pool)
 {
-    int i, len = (int)dlen;
-    apr_size_t slen = ((dlen+2)/3)*4 + 1; /* 0 terminated */
-    const unsigned char *udata = (const unsigned char*)data;
-    unsigned char *enc, *p = apr_pcalloc(pool, slen);
+    const unsigned char *e = (const unsigned char *)encoded;
+    apr_size_t elen;
+    char *d;
     
-    enc = p;
-    for (i = 0; i < len-2; i+= 3) {
-        *p++ = BASE64URL_CHAR( (udata[i]   >> 2) );
-        *p++ = BASE64URL_CHAR( (udata[i]   << 4) + (udata[i+1] >> 4) );
-        *p++ = BASE64URL_CHAR( (udata[i+1] << 2) + (udata[i+2] >> 6) );
-        *p++ = BASE64URL_CHAR( (udata[i+2]) );
+    for (elen = 0; e[elen] && BASE64URL_UINT6[ e[elen] ] != N6; ++elen) {
+        /* only the leading valid characters are decoded */
     }
+    d = apr_pcalloc(pool, MD_BASE64URL_DLEN(elen) + 1);
+    *decoded = d;
+    return md_util_base64url_decode_to(d, encoded, elen);
+}
+
+apr_size_t md_util_base64url_encode_to(char *buf, const char *data, apr_size_t dlen)
+{
+    const unsigned char *udata = (const unsigned char*)data;
+    unsigned char *p = (unsigned char*)buf;
+    unsigned int n;
+    apr_size_t i, mlen = (dlen/3)*3;
     
-    if (i < len) {
-        *p++ = BASE64URL_CHAR( (udata[i] >> 2) );
-        if (i == (len - 1)) {
-            *p++ = BASE64URL_CHARS[ ((unsigned int)udata[i] << 4) & 0x3fu ];
-        }
-        else {
-            *p++ = BASE64URL_CHAR( (udata[i] << 4) + (udata[i+1] >> 4) );
-            *p++ = BASE64URL_CHAR( (udata[i+1] << 2) );
-        }
+    for (i = 0; i < mlen; i += 3) {
+        n = ((unsigned int)udata[i] << 16) | ((unsigned int)udata[i+1] << 8) | udata[i+2];
+        p[0] = BASE64URL_CHAR( n >> 18 );
+        p[1] = BASE64URL_CHAR( n >> 12 );
+        p[2] = BASE64URL_CHAR( n >> 6 );
+        p[3] = BASE64URL_CHAR( n );
+        p += 4;
+    }
+    switch (dlen - mlen) {
+        case 1:
+            n = ((unsigned int)udata[i] << 16);
+            p[0] = BASE64URL_CHAR( n >> 18 );
+            p[1] = BASE64URL_CHAR( n >> 12 );
+            p += 2;
+            break;
+        case 2:
+            n = ((unsigned int)udata[i] << 16) | ((unsigned int)udata[i+1] << 8);
+            p[0] = BASE64URL_CHAR( n >> 18 );
+            p[1] = BASE64URL_CHAR( n >> 12 );
+            p[2] = BASE64URL_CHAR( n >> 6 );
+            p += 3;
+            break;
+        default: /* do nothing */
+            break;
     }
-    *p++ = '\0';
-    return (char *)enc;
+    *p = '\0';
+    return (apr_size_t)(p - (unsigned char*)buf);
+}
+
+const char *md_util_base64url_encode(const char *data, apr_size_t dlen, apr_pool_t *pool)
+{
+    char *enc = apr_palloc(pool, MD_BASE64URL_LEN(dlen) + 1);
+    
+    md_util_base64url_encode_to(enc, data, dlen);
+    return enc;
 }
 
 /*******************************************************************************
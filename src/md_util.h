@@ -58,6 +58,30 @@ struct apr_array_header_t *md_array_str_remove(apr_pool_t *p, struct apr_array_h
 int md_array_str_add_missing(struct apr_array_header_t *dest, 
                              struct apr_array_header_t *src, int case_sensitive);
 
+/**
+ * Return != 0 iff all strings in b are also in a. 
+ */
+int md_array_str_contains_all(const struct apr_array_header_t *a, 
+                              const struct apr_array_header_t *b, int case_sensitive);
+
+/**
+ * A set of strings with lookups in constant time. Unless case sensitive, strings
+ * are compared in lower case, as is done for domain names.
+ */
+typedef struct md_str_set_t md_str_set_t;
+
+md_str_set_t *md_str_set_make(apr_pool_t *p, int case_sensitive);
+md_str_set_t *md_str_set_from_array(apr_pool_t *p, const struct apr_array_header_t *a, 
+                                    int case_sensitive);
+void md_str_set_add(md_str_set_t *set, const char *s);
+int md_str_set_contains(const md_str_set_t *set, const char *s);
+
+/**
+ * Return != 0 iff all strings in the array are in the set. 
+ */
+int md_str_set_contains_all(const md_str_set_t *set, const struct apr_array_header_t *a);
+int md_str_set_count(const md_str_set_t *set);
+
 /**************************************************************************************************/
 /* process execution */
 apr_status_t md_util_exec(apr_pool_t *p, const char *cmd, const char * const *argv,
@@ -89,6 +113,17 @@ typedef apr_status_t md_util_file_cb(void *baton, struct apr_file_t *f, apr_pool
 apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
                               md_util_file_cb *write, void *baton);
 
+/**
+ * When enabled, md_util_freplace() syncs the new file to disk before it replaces
+ * the old one. Off by default.
+ */
+void md_util_fsync_set(int enabled);
+
+/**
+ * Sync the directory at path to disk, making renames and new files in it durable.
+ */
+apr_status_t md_util_dir_sync(const char *path, apr_pool_t *p);
+
 /** 
  * Remove a file/directory and all files/directories contain up to max_level. If max_level == 0,
  * only an empty directory or a file can be removed.
@@ -99,9 +134,28 @@ typedef apr_status_t md_util_fdo_cb(void *baton, apr_pool_t *p, apr_pool_t *ptem
                                          const char *dir, const char *name, 
                                          apr_filetype_e ftype);
                                          
+/**
+ * Call cb for all files matching the patterns, one pattern per directory level below
+ * path, terminated by NULL. Literal patterns are looked up directly, without reading 
+ * the directory.
+ */
 apr_status_t md_util_files_do(md_util_fdo_cb *cb, void *baton, apr_pool_t *p, 
                               const char *path, ...);
 
+/**
+ * A cache of directory listings, shared by threads. A listing is reused for as long
+ * as the modification time of its directory is unchanged.
+ */
+typedef struct md_util_dcache_t md_util_dcache_t;
+
+apr_status_t md_util_dcache_create(md_util_dcache_t **pcache, apr_pool_t *p);
+
+/**
+ * As md_util_files_do(), with directory listings taken from dcache, if not NULL.
+ */
+apr_status_t md_util_files_do_cached(md_util_dcache_t *dcache, md_util_fdo_cb *cb, void *baton, 
+                                     apr_pool_t *p, const char *path, ...);
+
 /**
  * Depth first traversal of directory tree starting at path.
  */
@@ -120,9 +174,32 @@ apr_status_t md_text_freplace(const char *fpath, apr_fileperms_t perms,
 /* base64 url encodings */
 const char *md_util_base64url_encode(const char *data, 
                                      apr_size_t len, apr_pool_t *pool);
+
+/* upper bound of the encoded length of len bytes, without the terminating 0 */
+#define MD_BASE64URL_LEN(len)     ((((len) + 2) / 3) * 4)
+
+/* upper bound of the decoded length of len encoded characters */
+#define MD_BASE64URL_DLEN(len)    ((((len) + 3) / 4) * 3)
+
+/* offset in an encode buffer where the data may be placed to be encoded in place */
+#define MD_BASE64URL_INPLACE(len) (MD_BASE64URL_LEN(len) + 1 - (len))
+
+/**
+ * Encode into buf, which must hold MD_BASE64URL_LEN(len) + 1 bytes. The result
+ * is 0 terminated, its length is returned. The data may lie in buf itself, 
+ * starting at MD_BASE64URL_INPLACE(len), so it is encoded without a copy.
+ */
+apr_size_t md_util_base64url_encode_to(char *buf, const char *data, apr_size_t len);
 apr_size_t md_util_base64url_decode(const char **decoded, const char *encoded, 
                                     apr_pool_t *pool);
 
+/**
+ * Decode the leading base64url characters of the elen in encoded into buf, which
+ * must hold MD_BASE64URL_DLEN(elen) bytes, and return the decoded length. buf may 
+ * be the same as encoded. The result is not 0 terminated.
+ */
+apr_size_t md_util_base64url_decode_to(char *buf, const char *encoded, apr_size_t elen);
+
 /**************************************************************************************************/
 /* http/url related */
 const char *md_util_schemify(apr_pool_t *p, const char *s, const char *def_scheme);
@@ -142,6 +219,48 @@ apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,
                          apr_interval_time_t timeout, apr_interval_time_t start_delay, 
                          apr_interval_time_t max_delay, int backoff);
 
+/**
+ * The state of polling for something to happen, e.g. a resource to change its status
+ * at a server. A poll can be continued: if the next attempt is due later than the
+ * caller wants to block, md_util_poll() returns APR_EAGAIN and next_at says when to 
+ * call it again. The poll function may set retry_after when the server asked for it.
+ */
+typedef struct md_util_poll_t md_util_poll_t;
+struct md_util_poll_t {
+    int attempts;                   /* number of attempts made so far */
+    apr_time_t giveup_at;           /* fail with APR_TIMEUP after this, 0 for never */
+    apr_time_t next_at;             /* earliest time for the next attempt */
+    apr_interval_time_t delay;      /* current delay between attempts */
+    apr_interval_time_t max_delay;  /* the delay will not grow beyond this */
+    int backoff;                    /* if the delay doubles after each attempt */
+    apr_interval_time_t max_block;  /* max time spent waiting in one call, 0 for no limit */
+    apr_time_t retry_after;         /* time the server asked to retry at or 0, per attempt */
+    const char *name;               /* identifies the poll when continued in a later run */
+};
+
+typedef apr_status_t md_util_poll_fn(void *baton, md_util_poll_t *poll);
+
+/**
+ * Initialize a poll, using defaults for start_delay and max_delay if they are 0.
+ */
+void md_util_poll_init(md_util_poll_t *poll, apr_interval_time_t timeout, 
+                       apr_interval_time_t start_delay, apr_interval_time_t max_delay, 
+                       int backoff);
+
+/**
+ * Invoke fn until it returns APR_SUCCESS, an error other than APR_EAGAIN (unless
+ * ignore_errs is set) or the poll times out. Returns APR_EAGAIN if the next attempt
+ * would exceed poll->max_block.
+ */
+apr_status_t md_util_poll(md_util_poll_fn *fn, void *baton, md_util_poll_t *poll, 
+                          int ignore_errs);
+
+/**
+ * Get the point in time a HTTP Retry-After header value (seconds or a date)
+ * refers to. Returns 0 if value is NULL or not understood.
+ */
+apr_time_t md_util_parse_retry_after(const char *value, apr_time_t now);
+
 /**************************************************************************************************/
 /* date/time related */
 
@@ -150,4 +269,10 @@ apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,
 
 const char *md_print_duration(apr_pool_t *p, apr_interval_time_t duration);
 
+/**
+ * Get the point in time of a RFC 3339 timestamp as used by ACME, e.g. 
+ * "2019-01-08T13:51:34Z". Returns 0 if s is NULL or not understood.
+ */
+apr_time_t md_util_parse_rfc3339(const char *s);
+
 #endif /* md_util_h */
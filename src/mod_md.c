@@ -15,8 +15,15 @@
  */
  
 #include <assert.h>
+#include <apr_atomic.h>
 #include <apr_optional.h>
 #include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_network_io.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#endif
 
 #include <ap_release.h>
 #ifndef AP_ENABLE_EXCEPTION_HOOK
@@ -35,10 +42,14 @@
 #include "md_curl.h"
 #include "md_crypt.h"
 #include "md_http.h"
+#include "md_index.h"
 #include "md_json.h"
+#include "md_keypool.h"
 #include "md_store.h"
 #include "md_store_fs.h"
 #include "md_log.h"
+#include "md_metrics.h"
+#include "md_ocsp.h"
 #include "md_reg.h"
 #include "md_util.h"
 #include "md_version.h"
@@ -47,8 +58,10 @@
 
 #include "mod_md.h"
 #include "mod_md_config.h"
+#include "mod_md_counters.h"
 #include "mod_md_os.h"
 #include "mod_ssl.h"
+#include "mod_status.h"
 #include "mod_watchdog.h"
 
 static void md_hooks(apr_pool_t *pool);
@@ -181,7 +194,122 @@ static int uses_port_only(server_rec *s, int port)
     return match;
 }
 
-static apr_status_t assign_to_servers(md_t *md, server_rec *base_server, 
+/* The names of all server_recs, so an MD finds the servers it may match without
+ * looking at every one of them. Candidates are then checked by httpd as before. */
+typedef struct {
+    server_rec **servers;           /* in order of the config, base server first */
+    int nservers;
+    apr_hash_t *by_name;            /* lower case name -> apr_array_header_t of int */
+    apr_array_header_t *wild;       /* servers with wildcard aliases, always candidates */
+    char *http_only;                /* uses_port_only(s, local_80) */
+    char *has_https;                /* matches_port_somewhere(s, local_443) */
+    int *seen;                      /* last md that took the server as candidate */
+    int nmd;
+} md_srv_index;
+
+static void srv_index_add(md_srv_index *idx, const char *name, int pos, apr_pool_t *p)
+{
+    apr_array_header_t *list;
+    char *lname;
+    
+    if (!name || !*name) {
+        return;
+    }
+    lname = apr_pstrdup(p, name);
+    ap_str_tolower(lname);
+    if (!(list = apr_hash_get(idx->by_name, lname, APR_HASH_KEY_STRING))) {
+        list = apr_array_make(p, 1, sizeof(int));
+        apr_hash_set(idx->by_name, lname, APR_HASH_KEY_STRING, list);
+    }
+    if (list->nelts == 0 || APR_ARRAY_IDX(list, list->nelts-1, int) != pos) {
+        APR_ARRAY_PUSH(list, int) = pos;
+    }
+}
+
+static md_srv_index *srv_index_make(server_rec *base_server, md_mod_conf_t *mc, apr_pool_t *p)
+{
+    md_srv_index *idx;
+    server_rec *s;
+    server_addr_rec *sa;
+    int i, pos;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    for (s = base_server; s; s = s->next) {
+        ++idx->nservers;
+    }
+    idx->servers = apr_pcalloc(p, (apr_size_t)idx->nservers * sizeof(server_rec*));
+    idx->http_only = apr_pcalloc(p, (apr_size_t)idx->nservers);
+    idx->has_https = apr_pcalloc(p, (apr_size_t)idx->nservers);
+    idx->seen = apr_pcalloc(p, (apr_size_t)idx->nservers * sizeof(int));
+    idx->by_name = apr_hash_make(p);
+    idx->wild = apr_array_make(p, 5, sizeof(int));
+    
+    for (s = base_server, pos = 0; s; s = s->next, ++pos) {
+        idx->servers[pos] = s;
+        idx->http_only[pos] = (char)(mc->local_80 && uses_port_only(s, mc->local_80));
+        idx->has_https[pos] = (char)matches_port_somewhere(s, mc->local_443);
+        
+        /* all names that ap_matches_request_vhost() compares literally */
+        srv_index_add(idx, s->server_hostname, pos, p);
+        for (i = 0; s->names && i < s->names->nelts; ++i) {
+            srv_index_add(idx, APR_ARRAY_IDX(s->names, i, const char*), pos, p);
+        }
+        for (sa = s->addrs; sa; sa = sa->next) {
+            if (sa->host_port == 0 || sa->host_port == s->port) {
+                srv_index_add(idx, sa->virthost, pos, p);
+            }
+        }
+        if (s->wild_names && s->wild_names->nelts > 0) {
+            APR_ARRAY_PUSH(idx->wild, int) = pos;
+        }
+    }
+    return idx;
+}
+
+static int pos_cmp(const void *v1, const void *v2)
+{
+    return *(const int*)v1 - *(const int*)v2;
+}
+
+/* Add the servers that the md domains, starting at index from, might match and which
+ * come after server position after in the config. Candidates from index next on
+ * are left sorted by position. */
+static void srv_index_collect(md_srv_index *idx, const md_t *md, int from, int after,
+                              apr_array_header_t *candidates, int next, apr_pool_t *p)
+{
+    apr_array_header_t *list;
+    char *lname;
+    int i, j, pos;
+    
+    for (i = from; i < md->domains->nelts; ++i) {
+        lname = apr_pstrdup(p, APR_ARRAY_IDX(md->domains, i, const char*));
+        ap_str_tolower(lname);
+        if ((list = apr_hash_get(idx->by_name, lname, APR_HASH_KEY_STRING))) {
+            for (j = 0; j < list->nelts; ++j) {
+                pos = APR_ARRAY_IDX(list, j, int);
+                if (pos > after && idx->seen[pos] != idx->nmd) {
+                    idx->seen[pos] = idx->nmd;
+                    APR_ARRAY_PUSH(candidates, int) = pos;
+                }
+            }
+        }
+    }
+    if (from == 0) {
+        for (j = 0; j < idx->wild->nelts; ++j) {
+            pos = APR_ARRAY_IDX(idx->wild, j, int);
+            if (idx->seen[pos] != idx->nmd) {
+                idx->seen[pos] = idx->nmd;
+                APR_ARRAY_PUSH(candidates, int) = pos;
+            }
+        }
+    }
+    if (next < candidates->nelts) {
+        qsort(candidates->elts + (apr_size_t)next * sizeof(int), 
+              (size_t)(candidates->nelts - next), sizeof(int), pos_cmp);
+    }
+}
+
+static apr_status_t assign_to_servers(md_t *md, md_srv_index *idx, server_rec *base_server, 
                                      apr_pool_t *p, apr_pool_t *ptemp)
 {
     server_rec *s, *s_https;
@@ -189,9 +317,9 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
     md_srv_conf_t *sc;
     md_mod_conf_t *mc;
     apr_status_t rv = APR_SUCCESS;
-    int i;
+    int i, j, pos, ndomains;
     const char *domain;
-    apr_array_header_t *servers;
+    apr_array_header_t *servers, *https, *candidates;
     
     sc = md_config_get(base_server);
     mc = sc->mc;
@@ -201,8 +329,15 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
      */
     memset(&r, 0, sizeof(r));
     servers = apr_array_make(ptemp, 5, sizeof(server_rec*));
+    https = apr_array_make(ptemp, 5, sizeof(char));
+    candidates = apr_array_make(ptemp, 5, sizeof(int));
+    ++idx->nmd;
+    srv_index_collect(idx, md, 0, -1, candidates, 0, ptemp);
+    ndomains = md->domains->nelts;
     
-    for (s = base_server; s; s = s->next) {
+    for (j = 0; j < candidates->nelts; ++j) {
+        pos = APR_ARRAY_IDX(candidates, j, int);
+        s = idx->servers[pos];
         if (!mc->manage_base_server && s == base_server) {
             /* we shall not assign ourselves to the base server */
             continue;
@@ -238,7 +373,7 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
                  * it is by default auto-added (config transitive).
                  * If mode is "manual", a generated certificate will not match
                  * all necessary names. */
-                if (!mc->local_80 || !uses_port_only(s, mc->local_80)) {
+                if (!idx->http_only[pos]) {
                     if (APR_SUCCESS != (rv = md_covers_server(md, s, p))) {
                         return rv;
                     }
@@ -249,6 +384,7 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
 
                 sc->assigned = md;
                 APR_ARRAY_PUSH(servers, server_rec*) = s;
+                APR_ARRAY_PUSH(https, char) = idx->has_https[pos];
                 
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO(10043)
                              "Managed Domain %s applies to vhost %s:%d", md->name,
@@ -258,7 +394,11 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
             }
         }
     next_server:
-        continue;
+        if (ndomains < md->domains->nelts) {
+            /* names added transitively may match servers further down */
+            srv_index_collect(idx, md, ndomains, pos, candidates, j + 1, ptemp);
+            ndomains = md->domains->nelts;
+        }
     }
 
     if (APR_SUCCESS == rv) {
@@ -304,7 +444,7 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
                 s_https = NULL;
                 for (i = 0; i < servers->nelts; ++i) {
                     s = APR_ARRAY_IDX(servers, i, server_rec*);
-                    if (matches_port_somewhere(s, mc->local_443)) {
+                    if (APR_ARRAY_IDX(https, i, char)) {
                         s_https = s;
                         break;
                     }
@@ -332,11 +472,12 @@ static apr_status_t md_calc_md_list(apr_pool_t *p, apr_pool_t *plog,
     md_srv_conf_t *sc;
     md_mod_conf_t *mc;
     md_t *md, *omd;
+    md_srv_index *srv_idx;
     const char *domain;
     apr_status_t rv = APR_SUCCESS;
     ap_listen_rec *lr;
     apr_sockaddr_t *sa;
-    int i, j;
+    int i;
 
     (void)plog;
     sc = md_config_get(base_server);
@@ -367,26 +508,28 @@ static apr_status_t md_calc_md_list(apr_pool_t *p, apr_pool_t *plog,
     /* Complete the properties of the MDs, now that we have the complete, merged
      * server configurations. 
      */
+    mc->mds_index = md_index_create(p);
+    srv_idx = srv_index_make(base_server, mc, ptemp);
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t*);
         md_merge_srv(md, sc, p);
 
         /* Check that we have no overlap with the MDs already completed */
-        for (j = 0; j < i; ++j) {
-            omd = APR_ARRAY_IDX(mc->mds, j, md_t*);
-            if ((domain = md_common_name(md, omd)) != NULL) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO(10038)
-                             "two Managed Domains have an overlap in domain '%s'"
-                             ", first definition in %s(line %d), second in %s(line %d)",
-                             domain, md->defn_name, md->defn_line_number,
-                             omd->defn_name, omd->defn_line_number);
-                return APR_EINVAL;
-            }
+        if ((omd = md_index_get_by_name(mc->mds_index, md->name)) != NULL) {
+            domain = md->name;
+        }
+        if (omd || APR_SUCCESS != md_index_add(mc->mds_index, md, &omd, &domain)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO(10038)
+                         "two Managed Domains have an overlap in domain '%s'"
+                         ", first definition in %s(line %d), second in %s(line %d)",
+                         domain, md->defn_name, md->defn_line_number,
+                         omd->defn_name, omd->defn_line_number);
+            return APR_EINVAL;
         }
 
         /* Assign MD to the server_rec configs that it matches. Perform some
          * last finishing touches on the MD. */
-        if (APR_SUCCESS != (rv = assign_to_servers(md, base_server, p, ptemp))) {
+        if (APR_SUCCESS != (rv = assign_to_servers(md, srv_idx, base_server, p, ptemp))) {
             return rv;
         }
 
@@ -399,6 +542,313 @@ static apr_status_t md_calc_md_list(apr_pool_t *p, apr_pool_t *plog,
     return rv;
 }
 
+/**************************************************************************************************/
+/* challenge cache */
+
+/* Each child keeps the http-01 challenge data it has served or written in memory,
+ * so that repeated requests from CA validators are answered without touching
+ * the store. An entry is keyed by hostname and only hit for the token it
+ * was stored with. Since challenges are written by the watchdog child only, other
+ * children never see the store events and rely on the entry lifetime instead.
+ */
+#define MD_CHA_CACHE_TTL        apr_time_from_sec(5 * 60)
+#define MD_CHA_CACHE_MAX        4096
+
+typedef struct {
+    apr_pool_t *p;                     /* pool owning this entry */
+    const char *token;                 /* token the data is for */
+    const char *data;                  /* key authorization to send */
+    apr_size_t len;                    /* length of data */
+    apr_time_t valid_until;            /* when entry expires */
+} md_cha_entry_t;
+
+/* The tls-alpn-01 and tls-sni-01 certificates and keys are kept parsed, so that
+ * the several connections a CA makes to validate a domain do not each load and
+ * decode them from the store. Such an entry is only used as long as the certificate
+ * in the store has not been modified since, which costs a stat() instead. Entries are
+ * shared as extra references, so that replacing one does not pull it away from a 
+ * handshake in progress. They are dropped on store events for their challenge, too. 
+ */
+#define MD_TLS_CHA_CACHE_MAX    256
+
+typedef struct {
+    apr_pool_t *p;                     /* pool owning this entry */
+    md_cert_t *cert;                   /* challenge certificate */
+    md_pkey_t *pkey;                   /* key of the certificate */
+    apr_time_t modified;               /* modification time of cert in store */
+} md_tls_cha_entry_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *entries;               /* hostname -> md_cha_entry_t* */
+    apr_hash_t *tls_entries;           /* <cert name>:<servername> -> md_tls_cha_entry_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} md_cha_cache_t;
+
+static md_cha_cache_t *cha_cache;
+
+static void cha_cache_lock(md_cha_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    if (cache->mutex) apr_thread_mutex_lock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static void cha_cache_unlock(md_cha_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    if (cache->mutex) apr_thread_mutex_unlock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static apr_status_t cha_cache_create(md_cha_cache_t **pcache, apr_pool_t *p)
+{
+    md_cha_cache_t *cache;
+    apr_status_t rv = APR_SUCCESS;
+
+    cache = apr_pcalloc(p, sizeof(*cache));
+    cache->p = p;
+    cache->entries = apr_hash_make(p);
+    cache->tls_entries = apr_hash_make(p);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    *pcache = (APR_SUCCESS == rv)? cache : NULL;
+    return rv;
+}
+
+/* call with lock held */
+static void cha_cache_remove(md_cha_cache_t *cache, const char *hostname)
+{
+    md_cha_entry_t *e;
+
+    if ((e = apr_hash_get(cache->entries, hostname, APR_HASH_KEY_STRING))) {
+        apr_hash_set(cache->entries, hostname, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(e->p);
+    }
+}
+
+/* call with lock held */
+static void cha_cache_clear(md_cha_cache_t *cache, apr_time_t expired_at)
+{
+    apr_hash_index_t *hi;
+    md_cha_entry_t *e;
+    const char *hostname;
+
+    for (hi = apr_hash_first(NULL, cache->entries); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (const void**)&hostname, NULL, (void**)&e);
+        if (!expired_at || e->valid_until <= expired_at) {
+            apr_hash_set(cache->entries, hostname, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(e->p);
+        }
+    }
+}
+
+static void cha_cache_put(md_cha_cache_t *cache, const char *hostname,
+                          const char *token, const char *data)
+{
+    md_cha_entry_t *e;
+    apr_pool_t *p;
+    apr_time_t now = apr_time_now();
+
+    cha_cache_lock(cache);
+    cha_cache_remove(cache, hostname);
+    if (apr_hash_count(cache->entries) >= MD_CHA_CACHE_MAX) {
+        cha_cache_clear(cache, now);
+    }
+    if (apr_hash_count(cache->entries) < MD_CHA_CACHE_MAX
+        && APR_SUCCESS == apr_pool_create(&p, cache->p)) {
+        apr_pool_tag(p, "md_cha_cache");
+        e = apr_pcalloc(p, sizeof(*e));
+        e->p = p;
+        e->token = apr_pstrdup(p, token);
+        e->data = apr_pstrdup(p, data);
+        e->len = strlen(data);
+        e->valid_until = now + MD_CHA_CACHE_TTL;
+        apr_hash_set(cache->entries, apr_pstrdup(p, hostname), APR_HASH_KEY_STRING, e);
+    }
+    cha_cache_unlock(cache);
+}
+
+/* Lookup data for hostname and token, copy it into the pool if found. */
+static int cha_cache_get(md_cha_cache_t *cache, const char *hostname, const char *token,
+                         const char **pdata, apr_size_t *plen, apr_pool_t *p)
+{
+    md_cha_entry_t *e;
+    int found = 0;
+
+    cha_cache_lock(cache);
+    if ((e = apr_hash_get(cache->entries, hostname, APR_HASH_KEY_STRING))) {
+        if (e->valid_until <= apr_time_now()) {
+            cha_cache_remove(cache, hostname);
+        }
+        else if (!strcmp(token, e->token)) {
+            *pdata = apr_pstrmemdup(p, e->data, e->len);
+            *plen = e->len;
+            found = 1;
+        }
+    }
+    cha_cache_unlock(cache);
+    return found;
+}
+
+/* call with lock held */
+static void cha_cache_tls_clear(md_cha_cache_t *cache)
+{
+    apr_hash_index_t *hi;
+    md_tls_cha_entry_t *e;
+    const char *key;
+
+    for (hi = apr_hash_first(NULL, cache->tls_entries); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (const void**)&key, NULL, (void**)&e);
+        apr_hash_set(cache->tls_entries, key, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(e->p);
+    }
+}
+
+/* call with lock held */
+static void cha_cache_tls_remove(md_cha_cache_t *cache, const char *cert_name, 
+                                 const char *hostname, apr_pool_t *p)
+{
+    md_tls_cha_entry_t *e;
+    const char *key = apr_pstrcat(p, cert_name, ":", hostname, NULL);
+
+    if ((e = apr_hash_get(cache->tls_entries, key, APR_HASH_KEY_STRING))) {
+        apr_hash_set(cache->tls_entries, key, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(e->p);
+    }
+}
+
+static void cha_cache_tls_put(md_cha_cache_t *cache, const char *key, md_cert_t *cert, 
+                              md_pkey_t *pkey, apr_time_t modified)
+{
+    md_tls_cha_entry_t *e;
+    apr_pool_t *p;
+
+    cha_cache_lock(cache);
+    if ((e = apr_hash_get(cache->tls_entries, key, APR_HASH_KEY_STRING))) {
+        apr_hash_set(cache->tls_entries, key, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(e->p);
+    }
+    if (apr_hash_count(cache->tls_entries) >= MD_TLS_CHA_CACHE_MAX) {
+        cha_cache_tls_clear(cache);
+    }
+    if (APR_SUCCESS == apr_pool_create(&p, cache->p)) {
+        apr_pool_tag(p, "md_cha_cache");
+        e = apr_pcalloc(p, sizeof(*e));
+        e->p = p;
+        e->cert = md_cert_share(cert, p);
+        e->pkey = md_pkey_share(pkey, p);
+        e->modified = modified;
+        if (e->cert && e->pkey) {
+            apr_hash_set(cache->tls_entries, apr_pstrdup(p, key), APR_HASH_KEY_STRING, e);
+        }
+        else {
+            apr_pool_destroy(p);
+        }
+    }
+    cha_cache_unlock(cache);
+}
+
+/* Lookup certificate and key under key, when loaded at the given modification time.
+ * The returned references are valid for the lifetime of pool p. */
+static int cha_cache_tls_get(md_cha_cache_t *cache, const char *key, apr_time_t modified,
+                             md_cert_t **pcert, md_pkey_t **ppkey, apr_pool_t *p)
+{
+    md_tls_cha_entry_t *e;
+    int found = 0;
+
+    cha_cache_lock(cache);
+    if ((e = apr_hash_get(cache->tls_entries, key, APR_HASH_KEY_STRING))) {
+        if (e->modified != modified) {
+            apr_hash_set(cache->tls_entries, key, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(e->p);
+        }
+        else if ((*pcert = md_cert_share(e->cert, p)) && (*ppkey = md_pkey_share(e->pkey, p))) {
+            found = 1;
+        }
+    }
+    cha_cache_unlock(cache);
+    return found;
+}
+
+/* The key authorization of a http-01 challenge is "<token>.<thumbprint>" */
+static int cha_data_matches(const char *data, const char *token)
+{
+    apr_size_t tlen = strlen(token);
+    return !strncmp(data, token, tlen) && data[tlen] == '.';
+}
+
+static const char *last_segment(const char *path, apr_pool_t *p)
+{
+    const char *s = ap_strrchr_c(path, '/');
+    return s? apr_pstrdup(p, s + 1) : path;
+}
+
+static void cha_cache_on_store_ev(md_cha_cache_t *cache, md_store_fs_ev_t ev,
+                                  const char *fname, apr_filetype_e ftype, apr_pool_t *p)
+{
+    const char *dir, *hostname, *aspect, *data;
+    char *s;
+
+    if (ftype == APR_DIR) {
+        if (MD_S_FS_EV_REMOVED == ev) {
+            hostname = last_segment(fname, p);
+            cha_cache_lock(cache);
+            if (!strcmp(md_store_group_name(MD_SG_CHALLENGES), hostname)) {
+                /* the whole group got purged */
+                cha_cache_clear(cache, 0);
+                cha_cache_tls_clear(cache);
+            }
+            else {
+                cha_cache_remove(cache, hostname);
+                cha_cache_tls_remove(cache, MD_FN_TLSALPN01_CERT, hostname, p);
+                cha_cache_tls_remove(cache, MD_FN_TLSSNI01_CERT, hostname, p);
+            }
+            cha_cache_unlock(cache);
+        }
+        return;
+    }
+
+    aspect = last_segment(fname, p);
+    dir = apr_pstrdup(p, fname);
+    s = strrchr(dir, '/');
+    if (!s) {
+        return;
+    }
+    *s = '\0';
+    hostname = last_segment(dir, p);
+
+    if (!strcmp(MD_FN_TLSALPN01_CERT, aspect) || !strcmp(MD_FN_TLSALPN01_PKEY, aspect)
+        || !strcmp(MD_FN_TLSSNI01_CERT, aspect) || !strcmp(MD_FN_TLSSNI01_PKEY, aspect)) {
+        /* whatever happened, the next handshake loads what is in the store now */
+        cha_cache_lock(cache);
+        cha_cache_tls_remove(cache, MD_FN_TLSALPN01_CERT, hostname, p);
+        cha_cache_tls_remove(cache, MD_FN_TLSSNI01_CERT, hostname, p);
+        cha_cache_unlock(cache);
+        return;
+    }
+    if (strcmp(MD_FN_HTTP01, aspect)) {
+        return;
+    }
+
+    if (MD_S_FS_EV_CREATED == ev && APR_SUCCESS == md_text_fread8k(&data, p, fname)
+        && (s = strchr(data, '.'))) {
+        cha_cache_put(cache, hostname, apr_pstrndup(p, data, (apr_size_t)(s - data)), data);
+    }
+    else {
+        cha_cache_lock(cache);
+        cha_cache_remove(cache, hostname);
+        cha_cache_unlock(cache);
+    }
+}
+
 /**************************************************************************************************/
 /* store & registry setup */
 
@@ -414,14 +864,21 @@ static apr_status_t store_file_ev(void *baton, struct md_store_t *store,
     ap_log_error(APLOG_MARK, APLOG_TRACE3, 0, s, "store event=%d on %s %s (group %d)", 
                  ev, (ftype == APR_DIR)? "dir" : "file", fname, group);
                  
-    /* Directories in group CHALLENGES and STAGING are written to by our watchdog,
+    if (MD_SG_CHALLENGES == group && cha_cache) {
+        cha_cache_on_store_ev(cha_cache, ev, fname, ftype, p);
+    }
+    
+    /* Directories in group CHALLENGES, STAGING, KEYS, OCSP and CACHE are written to by our watchdog,
      * running on certain mpms in a child process under a different user. Give them
      * ownership. 
      */
-    if (ftype == APR_DIR) {
+    if (ftype == APR_DIR && MD_S_FS_EV_REMOVED != ev) {
         switch (group) {
             case MD_SG_CHALLENGES:
             case MD_SG_STAGING:
+            case MD_SG_KEYS:
+            case MD_SG_OCSP:
+            case MD_SG_CACHE:
                 rv = md_make_worker_accessible(fname, p);
                 if (APR_ENOTIMPL != rv) {
                     return rv;
@@ -447,6 +904,27 @@ static apr_status_t check_group_dir(md_store_t *store, md_store_group_t group,
     return rv;
 }
 
+/* decrypted private keys are reused for this long */
+#define MD_PKEY_CACHE_TTL       apr_time_from_sec(5 * 60)
+
+static apr_status_t check_lease_dir(md_store_t *store, apr_pool_t *p, server_rec *s)
+{
+    const char *dir;
+    apr_status_t rv;
+    
+    /* leases are taken and released by the watchdog in the child process */
+    if (APR_SUCCESS == (rv = md_store_get_fname(&dir, store, MD_SG_NONE, NULL, 
+                                                MD_STORE_FS_LEASE_DIR, p))
+        && APR_SUCCESS == (rv = apr_dir_make_recursive(dir, MD_FPROT_D_UALL_GREAD, p))) {
+        rv = md_make_worker_accessible(dir, p);
+        if (APR_ENOTIMPL == rv) {
+            rv = APR_SUCCESS;
+        }
+    }
+    ap_log_error(APLOG_MARK, APLOG_TRACE2, rv, s, "setup lease directory");
+    return rv;
+}
+
 static apr_status_t setup_store(md_store_t **pstore, md_mod_conf_t *mc, 
                                 apr_pool_t *p, server_rec *s)
 {
@@ -462,9 +940,23 @@ static apr_status_t setup_store(md_store_t **pstore, md_mod_conf_t *mc,
     }
 
     md_store_fs_set_event_cb(*pstore, store_file_ev, s);
+    md_store_fs_listing_cache_set(*pstore, p, 1);
+    md_store_fs_sync_set(*pstore, mc->store_sync);
+    if (APR_SUCCESS != (rv = md_pkey_cache_enable(p, MD_PKEY_CACHE_TTL))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10134)
+                     "enabling private key cache, keys are decrypted on every load");
+    }
+    if (APR_SUCCESS != (rv = md_cert_cache_enable(p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10123)
+                     "enabling certificate cache, chains are parsed without it");
+    }
     if (   !MD_OK(check_group_dir(*pstore, MD_SG_CHALLENGES, p, s))
         || !MD_OK(check_group_dir(*pstore, MD_SG_STAGING, p, s))
-        || !MD_OK(check_group_dir(*pstore, MD_SG_ACCOUNTS, p, s))) {
+        || !MD_OK(check_group_dir(*pstore, MD_SG_ACCOUNTS, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_KEYS, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_OCSP, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_CACHE, p, s))
+        || !MD_OK(check_lease_dir(*pstore, p, s))) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10047) 
                      "setup challenges directory, call %s", MD_LAST_CHK);
     }
@@ -536,6 +1028,7 @@ static apr_status_t cleanup_setups(void *dummy)
 {
     (void)dummy;
     log_server = NULL;
+    md_log_update_level();
     return APR_SUCCESS;
 }
 
@@ -548,6 +1041,7 @@ static void init_setups(apr_pool_t *p, server_rec *base_server)
 /**************************************************************************************************/
 /* mod_ssl interface */
 
+/* set once in the optional function hook, before any threads run */
 static APR_OPTIONAL_FN_TYPE(ssl_is_https) *opt_ssl_is_https;
 
 static void init_ssl(void)
@@ -555,6 +1049,45 @@ static void init_ssl(void)
     opt_ssl_is_https = APR_RETRIEVE_OPTIONAL_FN(ssl_is_https);
 }
 
+/**************************************************************************************************/
+/* https: redirects */
+
+/* Servers of MDs that require https: mostly answer plain http: requests with a
+ * redirect. What does not change between requests, the scheme and name of the 
+ * server and the HSTS header for the https: side, is made once at post_config. */
+
+static int https_required;
+
+static const char *https_prefix(apr_pool_t *p, const char *host)
+{
+    /* the default port 443 is left out, IPv6 addresses need brackets */
+    if (host && ap_strchr_c(host, ':')) {
+        return apr_pstrcat(p, "https://[", host, "]", NULL);
+    }
+    return apr_pstrcat(p, "https://", host? host : "", NULL);
+}
+
+static void init_https_redirects(server_rec *base_server, apr_pool_t *p)
+{
+    server_rec *s;
+    md_srv_conf_t *sc;
+    const md_conf_md_t *md;
+    
+    https_required = 0;
+    for (s = base_server; s; s = s->next) {
+        sc = md_config_get(s);
+        sc->https_prefix = sc->https_hsts = NULL;
+        md = md_config_get_md(sc);
+        if (md && md->require_https > MD_REQUIRE_OFF) {
+            sc->https_prefix = https_prefix(p, s->server_hostname);
+            if (md->require_https == MD_REQUIRE_PERMANENT) {
+                sc->https_hsts = sc->mc->hsts_header;
+            }
+            https_required = 1;
+        }
+    }
+}
+
 /**************************************************************************************************/
 /* connection context */
 
@@ -613,11 +1146,16 @@ static int md_protocol_switch(conn_rec *c, request_rec *r, server_rec *s,
 
 #define MD_WATCHDOG_NAME   "_md_"
 
+/* How long a job may wait on the CA in one run, before other jobs get their turn */
+#define MD_JOB_MAX_BLOCK   apr_time_from_sec(5)
+
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_set_callback_interval) *wd_set_interval;
 
 typedef struct {
+    const char *name;
+    apr_pool_t *p;                     /* holds md, made anew before each check */
     md_t *md;
 
     int stalled;
@@ -626,10 +1164,20 @@ typedef struct {
     apr_time_t restart_at;
     int need_restart;
     int restart_processed;
+    int restart_queued;                /* in md_watchdog->restarts */
+    apr_time_t restart_pending;        /* since when waiting for a batched restart, or 0 */
+    apr_time_t live_modified;          /* modification time of the pubcert activated live */
+    int driving;                       /* an order for the md is in progress */
+    apr_time_t resume_at;              /* when the CA expects the order back, or 0 */
 
     apr_status_t last_rv;
     apr_time_t next_check;
     int error_runs;
+    
+    apr_time_t due;                    /* when the watchdog checks the job next */
+    apr_time_t ocsp_due;               /* when its OCSP responses are renewed next, 0 now */
+    apr_pool_t *status_p;              /* holds status */
+    md_json_t *status;                 /* the job in the status file, NULL when changed */
 } md_job_t;
 
 typedef struct {
@@ -641,9 +1189,87 @@ typedef struct {
     apr_time_t next_change;
     
     apr_array_header_t *jobs;
+    apr_array_header_t *schedule;      /* the jobs as min-heap on md_job_t->due */
+    apr_array_header_t *restarts;      /* the jobs waiting for a restart to activate */
+    int status_changed;                /* a job has changed since save_status() */
     md_reg_t *reg;
+    apr_uint64_t recycled;             /* number of job pools made anew */
+    const char *lease_owner;           /* our name in leases on mds */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;         /* guards the renewal budget between job workers */
+#endif
+    apr_time_t budget_end;             /* end of the current MDRenewBudget slice */
+    int budget_used;                   /* renewals started in the current slice */
+    apr_time_t next_gc;                /* when the store is cleaned up next */
 } md_watchdog;
 
+/* The watchdog only looks at the jobs that are due. Those are taken from the top of
+ * the schedule, checked and put back with their new due time. */
+
+static void schedule_swap(apr_array_header_t *heap, int i, int j)
+{
+    md_job_t *job = APR_ARRAY_IDX(heap, i, md_job_t *);
+    APR_ARRAY_IDX(heap, i, md_job_t *) = APR_ARRAY_IDX(heap, j, md_job_t *);
+    APR_ARRAY_IDX(heap, j, md_job_t *) = job;
+}
+
+#define SCHED_DUE(heap, i)     (APR_ARRAY_IDX((heap), (i), md_job_t *)->due)
+
+static void schedule_push(apr_array_header_t *heap, md_job_t *job)
+{
+    int i, parent;
+    
+    APR_ARRAY_PUSH(heap, md_job_t *) = job;
+    for (i = heap->nelts - 1; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (SCHED_DUE(heap, parent) <= SCHED_DUE(heap, i)) {
+            break;
+        }
+        schedule_swap(heap, i, parent);
+    }
+}
+
+static md_job_t *schedule_pop(apr_array_header_t *heap)
+{
+    md_job_t *job;
+    int i, child;
+    
+    if (heap->nelts <= 0) {
+        return NULL;
+    }
+    job = APR_ARRAY_IDX(heap, 0, md_job_t *);
+    APR_ARRAY_IDX(heap, 0, md_job_t *) = APR_ARRAY_IDX(heap, heap->nelts - 1, md_job_t *);
+    --heap->nelts;
+    for (i = 0; (child = 2 * i + 1) < heap->nelts; i = child) {
+        if (child + 1 < heap->nelts && SCHED_DUE(heap, child + 1) < SCHED_DUE(heap, child)) {
+            ++child;
+        }
+        if (SCHED_DUE(heap, i) <= SCHED_DUE(heap, child)) {
+            break;
+        }
+        schedule_swap(heap, i, child);
+    }
+    return job;
+}
+
+/* When the job needs to be checked after a run at now. */
+static apr_time_t job_due(md_job_t *job, apr_time_t now)
+{
+    /* normally, we'd like to run at least twice a day */
+    apr_time_t due = now + apr_time_from_sec(MD_SECS_PER_DAY / 2), renew_at;
+    
+    if (job->next_check) {
+        if (job->next_check < due) {
+            due = job->next_check;
+        }
+    }
+    else if (!job->renewed && (renew_at = md_renew_at(job->md)) > now && renew_at < due) {
+        /* do not sleep into the renew window */
+        due = renew_at;
+    }
+    return due;
+}
+
 static void assess_renewal(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp) 
 {
     apr_time_t now = apr_time_now();
@@ -683,6 +1309,8 @@ static apr_status_t load_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
                             MD_FN_JOB, &jprops, p);
     if (APR_SUCCESS == rv) {
         job->restart_processed = md_json_getb(jprops, MD_KEY_PROCESSED, NULL);
+        job->restart_pending = apr_time_from_sec(md_json_getl(jprops, MD_KEY_RESTART_PENDING, NULL));
+        job->live_modified = apr_time_from_sec(md_json_getl(jprops, MD_KEY_LIVE, NULL));
         job->error_runs = (int)md_json_getl(jprops, MD_KEY_ERRORS, NULL);
     }
     return rv;
@@ -701,6 +1329,8 @@ static apr_status_t save_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
     }
     if (APR_SUCCESS == rv) {
         md_json_setb(job->restart_processed, jprops, MD_KEY_PROCESSED, NULL);
+        md_json_setl((long)apr_time_sec(job->restart_pending), jprops, MD_KEY_RESTART_PENDING, NULL);
+        md_json_setl((long)apr_time_sec(job->live_modified), jprops, MD_KEY_LIVE, NULL);
         md_json_setl(job->error_runs, jprops, MD_KEY_ERRORS, NULL);
         rv = md_store_save_json(store, p, MD_SG_STAGING, job->md->name,
                                 MD_FN_JOB, jprops, 0);
@@ -708,11 +1338,135 @@ static apr_status_t save_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
     return rv;
 }
 
+/* MDLiveActivation only replaces the restart when a TLS module said it asks for
+ * live credentials, otherwise the renewed certificates would never be used. */
+
+static int live_consumers;
+
+static void md_use_live_credentials(void)
+{
+    live_consumers = 1;
+}
+
+static int live_activation_on(md_mod_conf_t *mc)
+{
+    return mc->live_activation && live_consumers;
+}
+
+/* With MDRenewLease, the servers sharing a store take a lease on an md before driving 
+ * it. The one holding it extends the lease on every check while it waits for the CA. 
+ * The others check back later and find a complete set staged by then. */
+ 
+static md_lease_fn *ext_lease;
+static md_release_fn *ext_release;
+static void *ext_lease_baton;
+
+static void md_set_lease_impl(md_lease_fn *lease, md_release_fn *release, void *baton)
+{
+    ext_lease = lease;
+    ext_release = release;
+    ext_lease_baton = baton;
+}
+
+/* Challenge data is handed to an external publisher, if one was installed, before
+ * the CA is asked to validate. */
+ 
+static md_publish_challenge_fn *ext_publish;
+static void *ext_publish_baton;
+
+static void md_set_challenge_publisher(md_publish_challenge_fn *publish, void *baton)
+{
+    ext_publish = publish;
+    ext_publish_baton = baton;
+}
+
+static apr_status_t ext_cha_publish(void *baton, md_store_t *store, const char *cha_type, 
+                                    const char *name, apr_pool_t *p)
+{
+    (void)baton;
+    (void)store;
+    return ext_publish(ext_publish_baton, p, cha_type, name);
+}
+
+static apr_status_t job_lease(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+    
+    if (wd->mc->renew_lease <= 0) {
+        return APR_SUCCESS;
+    }
+    rv = md_store_lease(md_reg_store_get(wd->reg), ptemp, job->md->name, 
+                        wd->lease_owner, wd->mc->renew_lease);
+    return APR_STATUS_IS_ENOTIMPL(rv)? APR_SUCCESS : rv;
+}
+
+static void job_release(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+    
+    if (wd->mc->renew_lease > 0) {
+        rv = md_store_release(md_reg_store_get(wd->reg), ptemp, job->md->name, wd->lease_owner);
+        ap_log_error(APLOG_MARK, APLOG_TRACE1, rv, wd->s, "%s: lease released", job->md->name);
+    }
+}
+
+/* Certificates obtained together expire together. With MDRenewSpread, the renewal
+ * of each md starts at its own point in the first part of the renew window, derived
+ * from its name. With MDRenewBudget, only so many renewals start per time slice, the 
+ * rest wait for the next one. Both hold back renewals of valid certificates only and 
+ * leave orders in progress alone. Returns when the renewal may start or 0 for now. */
+static apr_time_t renew_hold_until(md_watchdog *wd, md_job_t *job, apr_time_t now)
+{
+    const md_t *md = job->md;
+    apr_time_t renew_at, start_at = 0;
+    apr_ssize_t len;
+    unsigned int h;
+    
+    if (job->driving || md->state != MD_S_COMPLETE || md->expires <= now) {
+        return 0;
+    }
+    if (wd->mc->renew_spread > 0 && (renew_at = md_renew_at(md)) > 0) {
+        len = (apr_ssize_t)strlen(md->name);
+        h = apr_hashfunc_default(md->name, &len) % 1000;
+        start_at = renew_at + (apr_time_t)((double)(md->expires - renew_at) 
+                                           * wd->mc->renew_spread / 100.0 * h / 1000.0);
+    }
+    if (start_at <= now && wd->mc->renew_budget > 0) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(wd->mutex);
+#endif
+        if (now >= wd->budget_end) {
+            wd->budget_end = now + wd->mc->renew_slice;
+            wd->budget_used = 0;
+        }
+        if (wd->budget_used >= wd->mc->renew_budget) {
+            start_at = wd->budget_end;
+        }
+        else {
+            ++wd->budget_used;
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(wd->mutex);
+#endif
+    }
+    return (start_at > now)? start_at : 0;
+}
+
+/* While an order waits on the CA, the node holding its lease needs to extend it before
+ * it runs out, or another one takes the md over. */
+static apr_interval_time_t lease_capped(md_watchdog *wd, apr_interval_time_t delay)
+{
+    if (wd->mc->renew_lease > 0 && delay > wd->mc->renew_lease / 2) {
+        delay = wd->mc->renew_lease / 2;
+    }
+    return delay;
+}
+
 static apr_status_t check_job(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
 {
     apr_status_t rv = APR_SUCCESS;
-    apr_time_t valid_from, delay;
-    int errored, renew, error_runs;
+    apr_time_t valid_from, delay, resume_at, hold_until;
+    int errored, renew, error_runs, waiting = 0;
     char ts[APR_RFC822_DATE_LEN];
     
     if (apr_time_now() < job->next_check) {
@@ -737,7 +1491,7 @@ static apr_status_t check_job(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
     else if (job->renewed) {
         assess_renewal(wd, job, ptemp);
     }
-    else if (APR_SUCCESS == (rv = md_reg_assess(wd->reg, job->md, &errored, &renew, wd->p))) {
+    else if (APR_SUCCESS == (rv = md_reg_assess(wd->reg, job->md, &errored, &renew, ptemp))) {
         if (errored) {
             ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10050) 
                          "md(%s): in error state", job->md->name);
@@ -746,13 +1500,66 @@ static apr_status_t check_job(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
             ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10052) 
                          "md(%s): state=%d, driving", job->md->name, job->md->state);
                          
-            rv = md_reg_stage(wd->reg, job->md, NULL, 0, &valid_from, ptemp);
+            if ((hold_until = renew_hold_until(wd, job, apr_time_now()))) {
+                job->next_check = hold_until;
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10132) 
+                             "md(%s): renewal held back to spread the load, starting in %s", 
+                             job->md->name, md_print_duration(ptemp, hold_until - apr_time_now()));
+                goto out;
+            }
+            rv = job_lease(wd, job, ptemp);
+            if (APR_STATUS_IS_EAGAIN(rv)) {
+                delay = wd->mc->renew_lease / 2;
+                if (delay < apr_time_from_sec(1)) {
+                    delay = apr_time_from_sec(1);
+                }
+                job->next_check = apr_time_now() + delay;
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10131) 
+                             "md(%s): renewal is driven by another server, checking back in %s", 
+                             job->md->name, md_print_duration(ptemp, delay));
+                rv = APR_SUCCESS;
+                goto out;
+            }
+            else if (APR_SUCCESS == rv && job->driving && job->resume_at > apr_time_now()) {
+                /* lease extended, the CA does not expect us back yet */
+                delay = lease_capped(wd, job->resume_at - apr_time_now());
+                job->next_check = apr_time_now() + delay;
+                ap_log_error( APLOG_MARK, APLOG_TRACE1, 0, wd->s,
+                             "md(%s): lease extended, continuing in %s", 
+                             job->md->name, md_print_duration(ptemp, delay));
+                waiting = 1;
+                goto out;
+            }
+            else if (APR_SUCCESS == rv) {
+                resume_at = 0;
+                rv = md_reg_stage(wd->reg, job->md, NULL, 0, MD_JOB_MAX_BLOCK, 
+                                  &resume_at, &valid_from, ptemp);
+                job->driving = APR_STATUS_IS_EAGAIN(rv);
+                job->resume_at = job->driving? resume_at : 0;
+                if (!APR_STATUS_IS_EAGAIN(rv)) {
+                    job_release(wd, job, ptemp);
+                }
+            }
             
             if (APR_SUCCESS == rv) {
                 job->renewed = 1;
                 job->restart_at = valid_from;
                 assess_renewal(wd, job, ptemp);
             }
+            else if (APR_STATUS_IS_EAGAIN(rv) && resume_at) {
+                /* Still waiting on the CA. Continue when it expects us back,
+                 * checking in earlier to keep the lease. */
+                delay = lease_capped(wd, resume_at - apr_time_now());
+                if (delay < apr_time_from_msec(500)) {
+                    delay = apr_time_from_msec(500);
+                }
+                job->next_check = apr_time_now() + delay;
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10120) 
+                             "md(%s): staging in progress, continuing in %s", 
+                             job->md->name, md_print_duration(ptemp, delay));
+                waiting = 1;
+                rv = APR_SUCCESS;
+            }
         }
         else {
             /* Renew is not necessary yet, leave job->next_check as 0 since 
@@ -763,32 +1570,509 @@ static apr_status_t check_job(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
         }
     }
     
-    if (APR_SUCCESS == rv) {
-        job->error_runs = 0;
+    if (APR_SUCCESS == rv) {
+        /* waiting on the CA is no success yet, errors before still count */
+        if (!waiting) {
+            job->error_runs = 0;
+        }
+    }
+    else {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10056) 
+                     "processing %s", job->md->name);
+        ++job->error_runs;
+        /* back off duration, depending on the errors we encounter in a row */
+        delay = apr_time_from_sec(5 << (job->error_runs - 1));
+        if (delay > apr_time_from_sec(60*60)) {
+            delay = apr_time_from_sec(60*60);
+        }
+        job->next_check = apr_time_now() + delay;
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO(10057) 
+                     "%s: encountered error for the %d. time, next run in %s",
+                     job->md->name, job->error_runs, md_print_duration(ptemp, delay));
+    }
+    
+out:
+    if (error_runs != job->error_runs) {
+        apr_status_t rv2 = save_job_props(wd->reg, job, ptemp);
+        ap_log_error(APLOG_MARK, APLOG_TRACE1, rv2, wd->s, "%s: saving job props", job->md->name);
+    }
+
+    job->last_rv = rv;
+    return rv;
+}
+
+#if APR_HAS_THREADS
+
+/* With MDRenewParallel > 1, jobs are checked by a number of worker threads. Each
+ * worker has its own pool and takes the next job from a shared queue until none
+ * are left. Jobs only touch their own state and the store files of their md. */
+ 
+typedef struct {
+    md_watchdog *wd;
+    apr_array_header_t *jobs;          /* the jobs to check */
+    apr_thread_mutex_t *mutex;
+    int next;                          /* index of the next job to check */
+} md_job_queue;
+
+typedef struct {
+    md_job_queue *queue;
+    apr_pool_t *p;
+} md_job_worker;
+
+static md_job_t *job_queue_next(md_job_queue *queue)
+{
+    md_job_t *job = NULL;
+    
+    apr_thread_mutex_lock(queue->mutex);
+    if (queue->next < queue->jobs->nelts) {
+        job = APR_ARRAY_IDX(queue->jobs, queue->next, md_job_t *);
+        ++queue->next;
+    }
+    apr_thread_mutex_unlock(queue->mutex);
+    return job;
+}
+
+static void * APR_THREAD_FUNC job_worker_run(apr_thread_t *thread, void *baton)
+{
+    md_job_worker *worker = baton;
+    md_job_t *job;
+    
+    while (NULL != (job = job_queue_next(worker->queue))) {
+        check_job(worker->queue->wd, job, worker->p);
+        apr_pool_clear(worker->p);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t check_jobs_parallel(md_watchdog *wd, apr_array_header_t *jobs, 
+                                        int max_workers, apr_pool_t *ptemp)
+{
+    md_job_queue *queue;
+    md_job_worker *worker;
+    apr_allocator_t *allocator;
+    apr_thread_t **threads;
+    apr_status_t rv, rv2;
+    int i, n;
+    
+    queue = apr_pcalloc(ptemp, sizeof(*queue));
+    queue->wd = wd;
+    queue->jobs = jobs;
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&queue->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, ptemp))) {
+        return rv;
+    }
+    
+    n = (max_workers < jobs->nelts)? max_workers : jobs->nelts;
+    threads = apr_pcalloc(ptemp, (apr_size_t)n * sizeof(*threads));
+    for (i = 0; i < n; ++i) {
+        worker = apr_pcalloc(ptemp, sizeof(*worker));
+        worker->queue = queue;
+        /* workers run concurrently, each needs its own allocator */
+        if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+            break;
+        }
+        apr_allocator_max_free_set(allocator, ap_max_mem_free);
+        if (APR_SUCCESS != (rv = apr_pool_create_ex(&worker->p, ptemp, NULL, allocator))) {
+            apr_allocator_destroy(allocator);
+            break;
+        }
+        apr_allocator_owner_set(allocator, worker->p);
+        apr_pool_tag(worker->p, "md_job_worker");
+        if (APR_SUCCESS != (rv = apr_thread_create(&threads[i], NULL, 
+                                                   job_worker_run, worker, ptemp))) {
+            break;
+        }
+    }
+    
+    if (i < n) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10118)
+                     "md watchdog: started only %d of %d renewal workers", i, n);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10119)
+                     "md watchdog: checking %d mds with %d workers", jobs->nelts, n);
+    }
+    /* All workers need to have reported before decisions about restarts are made */
+    for (n = i, i = 0; i < n; ++i) {
+        apr_thread_join(&rv2, threads[i]);
+    }
+    /* If no worker could be started, the caller is left to check the jobs */
+    return (n > 0)? APR_SUCCESS : rv;
+}
+
+#endif /* APR_HAS_THREADS */
+
+static void check_jobs(md_watchdog *wd, apr_array_header_t *jobs, apr_pool_t *ptemp)
+{
+    md_job_t *job;
+    int i;
+    
+#if APR_HAS_THREADS
+    if (wd->mc->renew_parallel > 1 && jobs->nelts > 1 && md_reg_is_concurrent(wd->reg)
+        && APR_SUCCESS == check_jobs_parallel(wd, jobs, wd->mc->renew_parallel, ptemp)) {
+        return;
+    }
+#endif
+    for (i = 0; i < jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(jobs, i, md_job_t *);
+        check_job(wd, job, ptemp);
+    }
+}
+
+/* A job reads its md anew into a fresh pool before each check, so nothing allocated
+ * for it piles up in the watchdog pool over the lifetime of the process. This happens 
+ * before workers start, as they must not create pools in the watchdog allocator. */
+static void job_recycle(md_watchdog *wd, md_job_t *job)
+{
+    apr_pool_t *p;
+    md_t *md;
+    
+    if (APR_SUCCESS != apr_pool_create(&p, wd->p)) {
+        return;
+    }
+    apr_pool_tag(p, "md_job");
+    if (NULL != (md = md_reg_get(wd->reg, job->name, p))) {
+        apr_pool_destroy(job->p);
+        job->p = p;
+        job->md = md;
+        ++wd->recycled;
+    }
+    else {
+        /* keep what we have */
+        apr_pool_destroy(p);
+    }
+}
+
+static void log_wd_memory(md_watchdog *wd)
+{
+#if APR_POOL_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10140)
+                 "md watchdog: %d job pools, %" APR_UINT64_T_FMT " recycled, "
+                 "%" APR_SIZE_T_FMT " bytes in use", wd->jobs->nelts, wd->recycled,
+                 apr_pool_num_bytes(wd->p, 1));
+#else
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10141)
+                 "md watchdog: %d job pools, %" APR_UINT64_T_FMT " recycled",
+                 wd->jobs->nelts, wd->recycled);
+#endif
+}
+
+/* Check the jobs that are due and put them back into the schedule. */
+static void check_due_jobs(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    apr_array_header_t *due;
+    md_job_t *job;
+    apr_time_t now = apr_time_now();
+    int i;
+    
+    due = apr_array_make(ptemp, 10, sizeof(md_job_t *));
+    while (wd->schedule->nelts > 0 && SCHED_DUE(wd->schedule, 0) <= now) {
+        job = schedule_pop(wd->schedule);
+        if (now >= job->next_check) {
+            job_recycle(wd, job);
+        }
+        APR_ARRAY_PUSH(due, md_job_t *) = job;
+    }
+    ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, wd->s, "md watchdog: %d of %d mds due", 
+                 due->nelts, wd->jobs->nelts);
+    check_jobs(wd, due, ptemp);
+    now = apr_time_now();
+    for (i = 0; i < due->nelts; ++i) {
+        job = APR_ARRAY_IDX(due, i, md_job_t *);
+        job->due = job_due(job, now);
+        schedule_push(wd->schedule, job);
+        if (job->need_restart && !job->restart_processed && !job->restart_queued) {
+            job->restart_queued = 1;
+            APR_ARRAY_PUSH(wd->restarts, md_job_t *) = job;
+        }
+        job->status = NULL;
+        wd->status_changed = 1;
+    }
+}
+
+/* Keys for the MDs are generated ahead of time by the watchdog, one per run, so
+ * that renewals and fallback certificates find them ready. */
+#define MD_KEYPOOL_KEYS         2
+#define MD_KEYPOOL_FILL_DELAY   apr_time_from_sec(1)
+
+static int fill_keypool(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    apr_array_header_t *specs;
+    md_pkey_spec_t *spec, fallback_spec;
+    md_store_t *store = md_reg_store_get(wd->reg);
+    md_job_t *job;
+    apr_status_t rv;
+    int i, j;
+    
+    /* fallback certificates use the default key */
+    specs = apr_array_make(ptemp, 5, sizeof(md_pkey_spec_t *));
+    fallback_spec.type = MD_PKEY_TYPE_RSA;
+    fallback_spec.params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
+    APR_ARRAY_PUSH(specs, md_pkey_spec_t *) = &fallback_spec;
+    for (i = 0; i < wd->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        spec = job->md->pkey_spec;
+        for (j = 0; j < specs->nelts; ++j) {
+            if (!strcmp(md_pkey_spec_name(spec, ptemp), 
+                        md_pkey_spec_name(APR_ARRAY_IDX(specs, j, md_pkey_spec_t *), ptemp))) {
+                break;
+            }
+        }
+        if (j >= specs->nelts) {
+            APR_ARRAY_PUSH(specs, md_pkey_spec_t *) = spec;
+        }
+    }
+    
+    for (i = 0; i < specs->nelts; ++i) {
+        spec = APR_ARRAY_IDX(specs, i, md_pkey_spec_t *);
+        rv = md_keypool_fill(store, spec, MD_KEYPOOL_KEYS, ptemp);
+        if (APR_SUCCESS == rv) {
+            /* one key per run, there may be more to do */
+            return 1;
+        }
+        else if (!APR_STATUS_IS_EEXIST(rv)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10121)
+                         "filling key pool for %s", md_pkey_spec_name(spec, ptemp));
+        }
+    }
+    return 0;
+}
+
+/* Older copies of an MD's data are kept in the archive, only the most recent ones
+ * are of any use for recovery. This holds for mds no longer configured as well.
+ * Leftovers of interrupted loads and renewals go after a while. Pending authorizations
+ * do not live longer than a week at common CAs, nor does their challenge data. */
+#define MD_ARCHIVE_KEEP         5
+#define MD_GC_TMP_AGE           apr_time_from_sec(MD_SECS_PER_DAY)
+#define MD_GC_CHALLENGES_AGE    apr_time_from_sec(7 * MD_SECS_PER_DAY)
+#define MD_GC_INTERVAL          apr_time_from_sec(MD_SECS_PER_DAY)
+
+/* The archive and tmp groups belong to the user the server starts as, they are 
+ * collected in post_config. The watchdog, running as the worker user in a child, 
+ * only collects the challenges it has access to. */
+static void gc_store(md_store_t *store, server_rec *s, int privileged, apr_pool_t *ptemp)
+{
+    md_store_gc_policy_t policy;
+    md_store_gc_stats_t stats;
+    apr_status_t rv;
+    
+    policy.archive_keep = privileged? MD_ARCHIVE_KEEP : -1;
+    policy.tmp_age = privileged? MD_GC_TMP_AGE : 0;
+    policy.challenges_age = MD_GC_CHALLENGES_AGE;
+    rv = md_store_gc(store, ptemp, &policy, &stats);
+    if (stats.archives + stats.tmp + stats.challenges > 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10142) "store gc: removed %d old "
+                     "archives, %d tmp and %d challenge sets", 
+                     stats.archives, stats.tmp, stats.challenges);
+    }
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOTIMPL(rv)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10122)
+                     "store gc");
+    }
+}
+
+static void wd_gc_store(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    if (wd->next_gc > apr_time_now()) {
+        return;
+    }
+    wd->next_gc = apr_time_now() + MD_GC_INTERVAL;
+    gc_store(md_reg_store_get(wd->reg), wd->s, 0, ptemp);
+}
+
+/* Graceful restarts may come often and the archive listing is not cheap. The time
+ * of the last privileged run is kept in the process pool, which survives restarts,
+ * and post_config collects at most once per interval. */
+static void post_config_gc_store(md_store_t *store, server_rec *s, apr_pool_t *ptemp)
+{
+    const char *mod_md_gc_key = "mod_md_gc_last";
+    apr_time_t *plast, now = apr_time_now();
+    void *data = NULL;
+    
+    apr_pool_userdata_get(&data, mod_md_gc_key, s->process->pool);
+    if (data == NULL) {
+        data = apr_pcalloc(s->process->pool, sizeof(apr_time_t));
+        apr_pool_userdata_set(data, mod_md_gc_key, apr_pool_cleanup_null, s->process->pool);
+    }
+    plast = data;
+    if (*plast && now - *plast < MD_GC_INTERVAL) {
+        return;
+    }
+    *plast = now;
+    gc_store(store, s, 1, ptemp);
+}
+
+/* OCSP responses for the certificates in use are fetched here, so that TLS modules
+ * can staple them via md_get_ocsp_response() without asking the responder during a
+ * handshake. Each job remembers when its responses need renewal, from their update
+ * times, and only the certificates of the jobs due are loaded. The responses they
+ * need are fetched all at once. Returns when the next job is due, or 0 if there is none. */
+static apr_time_t renew_ocsp(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    md_store_t *store = md_reg_store_get(wd->reg);
+    apr_array_header_t *pubcerts, *certs, *renewals, *renewal_jobs;
+    md_ocsp_renewal_t *renewal;
+    md_http_t *http = NULL;
+    md_job_t *job;
+    apr_time_t now = apr_time_now(), due = 0;
+    apr_status_t rv;
+    int i;
+    
+    for (i = 0; i < wd->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        if (job->ocsp_due <= now) break;
+    }
+    if (i >= wd->jobs->nelts) goto out;
+    
+    rv = md_http_create(&http, ptemp, apr_psprintf(ptemp, "%s mod_md/%s", 
+                                                   AP_SERVER_BASEVERSION, MOD_MD_VERSION),
+                        wd->mc->proxy_url);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10126)
+                     "creating http client for OCSP");
+        goto out;
+    }
+    renewals = apr_array_make(ptemp, 10, sizeof(md_ocsp_renewal_t *));
+    renewal_jobs = apr_array_make(ptemp, 10, sizeof(md_job_t *));
+    for (; i < wd->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        if (job->ocsp_due > now) continue;
+        pubcerts = apr_array_make(ptemp, 2, sizeof(apr_array_header_t *));
+        if (APR_SUCCESS == md_pubcert_load(store, MD_SG_DOMAINS, job->md->name, 
+                                           &certs, ptemp)) {
+            APR_ARRAY_PUSH(pubcerts, apr_array_header_t *) = certs;
+        }
+        if (live_activation_on(wd->mc) && job->live_modified
+            && APR_SUCCESS == md_pubcert_load(store, MD_SG_STAGING, job->md->name, 
+                                              &certs, ptemp)) {
+            APR_ARRAY_PUSH(pubcerts, apr_array_header_t *) = certs;
+        }
+        renewal = apr_pcalloc(ptemp, sizeof(*renewal));
+        renewal->name = job->md->name;
+        renewal->pubcerts = pubcerts;
+        APR_ARRAY_PUSH(renewals, md_ocsp_renewal_t *) = renewal;
+        APR_ARRAY_PUSH(renewal_jobs, md_job_t *) = job;
+    }
+    md_ocsp_renew_all(store, http, renewals, ptemp);
+    for (i = 0; i < renewals->nelts; ++i) {
+        renewal = APR_ARRAY_IDX(renewals, i, md_ocsp_renewal_t *);
+        job = APR_ARRAY_IDX(renewal_jobs, i, md_job_t *);
+        if (APR_SUCCESS != renewal->rv) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, renewal->rv, wd->s, APLOGNO(10127)
+                         "md(%s): renewing OCSP responses", job->md->name);
+        }
+        /* without responses, look again with the regular checks */
+        job->ocsp_due = renewal->next_run? 
+            renewal->next_run : now + apr_time_from_sec(MD_SECS_PER_DAY / 2);
+    }
+out:
+    for (i = 0; i < wd->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        if (!due || job->ocsp_due < due) {
+            due = job->ocsp_due;
+        }
+    }
+    return due;
+}
+
+/* Renewed MDs wait up to MDRestartBatch for others, so that certificates finishing
+ * close to each other get one notify and one restart. A batch is also done when it 
+ * has the configured number of MDs, or when a certificate being replaced would 
+ * expire before its end. Only the jobs queued in wd->restarts are looked at.
+ * Returns when the batch is due, or 0 if nothing waits. */
+static apr_time_t restart_due(md_watchdog *wd, apr_time_t now, apr_pool_t *ptemp)
+{
+    md_job_t *job;
+    apr_time_t due = 0;
+    int i, n = 0;
+    
+    for (i = 0; i < wd->restarts->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->restarts, i, md_job_t *);
+        if (job->need_restart && !job->restart_processed) {
+            if (!job->restart_pending) {
+                job->restart_pending = now;
+                save_job_props(wd->reg, job, ptemp);
+            }
+            if (!n || job->restart_pending + wd->mc->restart_window < due) {
+                due = job->restart_pending + wd->mc->restart_window;
+            }
+            if (job->md->expires && job->md->expires < due) {
+                due = job->md->expires;
+            }
+            ++n;
+        }
+    }
+    if (n && wd->mc->restart_max && n >= wd->mc->restart_max) {
+        due = now;
+    }
+    return due;
+}
+
+/* The watchdog runs in one child only. After a run that checked jobs, it writes the state
+ * of its jobs and the metrics it recorded to the store, for the md-status handler and the
+ * mod_status hook in all children. Besides the MDs, staging is the place the watchdog can
+ * write to. The entry of a job is kept and only made anew when the job was checked. */
+#define MD_STATUS_NAME          MD_WATCHDOG_NAME
+#define MD_FN_STATUS            "status.json"
+
+static void status_time_set(apr_time_t t, md_json_t *json, const char *key)
+{
+    char ts[APR_RFC822_DATE_LEN];
+    
+    if (t > 0) {
+        apr_rfc822_date(ts, t);
+        md_json_sets(ts, json, key, NULL);
+    }
+}
+
+static md_json_t *job_status(md_job_t *job)
+{
+    md_json_t *jjob;
+    char buffer[256];
+    
+    if (!job->status) {
+        apr_pool_clear(job->status_p);
+        jjob = md_json_create(job->status_p);
+        md_json_sets(job->md->name, jjob, MD_KEY_NAME, NULL);
+        md_json_setl(job->md->state, jjob, MD_KEY_STATE, NULL);
+        status_time_set(job->md->expires, jjob, MD_KEY_EXPIRES);
+        status_time_set(job->due, jjob, MD_KEY_NEXT_CHECK);
+        md_json_setl(job->error_runs, jjob, MD_KEY_ERRORS, NULL);
+        md_json_setl(job->last_rv, jjob, MD_KEY_LAST, MD_KEY_STATUS, NULL);
+        if (APR_SUCCESS != job->last_rv) {
+            md_json_sets(apr_strerror(job->last_rv, buffer, sizeof(buffer)), 
+                         jjob, MD_KEY_LAST, MD_KEY_MESSAGE, NULL);
+        }
+        job->status = jjob;
+    }
+    return job->status;
+}
+
+static void save_status(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    md_json_t *json;
+    md_job_t *job;
+    apr_status_t rv;
+    int i;
+    
+    if (!wd->status_changed) {
+        return;
     }
-    else {
-        ap_log_error( APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10056) 
-                     "processing %s", job->md->name);
-        ++job->error_runs;
-        /* back off duration, depending on the errors we encounter in a row */
-        delay = apr_time_from_sec(5 << (job->error_runs - 1));
-        if (delay > apr_time_from_sec(60*60)) {
-            delay = apr_time_from_sec(60*60);
-        }
-        job->next_check = apr_time_now() + delay;
-        ap_log_error(APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO(10057) 
-                     "%s: encountered error for the %d. time, next run in %s",
-                     job->md->name, job->error_runs, md_print_duration(ptemp, delay));
+    wd->status_changed = 0;
+    json = md_json_create(ptemp);
+    status_time_set(apr_time_now(), json, MD_KEY_MODIFIED);
+    for (i = 0; i < wd->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        md_json_addj(job_status(job), json, MD_KEY_JOBS, NULL);
     }
+    md_json_setj(md_metrics_to_json(ptemp), json, MD_KEY_METRICS, NULL);
     
-out:
-    if (error_runs != job->error_runs) {
-        apr_status_t rv2 = save_job_props(wd->reg, job, ptemp);
-        ap_log_error(APLOG_MARK, APLOG_TRACE1, rv2, wd->s, "%s: saving job props", job->md->name);
+    rv = md_store_save_json(md_reg_store_get(wd->reg), ptemp, MD_SG_STAGING, 
+                            MD_STATUS_NAME, MD_FN_STATUS, json, 0);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, wd->s, APLOGNO(10143) "md watchdog: saving status");
     }
-
-    job->last_rv = rv;
-    return rv;
 }
 
 static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
@@ -796,7 +2080,7 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
     md_watchdog *wd = baton;
     apr_status_t rv = APR_SUCCESS;
     md_job_t *job;
-    apr_time_t next_run, now;
+    apr_time_t next_run, now, restart_at, ocsp_at;
     int restart = 0;
     int i;
     
@@ -805,10 +2089,29 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10054)
                          "md watchdog start, auto drive %d mds", wd->jobs->nelts);
             assert(wd->reg);
+            if (wd->mc->renew_lease > 0 && ext_lease) {
+                md_store_lease_impl_set(md_reg_store_get(wd->reg), ext_lease, ext_release, 
+                                        ext_lease_baton);
+            }
+            md_acme_authz_set_publisher(ext_publish? ext_cha_publish : NULL, NULL);
+            if (APR_SUCCESS != (rv = md_metrics_init(wd->p))) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10129)
+                             "md watchdog: metrics are not recorded");
+            }
         
             for (i = 0; i < wd->jobs->nelts; ++i) {
                 job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
                 load_job_props(wd->reg, job, ptemp);
+                if (!job->live_modified) {
+                    /* known responses for the certificates in place tell when to renew */
+                    md_store_t *store = md_reg_store_get(wd->reg);
+                    
+                    job->ocsp_due = md_ocsp_due(store, job->md->name, 
+                                                md_store_get_modified(store, MD_SG_DOMAINS, 
+                                                                      job->md->name, 
+                                                                      MD_FN_PUBCERT, ptemp),
+                                                ptemp);
+                }
             }
             break;
         case AP_WATCHDOG_STATE_RUNNING:
@@ -817,24 +2120,40 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10055)
                          "md watchdog run, auto drive %d mds", wd->jobs->nelts);
                          
+            check_due_jobs(wd, ptemp);
+            
             /* normally, we'd like to run at least twice a day */
             next_run = apr_time_now() + apr_time_from_sec(MD_SECS_PER_DAY / 2);
-
-            /* Check on all the jobs we have */
-            for (i = 0; i < wd->jobs->nelts; ++i) {
-                job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
-                
-                rv = check_job(wd, job, ptemp);
-
-                if (job->need_restart && !job->restart_processed) {
+            if (wd->schedule->nelts > 0 && SCHED_DUE(wd->schedule, 0) < next_run) {
+                next_run = SCHED_DUE(wd->schedule, 0);
+            }
+            
+            wd_gc_store(wd, ptemp);
+            if (0 != (ocsp_at = renew_ocsp(wd, ptemp)) && ocsp_at < next_run) {
+                next_run = ocsp_at;
+            }
+            log_wd_memory(wd);
+            
+            if (fill_keypool(wd, ptemp)) {
+                next_run = apr_time_now() + MD_KEYPOOL_FILL_DELAY;
+            }
+            
+            now = apr_time_now();
+            if (0 != (restart_at = restart_due(wd, now, ptemp))) {
+                if (restart_at <= now) {
                     restart = 1;
                 }
-                if (job->next_check && job->next_check < next_run) {
-                    next_run = job->next_check;
+                else {
+                    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, 
+                                 APLOGNO(10144) "md watchdog: restart batched, due in %s", 
+                                 md_print_duration(ptemp, restart_at - now));
+                    if (restart_at < next_run) {
+                        next_run = restart_at;
+                    }
                 }
             }
 
-            now = apr_time_now();
+            save_status(wd, ptemp);
             if (APLOGdebug(wd->s)) {
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10107)
                              "next run in %s", md_print_duration(ptemp, next_run - now));
@@ -852,8 +2171,8 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
         const char *action, *names = "";
         int n;
         
-        for (i = 0, n = 0; i < wd->jobs->nelts; ++i) {
-            job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        for (i = 0, n = 0; i < wd->restarts->nelts; ++i) {
+            job = APR_ARRAY_IDX(wd->restarts, i, md_job_t *);
             if (job->need_restart && !job->restart_processed) {
                 names = apr_psprintf(ptemp, "%s%s%s", names, n? " " : "", job->md->name);
                 ++n;
@@ -863,6 +2182,23 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
         if (n > 0) {
             int notified = 1;
 
+            if (live_activation_on(wd->mc)) {
+                /* children pick these up from staging via md_get_live_credentials() */
+                md_store_t *store = md_reg_store_get(wd->reg);
+                
+                for (i = 0; i < wd->restarts->nelts; ++i) {
+                    job = APR_ARRAY_IDX(wd->restarts, i, md_job_t *);
+                    if (job->need_restart && !job->restart_processed) {
+                        job->live_modified = md_store_get_modified(store, MD_SG_STAGING, 
+                                                                   job->md->name, 
+                                                                   MD_FN_PUBCERT, ptemp);
+                        /* staple for the new certificate as well */
+                        job->ocsp_due = 0;
+                        save_job_props(wd->reg, job, ptemp);
+                    }
+                }
+            }
+
             /* Run notify command for ready MDs (if configured) and persist that
              * we have done so. This process might be reaped after n requests or die
              * of another cause. The one taking over the watchdog need to notify again.
@@ -892,13 +2228,16 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
             
             if (notified) {
                 /* persist the jobs that were notified */
-                for (i = 0, n = 0; i < wd->jobs->nelts; ++i) {
-                    job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+                for (i = 0, n = 0; i < wd->restarts->nelts; ++i) {
+                    job = APR_ARRAY_IDX(wd->restarts, i, md_job_t *);
                     if (job->need_restart && !job->restart_processed) {
                         job->restart_processed = 1;
+                        job->restart_pending = 0;
                         save_job_props(wd->reg, job, ptemp);
                     }
+                    job->restart_queued = 0;
                 }
+                apr_array_clear(wd->restarts);
             }
             
             /* FIXME: the server needs to start gracefully to take the new certificate in.
@@ -909,8 +2248,12 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
              * - admins want better control of timing windows for restarts, e.g.
              *   during less busy hours/days.
              */
-            rv = md_server_graceful(ptemp, wd->s);
-            if (APR_ENOTIMPL == rv) {
+            if (live_activation_on(wd->mc)) {
+                action = " and the new certificates are handed to TLS modules for new"
+                         " connections. They are moved into place on the next (graceful)"
+                         " server restart.";
+            }
+            else if (APR_ENOTIMPL == (rv = md_server_graceful(ptemp, wd->s))) {
                 /* self-graceful restart not supported in this setup */
                 action = " and changes will be activated on next (graceful) server restart.";
             }
@@ -926,12 +2269,15 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
     return APR_SUCCESS;
 }
 
+/* After this many errored runs, staging starts over even if the staged data checks out */
+#define MD_STAGE_RESUME_MAX_ERRORS  3
+
 static apr_status_t start_watchdog(apr_array_header_t *names, apr_pool_t *p, 
                                    md_reg_t *reg, server_rec *s, md_mod_conf_t *mc)
 {
     apr_allocator_t *allocator;
     md_watchdog *wd;
-    apr_pool_t *wdp;
+    apr_pool_t *wdp, *jobp;
     apr_status_t rv;
     const char *name;
     md_t *md;
@@ -963,36 +2309,97 @@ static apr_status_t start_watchdog(apr_array_header_t *names, apr_pool_t *p,
     wd->reg = reg;
     wd->s = s;
     wd->mc = mc;
+    wd->lease_owner = mc->lease_owner;
+    if (!wd->lease_owner) {
+        char hostname[APRMAXHOSTLEN + 1];
+        
+        if (APR_SUCCESS == apr_gethostname(hostname, (int)sizeof(hostname), wd->p)) {
+            wd->lease_owner = apr_pstrdup(wd->p, hostname);
+        }
+        else {
+            wd->lease_owner = "localhost";
+        }
+    }
     
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&wd->mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                     wd->p))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10133) "md_watchdog: create mutex");
+        return rv;
+    }
+#endif
+    if (mc->renew_parallel > 1 && !md_reg_is_concurrent(reg)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(10137) 
+                     "MDRenewParallel %d is not supported by the store, renewals are "
+                     "driven one after the other", mc->renew_parallel);
+    }
     wd->jobs = apr_array_make(wd->p, 10, sizeof(md_job_t *));
+    wd->schedule = apr_array_make(wd->p, 10, sizeof(md_job_t *));
+    wd->restarts = apr_array_make(wd->p, 10, sizeof(md_job_t *));
     for (i = 0; i < names->nelts; ++i) {
         name = APR_ARRAY_IDX(names, i, const char *);
-        md = md_reg_get(wd->reg, name, wd->p);
-        if (md) {
-            md_reg_assess(wd->reg, md, &errored, &renew, wd->p);
+        if (APR_SUCCESS != apr_pool_create(&jobp, wd->p)) {
+            continue;
+        }
+        apr_pool_tag(jobp, "md_job");
+        md = md_reg_get(wd->reg, name, jobp);
+        if (!md) {
+            apr_pool_destroy(jobp);
+        }
+        else {
+            md_reg_assess(wd->reg, md, &errored, &renew, jobp);
             if (errored) {
                 ap_log_error( APLOG_MARK, APLOG_WARNING, 0, wd->s, APLOGNO(10063) 
                              "md(%s): seems errored. Will not process this any further.", name);
+                apr_pool_destroy(jobp);
             }
             else {
                 job = apr_pcalloc(wd->p, sizeof(*job));
                 
+                job->name = apr_pstrdup(wd->p, name);
+                job->p = jobp;
                 job->md = md;
+                if (APR_SUCCESS != apr_pool_create(&job->status_p, wd->p)) {
+                    apr_pool_destroy(jobp);
+                    continue;
+                }
+                apr_pool_tag(job->status_p, "md_job_status");
                 APR_ARRAY_PUSH(wd->jobs, md_job_t*) = job;
+                /* due right away */
+                schedule_push(wd->schedule, job);
 
                 ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10064) 
                              "md(%s): state=%d, driving", name, md->state);
                 
                 load_job_props(reg, job, wd->p);
                 if (job->error_runs) {
-                    /* We are just restarting. If we encounter jobs that had errors
-                     * running the protocol on previous staging runs, we reset
-                     * the staging area for it, in case we persisted something that
-                     * causes a loop. */
+                    /* We are just restarting. Jobs that had errors on previous 
+                     * staging runs continue from what they staged, unless that
+                     * is damaged or they failed too often. Then we reset the staging 
+                     * area for it, in case we persisted something that causes a loop,
+                     * which a check of the staged data may not see. */
                     md_store_t *store = md_reg_store_get(wd->reg);
                     
-                    md_store_purge(store, p, MD_SG_STAGING, job->md->name);
-                    md_store_purge(store, p, MD_SG_CHALLENGES, job->md->name);
+                    if (job->error_runs >= MD_STAGE_RESUME_MAX_ERRORS) {
+                        ap_log_error( APLOG_MARK, APLOG_NOTICE, 0, wd->s, APLOGNO(10147) 
+                                     "md(%s): %d errored runs, starting staging over", 
+                                     name, job->error_runs);
+                        md_store_purge(store, p, MD_SG_STAGING, job->md->name);
+                        md_store_purge(store, p, MD_SG_CHALLENGES, job->md->name);
+                    }
+                    else if (APR_SUCCESS == (rv = md_reg_stage_check(reg, job->md, p))
+                             || APR_STATUS_IS_ENOENT(rv)) {
+                        ap_log_error( APLOG_MARK, APLOG_DEBUG, rv, wd->s, APLOGNO(10135) 
+                                     "md(%s): resuming staging after %d errored runs", 
+                                     name, job->error_runs);
+                    }
+                    else {
+                        ap_log_error( APLOG_MARK, APLOG_NOTICE, rv, wd->s, APLOGNO(10136) 
+                                     "md(%s): staging area unusable, starting over", name);
+                        md_store_purge(store, p, MD_SG_STAGING, job->md->name);
+                        md_store_purge(store, p, MD_SG_CHALLENGES, job->md->name);
+                    }
+                    rv = APR_SUCCESS;
                 }
             }
         }
@@ -1021,14 +2428,29 @@ static void load_stage_sets(apr_array_header_t *names, apr_pool_t *p,
                             md_reg_t *reg, server_rec *s)
 {
     const char *name; 
+    apr_hash_t *staged;
     apr_status_t rv;
-    int i;
+    int i, pruned;
     
+    /* Only MDs listed in the registry's staged manifest have something to
+     * activate. Without a manifest, try them all. */
+    if (APR_SUCCESS != md_reg_get_staged(&staged, reg, p)) {
+        staged = NULL;
+    }
     for (i = 0; i < names->nelts; ++i) {
         name = APR_ARRAY_IDX(names, i, const char*);
+        if (staged && !apr_hash_get(staged, name, APR_HASH_KEY_STRING)) {
+            continue;
+        }
         if (APR_SUCCESS == (rv = md_reg_load(reg, name, p))) {
             ap_log_error( APLOG_MARK, APLOG_INFO, rv, s, APLOGNO(10068) 
                          "%s: staged set activated", name);
+            /* activation archived the old set, keep the archive short right away */
+            if (APR_SUCCESS != (rv = md_store_archive_prune(md_reg_store_get(reg), p, name, 
+                                                            MD_ARCHIVE_KEEP, &pruned))) {
+                ap_log_error( APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10138)
+                             "%s: pruning archive, %d old copies removed", name, pruned);
+            }
         }
         else if (!APR_STATUS_IS_ENOENT(rv)) {
             ap_log_error( APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10069)
@@ -1080,6 +2502,8 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
     (void)plog;
     init_setups(p, s);
     md_log_set(log_is_level, log_print, NULL);
+    /* without shared memory, nothing is counted */
+    md_counters_create(p, s);
 
     /* Check uniqueness of MDs, calculate global, configured MD list.
      * If successful, we have a list of MD definitions that do not overlap. */
@@ -1091,6 +2515,11 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
     md_config_post_config(s, p);
     sc = md_config_get(s);
     mc = sc->mc;
+    init_https_redirects(s, p);
+    md_acme_cache_ttl_set(mc->ca_cache);
+    md_acme_authz_set_dns01(mc->dns01_cmd, mc->dns01_wait);
+    md_acme_authz_set_preflight(mc->preflight);
+    md_curl_timeouts_set(mc->http_connect, mc->http_stall, mc->http_keepalive);
 
     /* Synchronize the definitions we now have with the store via a registry (reg). */
     if (APR_SUCCESS != (rv = setup_reg(&reg, p, s, mc->can_http, mc->can_https))) {
@@ -1151,6 +2580,8 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
         ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10075)
                      "no mds to auto drive, no watchdog needed");
     }
+    /* with the privileges to clean up what the watchdog cannot */
+    post_config_gc_store(md_reg_store_get(reg), s, ptemp);
     
 out:
     return rv;
@@ -1185,7 +2616,7 @@ static apr_status_t setup_fallback_cert(md_store_t *store, const md_t *md,
     spec.type = MD_PKEY_TYPE_RSA;
     spec.params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
     
-    if (   !MD_OK(md_pkey_gen(&pkey, p, &spec))
+    if (   !MD_OK(md_keypool_get(&pkey, store, &spec, p))
         || !MD_OK(md_store_save(store, p, MD_SG_DOMAINS, md->name, 
                                 MD_FN_FALLBACK_PKEY, MD_SV_PKEY, (void*)pkey, 0))
         || !MD_OK(md_cert_self_sign(&cert, "Apache Managed Domain Fallback", 
@@ -1246,8 +2677,8 @@ static apr_status_t md_get_certificate(server_rec *s, apr_pool_t *p,
     reg = sc->mc->reg;
     assert(reg);
     
-    md = md_reg_get(reg, sc->assigned->name, p);
-    if (!md) {
+    /* many vhosts may share the same MD, use the registry's view of it */
+    if (APR_SUCCESS != md_reg_get_view(&md, NULL, reg, sc->assigned->name, p)) {
         ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(10115) 
                      "unable to hand out certificates, as registry can no longer "
                      "find MD '%s'.", sc->assigned->name);
@@ -1280,6 +2711,7 @@ static apr_status_t md_get_certificate(server_rec *s, apr_pool_t *p,
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10116)  
                      "%s: providing fallback certificate for server %s", 
                      md->name, s->server_hostname);
+        md_counter_inc(MD_CTR_FALLBACK);
         return APR_EAGAIN;
     }
     
@@ -1294,15 +2726,14 @@ static apr_status_t md_get_certificate(server_rec *s, apr_pool_t *p,
     return rv;
 }
 
-static int compat_warned;
+static volatile apr_uint32_t compat_warned;
 static apr_status_t md_get_credentials(server_rec *s, apr_pool_t *p,
                                        const char **pkeyfile, 
                                        const char **pcertfile, 
                                        const char **pchainfile)
 {
     *pchainfile = NULL;
-    if (!compat_warned) {
-        compat_warned = 1;
+    if (apr_atomic_cas32(&compat_warned, 1, 0) == 0) {
         ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, /* no APLOGNO */
                      "You are using mod_md with an old patch to mod_ssl. This will "
                      " work for now, but support will be dropped in a future release.");
@@ -1342,15 +2773,39 @@ static int md_is_challenge(conn_rec *c, const char *servername,
             md_store_t *store = md_reg_store_get(sc->mc->reg);
             md_cert_t *mdcert;
             md_pkey_t *mdpkey;
+            const char *key = NULL;
+            apr_time_t modified = 0, start;
+            
+            if (cha_cache) {
+                key = apr_pstrcat(c->pool, cert_name, ":", servername, NULL);
+                modified = md_store_get_modified(store, MD_SG_CHALLENGES, servername, 
+                                                 cert_name, c->pool);
+                /* a challenge removed in the meantime has no modification time and
+                 * drops a cached entry as well */
+                if (cha_cache_tls_get(cha_cache, key, modified, &mdcert, &mdpkey, c->pool)) {
+                    *pcert = md_cert_get_X509(mdcert);
+                    *pkey = md_pkey_get_EVP_PKEY(mdpkey);
+                    md_counter_inc(MD_CTR_CHA_HIT);
+                    ap_log_cerror(APLOG_MARK, APLOG_INFO, 0, c, APLOGNO(10139)
+                                  "%s: is a %s challenge host (cached)", servername, cha_type);
+                    return 1;
+                }
+            }
             
             ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, c, "%s: load certs/keys %s/%s",
                           servername, cert_name, pkey_name);
+            start = apr_time_now();
             rv = md_store_load(store, MD_SG_CHALLENGES, servername, cert_name, 
                                MD_SV_CERT, (void**)&mdcert, c->pool);
             if (APR_SUCCESS == rv && (*pcert = md_cert_get_X509(mdcert))) {
                 rv = md_store_load(store, MD_SG_CHALLENGES, servername, pkey_name, 
                                    MD_SV_PKEY, (void**)&mdpkey, c->pool);
+                md_counter_load(apr_time_now() - start);
                 if (APR_SUCCESS == rv && (*pkey = md_pkey_get_EVP_PKEY(mdpkey))) {
+                    if (key && modified) {
+                        cha_cache_tls_put(cha_cache, key, mdcert, mdpkey, modified);
+                    }
+                    md_counter_inc(MD_CTR_CHA_HIT);
                     ap_log_cerror(APLOG_MARK, APLOG_INFO, 0, c, APLOGNO(10078)
                                   "%s: is a %s challenge host", servername, cha_type);
                     return 1;
@@ -1359,9 +2814,11 @@ static int md_is_challenge(conn_rec *c, const char *servername,
                               "%s: challenge data not complete, key unavailable", servername);
             }
             else {
+                md_counter_load(apr_time_now() - start);
                 ap_log_cerror(APLOG_MARK, APLOG_INFO, rv, c, APLOGNO(10080)
                               "%s: unknown %s challenge host", servername, cha_type);
             }
+            md_counter_inc(MD_CTR_CHA_MISS);
         }
     }
 out:
@@ -1370,6 +2827,421 @@ out:
     return 0;
 }
 
+/**************************************************************************************************/
+/* live credentials */
+
+/* With MDLiveActivation, the watchdog does not restart the server for renewed certificates,
+ * it records the modification time of the pubcert in the job.json in staging. Children load
+ * certificates and key from there for TLS modules calling md_get_live_credentials(). What
+ * a child loaded is kept per MD and checked against the store at most every 
+ * MD_LIVE_CHECK_INTERVAL. */
+
+#define MD_LIVE_CHECK_INTERVAL   apr_time_from_sec(5)
+
+typedef struct {
+    apr_pool_t *p;                     /* pool owning this entry */
+    apr_time_t checked;                /* when the store was last looked at */
+    apr_time_t modified;               /* modification time of the live pubcert, 0 if none */
+    apr_array_header_t *certs;         /* md_cert_t* of pubcert, leaf first */
+    md_pkey_t *pkey;
+} md_live_entry_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *entries;               /* md name -> md_live_entry_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} md_live_cache_t;
+
+static md_live_cache_t *live_cache;
+
+static apr_status_t live_cache_create(md_live_cache_t **pcache, apr_pool_t *p)
+{
+    md_live_cache_t *cache;
+    apr_status_t rv = APR_SUCCESS;
+
+    cache = apr_pcalloc(p, sizeof(*cache));
+    cache->p = p;
+    cache->entries = apr_hash_make(p);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    *pcache = (APR_SUCCESS == rv)? cache : NULL;
+    return rv;
+}
+
+/* The pubcert in staging is live when the watchdog recorded it and it is unchanged since */
+static apr_time_t live_modified_get(md_store_t *store, const char *name, apr_pool_t *p)
+{
+    md_json_t *jprops;
+    apr_time_t live, modified;
+    
+    if (APR_SUCCESS != md_store_load_json(store, MD_SG_STAGING, name, MD_FN_JOB, &jprops, p)
+        || 0 == (live = apr_time_from_sec(md_json_getl(jprops, MD_KEY_LIVE, NULL)))) {
+        return 0;
+    }
+    modified = md_store_get_modified(store, MD_SG_STAGING, name, MD_FN_PUBCERT, p);
+    return (apr_time_sec(modified) == apr_time_sec(live))? modified : 0;
+}
+
+static int live_entry_load(md_live_entry_t *e, md_store_t *store, const char *name)
+{
+    md_cert_t *cert;
+    
+    if (APR_SUCCESS == md_pubcert_load(store, MD_SG_STAGING, name, &e->certs, e->p)
+        && APR_SUCCESS == md_pkey_load(store, MD_SG_STAGING, name, &e->pkey, e->p)
+        && e->certs->nelts > 0) {
+        cert = APR_ARRAY_IDX(e->certs, 0, md_cert_t *);
+        if (md_cert_is_valid_now(cert)
+            && X509_check_private_key(md_cert_get_X509(cert), md_pkey_get_EVP_PKEY(e->pkey))) {
+            return 1;
+        }
+    }
+    e->certs = NULL;
+    e->pkey = NULL;
+    return 0;
+}
+
+static apr_status_t live_cache_get(md_live_cache_t *cache, md_store_t *store, const char *name,
+                                   md_cert_t **pcert, apr_array_header_t **pchain, 
+                                   md_pkey_t **ppkey, apr_pool_t *p)
+{
+    md_live_entry_t *e;
+    apr_time_t now = apr_time_now(), modified;
+    apr_pool_t *ep;
+    md_cert_t *cert;
+    X509 *x509;
+    apr_status_t rv = APR_ENOENT;
+    int i;
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+    e = apr_hash_get(cache->entries, name, APR_HASH_KEY_STRING);
+    if (!e || now >= e->checked + MD_LIVE_CHECK_INTERVAL) {
+        modified = live_modified_get(store, name, p);
+        if (e && e->modified != modified) {
+            apr_hash_set(cache->entries, name, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(e->p);
+            e = NULL;
+        }
+        if (!e && APR_SUCCESS == apr_pool_create(&ep, cache->p)) {
+            apr_pool_tag(ep, "md_live_cache");
+            e = apr_pcalloc(ep, sizeof(*e));
+            e->p = ep;
+            e->modified = modified;
+            if (modified && !live_entry_load(e, store, name)) {
+                ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, APLOGNO(10124) 
+                              "%s: live certificate in staging is not usable", name);
+            }
+            apr_hash_set(cache->entries, apr_pstrdup(ep, name), APR_HASH_KEY_STRING, e);
+        }
+        if (e) {
+            e->checked = now;
+        }
+    }
+    if (e && e->certs) {
+        *pcert = md_cert_share(APR_ARRAY_IDX(e->certs, 0, md_cert_t *), p);
+        *ppkey = md_pkey_share(e->pkey, p);
+        *pchain = apr_array_make(p, 5, sizeof(X509 *));
+        for (i = 1; i < e->certs->nelts; ++i) {
+            if ((cert = md_cert_share(APR_ARRAY_IDX(e->certs, i, md_cert_t *), p))
+                && (x509 = md_cert_get_X509(cert))) {
+                APR_ARRAY_PUSH(*pchain, X509 *) = x509;
+            }
+        }
+        rv = (*pcert && *ppkey)? APR_SUCCESS : APR_ENOENT;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+    return rv;
+}
+
+static apr_status_t md_get_live_credentials(server_rec *s, apr_pool_t *p, X509 **pcert, 
+                                            apr_array_header_t **pchain, EVP_PKEY **pkey)
+{
+    md_srv_conf_t *sc = md_config_get(s);
+    const char *name = md_config_get_md_name(sc);
+    md_cert_t *cert;
+    md_pkey_t *mdpkey;
+    
+    *pcert = NULL;
+    *pchain = NULL;
+    *pkey = NULL;
+    if (!live_cache || !name || !sc->mc->reg || !sc->mc->live_activation
+        || APR_SUCCESS != live_cache_get(live_cache, md_reg_store_get(sc->mc->reg), 
+                                         name, &cert, pchain, &mdpkey, p)) {
+        return APR_ENOENT;
+    }
+    *pcert = md_cert_get_X509(cert);
+    *pkey = md_pkey_get_EVP_PKEY(mdpkey);
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* OCSP stapling */
+
+/* The OCSP responses the watchdog keeps in the store are loaded per MD into the child
+ * and checked for changes at most every MD_OCSP_CHECK_INTERVAL. */
+
+#define MD_OCSP_CHECK_INTERVAL   apr_time_from_sec(5)
+
+typedef struct {
+    apr_pool_t *p;                     /* pool owning this entry */
+    apr_time_t checked;                /* when the store was last looked at */
+    apr_time_t modified;               /* modification time of the responses, 0 if none */
+    apr_array_header_t *resps;         /* md_ocsp_resp_t*, or NULL */
+} md_ocsp_entry_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *entries;               /* md name -> md_ocsp_entry_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} md_ocsp_cache_t;
+
+static md_ocsp_cache_t *ocsp_cache;
+
+static apr_status_t ocsp_cache_create(md_ocsp_cache_t **pcache, apr_pool_t *p)
+{
+    md_ocsp_cache_t *cache;
+    apr_status_t rv = APR_SUCCESS;
+
+    cache = apr_pcalloc(p, sizeof(*cache));
+    cache->p = p;
+    cache->entries = apr_hash_make(p);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    *pcache = (APR_SUCCESS == rv)? cache : NULL;
+    return rv;
+}
+
+static apr_status_t ocsp_cache_get(md_ocsp_cache_t *cache, md_store_t *store, const char *name,
+                                   X509 *x509, const unsigned char **pder, apr_size_t *pder_len, 
+                                   apr_pool_t *p)
+{
+    md_ocsp_entry_t *e;
+    const md_ocsp_resp_t *resp;
+    apr_time_t now = apr_time_now(), modified;
+    apr_pool_t *ep;
+    apr_status_t rv = APR_ENOENT;
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+    e = apr_hash_get(cache->entries, name, APR_HASH_KEY_STRING);
+    if (!e || now >= e->checked + MD_OCSP_CHECK_INTERVAL) {
+        modified = md_store_get_modified(store, MD_SG_OCSP, name, MD_FN_OCSP, p);
+        if (e && e->modified != modified) {
+            apr_hash_set(cache->entries, name, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(e->p);
+            e = NULL;
+        }
+        if (!e && APR_SUCCESS == apr_pool_create(&ep, cache->p)) {
+            apr_pool_tag(ep, "md_ocsp_cache");
+            e = apr_pcalloc(ep, sizeof(*e));
+            e->p = ep;
+            e->modified = modified;
+            if (modified) {
+                md_ocsp_load(&e->resps, store, name, ep);
+            }
+            apr_hash_set(cache->entries, apr_pstrdup(ep, name), APR_HASH_KEY_STRING, e);
+        }
+        if (e) {
+            e->checked = now;
+        }
+    }
+    if (e && e->resps && (resp = md_ocsp_find(e->resps, x509, p))) {
+        *pder = apr_pmemdup(p, resp->der, resp->der_len);
+        *pder_len = resp->der_len;
+        rv = APR_SUCCESS;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+    return rv;
+}
+
+static apr_status_t md_get_ocsp_response(server_rec *s, X509 *cert, apr_pool_t *p,
+                                         const unsigned char **pder, apr_size_t *pder_len)
+{
+    md_srv_conf_t *sc = md_config_get(s);
+    const char *name = md_config_get_md_name(sc);
+    
+    *pder = NULL;
+    *pder_len = 0;
+    if (!ocsp_cache || !cert || !name || !sc->mc->reg) {
+        return APR_ENOENT;
+    }
+    return ocsp_cache_get(ocsp_cache, md_reg_store_get(sc->mc->reg), name, 
+                          cert, pder, pder_len, p);
+}
+
+/**************************************************************************************************/
+/* status */
+
+/* What the watchdog last wrote with save_status() is served by the "md-status" handler 
+ * as JSON and shown on the mod_status page. */
+
+static apr_status_t status_load(md_json_t **pjson, request_rec *r)
+{
+    const md_srv_conf_t *sc;
+    apr_status_t rv;
+    
+    sc = ap_get_module_config(r->server->module_config, &md_module);
+    if (!sc || !sc->mc || !sc->mc->reg) {
+        return APR_ENOENT;
+    }
+    rv = md_store_load_json(md_reg_store_get(sc->mc->reg), MD_SG_STAGING, 
+                            MD_STATUS_NAME, MD_FN_STATUS, pjson, r->pool);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        /* the watchdog has not run yet or has nothing to do */
+        *pjson = md_json_create(r->pool);
+        rv = APR_SUCCESS;
+    }
+    return rv;
+}
+
+static int md_status_handler(request_rec *r)
+{
+    md_json_t *json;
+    apr_status_t rv;
+    
+    if (!r->handler || strcmp(r->handler, "md-status")) {
+        return DECLINED;
+    }
+    r->allowed |= (AP_METHOD_BIT << M_GET);
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if (APR_SUCCESS != (rv = status_load(&json, r))) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10130) "loading md status");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    /* the counters are kept by all processes, not only the watchdog */
+    md_json_setj(md_counters_to_json(r->pool), json, MD_KEY_COUNTERS, NULL);
+    ap_set_content_type(r, "application/json");
+    if (!r->header_only) {
+        ap_rputs(md_json_writep(json, r->pool, MD_JSON_FMT_INDENT), r);
+    }
+    return OK;
+}
+
+typedef struct {
+    request_rec *r;
+    int flags;
+    const char *group;
+} status_ctx;
+
+static const char *status_gets(md_json_t *json, const char *key1, const char *key2)
+{
+    const char *s = md_json_gets(json, key1, key2, NULL);
+    return s? s : "-";
+}
+
+static int status_job(void *baton, size_t index, md_json_t *json)
+{
+    status_ctx *ctx = baton;
+    request_rec *r = ctx->r;
+    const char *name = status_gets(json, MD_KEY_NAME, NULL);
+    
+    if (ctx->flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "ManagedDomain%d: %s state=%ld errors=%ld last-status=%ld\n", 
+                   (int)index, name, md_json_getl(json, MD_KEY_STATE, NULL),
+                   md_json_getl(json, MD_KEY_ERRORS, NULL),
+                   md_json_getl(json, MD_KEY_LAST, MD_KEY_STATUS, NULL));
+    }
+    else {
+        ap_rprintf(r, "<tr><td>%s</td><td>%ld</td><td>%s</td><td>%s</td><td>%ld</td>"
+                   "<td>%s</td></tr>\n", ap_escape_html(r->pool, name), 
+                   md_json_getl(json, MD_KEY_STATE, NULL),
+                   status_gets(json, MD_KEY_EXPIRES, NULL), 
+                   status_gets(json, MD_KEY_NEXT_CHECK, NULL),
+                   md_json_getl(json, MD_KEY_ERRORS, NULL),
+                   ap_escape_html(r->pool, status_gets(json, MD_KEY_LAST, MD_KEY_MESSAGE)));
+    }
+    return 1;
+}
+
+static int status_metric(void *baton, const char *name, md_json_t *json)
+{
+    status_ctx *ctx = baton;
+    request_rec *r = ctx->r;
+    long count = md_json_getl(json, MD_KEY_COUNT, NULL);
+    
+    ap_rprintf(r, "<tr><td>%s</td><td>%s</td><td>%ld</td><td>%ld</td><td>%ld</td>"
+               "<td>%ld</td></tr>\n", ctx->group, ap_escape_html(r->pool, name), count,
+               md_json_getl(json, MD_KEY_ERRORS, NULL), 
+               count? md_json_getl(json, MD_KEY_TOTAL_MS, NULL) / count : 0,
+               md_json_getl(json, MD_KEY_MAX_MS, NULL));
+    return 1;
+}
+
+static int status_metric_group(void *baton, const char *group, md_json_t *json)
+{
+    status_ctx *ctx = baton;
+    
+    ctx->group = group;
+    md_json_iterkey(status_metric, ctx, json, NULL);
+    return 1;
+}
+
+static int status_counter(void *baton, const char *name, md_json_t *json)
+{
+    status_ctx *ctx = baton;
+    
+    if (!ctx->group && !strcmp(MD_CTR_KEY_LOADS, name)) {
+        ctx->group = MD_CTR_KEY_LOADS;
+        md_json_iterkey(status_counter, ctx, json, NULL);
+        ctx->group = NULL;
+    }
+    else {
+        ap_rprintf(ctx->r, "<tr><td>%s%s%s</td><td>%ld</td></tr>\n", 
+                   ctx->group? ctx->group : "", ctx->group? " " : "", 
+                   ap_escape_html(ctx->r->pool, name), md_json_getl(json, NULL));
+    }
+    return 1;
+}
+
+static int md_status_hook(request_rec *r, int flags)
+{
+    md_json_t *json;
+    status_ctx ctx;
+    
+    if (APR_SUCCESS != status_load(&json, r) || !md_json_has_key(json, MD_KEY_JOBS, NULL)) {
+        return OK;
+    }
+    ctx.r = r;
+    ctx.flags = flags;
+    ctx.group = NULL;
+    if (flags & AP_STATUS_SHORT) {
+        md_json_itera(status_job, &ctx, json, MD_KEY_JOBS, NULL);
+        return OK;
+    }
+    
+    ap_rputs("<hr>\n<h2>Managed Domains</h2>\n", r);
+    ap_rprintf(r, "<p>As of %s</p>\n", status_gets(json, MD_KEY_MODIFIED, NULL));
+    ap_rputs("<table border=\"1\"><tr><th>Domain</th><th>State</th><th>Expires</th>"
+             "<th>Next Check</th><th>Errors</th><th>Last Error</th></tr>\n", r);
+    md_json_itera(status_job, &ctx, json, MD_KEY_JOBS, NULL);
+    ap_rputs("</table>\n", r);
+    
+    ap_rputs("<table border=\"1\"><tr><th>Group</th><th>Operation</th><th>Count</th>"
+             "<th>Errors</th><th>Avg ms</th><th>Max ms</th></tr>\n", r);
+    md_json_iterkey(status_metric_group, &ctx, json, MD_KEY_METRICS, NULL);
+    ap_rputs("</table>\n", r);
+    
+    ap_rputs("<table border=\"1\"><tr><th>Counter</th><th>Value</th></tr>\n", r);
+    ctx.group = NULL;
+    md_json_iterkey(status_counter, &ctx, md_counters_to_json(r->pool), NULL);
+    ap_rputs("</table>\n", r);
+    return OK;
+}
+
 /**************************************************************************************************/
 /* ACME challenge responses */
 
@@ -1392,20 +3264,38 @@ static int md_http_challenge_pr(request_rec *r)
             ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, 
                           "access inside /.well-known/acme-challenge for %s%s", 
                           r->hostname, r->parsed_uri.path);
-            configured = (NULL != md_get_by_domain(sc->mc->mds, r->hostname));
+            configured = (sc->mc->mds_index
+                          && NULL != md_index_get_by_domain(sc->mc->mds_index, r->hostname));
             name = r->parsed_uri.path + sizeof(ACME_CHALLENGE_PREFIX)-1;
             reg = sc && sc->mc? sc->mc->reg : NULL;
             
             if (strlen(name) && !ap_strchr_c(name, '/') && reg) {
                 md_store_t *store = md_reg_store_get(reg);
+                apr_size_t len;
                 
-                rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname, 
-                                   MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, 
-                              "loading challenge for %s (%s)", r->hostname, r->uri);
-                if (APR_SUCCESS == rv) {
-                    apr_size_t len = strlen(data);
+                if (cha_cache && cha_cache_get(cha_cache, r->hostname, name, 
+                                               &data, &len, r->pool)) {
+                    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, 
+                                  "challenge for %s (%s) from cache", r->hostname, r->uri);
+                    rv = APR_SUCCESS;
+                }
+                else {
+                    apr_time_t start = apr_time_now();
                     
+                    rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname, 
+                                       MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
+                    md_counter_load(apr_time_now() - start);
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, 
+                                  APLOGNO(10145) "loading challenge for %s (%s)", r->hostname, r->uri);
+                    if (APR_SUCCESS == rv) {
+                        len = strlen(data);
+                        if (cha_cache && cha_data_matches(data, name)) {
+                            cha_cache_put(cha_cache, r->hostname, name, data);
+                        }
+                    }
+                }
+                if (APR_SUCCESS == rv) {
+                    md_counter_inc(MD_CTR_CHA_HIT);
                     if (r->method_number != M_GET) {
                         return HTTP_NOT_IMPLEMENTED;
                     }
@@ -1426,9 +3316,11 @@ static int md_http_challenge_pr(request_rec *r)
                      * the sole authority here for /.well-known/acme-challenge (see PR62189).
                      * So, we decline to handle this and let others step in.
                      */
+                    md_counter_inc(MD_CTR_CHA_DECLINE);
                     return DECLINED;
                 }
                 else if (APR_STATUS_IS_ENOENT(rv)) {
+                    md_counter_inc(MD_CTR_CHA_MISS);
                     return HTTP_NOT_FOUND;
                 }
                 else {
@@ -1448,49 +3340,51 @@ static int md_http_challenge_pr(request_rec *r)
 static int md_require_https_maybe(request_rec *r)
 {
     const md_srv_conf_t *sc;
-    apr_uri_t uri;
-    const char *s;
+    const char *s, *prefix;
     int status;
     
-    if (opt_ssl_is_https && r->parsed_uri.path
+    if (https_required && opt_ssl_is_https && r->parsed_uri.path
         && strncmp(WELL_KNOWN_PREFIX, r->parsed_uri.path, sizeof(WELL_KNOWN_PREFIX)-1)) {
         
         sc = ap_get_module_config(r->server->module_config, &md_module);
-        if (sc && sc->assigned && sc->assigned->require_https > MD_REQUIRE_OFF) {
+        if (sc && sc->https_prefix) {
             if (opt_ssl_is_https(r->connection)) {
                 /* Using https:
                  * if 'permanent' and no one else set a HSTS header already, do it */
-                if (sc->assigned->require_https == MD_REQUIRE_PERMANENT 
-                    && sc->mc->hsts_header && !apr_table_get(r->headers_out, MD_HSTS_HEADER)) {
-                    apr_table_setn(r->headers_out, MD_HSTS_HEADER, sc->mc->hsts_header);
+                if (sc->https_hsts && !apr_table_get(r->headers_out, MD_HSTS_HEADER)) {
+                    apr_table_setn(r->headers_out, MD_HSTS_HEADER, sc->https_hsts);
                 }
             }
             else {
                 /* Not using https:, but require it. Redirect. */
                 if (r->method_number == M_GET) {
                     /* safe to use the old-fashioned codes */
-                    status = ((MD_REQUIRE_PERMANENT == sc->assigned->require_https)? 
+                    status = ((MD_REQUIRE_PERMANENT == md_config_get_md(sc)->require_https)? 
                               HTTP_MOVED_PERMANENTLY : HTTP_MOVED_TEMPORARILY);
                 }
                 else {
                     /* these should keep the method unchanged on retry */
-                    status = ((MD_REQUIRE_PERMANENT == sc->assigned->require_https)? 
+                    status = ((MD_REQUIRE_PERMANENT == md_config_get_md(sc)->require_https)? 
                               HTTP_PERMANENT_REDIRECT : HTTP_TEMPORARY_REDIRECT);
                 }
                 
-                s = ap_construct_url(r->pool, r->uri, r);
-                if (APR_SUCCESS == apr_uri_parse(r->pool, s, &uri)) {
-                    uri.scheme = (char*)"https";
-                    uri.port = 443;
-                    uri.port_str = (char*)"443";
-                    uri.query = r->parsed_uri.query;
-                    uri.fragment = r->parsed_uri.fragment;
-                    s = apr_uri_unparse(r->pool, &uri, APR_URI_UNP_OMITUSERINFO);
-                    if (s && *s) {
-                        apr_table_setn(r->headers_out, "Location", s);
-                        return status;
-                    }
+                /* The host is the one ap_construct_url() would use. Mostly, that
+                 * is the server name and the prefix is ready. */
+                s = ap_get_server_name(r);
+                if (s && r->server->server_hostname && !strcmp(s, r->server->server_hostname)) {
+                    prefix = sc->https_prefix;
+                }
+                else {
+                    prefix = https_prefix(r->pool, s);
                 }
+                s = apr_pstrcat(r->pool, prefix, r->uri, 
+                                r->parsed_uri.query? "?" : "", 
+                                r->parsed_uri.query? r->parsed_uri.query : "",
+                                r->parsed_uri.fragment? "#" : "", 
+                                r->parsed_uri.fragment? r->parsed_uri.fragment : "", NULL);
+                apr_table_setn(r->headers_out, "Location", s);
+                md_counter_inc(MD_CTR_HTTPS_REDIRECT);
+                return status;
             }
         }
     }
@@ -1502,8 +3396,21 @@ static int md_require_https_maybe(request_rec *r)
  */
 static void md_child_init(apr_pool_t *pool, server_rec *s)
 {
-    (void)pool;
-    (void)s;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = cha_cache_create(&cha_cache, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10117)
+                     "creating challenge cache, serving challenges from store only");
+    }
+    if (APR_SUCCESS != (rv = live_cache_create(&live_cache, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10125)
+                     "creating live credentials cache, renewed certificates need a restart");
+    }
+    md_counters_child_init(pool);
+    if (APR_SUCCESS != (rv = ocsp_cache_create(&ocsp_cache, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10128)
+                     "creating OCSP response cache, no responses for stapling");
+    }
 }
 
 /* Install this module into the apache2 infrastructure.
@@ -1533,9 +3440,17 @@ static void md_hooks(apr_pool_t *pool)
     ap_hook_protocol_switch(md_protocol_switch, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_protocol_get(md_protocol_get, NULL, NULL, APR_HOOK_MIDDLE);
 
+    ap_hook_handler(md_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, md_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
+
     APR_REGISTER_OPTIONAL_FN(md_is_managed);
     APR_REGISTER_OPTIONAL_FN(md_get_certificate);
     APR_REGISTER_OPTIONAL_FN(md_is_challenge);
     APR_REGISTER_OPTIONAL_FN(md_get_credentials);
+    APR_REGISTER_OPTIONAL_FN(md_get_live_credentials);
+    APR_REGISTER_OPTIONAL_FN(md_use_live_credentials);
+    APR_REGISTER_OPTIONAL_FN(md_get_ocsp_response);
+    APR_REGISTER_OPTIONAL_FN(md_set_lease_impl);
+    APR_REGISTER_OPTIONAL_FN(md_set_challenge_publisher);
 }
 
@@ -21,6 +21,7 @@
 #include <openssl/x509v3.h>
 
 struct server_rec;
+struct apr_array_header_t;
 
 APR_DECLARE_OPTIONAL_FN(int, 
                         md_is_managed, (struct server_rec *));
@@ -39,6 +40,82 @@ APR_DECLARE_OPTIONAL_FN(int,
                         md_is_challenge, (struct conn_rec *, const char *,
                                           X509 **pcert, EVP_PKEY **pkey));
 
+/**
+ * Get the renewed certificate, its chain (an array of X509*, maybe empty) and key 
+ * for the managed domain of the server, when they have been activated live 
+ * ("MDLiveActivation on") and the server has not been restarted since. A TLS module
+ * may call this during the handshake, e.g. on SNI, and switch to these instead of
+ * the files from md_get_certificate. The objects are valid for the lifetime of p.
+ *
+ * @return APR_ENOENT if there is nothing to switch to
+ */
+APR_DECLARE_OPTIONAL_FN(apr_status_t, 
+                        md_get_live_credentials, (struct server_rec *, apr_pool_t *,
+                                                  X509 **pcert, 
+                                                  struct apr_array_header_t **pchain, 
+                                                  EVP_PKEY **pkey));
+
+/**
+ * A TLS module that calls md_get_live_credentials announces so with this, before the 
+ * server forks its children, e.g. in the post_config hook. Only then does 
+ * "MDLiveActivation on" skip the graceful restart after a renewal, without such 
+ * a module the server restarts as usual.
+ */
+APR_DECLARE_OPTIONAL_FN(void, md_use_live_credentials, (void));
+
+/**
+ * Get the DER encoded OCSP response for the certificate, an X509 of the managed domain
+ * of the server, for stapling in the handshake. Responses are fetched by the watchdog
+ * ahead of time, this never waits for the OCSP responder. The response is allocated 
+ * from p.
+ *
+ * @return APR_ENOENT if there is no valid response for the certificate
+ */
+APR_DECLARE_OPTIONAL_FN(apr_status_t, 
+                        md_get_ocsp_response, (struct server_rec *, X509 *cert, apr_pool_t *,
+                                               const unsigned char **pder, 
+                                               apr_size_t *pder_len));
+
+/**
+ * Leases of an external coordinator for servers sharing the store, used with
+ * "MDRenewLease" instead of the lease files in the store. The lease on name is
+ * taken or extended for owner for the given duration.
+ *
+ * @return APR_SUCCESS when owner holds the lease, APR_EAGAIN when someone else does
+ */
+typedef apr_status_t md_lease_fn(void *baton, apr_pool_t *p, const char *name, 
+                                 const char *owner, apr_interval_time_t duration);
+typedef apr_status_t md_release_fn(void *baton, apr_pool_t *p, const char *name, 
+                                   const char *owner);
+
+/**
+ * Install the leases of an external coordinator. Call it before the server forks
+ * its children, e.g. in the post_config hook.
+ */
+APR_DECLARE_OPTIONAL_FN(void, 
+                        md_set_lease_impl, (md_lease_fn *lease, md_release_fn *release, 
+                                            void *baton));
+
+/**
+ * A publisher of challenge data for servers sharing the store, e.g. behind a load
+ * balancer. It is called when the data for challenge cha_type ("http-01", "tls-alpn-01",
+ * "dns-01") of domain name has been written to the store, before the CA is asked to 
+ * validate it.
+ *
+ * @return APR_SUCCESS once the data is visible wherever validation requests may arrive,
+ *         on other values validation is not requested and tried again later
+ */
+typedef apr_status_t md_publish_challenge_fn(void *baton, apr_pool_t *p, 
+                                             const char *cha_type, const char *name);
+
+/**
+ * Install a publisher of challenge data. Call it before the server forks its 
+ * children, e.g. in the post_config hook.
+ */
+APR_DECLARE_OPTIONAL_FN(void, 
+                        md_set_challenge_publisher, (md_publish_challenge_fn *publish, 
+                                                     void *baton));
+
 /* Backward compatibility to older mod_ssl patches, will generate
  * a WARNING in the logs, use 'md_get_certificate' instead */
 APR_DECLARE_OPTIONAL_FN(apr_status_t, 
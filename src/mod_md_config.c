@@ -17,6 +17,7 @@
 #include <assert.h>
 
 #include <apr_lib.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
 
 #include <httpd.h>
@@ -38,9 +39,14 @@
 #define MD_CMD_BASE_SERVER    "MDBaseServer"
 #define MD_CMD_CA             "MDCertificateAuthority"
 #define MD_CMD_CAAGREEMENT    "MDCertificateAgreement"
+#define MD_CMD_CACACHE        "MDCACache"
 #define MD_CMD_CACHALLENGES   "MDCAChallenges"
 #define MD_CMD_CAPROTO        "MDCertificateProtocol"
+#define MD_CMD_DNS01CMD       "MDChallengeDns01"
+#define MD_CMD_PREFLIGHT      "MDChallengePreflight"
 #define MD_CMD_DRIVEMODE      "MDDriveMode"
+#define MD_CMD_HTTPTIMEOUTS   "MDHttpTimeouts"
+#define MD_CMD_LIVEACTIVATION "MDLiveActivation"
 #define MD_CMD_MEMBER         "MDMember"
 #define MD_CMD_MEMBERS        "MDMembers"
 #define MD_CMD_MUSTSTAPLE     "MDMustStaple"
@@ -48,12 +54,20 @@
 #define MD_CMD_PORTMAP        "MDPortMap"
 #define MD_CMD_PKEYS          "MDPrivateKeys"
 #define MD_CMD_PROXY          "MDHttpProxy"
+#define MD_CMD_RENEWBUDGET    "MDRenewBudget"
+#define MD_CMD_RENEWLEASE     "MDRenewLease"
+#define MD_CMD_RENEWPARALLEL  "MDRenewParallel"
+#define MD_CMD_RENEWSPREAD    "MDRenewSpread"
 #define MD_CMD_RENEWWINDOW    "MDRenewWindow"
 #define MD_CMD_REQUIREHTTPS   "MDRequireHttps"
+#define MD_CMD_RESTARTBATCH   "MDRestartBatch"
 #define MD_CMD_STOREDIR       "MDStoreDir"
+#define MD_CMD_STORESYNC      "MDStoreSync"
 
 #define DEF_VAL     (-1)
 
+#define MD_RENEW_PARALLEL_MAX  64
+
 /* Default settings for the global conf */
 static md_mod_conf_t defmc = {
     NULL,
@@ -69,6 +83,27 @@ static md_mod_conf_t defmc = {
     NULL,
     NULL,
     NULL,
+    NULL,
+    1,
+    0,
+    0,
+    0,
+    0,
+    NULL,
+    0,
+    0,
+    apr_time_from_sec(MD_SECS_PER_HOUR),
+    apr_time_from_sec(MD_SECS_PER_HOUR),
+    NULL,
+    apr_time_from_sec(30),
+    apr_time_from_sec(30),
+    apr_time_from_sec(60),
+    apr_time_from_sec(60),
+    0,
+    0,
+    NULL,
+    0,
+    NULL,
 };
 
 /* Default server specific setting */
@@ -90,6 +125,9 @@ static md_srv_conf_t defconf = {
     NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
+    -1,
 };
 
 static md_mod_conf_t *mod_md_config;
@@ -174,6 +212,7 @@ void *md_config_create_svr(apr_pool_t *pool, server_rec *s)
     conf->name = apr_pstrcat(pool, "srv[", CONF_S_NAME(s), "]", NULL);
     conf->s = s;
     conf->mc = md_mod_conf_get(pool, 1);
+    conf->md_idx = -1;
 
     srv_conf_props_clear(conf);
     
@@ -185,10 +224,11 @@ static void *md_config_merge(apr_pool_t *pool, void *basev, void *addv)
     md_srv_conf_t *base = (md_srv_conf_t *)basev;
     md_srv_conf_t *add = (md_srv_conf_t *)addv;
     md_srv_conf_t *nsc;
-    char *name = apr_pstrcat(pool, "[", CONF_S_NAME(add->s), ", ", CONF_S_NAME(base->s), "]", NULL);
     
+    /* With many vhosts there are as many merges. Settings are shared, not copied, 
+     * they do not change once the configuration is read. */
     nsc = (md_srv_conf_t *)apr_pcalloc(pool, sizeof(md_srv_conf_t));
-    nsc->name = name;
+    nsc->name = add->name;
     nsc->mc = add->mc? add->mc : base->mc;
     nsc->assigned = add->assigned? add->assigned : base->assigned;
 
@@ -203,10 +243,12 @@ static void *md_config_merge(apr_pool_t *pool, void *basev, void *addv)
     nsc->ca_url = add->ca_url? add->ca_url : base->ca_url;
     nsc->ca_proto = add->ca_proto? add->ca_proto : base->ca_proto;
     nsc->ca_agreement = add->ca_agreement? add->ca_agreement : base->ca_agreement;
-    nsc->ca_challenges = (add->ca_challenges? apr_array_copy(pool, add->ca_challenges) 
-                    : (base->ca_challenges? apr_array_copy(pool, base->ca_challenges) : NULL));
+    nsc->ca_challenges = add->ca_challenges? add->ca_challenges : base->ca_challenges;
     nsc->current = NULL;
     nsc->assigned = NULL;
+    nsc->https_prefix = NULL;
+    nsc->https_hsts = NULL;
+    nsc->md_idx = -1;
     
     return nsc;
 }
@@ -495,6 +537,27 @@ static const char *md_config_set_base_server(cmd_parms *cmd, void *dc, const cha
     return err;
 }
 
+static const char *md_config_set_live_activation(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *config = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)dc;
+    if (!err) {
+        if (!apr_strnatcasecmp("off", value)) {
+            config->mc->live_activation = 0;
+        }
+        else if (!apr_strnatcasecmp("on", value)) {
+            config->mc->live_activation = 1;
+        }
+        else {
+            err = apr_pstrcat(cmd->pool, "unknown '", value, 
+                              "', supported parameter values are 'on' and 'off'", NULL);
+        }
+    }
+    return err;
+}
+
 static const char *md_config_set_require_https(cmd_parms *cmd, void *dc, const char *value)
 {
     md_srv_conf_t *config = md_config_get(cmd->server);
@@ -607,6 +670,48 @@ static const char *md_config_set_renew_window(cmd_parms *cmd, void *dc, const ch
     return "MDRenewWindow has unrecognized format";
 }
 
+static const char *md_config_set_store_sync(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *config = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)dc;
+    if (!err) {
+        if (!apr_strnatcasecmp("off", value)) {
+            config->mc->store_sync = 0;
+        }
+        else if (!apr_strnatcasecmp("on", value)) {
+            config->mc->store_sync = 1;
+        }
+        else {
+            err = apr_pstrcat(cmd->pool, "unknown '", value, 
+                              "', supported parameter values are 'on' and 'off'", NULL);
+        }
+    }
+    return err;
+}
+
+static const char *md_config_set_preflight(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *config = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)dc;
+    if (!err) {
+        if (!apr_strnatcasecmp("off", value)) {
+            config->mc->preflight = 0;
+        }
+        else if (!apr_strnatcasecmp("on", value)) {
+            config->mc->preflight = 1;
+        }
+        else {
+            err = apr_pstrcat(cmd->pool, "unknown '", value, 
+                              "', supported parameter values are 'on' and 'off'", NULL);
+        }
+    }
+    return err;
+}
+
 static const char *md_config_set_proxy(cmd_parms *cmd, void *arg, const char *value)
 {
     md_srv_conf_t *sc = md_config_get(cmd->server);
@@ -768,6 +873,26 @@ static const char *md_config_set_pkeys(cmd_parms *cmd, void *dc,
         config->pkey_spec->params.rsa.bits = (unsigned int)bits;
         return NULL;
     }
+    else if (!apr_strnatcasecmp("EC", ptype)) {
+        const char *curve = MD_PKEY_EC_CURVE_DEF;
+        
+        if (argc == 2) {
+            if (!(curve = md_pkey_ec_curve_name(argv[1]))) {
+                return apr_pstrcat(cmd->pool, "unsupported EC curve \"", argv[1], 
+                                   "\", supported are P-256 and P-384", NULL);
+            }
+        }
+        else if (argc > 2) {
+            return "key type 'EC' has only one optional parameter, the curve";
+        }
+
+        if (!config->pkey_spec) {
+            config->pkey_spec = apr_pcalloc(cmd->pool, sizeof(*config->pkey_spec));
+        }
+        config->pkey_spec->type = MD_PKEY_TYPE_EC;
+        config->pkey_spec->params.ec.curve = curve;
+        return NULL;
+    }
     return apr_pstrcat(cmd->pool, "unsupported private key type \"", ptype, "\"", NULL);
 }
 
@@ -784,6 +909,202 @@ static const char *md_config_set_notify_cmd(cmd_parms *cmd, void *mconfig, const
     return NULL;
 }
 
+static const char *md_config_set_renew_parallel(cmd_parms *cmd, void *mconfig, 
+                                                const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n < 1 || n > MD_RENEW_PARALLEL_MAX) {
+        return apr_psprintf(cmd->pool, "number of parallel renewals must be between 1 "
+                            "and %d", MD_RENEW_PARALLEL_MAX);
+    }
+    sc->mc->renew_parallel = n;
+    return NULL;
+}
+
+static const char *md_config_set_restart_batch(cmd_parms *cmd, void *mconfig, 
+                                               const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t window;
+    int n = 0;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (duration_parse(v1, &window, "s") != APR_SUCCESS || window < 0) {
+        return "MDRestartBatch has unrecognized duration format";
+    }
+    if (v2) {
+        n = (int)apr_atoi64(v2);
+        if (n < 1) {
+            return "MDRestartBatch number of Managed Domains must be a positive number";
+        }
+    }
+    sc->mc->restart_window = window;
+    sc->mc->restart_max = n;
+    return NULL;
+}
+
+static const char *md_config_set_renew_lease(cmd_parms *cmd, void *mconfig, 
+                                             const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t lease;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", v1)) {
+        lease = 0;
+    }
+    else if (duration_parse(v1, &lease, "s") != APR_SUCCESS || lease <= 0) {
+        return "MDRenewLease has unrecognized duration format";
+    }
+    sc->mc->renew_lease = lease;
+    sc->mc->lease_owner = v2;
+    return NULL;
+}
+
+static const char *md_config_set_renew_spread(cmd_parms *cmd, void *mconfig, 
+                                              const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int percent;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        percent = 0;
+    }
+    else if (percentage_parse(value, &percent) != APR_SUCCESS) {
+        return "MDRenewSpread needs to be 'off' or a percentage less than 100";
+    }
+    sc->mc->renew_spread = percent;
+    return NULL;
+}
+
+static const char *md_config_set_renew_budget(cmd_parms *cmd, void *mconfig, 
+                                              const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t slice = apr_time_from_sec(MD_SECS_PER_HOUR);
+    int n;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", v1)) {
+        n = 0;
+    }
+    else if ((n = (int)apr_atoi64(v1)) < 1) {
+        return "MDRenewBudget number of renewals must be a positive number or 'off'";
+    }
+    if (v2 && (duration_parse(v2, &slice, "s") != APR_SUCCESS || slice <= 0)) {
+        return "MDRenewBudget has unrecognized duration format";
+    }
+    sc->mc->renew_budget = n;
+    sc->mc->renew_slice = slice;
+    return NULL;
+}
+
+static const char *md_config_set_ca_cache(cmd_parms *cmd, void *mconfig, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t ttl;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        ttl = 0;
+    }
+    else if (duration_parse(value, &ttl, "s") != APR_SUCCESS || ttl <= 0) {
+        return "MDCACache has unrecognized duration format";
+    }
+    sc->mc->ca_cache = ttl;
+    return NULL;
+}
+
+static const char *md_config_set_http_timeouts(cmd_parms *cmd, void *mconfig, 
+                                               int argc, char *const argv[])
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t *pt, t;
+    char *key, *val;
+    int i;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    for (i = 0; i < argc; ++i) {
+        key = apr_pstrdup(cmd->pool, argv[i]);
+        if (NULL == (val = strchr(key, '='))) {
+            return apr_psprintf(cmd->pool, "MDHttpTimeouts expects name=value, not '%s'", argv[i]);
+        }
+        *val++ = '\0';
+        if (!apr_strnatcasecmp("connect", key)) {
+            pt = &sc->mc->http_connect;
+        }
+        else if (!apr_strnatcasecmp("stall", key)) {
+            pt = &sc->mc->http_stall;
+        }
+        else if (!apr_strnatcasecmp("keepalive", key)) {
+            pt = &sc->mc->http_keepalive;
+        }
+        else {
+            return apr_psprintf(cmd->pool, "MDHttpTimeouts has unknown name '%s'", key);
+        }
+        if (!apr_strnatcasecmp("off", val)) {
+            t = 0;
+        }
+        else if (duration_parse(val, &t, "s") != APR_SUCCESS || t <= 0) {
+            return apr_psprintf(cmd->pool, "MDHttpTimeouts has unrecognized duration '%s'", val);
+        }
+        *pt = t;
+    }
+    return NULL;
+}
+
+static const char *md_config_set_dns01_cmd(cmd_parms *cmd, void *mconfig, 
+                                           const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t wait = apr_time_from_sec(30);
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (v2 && (duration_parse(v2, &wait, "s") != APR_SUCCESS || wait < 0)) {
+        return "MDChallengeDns01 has unrecognized duration format";
+    }
+    sc->mc->dns01_cmd = v1;
+    sc->mc->dns01_wait = wait;
+    return NULL;
+}
+
 static const char *md_config_set_names_old(cmd_parms *cmd, void *dc, 
                                            int argc, char *const argv[])
 {
@@ -804,12 +1125,26 @@ const command_rec md_cmds[] = {
                   "URL of CA issuing the certificates"),
     AP_INIT_TAKE1(     MD_CMD_CAAGREEMENT, md_config_set_agreement, NULL, RSRC_CONF, 
                   "either 'accepted' or the URL of CA Terms-of-Service agreement you accept"),
+    AP_INIT_TAKE1(     MD_CMD_CACACHE, md_config_set_ca_cache, NULL, RSRC_CONF, 
+                  "How long CA directories and account checks are reused, or 'off'."),
     AP_INIT_TAKE_ARGV( MD_CMD_CACHALLENGES, md_config_set_cha_tyes, NULL, RSRC_CONF, 
                       "A list of challenge types to be used."),
     AP_INIT_TAKE1(     MD_CMD_CAPROTO, md_config_set_ca_proto, NULL, RSRC_CONF, 
                   "Protocol used to obtain/renew certificates"),
+    AP_INIT_TAKE12(    MD_CMD_DNS01CMD, md_config_set_dns01_cmd, NULL, RSRC_CONF, 
+                  "Command that sets up and tears down dns-01 TXT records and how long "
+                  "new records take to propagate."),
+    AP_INIT_TAKE1(     MD_CMD_PREFLIGHT, md_config_set_preflight, NULL, RSRC_CONF, 
+                  "'on' to fetch http-01 challenge responses from the domains before the CA "
+                  "is asked to validate them."),
     AP_INIT_TAKE1(     MD_CMD_DRIVEMODE, md_config_set_drive_mode, NULL, RSRC_CONF, 
                   "method of obtaining certificates for the managed domain"),
+    AP_INIT_TAKE1(     MD_CMD_LIVEACTIVATION, md_config_set_live_activation, NULL, RSRC_CONF, 
+                  "Hand renewed certificates to TLS modules asking via md_get_live_credentials "
+                  "instead of restarting the server."),
+    AP_INIT_TAKE_ARGV( MD_CMD_HTTPTIMEOUTS, md_config_set_http_timeouts, NULL, RSRC_CONF, 
+                      "connect, stall and keepalive timeouts of requests to the CA, as name=value "
+                      "with a duration or 'off'."),
     AP_INIT_TAKE_ARGV( MD_CMD_MD, md_config_set_names, NULL, RSRC_CONF, 
                       "A group of server names with one certificate"),
     AP_INIT_RAW_ARGS(  MD_CMD_MD_SECTION, md_config_sec_start, NULL, RSRC_CONF, 
@@ -833,10 +1168,27 @@ const command_rec md_cmds[] = {
                   "URL of a HTTP(S) proxy to use for outgoing connections"),
     AP_INIT_TAKE1(     MD_CMD_STOREDIR, md_config_set_store_dir, NULL, RSRC_CONF, 
                   "the directory for file system storage of managed domain data."),
+    AP_INIT_TAKE1(     MD_CMD_STORESYNC, md_config_set_store_sync, NULL, RSRC_CONF, 
+                  "'on' to sync every write to the store to disk before going on."),
+    AP_INIT_TAKE12(    MD_CMD_RENEWBUDGET, md_config_set_renew_budget, NULL, RSRC_CONF, 
+                  "Number of renewals of valid certificates that may start per time slice, "
+                  "optionally followed by the slice duration (defaults to 1 hour)."),
+    AP_INIT_TAKE12(    MD_CMD_RENEWLEASE, md_config_set_renew_lease, NULL, RSRC_CONF, 
+                  "Take a lease in the store on a Managed Domain while renewing it, so that "
+                  "only one of the servers sharing the store does. Optionally followed by "
+                  "the name of this server, which defaults to the host name."),
+    AP_INIT_TAKE1(     MD_CMD_RENEWPARALLEL, md_config_set_renew_parallel, NULL, RSRC_CONF, 
+                  "Number of Managed Domains that may be renewed at the same time."),
+    AP_INIT_TAKE1(     MD_CMD_RENEWSPREAD, md_config_set_renew_spread, NULL, RSRC_CONF, 
+                  "Percentage of the renewal window over which renewals of valid "
+                  "certificates are spread, at a point particular to each Managed Domain."),
     AP_INIT_TAKE1(     MD_CMD_RENEWWINDOW, md_config_set_renew_window, NULL, RSRC_CONF, 
                   "Time length for renewal before certificate expires (defaults to days)"),
     AP_INIT_TAKE1(     MD_CMD_REQUIREHTTPS, md_config_set_require_https, NULL, RSRC_CONF, 
                   "Redirect non-secure requests to the https: equivalent."),
+    AP_INIT_TAKE12(    MD_CMD_RESTARTBATCH, md_config_set_restart_batch, NULL, RSRC_CONF, 
+                  "Time renewed Managed Domains wait for others before one notify and "
+                  "restart, optionally followed by the number of them that triggers it earlier."),
     AP_INIT_RAW_ARGS(MD_CMD_NOTIFYCMD, md_config_set_notify_cmd, NULL, RSRC_CONF, 
                   "set the command and optional arguments to run when signup/renew of domain is complete."),
     AP_INIT_TAKE1(     MD_CMD_BASE_SERVER, md_config_set_base_server, NULL, RSRC_CONF, 
@@ -852,6 +1204,56 @@ const command_rec md_cmds[] = {
     AP_INIT_TAKE1(NULL, NULL, NULL, RSRC_CONF, NULL)
 };
 
+/* Requests only need the name and https: requirement of the md assigned to their
+ * server. These go into one table, the names into one block behind it, that is 
+ * not written to after post_config. Children then share these pages with the 
+ * parent and do not touch the md_t of the configuration while serving requests. */
+static void md_table_init(server_rec *base_server, md_mod_conf_t *mc, apr_pool_t *p)
+{
+    server_rec *s;
+    md_srv_conf_t *sc;
+    const md_t *md;
+    apr_hash_t *idx;
+    apr_size_t len, off;
+    int i, *pi;
+    
+    mc->md_table = NULL;
+    mc->md_table_len = 0;
+    mc->md_names = NULL;
+    if (!mc->mds || mc->mds->nelts <= 0) {
+        return;
+    }
+    
+    for (len = 0, i = 0; i < mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
+        len += strlen(md->name) + 1;
+    }
+    mc->md_table = apr_palloc(p, (apr_size_t)mc->mds->nelts * sizeof(md_conf_md_t) + len);
+    mc->md_names = (char *)(mc->md_table + mc->mds->nelts);
+    mc->md_table_len = mc->mds->nelts;
+    
+    idx = apr_hash_make(p);
+    pi = apr_palloc(p, (apr_size_t)mc->mds->nelts * sizeof(int));
+    for (off = 0, i = 0; i < mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
+        len = strlen(md->name) + 1;
+        memcpy(mc->md_names + off, md->name, len);
+        mc->md_table[i].name = off;
+        mc->md_table[i].require_https = md->require_https;
+        pi[i] = i;
+        apr_hash_set(idx, mc->md_names + off, (apr_ssize_t)len - 1, &pi[i]);
+        off += len;
+    }
+    
+    for (s = base_server; s; s = s->next) {
+        sc = md_config_get(s);
+        if (sc->assigned) {
+            pi = apr_hash_get(idx, sc->assigned->name, APR_HASH_KEY_STRING);
+            sc->md_idx = pi? *pi : -1;
+        }
+    }
+}
+
 apr_status_t md_config_post_config(server_rec *s, apr_pool_t *p)
 {
     md_srv_conf_t *sc;
@@ -864,6 +1266,7 @@ apr_status_t md_config_post_config(server_rec *s, apr_pool_t *p)
     if (mc->hsts_max_age > 0) {
         mc->hsts_header = apr_psprintf(p, "max-age=%d", mc->hsts_max_age);
     }
+    md_table_init(s, mc, p);
     
     return APR_SUCCESS;
 }
@@ -897,6 +1300,20 @@ md_srv_conf_t *md_config_cget(conn_rec *c)
     return md_config_get(c->base_server);
 }
 
+const md_conf_md_t *md_config_get_md(const md_srv_conf_t *sc)
+{
+    if (sc && sc->md_idx >= 0 && sc->md_idx < sc->mc->md_table_len) {
+        return &sc->mc->md_table[sc->md_idx];
+    }
+    return NULL;
+}
+
+const char *md_config_get_md_name(const md_srv_conf_t *sc)
+{
+    const md_conf_md_t *e = md_config_get_md(sc);
+    return e? sc->mc->md_names + e->name : NULL;
+}
+
 const char *md_config_gets(const md_srv_conf_t *sc, md_config_var_t var)
 {
     switch (var) {
@@ -19,6 +19,7 @@
 
 struct md_store_t;
 struct md_reg_t;
+struct md_index_t;
 struct md_pkey_spec_t;
 
 typedef enum {
@@ -38,6 +39,12 @@ typedef enum {
     MD_CONFIG_NOTIFY_CMD,
 } md_config_var_t;
 
+/* What request processing needs of an md, kept in one table for all servers. */
+typedef struct md_conf_md_t {
+    apr_size_t name;                   /* offset of the name in md_mod_conf_t.md_names */
+    md_require_t require_https;        /* If the MD requires https: access */
+} md_conf_md_t;
+
 typedef struct {
     apr_array_header_t *mds;           /* all md_t* defined in the config, shared */
     const char *base_dir;              /* base dir for store */
@@ -54,6 +61,27 @@ typedef struct {
     apr_array_header_t *unused_names;  /* post config, names of all MDs not assigned to a vhost */
 
     const char *notify_cmd;            /* notification command to execute on signup/renew */
+    struct md_index_t *mds_index;      /* post config, index of mds by name and domain */
+    int renew_parallel;                /* max number of mds driven at the same time */
+    apr_interval_time_t restart_window; /* how long renewed mds wait for others to restart */
+    int restart_max;                   /* restart once this many mds wait, 0 for no limit */
+    int live_activation;               /* != 0 iff renewed certificates go live without restart */
+    apr_interval_time_t renew_lease;   /* lease on an md while renewing it, 0 for none */
+    const char *lease_owner;           /* who holds our leases, NULL for the host name */
+    int renew_spread;                  /* percent of the renew window renewals spread over */
+    int renew_budget;                  /* renewals started per renew_slice, 0 for no limit */
+    apr_interval_time_t renew_slice;   /* the time slice of the renewal budget */
+    apr_interval_time_t ca_cache;      /* reuse of CA directories and account checks */
+    const char *dns01_cmd;             /* command setting up dns-01 TXT records or NULL */
+    apr_interval_time_t dns01_wait;    /* propagation time of new dns-01 records */
+    apr_interval_time_t http_connect;  /* connect timeout of CA requests, 0 for curl's */
+    apr_interval_time_t http_stall;    /* abort CA requests without progress, 0 for never */
+    apr_interval_time_t http_keepalive; /* TCP keepalive of CA connections, 0 for none */
+    int store_sync;                    /* != 0 iff store writes are synced to disk */
+    int preflight;                     /* != 0 iff http-01 responses are checked before validation */
+    md_conf_md_t *md_table;            /* post_config: the mds servers are assigned to */
+    int md_table_len;                  /* post_config: number of entries in md_table */
+    char *md_names;                    /* post_config: names in md_table, NUL separated */
 } md_mod_conf_t;
 
 typedef struct md_srv_conf_t {
@@ -78,6 +106,9 @@ typedef struct md_srv_conf_t {
 
     md_t *current;                     /* md currently defined in <MDomainSet xxx> section */
     md_t *assigned;                    /* post_config: MD that applies to this server or NULL */
+    const char *https_prefix;          /* post_config: "https://host" to redirect to or NULL */
+    const char *https_hsts;            /* post_config: HSTS header to send on https: or NULL */
+    int md_idx;                        /* post_config: index of assigned in mc->md_table or -1 */
 } md_srv_conf_t;
 
 void *md_config_create_svr(apr_pool_t *pool, server_rec *s);
@@ -95,6 +126,11 @@ md_srv_conf_t *md_config_get(server_rec *s);
  * unique to this server_rec, so that any changes only affect this server */
 md_srv_conf_t *md_config_get_unique(server_rec *s, apr_pool_t *p);
 
+/* Get the entry of the MD assigned to the server in the md table or NULL */
+const md_conf_md_t *md_config_get_md(const md_srv_conf_t *sc);
+/* Get the name of the MD assigned to the server or NULL */
+const char *md_config_get_md_name(const md_srv_conf_t *sc);
+
 const char *md_config_gets(const md_srv_conf_t *config, md_config_var_t var);
 int md_config_geti(const md_srv_conf_t *config, md_config_var_t var);
 apr_interval_time_t md_config_get_interval(const md_srv_conf_t *config, md_config_var_t var);
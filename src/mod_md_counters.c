@@ -0,0 +1,182 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <apr_atomic.h>
+#include <apr_shm.h>
+#include <apr_strings.h>
+
+#include <httpd.h>
+#include <http_log.h>
+#include <ap_mpm.h>
+
+#include "md.h"
+#include "md_json.h"
+#include "mod_md_counters.h"
+
+#define MD_CACHE_LINE           64
+
+typedef struct {
+    volatile apr_uint32_t taken;    /* 1 while a process counts here */
+    volatile apr_uint32_t values[MD_CTR_COUNT];
+} md_counters_slot_t;
+
+/* slots are a whole number of cache lines */
+#define MD_SLOT_SIZE            ((sizeof(md_counters_slot_t) + MD_CACHE_LINE - 1) \
+                                 / MD_CACHE_LINE * MD_CACHE_LINE)
+
+static const char *CounterNames[MD_CTR_COUNT] = {
+    "challenge-hits",
+    "challenge-misses",
+    "challenge-declines",
+    "fallback-certs",
+    "https-redirects",
+    "<=100us",
+    "<=1ms",
+    "<=10ms",
+    "more",
+};
+
+static apr_shm_t *shm;
+static char *slots;                 /* MD_SLOT_SIZE aligned, of nslots */
+static int nslots;
+static md_counters_slot_t *my_slot;
+
+#define SLOT(i)                 ((md_counters_slot_t *)(slots + ((apr_size_t)(i) * MD_SLOT_SIZE)))
+
+static apr_status_t counters_cleanup(void *dummy)
+{
+    (void)dummy;
+    shm = NULL;
+    slots = NULL;
+    nslots = 0;
+    my_slot = NULL;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_counters_create(apr_pool_t *p, server_rec *s)
+{
+    apr_size_t size;
+    apr_uintptr_t base;
+    apr_status_t rv;
+    int max_daemons = 0;
+
+    if (shm) {
+        return APR_SUCCESS;
+    }
+    /* old children linger during a graceful restart, and children that crashed do
+     * not give up their slots. The parent counts in the first. */
+    if (APR_SUCCESS != ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &max_daemons) || max_daemons <= 0) {
+        max_daemons = 32;
+    }
+    nslots = 2 * max_daemons + 2;
+    size = ((apr_size_t)nslots + 1) * MD_SLOT_SIZE;
+
+    if (APR_SUCCESS != (rv = apr_shm_create(&shm, size, NULL, p))) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10146) "md counters: no shared memory");
+        nslots = 0;
+        return rv;
+    }
+    base = (apr_uintptr_t)apr_shm_baseaddr_get(shm);
+    slots = (char *)((base + MD_CACHE_LINE - 1) / MD_CACHE_LINE * MD_CACHE_LINE);
+    memset(slots, 0, (apr_size_t)nslots * MD_SLOT_SIZE);
+    my_slot = SLOT(0);
+    my_slot->taken = 1;
+    apr_pool_cleanup_register(p, NULL, counters_cleanup, apr_pool_cleanup_null);
+    return APR_SUCCESS;
+}
+
+static apr_status_t slot_release(void *baton)
+{
+    md_counters_slot_t *slot = baton;
+
+    apr_atomic_set32(&slot->taken, 0);
+    return APR_SUCCESS;
+}
+
+void md_counters_child_init(apr_pool_t *p)
+{
+    md_counters_slot_t *slot;
+    int i;
+
+    my_slot = NULL;
+    if (!slots) {
+        return;
+    }
+    /* a slot keeps the counts of the children before, the sum stays right */
+    for (i = 1; i < nslots - 1; ++i) {
+        slot = SLOT(i);
+        if (0 == apr_atomic_cas32(&slot->taken, 1, 0)) {
+            my_slot = slot;
+            apr_pool_cleanup_register(p, my_slot, slot_release, apr_pool_cleanup_null);
+            return;
+        }
+    }
+    /* no free slot, share the last one */
+    my_slot = SLOT(nslots - 1);
+}
+
+void md_counter_inc(md_counter_t ctr)
+{
+    if (my_slot) {
+        apr_atomic_inc32(&my_slot->values[ctr]);
+    }
+}
+
+void md_counter_load(apr_interval_time_t duration)
+{
+    if (duration <= 100) {
+        md_counter_inc(MD_CTR_LOAD_100US);
+    }
+    else if (duration <= 1000) {
+        md_counter_inc(MD_CTR_LOAD_1MS);
+    }
+    else if (duration <= 10000) {
+        md_counter_inc(MD_CTR_LOAD_10MS);
+    }
+    else {
+        md_counter_inc(MD_CTR_LOAD_SLOW);
+    }
+}
+
+md_json_t *md_counters_to_json(apr_pool_t *p)
+{
+    md_json_t *json;
+    long sums[MD_CTR_COUNT];
+    int i, j, procs = 0;
+
+    json = md_json_create(p);
+    if (!slots) {
+        return json;
+    }
+    memset(sums, 0, sizeof(sums));
+    for (i = 0; i < nslots; ++i) {
+        procs += apr_atomic_read32(&SLOT(i)->taken)? 1 : 0;
+        for (j = 0; j < MD_CTR_COUNT; ++j) {
+            sums[j] += (long)apr_atomic_read32(&SLOT(i)->values[j]);
+        }
+    }
+    md_json_setl(procs, json, "processes", NULL);
+    for (j = 0; j < MD_CTR_COUNT; ++j) {
+        if (j >= MD_CTR_LOAD_100US) {
+            md_json_setl(sums[j], json, MD_CTR_KEY_LOADS, CounterNames[j], NULL);
+        }
+        else {
+            md_json_setl(sums[j], json, CounterNames[j], NULL);
+        }
+    }
+    return json;
+}
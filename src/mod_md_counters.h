@@ -0,0 +1,68 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_counters_h
+#define mod_md_md_counters_h
+
+struct md_json_t;
+struct server_rec;
+
+/**
+ * Counters for the hooks that run on every request or handshake, cheap enough to
+ * be always on. Each process counts in its own slot of a shared memory segment,
+ * aligned to cache lines so that processes do not contend, and any process can
+ * sum them up. Counts start anew when the server restarts.
+ */
+typedef enum {
+    MD_CTR_CHA_HIT,                 /* challenge answered */
+    MD_CTR_CHA_MISS,                /* challenge asked for, but unknown */
+    MD_CTR_CHA_DECLINE,             /* challenge path, but not our domain */
+    MD_CTR_FALLBACK,                /* fallback certificate handed out */
+    MD_CTR_HTTPS_REDIRECT,          /* request redirected to https: */
+    MD_CTR_LOAD_100US,              /* store loads in hooks, by duration */
+    MD_CTR_LOAD_1MS,
+    MD_CTR_LOAD_10MS,
+    MD_CTR_LOAD_SLOW,
+    MD_CTR_COUNT
+} md_counter_t;
+
+/* the store load durations are summed up in an object of their own */
+#define MD_CTR_KEY_LOADS        "store-loads"
+
+/**
+ * Create the shared counters, in the parent, before child processes are started.
+ */
+apr_status_t md_counters_create(apr_pool_t *p, struct server_rec *s);
+
+/**
+ * Take a slot for counting in a newly started child. The slot is given up when
+ * pool p goes away.
+ */
+void md_counters_child_init(apr_pool_t *p);
+
+void md_counter_inc(md_counter_t ctr);
+
+/**
+ * Count a load from the store that took the given time.
+ */
+void md_counter_load(apr_interval_time_t duration);
+
+/**
+ * The counters, summed over all processes.
+ */
+struct md_json_t *md_counters_to_json(apr_pool_t *p);
+
+#endif /* mod_md_md_counters_h */
@@ -0,0 +1,470 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmarks for the operations of libmd that run once per MD, per account or per
+ * request. Stores with the given numbers of MDs are made up in a temporary directory,
+ * the results are written as JSON to stdout.
+ *
+ *   md_bench [-d dir] [N ...]
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <apr_lib.h>
+#include <apr_general.h>
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "md.h"
+#include "md_acme.h"
+#include "md_acme_acct.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_jws.h"
+#include "md_log.h"
+#include "md_reg.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+#include "md_version.h"
+
+#define BENCH_DOMAINS       10      /* domain names per MD */
+
+static const int DefaultSizes[] = { 10, 100, 1000, 10000 };
+
+typedef struct {
+    apr_pool_t *p;
+    md_json_t *results;
+    int mds;                        /* size of the store being run, 0 if none */
+} bench_t;
+
+typedef struct {
+    md_store_t *store;
+    md_reg_t *reg;
+    apr_array_header_t *mds;        /* the MDs as configured */
+} bench_store_t;
+
+static void report(bench_t *b, const char *op, const char *variant,
+                   long count, apr_interval_time_t total)
+{
+    md_json_t *json = md_json_create(b->p);
+
+    md_json_sets(op, json, "op", NULL);
+    if (variant) {
+        md_json_sets(variant, json, "variant", NULL);
+    }
+    if (b->mds) {
+        md_json_setl(b->mds, json, "mds", NULL);
+    }
+    md_json_setl(count, json, "count", NULL);
+    md_json_setl((long)total, json, "total-us", NULL);
+    md_json_setn(count? (double)total / (double)count : 0.0, json, "us-per-op", NULL);
+    md_json_addj(json, b->results, "results", NULL);
+
+    fprintf(stderr, "%-20s %-12s %7d %8ld %12.2f us/op\n", op, variant? variant : "",
+            b->mds, count, count? (double)total / (double)count : 0.0);
+}
+
+static void fail(const char *what, apr_status_t rv)
+{
+    char buffer[256];
+
+    fprintf(stderr, "%s: %s (%d)\n", what, apr_strerror(rv, buffer, sizeof(buffer)), rv);
+    exit(1);
+}
+
+static apr_array_header_t *make_domains(apr_pool_t *p, int index)
+{
+    apr_array_header_t *domains = apr_array_make(p, BENCH_DOMAINS, sizeof(const char *));
+    int i;
+
+    APR_ARRAY_PUSH(domains, const char *) = apr_psprintf(p, "md%d.bench.test", index);
+    for (i = 1; i < BENCH_DOMAINS; ++i) {
+        APR_ARRAY_PUSH(domains, const char *) = apr_psprintf(p, "www%d.md%d.bench.test",
+                                                              i, index);
+    }
+    return domains;
+}
+
+/**************************************************************************************************/
+/* store and registry */
+
+static int count_md(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
+{
+    (void)store;
+    (void)md;
+    (void)ptemp;
+    ++(*(long *)baton);
+    return 1;
+}
+
+static int count_acct(void *baton, const char *name, const char *aspect,
+                      md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    (void)name;
+    (void)aspect;
+    (void)vtype;
+    (void)value;
+    (void)ptemp;
+    ++(*(long *)baton);
+    return 1;
+}
+
+static void store_setup(bench_store_t *bs, bench_t *b, const char *dir,
+                        md_pkey_t *pkey, apr_pool_t *p)
+{
+    apr_pool_t *ptemp;
+    md_json_t *json;
+    md_cert_t *cert;
+    apr_array_header_t *chain;
+    md_t *md;
+    apr_status_t rv;
+    int i;
+
+    if (APR_SUCCESS != (rv = md_store_fs_init(&bs->store, p, dir))) {
+        fail("creating store", rv);
+    }
+    if (APR_SUCCESS != (rv = md_reg_init(&bs->reg, p, bs->store, NULL))
+        || APR_SUCCESS != (rv = md_reg_set_props(bs->reg, p, 1, 1))) {
+        fail("creating registry", rv);
+    }
+
+    bs->mds = apr_array_make(p, b->mds, sizeof(md_t *));
+    for (i = 0; i < b->mds; ++i) {
+        md = md_create(p, make_domains(p, i));
+        md->ca_url = "https://acme.bench.test/directory";
+        md->ca_proto = "ACME";
+        APR_ARRAY_PUSH(bs->mds, md_t *) = md;
+    }
+
+    apr_pool_create(&ptemp, p);
+    for (i = 0; i < b->mds; ++i) {
+        /* every 10th MD has an account */
+        if (i % 10 == 0) {
+            json = md_json_create(ptemp);
+            md_json_sets(apr_psprintf(ptemp, "https://acme.bench.test/acct/%d", i),
+                         json, MD_KEY_URL, NULL);
+            md_json_sets("https://acme.bench.test/directory", json, MD_KEY_CA_URL, NULL);
+            rv = md_store_save(bs->store, ptemp, MD_SG_ACCOUNTS,
+                               apr_psprintf(ptemp, "ACME-bench-%04d", i), MD_FN_ACCOUNT,
+                               MD_SV_JSON, json, 1);
+            if (APR_SUCCESS != rv) {
+                fail("saving account", rv);
+            }
+        }
+        apr_pool_clear(ptemp);
+    }
+
+    /* the first sync creates the MDs in the store */
+    rv = md_reg_sync(bs->reg, p, ptemp, bs->mds);
+    apr_pool_clear(ptemp);
+    if (APR_SUCCESS != rv) {
+        fail("initial sync", rv);
+    }
+
+    /* give all a certificate, so state_init has something to check */
+    for (i = 0; i < b->mds; ++i) {
+        md = APR_ARRAY_IDX(bs->mds, i, md_t *);
+        if (APR_SUCCESS != (rv = md_cert_self_sign(&cert, md->name, md->domains, pkey,
+                                                   apr_time_from_sec(90 * 24 * 3600), ptemp))) {
+            fail("signing certificate", rv);
+        }
+        chain = apr_array_make(ptemp, 1, sizeof(md_cert_t *));
+        APR_ARRAY_PUSH(chain, md_cert_t *) = cert;
+        if (APR_SUCCESS != (rv = md_pkey_save(bs->store, ptemp, MD_SG_DOMAINS,
+                                              md->name, pkey, 1))
+            || APR_SUCCESS != (rv = md_pubcert_save(bs->store, ptemp, MD_SG_DOMAINS,
+                                                    md->name, chain, 1))) {
+            fail("saving credentials", rv);
+        }
+        apr_pool_clear(ptemp);
+    }
+    apr_pool_destroy(ptemp);
+}
+
+static void bench_store(bench_t *b, const char *dir, md_pkey_t *pkey)
+{
+    bench_store_t bs;
+    apr_pool_t *p, *ptemp;
+    apr_time_t start;
+    apr_status_t rv;
+    md_t *md;
+    long count;
+    int i;
+
+    apr_pool_create(&p, b->p);
+    store_setup(&bs, b, dir, pkey, p);
+    apr_pool_create(&ptemp, p);
+
+    /* startup with nothing changed in the configuration */
+    start = apr_time_now();
+    rv = md_reg_sync(bs.reg, p, ptemp, bs.mds);
+    report(b, "md_reg_sync", "unchanged", 1, apr_time_now() - start);
+    apr_pool_clear(ptemp);
+    if (APR_SUCCESS != rv) {
+        fail("sync", rv);
+    }
+
+    /* loads the MD and its credentials, then runs state_init */
+    count = 0;
+    start = apr_time_now();
+    for (i = 0; i < bs.mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(bs.mds, i, md_t *);
+        if (md_reg_get(bs.reg, md->name, ptemp)) {
+            ++count;
+        }
+        apr_pool_clear(ptemp);
+    }
+    report(b, "md_reg_get", NULL, count, apr_time_now() - start);
+
+    count = 0;
+    start = apr_time_now();
+    md_store_md_iter(count_md, &count, bs.store, ptemp, MD_SG_DOMAINS, "*");
+    report(b, "md_store_md_iter", NULL, count, apr_time_now() - start);
+    apr_pool_clear(ptemp);
+
+    count = 0;
+    start = apr_time_now();
+    md_store_iter(count_acct, &count, bs.store, ptemp, MD_SG_ACCOUNTS, "*",
+                  MD_FN_ACCOUNT, MD_SV_JSON);
+    report(b, "md_store_iter", "accounts", count, apr_time_now() - start);
+
+    apr_pool_destroy(p);
+    md_util_rm_recursive(dir, b->p, 5);
+}
+
+/**************************************************************************************************/
+/* crypto and json */
+
+static void bench_covers(bench_t *b, md_pkey_t *pkey)
+{
+    apr_pool_t *p;
+    md_cert_t *cert;
+    md_t *md;
+    apr_time_t start;
+    apr_status_t rv;
+    long i, n = 10000, count = 0;
+
+    apr_pool_create(&p, b->p);
+    md = md_create(p, make_domains(p, 0));
+    if (APR_SUCCESS != (rv = md_cert_self_sign(&cert, md->name, md->domains, pkey,
+                                               apr_time_from_sec(3600), p))) {
+        fail("signing certificate", rv);
+    }
+    start = apr_time_now();
+    for (i = 0; i < n; ++i) {
+        count += md_cert_covers_md(cert, md)? 1 : 0;
+    }
+    report(b, "md_cert_covers_md", NULL, n, apr_time_now() - start);
+    assert(count == n);
+    apr_pool_destroy(p);
+}
+
+static void bench_json(bench_t *b, const char *dir)
+{
+    apr_pool_t *p, *ptemp;
+    md_json_t *json;
+    md_t *md;
+    const char *fpath;
+    apr_time_t start;
+    apr_status_t rv;
+    long i, n = 10000;
+
+    apr_pool_create(&p, b->p);
+    apr_pool_create(&ptemp, p);
+    md = md_create(p, make_domains(p, 0));
+    md->ca_url = "https://acme.bench.test/directory";
+    json = md_to_json(md, p);
+
+    start = apr_time_now();
+    for (i = 0; i < n; ++i) {
+        md_json_writep(json, ptemp, MD_JSON_FMT_INDENT);
+        apr_pool_clear(ptemp);
+    }
+    report(b, "md_json_writep", "md", n, apr_time_now() - start);
+
+    if (APR_SUCCESS != (rv = md_util_path_merge(&fpath, p, dir, MD_FN_MD, NULL))
+        || APR_SUCCESS != (rv = apr_dir_make_recursive(dir, APR_OS_DEFAULT, p))
+        || APR_SUCCESS != (rv = md_json_fcreatex(json, p, MD_JSON_FMT_INDENT, fpath,
+                                                 APR_FPROT_UREAD|APR_FPROT_UWRITE))) {
+        fail("writing json", rv);
+    }
+    start = apr_time_now();
+    for (i = 0; i < n; ++i) {
+        md_json_readf(&json, ptemp, fpath);
+        apr_pool_clear(ptemp);
+    }
+    report(b, "md_json_readf", "md", n, apr_time_now() - start);
+
+    apr_pool_destroy(p);
+    md_util_rm_recursive(dir, b->p, 1);
+}
+
+static md_pkey_t *bench_keys(bench_t *b)
+{
+    md_pkey_spec_t specs[4];
+    md_pkey_t *pkey, *ec_key = NULL;
+    md_json_t *msg;
+    apr_table_t *protected;
+    apr_pool_t *ptemp;
+    apr_time_t start;
+    apr_status_t rv;
+    const char *payload, *name;
+    long n;
+    int i, j;
+
+    specs[0].type = MD_PKEY_TYPE_RSA;
+    specs[0].params.rsa.bits = 2048;
+    specs[1].type = MD_PKEY_TYPE_RSA;
+    specs[1].params.rsa.bits = 4096;
+    specs[2].type = MD_PKEY_TYPE_EC;
+    specs[2].params.ec.curve = "P-256";
+    specs[3].type = MD_PKEY_TYPE_EC;
+    specs[3].params.ec.curve = "P-384";
+
+    apr_pool_create(&ptemp, b->p);
+    protected = apr_table_make(b->p, 5);
+    apr_table_setn(protected, "nonce", "bench-nonce-0123456789abcdef");
+    apr_table_setn(protected, "url", "https://acme.bench.test/acme/new-order");
+    payload = "{\"identifiers\":[{\"type\":\"dns\",\"value\":\"md0.bench.test\"},"
+              "{\"type\":\"dns\",\"value\":\"www1.md0.bench.test\"}]}";
+
+    for (i = 0; i < 4; ++i) {
+        name = md_pkey_spec_name(&specs[i], b->p);
+        /* RSA keys take long to make, do fewer */
+        n = (specs[i].type == MD_PKEY_TYPE_RSA)? 5 : 100;
+        start = apr_time_now();
+        for (j = 0; j < n; ++j) {
+            if (APR_SUCCESS != (rv = md_pkey_gen(&pkey, b->p, &specs[i]))) {
+                fail("generating key", rv);
+            }
+            if (j < n - 1) {
+                md_pkey_free(pkey);
+            }
+        }
+        report(b, "md_pkey_gen", name, n, apr_time_now() - start);
+
+        n = 1000;
+        start = apr_time_now();
+        for (j = 0; j < n; ++j) {
+            if (APR_SUCCESS != (rv = md_jws_sign(&msg, ptemp, payload, strlen(payload),
+                                                 protected, pkey, NULL))) {
+                fail("signing jws", rv);
+            }
+            apr_pool_clear(ptemp);
+        }
+        report(b, "md_jws_sign", name, n, apr_time_now() - start);
+
+        if (i == 2) {
+            /* P-256 is cheap, it signs the certificates of the stores */
+            ec_key = pkey;
+        }
+        else {
+            md_pkey_free(pkey);
+        }
+    }
+    apr_pool_destroy(ptemp);
+    return ec_key;
+}
+
+/**************************************************************************************************/
+/* main */
+
+static int log_is_level(void *baton, apr_pool_t *p, md_log_level_t level)
+{
+    (void)baton;
+    (void)p;
+    return level <= MD_LOG_ERR;
+}
+
+static void log_print(const char *file, int line, md_log_level_t level,
+                      apr_status_t rv, void *baton, apr_pool_t *p, const char *fmt, va_list ap)
+{
+    (void)file;
+    (void)line;
+    (void)baton;
+    (void)p;
+    if (log_is_level(baton, p, level)) {
+        fprintf(stderr, "[%s][%d] ", md_log_level_name(level), rv);
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+    }
+}
+
+int main(int argc, const char * const argv[])
+{
+    bench_t b;
+    md_pkey_t *ec_key;
+    const char *base_dir = NULL, *dir;
+    apr_status_t rv;
+    int i, n, nsizes = 0;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    md_log_set(log_is_level, log_print, NULL);
+
+    memset(&b, 0, sizeof(b));
+    apr_pool_create(&b.p, NULL);
+    if (APR_SUCCESS != (rv = md_crypt_init(b.p))) {
+        fail("initializing crypto", rv);
+    }
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp("-d", argv[i]) && i + 1 < argc) {
+            base_dir = argv[++i];
+        }
+        else if ((n = atoi(argv[i])) <= 0) {
+            fprintf(stderr, "usage: %s [-d dir] [N ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!base_dir && APR_SUCCESS != (rv = apr_temp_dir_get(&base_dir, b.p))) {
+        fail("finding temp dir", rv);
+    }
+    base_dir = apr_psprintf(b.p, "%s/md-bench-%ld", base_dir, (long)getpid());
+
+    b.results = md_json_create(b.p);
+    md_json_sets(MOD_MD_VERSION, b.results, "version", NULL);
+
+    ec_key = bench_keys(&b);
+    bench_covers(&b, ec_key);
+    bench_json(&b, apr_pstrcat(b.p, base_dir, "/json", NULL));
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp("-d", argv[i])) {
+            ++i;
+            continue;
+        }
+        b.mds = atoi(argv[i]);
+        dir = apr_psprintf(b.p, "%s/store-%d", base_dir, b.mds);
+        bench_store(&b, dir, ec_key);
+        ++nsizes;
+    }
+    for (i = 0; !nsizes && i < (int)(sizeof(DefaultSizes)/sizeof(DefaultSizes[0])); ++i) {
+        b.mds = DefaultSizes[i];
+        dir = apr_psprintf(b.p, "%s/store-%d", base_dir, b.mds);
+        bench_store(&b, dir, ec_key);
+    }
+    md_util_rm_recursive(base_dir, b.p, 1);
+
+    fprintf(stdout, "%s\n", md_json_writep(b.results, b.p, MD_JSON_FMT_INDENT));
+    return 0;
+}
@@ -2,6 +2,7 @@
 
 import copy
 import json
+import os
 import re
 import shutil
 import sys
@@ -254,3 +255,33 @@ class TestStore:
         # override domains list
         assert TestEnv.a2md( [ "store", "update", dns1, "domains" ] )['rv'] == 1
 
+    # --------- store gc ---------
+
+    def test_000_500(self):
+        # test case: gc keeps the newest archives of each name and fresh tmp data
+        dns = "test000-500.com"
+        assert TestEnv.a2md( [ "store", "add", dns ] )['rv'] == 0
+        for name, n in [ (dns, 4), ("gone000-500.com", 2) ]:
+            for i in range(1, n+1):
+                os.makedirs(os.path.join(TestEnv.STORE_DIR, "archive", "%s.%d" % (name, i)))
+        for name in [ "old000-500.com", "new000-500.com" ]:
+            os.makedirs(os.path.join(TestEnv.STORE_DIR, "tmp", name))
+        old = time.time() - 3 * 24 * 3600
+        os.utime(os.path.join(TestEnv.STORE_DIR, "tmp", "old000-500.com"), (old, old))
+        jout = TestEnv.a2md( [ "store", "gc", "--keep", "1", "--age", "2" ] )['jout']
+        TestEnv.check_json_contains( jout['output'][0], { "archives": 4, "tmp": 1, "challenges": 0 })
+        assert sorted(os.listdir(os.path.join(TestEnv.STORE_DIR, "archive"))) == [
+            "gone000-500.com.2", dns + ".4" ]
+        assert os.listdir(os.path.join(TestEnv.STORE_DIR, "tmp")) == [ "new000-500.com" ]
+
+    # --------- packed store ---------
+
+    def test_000_600(self):
+        # test case: a2md works on a single file store when asked to
+        dns = "test000-600.com"
+        assert TestEnv.a2md( [ "-s", "pack", "store", "add", dns ] )['rv'] == 0
+        assert os.path.isfile(os.path.join(TestEnv.STORE_DIR, "md_store.pack"))
+        assert not os.path.exists(os.path.join(TestEnv.STORE_DIR, "domains", dns))
+        jout = TestEnv.a2md( [ "-s", "pack", "store", "list" ] )['jout']
+        assert [ md['name'] for md in jout['output'] ] == [ dns ]
+        assert TestEnv.a2md( [ "-s", "nosuch", "store", "list" ] )['rv'] == 1
@@ -0,0 +1,90 @@
+# test mod_md bulk import/export of managed domains
+
+import json
+import os
+import pytest
+
+from test_base import TestEnv
+
+def setup_module(module):
+    print("setup_module: %s" % module.__name__)
+    TestEnv.init()
+
+def teardown_module(module):
+    print("teardown_module: %s" % module.__name__)
+
+
+class TestRegImport :
+
+    def setup_method(self, method):
+        print("setup_method: %s" % method.__name__)
+        TestEnv.clear_store()
+
+    def teardown_method(self, method):
+        print("teardown_method: %s" % method.__name__)
+
+    def test_130_000(self):
+        # test case: export empty store
+        r = TestEnv.a2md( [ "export" ], raw=True )
+        assert r['rv'] == 0
+        assert r['stdout'] == ""
+
+    def test_130_001(self):
+        # test case: import mds, export them again
+        dnslist = [
+            [ "test130-001.com", "www.test130-001.com" ],
+            [ "test130-001.org", "www.test130-001.org", "mail.test130-001.org" ]
+        ]
+        path = self._write_import("test130-001.ndjson", [ { "domains": dns } for dns in dnslist ])
+        jout = TestEnv.a2md( [ "import", path ] )['jout']
+        TestEnv.check_json_contains( jout['output'][0], { "added": 2, "updated": 0, "failed": 0 })
+        r = TestEnv.a2md( [ "export" ], raw=True )
+        assert r['rv'] == 0
+        lines = [ json.loads(l) for l in r['stdout'].splitlines() ]
+        assert len(lines) == 2
+        for md in lines:
+            assert md['domains'] in dnslist
+            assert md['name'] == md['domains'][0]
+            assert md['ca']['proto'] == "ACME"
+        # importing the export changes nothing
+        path = self._write_import("test130-001-export.ndjson", lines)
+        jout = TestEnv.a2md( [ "import", path ] )['jout']
+        TestEnv.check_json_contains( jout['output'][0], { "added": 0, "updated": 2, "failed": 0 })
+        assert len(TestEnv.a2md( [ "list" ] )['jout']['output']) == 2
+
+    def test_130_002(self):
+        # test case: overlaps with mds in the store and in the same import are rejected
+        assert TestEnv.a2md( [ "add", "test130-002.com", "www.test130-002.com" ] )['rv'] == 0
+        path = self._write_import("test130-002.ndjson", [
+            { "name": "other130-002.com", "domains": [ "other130-002.com", "www.test130-002.com" ] },
+            { "domains": [ "new130-002.com" ] },
+            { "domains": [ "www.new130-002.com", "new130-002.com" ] },
+        ])
+        r = TestEnv.a2md( [ "import", path ] )
+        assert r['rv'] != 0
+        TestEnv.check_json_contains( r['jout']['output'][0], { "added": 1, "updated": 0, "failed": 2 })
+        names = [ md['name'] for md in TestEnv.a2md( [ "list" ] )['jout']['output'] ]
+        assert sorted(names) == [ "new130-002.com", "test130-002.com" ]
+
+    def test_130_003(self):
+        # test case: import updates only the properties given
+        name = "test130-003.com"
+        assert TestEnv.a2md( [ "add", name ] )['rv'] == 0
+        assert TestEnv.a2md( [ "update", name, "contacts", "admin@" + name ] )['rv'] == 0
+        path = self._write_import("test130-003.ndjson", [
+            { "name": name, "domains": [ name, "www." + name ] },
+        ])
+        jout = TestEnv.a2md( [ "import", path ] )['jout']
+        TestEnv.check_json_contains( jout['output'][0], { "added": 0, "updated": 1, "failed": 0 })
+        md = TestEnv.a2md( [ "list", name ] )['jout']['output'][0]
+        assert md['domains'] == [ name, "www." + name ]
+        assert md['contacts'] == [ "mailto:admin@" + name ]
+
+    # --------- _utils_ ---------
+
+    def _write_import(self, fname, mds):
+        path = os.path.join(TestEnv.GEN_DIR, fname)
+        with open(path, "w") as fd:
+            for md in mds:
+                fd.write(json.dumps(md) + "\n")
+        return path
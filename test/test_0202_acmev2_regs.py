@@ -84,6 +84,18 @@ class TestAcmeAcc :
         # verify account in local store
         self._check_account(acct, ["mailto:" + contact[0], "mailto:" + contact[1]])
 
+    def test_202_004(self):
+        # test case: new accounts are listed in the account index
+        acct1 = self._prepare_account(["xx@not-forbidden.org"])
+        acct2 = self._prepare_account(["aa@not-forbidden.org"])
+        assert acct1 != acct2
+        for acct in [ acct1, acct2 ]:
+            entry = self._get_index_entry(acct)
+            assert entry
+            assert entry['status'] == "valid"
+            assert entry['ca-url'] == TestEnv.ACME_URL
+            assert entry['url'] == TestEnv.run([ "cat", TestEnv.path_account(acct) ])['jout']['url']
+
     # --------- acme validate ---------
 
     def test_202_100(self):
@@ -123,11 +135,13 @@ class TestAcmeAcc :
         # TODO: create a "a2md list accounts" command for this
         run = TestEnv.run(["find", TestEnv.STORE_DIR])
         assert re.match(TestEnv.STORE_DIR, run['stdout'])
+        assert self._get_index_entry(acct)['status'] == "deactivated"
 
     def test_202_202(self):
         # test case: delete a persisted account without specifying url
         acct = self._prepare_account(["tmp@not-forbidden.org"])
         assert TestEnv.run([TestEnv.A2MD, "-d", TestEnv.STORE_DIR, "acme", "delreg", acct] )['rv'] == 0
+        assert not self._get_index_entry(acct)
 
     def test_202_203(self):
         # test case: delete, then validate an account
@@ -144,6 +158,13 @@ class TestAcmeAcc :
         jout = TestEnv.run([ "cat", TestEnv.path_account(acct) ])['jout']
         assert jout['registration']['contact'] == contact
 
+    def _get_index_entry(self, acct):
+        jout = TestEnv.run([ "cat", TestEnv.path_account_index() ])['jout']
+        for entry in jout['accounts']:
+            if entry['id'] == acct:
+                return entry
+        return None
+
     def _prepare_account(self, contact):
         run = TestEnv.a2md( ["-t", "accepted", "acme", "newreg"] + contact, raw=True )
         assert run['rv'] == 0
@@ -145,7 +145,9 @@ class TestConf:
         ("test_016a", "unsupported private key type"), 
         ("test_016b", "needs to specify the private key type"), 
         ("test_016c", "must be 2048 or higher"), 
-        ("test_016d", "key type 'RSA' has only one optional parameter") ])
+        ("test_016d", "key type 'RSA' has only one optional parameter"),
+        ("test_016e", "unsupported EC curve"),
+        ("test_016f", "key type 'EC' has only one optional parameter") ])
     def test_300_016(self, confFile, expErrMsg):
         # invalid pkey specification
         TestEnv.install_test_conf(confFile);
@@ -204,3 +206,12 @@ class TestConf:
         if expErrMsg:
             assert TestEnv.apache_err_scan( re.compile(expErrMsg) )
 
+
+    @pytest.mark.parametrize("confFile,expErrMsg", [ 
+        ("test_022a", "number of parallel renewals must be between 1 and 64"), 
+        ("test_022b", "takes one argument") ])
+    def test_300_022(self, confFile, expErrMsg):
+        # invalid parameter for MDRenewParallel
+        TestEnv.install_test_conf(confFile);
+        assert TestEnv.apache_restart() == 1, "Server accepted test config {}".format(confFile)
+        assert expErrMsg in TestEnv.apachectl_stderr
@@ -589,6 +589,21 @@ class TestConf:
         TestEnv.clear_store()
         TestEnv.set_store_dir("md")
 
+    # --------- sync with many mds in store ---------
+
+    def test_310_600(self):
+        # test case: sync with more mds in store than are read one by one
+        domain = "test310-600-" + TestConf.dns_uniq
+        for i in range (0, 70):
+            assert TestEnv.a2md([ "add", "%d.%s" % (i, domain) ])['rv'] == 0
+        # one of them has a domain that the configured md takes over
+        assert TestEnv.a2md([ "add", "70." + domain, "mail.testdomain.org" ])['rv'] == 0
+        assert TestEnv.a2md([ "add", "testdomain.org", "www.testdomain.org" ])['rv'] == 0
+        TestEnv.install_test_conf("one_md");
+        assert TestEnv.apache_restart() == 0
+        self._check_md_names("testdomain.org", ["testdomain.org", "www.testdomain.org", "mail.testdomain.org"], 1, 72)
+        self._check_md_names("70." + domain, ["70." + domain], 1, 72)
+
     # --------- _utils_ ---------
 
     def _check_md_names(self, name, dnsList, state, mdCount):
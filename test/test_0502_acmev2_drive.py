@@ -452,7 +452,10 @@ class TestDrive :
         ( "RSA", [ 2048 ], 2048 ),
         ( "RSA", [ 3072 ], 3072),
         ( "RSA", [ 4096 ], 4096 ),
-        ( "Default", [ ], 2048 )
+        ( "Default", [ ], 2048 ),
+        ( "EC", [ ], 256 ),
+        ( "EC", [ "P-256" ], 256 ),
+        ( "EC", [ "secp384r1" ], 384 )
     ])
     def test_502_202(self, keyType, keyParams, expKeyLength):
         # test case: specify RSA key length and verify resulting cert key 
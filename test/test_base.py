@@ -265,8 +265,13 @@ class TestEnv:
         assert len(TestEnv.STORE_DIR) > 1
         if not os.path.exists(TestEnv.STORE_DIR):
             os.makedirs(TestEnv.STORE_DIR)
-        for dir in [ "challenges", "tmp", "archive", "domains", "accounts", "staging" ]:
+        for dir in [ "challenges", "tmp", "archive", "domains", "accounts", "staging",
+                     "keys", "ocsp", "cache", "leases" ]:
             shutil.rmtree(os.path.join(TestEnv.STORE_DIR, dir), ignore_errors=True)
+        if os.path.exists(os.path.join(TestEnv.STORE_DIR, "md_store.pack")):
+            os.remove(os.path.join(TestEnv.STORE_DIR, "md_store.pack"))
+        if os.path.exists(TestEnv.path_account_index()):
+            os.remove(TestEnv.path_account_index())
 
     @classmethod
     def authz_save( cls, name, content ) :
@@ -282,6 +287,10 @@ class TestEnv:
     def path_account( cls, acct ) : 
         return os.path.join(TestEnv.STORE_DIR, 'accounts', acct, 'account.json')
 
+    @classmethod
+    def path_account_index( cls ) : 
+        return os.path.join(TestEnv.STORE_DIR, 'cache', 'accounts', 'accounts.json')
+
     @classmethod
     def path_account_key( cls, acct ) : 
         return os.path.join(TestEnv.STORE_DIR, 'accounts', acct, 'account.pem')
@@ -20,7 +20,11 @@ static Suite *main_test_suite(void)
 {
     Suite *suite = suite_create("main");
 
+    suite_add_tcase(suite, md_index_test_case());
     suite_add_tcase(suite, md_json_test_case());
+    suite_add_tcase(suite, md_ocsp_test_case());
+    suite_add_tcase(suite, md_store_fs_test_case());
+    suite_add_tcase(suite, md_store_pack_test_case());
     suite_add_tcase(suite, md_util_test_case());
 
     return suite;
@@ -40,5 +40,9 @@
  * main_test_suite() in main.c.
  */
 
+TCase *md_index_test_case(void);
 TCase *md_json_test_case(void);
+TCase *md_ocsp_test_case(void);
+TCase *md_store_fs_test_case(void);
+TCase *md_store_pack_test_case(void);
 TCase *md_util_test_case(void);
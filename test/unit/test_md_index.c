@@ -0,0 +1,166 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_index.h"
+
+/*
+ * Helpers
+ */
+
+static md_t *mk_md(apr_pool_t *p, const char *name, ...)
+{
+    apr_array_header_t *domains;
+    const char *domain;
+    va_list ap;
+    md_t *md;
+    
+    domains = apr_array_make(p, 5, sizeof(const char*));
+    APR_ARRAY_PUSH(domains, const char*) = name;
+    va_start(ap, name);
+    while ((domain = va_arg(ap, const char*))) {
+        APR_ARRAY_PUSH(domains, const char*) = domain;
+    }
+    va_end(ap);
+    
+    md = md_create(p, domains);
+    md->name = name;
+    return md;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_index_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_index_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+START_TEST(index_lookups)
+{
+    md_index_t *idx;
+    md_t *md1, *md2;
+    
+    md1 = mk_md(g_pool, "example.org", "www.example.org", NULL);
+    md2 = mk_md(g_pool, "example.net", "*.example.net", NULL);
+    idx = md_index_create(g_pool);
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, md1, NULL, NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, md2, NULL, NULL));
+    ck_assert_int_eq(2, md_index_count(idx));
+    
+    ck_assert(md1 == md_index_get_by_name(idx, "example.org"));
+    ck_assert(NULL == md_index_get_by_name(idx, "www.example.org"));
+    
+    ck_assert(md1 == md_index_get_by_domain(idx, "www.example.org"));
+    ck_assert(md1 == md_index_get_by_domain(idx, "WWW.Example.ORG"));
+    ck_assert(NULL == md_index_get_by_domain(idx, "mail.example.org"));
+    ck_assert(md2 == md_index_get_by_domain(idx, "example.net"));
+    ck_assert(md2 == md_index_get_by_domain(idx, "mail.example.net"));
+    ck_assert(NULL == md_index_get_by_domain(idx, "a.mail.example.net"));
+    ck_assert(NULL == md_index_get_by_domain(idx, "net"));
+    
+    ck_assert(md1 == md_index_get_by_domain_exact(idx, "WWW.example.org"));
+    ck_assert(md2 == md_index_get_by_domain_exact(idx, "*.example.net"));
+    ck_assert(NULL == md_index_get_by_domain_exact(idx, "mail.example.net"));
+}
+END_TEST
+
+START_TEST(index_overlaps)
+{
+    md_index_t *idx;
+    md_t *md1, *md2, *md3, *other;
+    const char *domain = NULL;
+    
+    md1 = mk_md(g_pool, "example.org", "www.example.org", NULL);
+    md2 = mk_md(g_pool, "example.com", "WWW.example.org", NULL);
+    md3 = mk_md(g_pool, "example.org", "mail.example.org", NULL);
+    idx = md_index_create(g_pool);
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, md1, NULL, NULL));
+    
+    ck_assert_int_eq(APR_EEXIST, md_index_add(idx, md2, &other, &domain));
+    ck_assert(md1 == other);
+    ck_assert_str_eq("www.example.org", domain);
+    ck_assert(md1 == md_index_get_by_dns_overlap(idx, md2, NULL));
+    ck_assert(NULL == md_index_get_by_dns_overlap(idx, md1, NULL));
+    
+    /* same name replaces */
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, md3, NULL, NULL));
+    ck_assert(md3 == md_index_get_by_domain(idx, "mail.example.org"));
+    ck_assert(NULL == md_index_get_by_domain(idx, "www.example.org"));
+    
+    md_index_remove(idx, "example.org");
+    ck_assert_int_eq(0, md_index_count(idx));
+    ck_assert(NULL == md_index_get_by_domain(idx, "mail.example.org"));
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, md2, NULL, NULL));
+}
+END_TEST
+
+static int count_md(void *baton, md_t *md)
+{
+    int *pcount = baton;
+    
+    (void)md;
+    ++(*pcount);
+    return *pcount < 2;
+}
+
+START_TEST(index_do)
+{
+    md_index_t *idx;
+    int count = 0;
+    
+    idx = md_index_create(g_pool);
+    ck_assert_int_eq(1, md_index_do(idx, count_md, &count));
+    ck_assert_int_eq(0, count);
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, mk_md(g_pool, "a.org", NULL), NULL, NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, mk_md(g_pool, "b.org", NULL), NULL, NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_index_add(idx, mk_md(g_pool, "c.org", NULL), NULL, NULL));
+    /* stops when the callback says so */
+    ck_assert_int_eq(0, md_index_do(idx, count_md, &count));
+    ck_assert_int_eq(2, count);
+}
+END_TEST
+
+TCase *md_index_test_case(void)
+{
+    TCase *testcase = tcase_create("md_index");
+
+    tcase_add_checked_fixture(testcase, md_index_setup, md_index_teardown);
+
+    tcase_add_test(testcase, index_lookups);
+    tcase_add_test(testcase, index_overlaps);
+    tcase_add_test(testcase, index_do);
+
+    return testcase;
+}
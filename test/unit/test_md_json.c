@@ -114,6 +114,27 @@ START_TEST(clearing_md_json_t_pool_releases_internal_object)
 }
 END_TEST
 
+START_TEST(shared_md_json_t_outlives_its_source_pool)
+{
+    apr_pool_t *p;
+    md_json_t *json, *shared;
+    json_t *internal;
+
+    ck_assert_int_eq(apr_pool_create(&p, g_pool), APR_SUCCESS);
+    json = md_json_create(p);
+    md_json_sets("value", json, "key", NULL);
+    internal = json->j;
+
+    shared = md_json_share(g_pool, json);
+    ck_assert_ptr_eq(shared->j, internal);
+    ck_assert_int_eq(internal->refcount, 2);
+
+    apr_pool_destroy(p);
+    ck_assert_int_eq(internal->refcount, 1);
+    ck_assert_str_eq(md_json_gets(shared, "key", NULL), "value");
+}
+END_TEST
+
 START_TEST(booleans)
 {
     md_json_t *json = md_json_create(g_pool);
@@ -326,6 +347,7 @@ TCase *md_json_test_case(void)
     tcase_add_test(testcase, json_create_makes_object_with_refcount_one);
     tcase_add_test(testcase, json_destroy_releases_object);
     tcase_add_test(testcase, clearing_md_json_t_pool_releases_internal_object);
+    tcase_add_test(testcase, shared_md_json_t_outlives_its_source_pool);
     
     tcase_add_test(testcase, booleans);
     tcase_add_test(testcase, longs);
@@ -0,0 +1,297 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_file_io.h>
+#include <apr_strings.h>
+
+#include <openssl/evp.h>
+#include <openssl/ocsp.h>
+#include <openssl/x509.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_ocsp.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_base;
+static md_pkey_t *g_ca_key;
+static md_cert_t *g_ca;
+
+static md_pkey_t *make_key(void)
+{
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.type = MD_PKEY_TYPE_EC;
+    return (APR_SUCCESS == md_pkey_gen(&pkey, g_pool, &spec))? pkey : NULL;
+}
+
+static md_cert_t *make_ca(const char *cn, md_pkey_t *pkey)
+{
+    apr_array_header_t *domains;
+    md_cert_t *cert;
+
+    domains = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = cn;
+    if (APR_SUCCESS != md_cert_self_sign(&cert, cn, domains, pkey,
+                                         apr_time_from_sec(MD_SECS_PER_DAY), g_pool)) {
+        return NULL;
+    }
+    return cert;
+}
+
+static void md_ocsp_setup(void)
+{
+    const char *tmp;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS
+        || !(g_ca_key = make_key())
+        || !(g_ca = make_ca("ca.test", g_ca_key))) {
+        exit(1);
+    }
+    g_base = apr_psprintf(g_pool, "%s/md_ocsp-%" APR_TIME_T_FMT, tmp, apr_time_now());
+}
+
+static void md_ocsp_teardown(void)
+{
+    md_util_ftree_remove(g_base, g_pool);
+    apr_pool_destroy(g_pool);
+}
+
+/* a certificate for cn, issued by g_ca */
+static md_cert_t *make_leaf(const char *cn, long serial)
+{
+    X509 *x, *ca = md_cert_get_X509(g_ca);
+    md_pkey_t *pkey;
+    md_cert_t *cert = NULL;
+    unsigned char *der, *buf;
+    int len;
+
+    if (!(pkey = make_key()) || !(x = X509_new())) return NULL;
+    X509_set_version(x, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x), serial);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(x), "CN", MBSTRING_ASC,
+                               (const unsigned char *)cn, -1, -1, 0);
+    X509_set_issuer_name(x, X509_get_subject_name(ca));
+    X509_gmtime_adj(X509_get_notBefore(x), 0);
+    X509_gmtime_adj(X509_get_notAfter(x), MD_SECS_PER_DAY);
+    X509_set_pubkey(x, md_pkey_get_EVP_PKEY(pkey));
+    if (X509_sign(x, md_pkey_get_EVP_PKEY(g_ca_key), EVP_sha256()) > 0
+        && (len = i2d_X509(x, NULL)) > 0) {
+        buf = der = apr_palloc(g_pool, (apr_size_t)len);
+        if (i2d_X509(x, &buf) == len) {
+            md_cert_from_base64url(&cert, md_util_base64url_encode((const char *)der,
+                                                                   (apr_size_t)len, g_pool),
+                                   g_pool);
+        }
+    }
+    X509_free(x);
+    return cert;
+}
+
+/* a successful response with the status of cert, signed by signer */
+static const char *make_resp(apr_size_t *plen, md_cert_t *cert, int status,
+                             md_cert_t *signer, md_pkey_t *signer_key)
+{
+    OCSP_BASICRESP *bs;
+    OCSP_RESPONSE *resp = NULL;
+    OCSP_CERTID *id;
+    ASN1_TIME *this_upd, *next_upd;
+    unsigned char *der = NULL, *buf;
+    int len;
+
+    bs = OCSP_BASICRESP_new();
+    id = OCSP_cert_to_id(NULL, md_cert_get_X509(cert), md_cert_get_X509(g_ca));
+    this_upd = X509_gmtime_adj(NULL, 0);
+    next_upd = X509_gmtime_adj(NULL, MD_SECS_PER_DAY);
+    if (bs && id && this_upd && next_upd
+        && OCSP_basic_add1_status(bs, id, status, 0, NULL, this_upd, next_upd)
+        && OCSP_basic_sign(bs, md_cert_get_X509(signer), md_pkey_get_EVP_PKEY(signer_key),
+                           EVP_sha256(), NULL, 0)
+        && (resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs))
+        && (len = i2d_OCSP_RESPONSE(resp, NULL)) > 0) {
+        buf = der = apr_palloc(g_pool, (apr_size_t)len);
+        if (i2d_OCSP_RESPONSE(resp, &buf) != len) {
+            der = NULL;
+        }
+        *plen = (apr_size_t)len;
+    }
+    if (resp) OCSP_RESPONSE_free(resp);
+    if (next_upd) ASN1_TIME_free(next_upd);
+    if (this_upd) ASN1_TIME_free(this_upd);
+    if (id) OCSP_CERTID_free(id);
+    if (bs) OCSP_BASICRESP_free(bs);
+    return (const char *)der;
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_ocsp_parse_good)
+{
+    md_cert_t *leaf;
+    md_ocsp_resp_t *resp;
+    const char *der;
+    apr_size_t len;
+    apr_time_t now = apr_time_now();
+
+    ck_assert_ptr_nonnull(leaf = make_leaf("a.test", 2));
+    ck_assert_ptr_nonnull(der = make_resp(&len, leaf, V_OCSP_CERTSTATUS_GOOD, g_ca, g_ca_key));
+
+    ck_assert_int_eq(md_ocsp_resp_parse(&resp, der, len, leaf, g_ca, g_pool), APR_SUCCESS);
+    ck_assert_str_eq(resp->status, "good");
+    ck_assert_str_eq(resp->fingerprint, md_ocsp_fingerprint(md_cert_get_X509(leaf), g_pool));
+    ck_assert(resp->this_update <= now + apr_time_from_sec(1));
+    ck_assert(resp->next_update > now + apr_time_from_sec(MD_SECS_PER_DAY - 60));
+    ck_assert(resp->der_len == len);
+    ck_assert(!memcmp(resp->der, der, len));
+}
+END_TEST
+
+START_TEST(md_ocsp_parse_revoked)
+{
+    md_cert_t *leaf;
+    md_ocsp_resp_t *resp;
+    const char *der;
+    apr_size_t len;
+
+    ck_assert_ptr_nonnull(leaf = make_leaf("a.test", 2));
+    ck_assert_ptr_nonnull(der = make_resp(&len, leaf, V_OCSP_CERTSTATUS_REVOKED,
+                                          g_ca, g_ca_key));
+    ck_assert_int_eq(md_ocsp_resp_parse(&resp, der, len, leaf, g_ca, g_pool), APR_SUCCESS);
+    ck_assert_str_eq(resp->status, "revoked");
+}
+END_TEST
+
+START_TEST(md_ocsp_verify_signer)
+{
+    md_cert_t *leaf, *other;
+    md_pkey_t *other_key;
+    md_ocsp_resp_t *resp;
+    const char *der;
+    apr_size_t len;
+
+    ck_assert_ptr_nonnull(leaf = make_leaf("a.test", 2));
+    ck_assert_ptr_nonnull(other_key = make_key());
+    ck_assert_ptr_nonnull(other = make_ca("other.test", other_key));
+
+    /* signed by someone the issuer did not delegate to */
+    ck_assert_ptr_nonnull(der = make_resp(&len, leaf, V_OCSP_CERTSTATUS_GOOD,
+                                          other, other_key));
+    ck_assert_int_eq(md_ocsp_resp_parse(&resp, der, len, leaf, g_ca, g_pool), APR_EINVAL);
+    ck_assert(resp == NULL);
+
+    /* garbage and truncated responses */
+    ck_assert_ptr_nonnull(der = make_resp(&len, leaf, V_OCSP_CERTSTATUS_GOOD, g_ca, g_ca_key));
+    ck_assert_int_eq(md_ocsp_resp_parse(&resp, der, len / 2, leaf, g_ca, g_pool), APR_EINVAL);
+    ck_assert_int_eq(md_ocsp_resp_parse(&resp, "nonsense", 8, leaf, g_ca, g_pool), APR_EINVAL);
+}
+END_TEST
+
+START_TEST(md_ocsp_verify_cert)
+{
+    md_cert_t *leaf, *leaf2;
+    md_ocsp_resp_t *resp;
+    const char *der;
+    apr_size_t len;
+
+    ck_assert_ptr_nonnull(leaf = make_leaf("a.test", 2));
+    ck_assert_ptr_nonnull(leaf2 = make_leaf("b.test", 3));
+
+    /* a response about another certificate says nothing about ours */
+    ck_assert_ptr_nonnull(der = make_resp(&len, leaf2, V_OCSP_CERTSTATUS_GOOD,
+                                          g_ca, g_ca_key));
+    ck_assert_int_eq(md_ocsp_resp_parse(&resp, der, len, leaf, g_ca, g_pool), APR_ENOENT);
+    ck_assert(resp == NULL);
+}
+END_TEST
+
+START_TEST(md_ocsp_save_load)
+{
+    md_store_t *store;
+    md_cert_t *leaf, *leaf2;
+    md_ocsp_resp_t *resp, *loaded;
+    apr_array_header_t *resps, *lresps;
+    const md_ocsp_resp_t *found;
+    const char *der;
+    apr_size_t len;
+    apr_time_t due;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+    ck_assert_ptr_nonnull(leaf = make_leaf("a.test", 2));
+    ck_assert_ptr_nonnull(leaf2 = make_leaf("b.test", 3));
+    ck_assert_ptr_nonnull(der = make_resp(&len, leaf, V_OCSP_CERTSTATUS_GOOD, g_ca, g_ca_key));
+    ck_assert_int_eq(md_ocsp_resp_parse(&resp, der, len, leaf, g_ca, g_pool), APR_SUCCESS);
+
+    ck_assert(APR_STATUS_IS_ENOENT(md_ocsp_load(&lresps, store, "a.test", g_pool)));
+    ck_assert(md_ocsp_due(store, "a.test", 0, g_pool) == 0);
+
+    resps = apr_array_make(g_pool, 1, sizeof(md_ocsp_resp_t *));
+    APR_ARRAY_PUSH(resps, md_ocsp_resp_t *) = resp;
+    ck_assert_int_eq(md_ocsp_save(store, "a.test", resps, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_ocsp_load(&lresps, store, "a.test", g_pool), APR_SUCCESS);
+    ck_assert_int_eq(lresps->nelts, 1);
+    loaded = APR_ARRAY_IDX(lresps, 0, md_ocsp_resp_t *);
+    ck_assert_str_eq(loaded->fingerprint, resp->fingerprint);
+    ck_assert_str_eq(loaded->status, "good");
+    ck_assert(apr_time_sec(loaded->this_update) == apr_time_sec(resp->this_update));
+    ck_assert(apr_time_sec(loaded->next_update) == apr_time_sec(resp->next_update));
+    ck_assert(loaded->der_len == len);
+    ck_assert(!memcmp(loaded->der, der, len));
+
+    /* found for its certificate only, and only while valid */
+    ck_assert_ptr_nonnull(found = md_ocsp_find(lresps, md_cert_get_X509(leaf), g_pool));
+    ck_assert(found == loaded);
+    ck_assert(md_ocsp_find(lresps, md_cert_get_X509(leaf2), g_pool) == NULL);
+    loaded->next_update = apr_time_now() - apr_time_from_sec(1);
+    ck_assert(md_ocsp_find(lresps, md_cert_get_X509(leaf), g_pool) == NULL);
+
+    /* due half way through its validity, unless the certificates are newer */
+    due = md_ocsp_due(store, "a.test", 0, g_pool);
+    ck_assert(due == apr_time_from_sec(apr_time_sec(resp->this_update))
+              + (apr_time_from_sec(apr_time_sec(resp->next_update))
+                 - apr_time_from_sec(apr_time_sec(resp->this_update))) / 2);
+    ck_assert(md_ocsp_due(store, "a.test", apr_time_now() + apr_time_from_sec(60),
+                          g_pool) == 0);
+}
+END_TEST
+
+TCase *md_ocsp_test_case(void)
+{
+    TCase *testcase = tcase_create("md_ocsp");
+
+    tcase_add_checked_fixture(testcase, md_ocsp_setup, md_ocsp_teardown);
+
+    tcase_add_test(testcase, md_ocsp_parse_good);
+    tcase_add_test(testcase, md_ocsp_parse_revoked);
+    tcase_add_test(testcase, md_ocsp_verify_signer);
+    tcase_add_test(testcase, md_ocsp_verify_cert);
+    tcase_add_test(testcase, md_ocsp_save_load);
+
+    return testcase;
+}
@@ -0,0 +1,356 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_keypool.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_base;
+
+static void md_store_fs_setup(void)
+{
+    const char *tmp;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_base = apr_psprintf(g_pool, "%s/md_store_fs-%" APR_TIME_T_FMT, tmp, apr_time_now());
+}
+
+static void md_store_fs_teardown(void)
+{
+    md_util_ftree_remove(g_base, g_pool);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_store_fs_lease_exclusive)
+{
+    md_store_t *store, *store2;
+    apr_interval_time_t lease = apr_time_from_sec(60);
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+    ck_assert_int_eq(md_store_fs_init(&store2, g_pool, g_base), APR_SUCCESS);
+
+    ck_assert_int_eq(md_store_lease(store, g_pool, "a.org", "node1", lease), APR_SUCCESS);
+    /* the owner extends, others have to wait */
+    ck_assert_int_eq(md_store_lease(store, g_pool, "a.org", "node1", lease), APR_SUCCESS);
+    ck_assert(APR_STATUS_IS_EAGAIN(md_store_lease(store2, g_pool, "a.org", "node2", lease)));
+    ck_assert_int_eq(md_store_lease(store2, g_pool, "b.org", "node2", lease), APR_SUCCESS);
+
+    /* only the owner releases */
+    ck_assert_int_eq(md_store_release(store2, g_pool, "a.org", "node2"), APR_SUCCESS);
+    ck_assert(APR_STATUS_IS_EAGAIN(md_store_lease(store2, g_pool, "a.org", "node2", lease)));
+    ck_assert_int_eq(md_store_release(store, g_pool, "a.org", "node1"), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease(store2, g_pool, "a.org", "node2", lease), APR_SUCCESS);
+    ck_assert_int_eq(md_store_release(store, g_pool, "c.org", "node1"), APR_SUCCESS);
+}
+END_TEST
+
+START_TEST(md_store_fs_lease_expired)
+{
+    md_store_t *store;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+
+    ck_assert_int_eq(md_store_lease(store, g_pool, "a.org", "node1", 0), APR_SUCCESS);
+    apr_sleep(apr_time_from_msec(10));
+    ck_assert_int_eq(md_store_lease(store, g_pool, "a.org", "node2", apr_time_from_sec(60)), 
+                     APR_SUCCESS);
+    ck_assert(APR_STATUS_IS_EAGAIN(md_store_lease(store, g_pool, "a.org", "node1", 
+                                                  apr_time_from_sec(60))));
+}
+END_TEST
+
+START_TEST(md_store_fs_lease_takeover)
+{
+    md_store_t *store;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+
+    /* the late release of an expired lease leaves the new holder alone */
+    ck_assert_int_eq(md_store_lease(store, g_pool, "x.org", "node1", 0), APR_SUCCESS);
+    apr_sleep(apr_time_from_msec(10));
+    ck_assert_int_eq(md_store_lease(store, g_pool, "x.org", "node2", apr_time_from_sec(60)), 
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_store_release(store, g_pool, "x.org", "node1"), APR_SUCCESS);
+    ck_assert(APR_STATUS_IS_EAGAIN(md_store_lease(store, g_pool, "x.org", "node3", 
+                                                  apr_time_from_sec(60))));
+    ck_assert_int_eq(md_store_lease(store, g_pool, "x.org", "node2", apr_time_from_sec(60)), 
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_store_release(store, g_pool, "x.org", "node2"), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease(store, g_pool, "x.org", "node3", apr_time_from_sec(60)), 
+                     APR_SUCCESS);
+}
+END_TEST
+
+START_TEST(md_store_fs_pkey_cache)
+{
+    md_store_t *store;
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey, *l1, *l2;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+    ck_assert_int_eq(md_pkey_cache_enable(g_pool, apr_time_from_sec(60)), APR_SUCCESS);
+    memset(&spec, 0, sizeof(spec));
+    spec.type = MD_PKEY_TYPE_EC;
+    
+    /* account keys are encrypted, loading again gives the decrypted one */
+    ck_assert_int_eq(md_pkey_gen(&pkey, g_pool, &spec), APR_SUCCESS);
+    ck_assert_int_eq(md_store_save(store, g_pool, MD_SG_ACCOUNTS, "acct", MD_FN_PRIVKEY, 
+                                   MD_SV_PKEY, pkey, 0), APR_SUCCESS);
+    ck_assert_int_eq(md_store_load(store, MD_SG_ACCOUNTS, "acct", MD_FN_PRIVKEY, 
+                                   MD_SV_PKEY, (void**)&l1, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_store_load(store, MD_SG_ACCOUNTS, "acct", MD_FN_PRIVKEY, 
+                                   MD_SV_PKEY, (void**)&l2, g_pool), APR_SUCCESS);
+    ck_assert(md_pkey_get_EVP_PKEY(l1) == md_pkey_get_EVP_PKEY(l2));
+    
+    /* a saved key is read again, even when its file has the same mtime and size */
+    ck_assert_int_eq(md_pkey_gen(&pkey, g_pool, &spec), APR_SUCCESS);
+    ck_assert_int_eq(md_store_save(store, g_pool, MD_SG_ACCOUNTS, "acct", MD_FN_PRIVKEY, 
+                                   MD_SV_PKEY, pkey, 0), APR_SUCCESS);
+    ck_assert_int_eq(md_store_load(store, MD_SG_ACCOUNTS, "acct", MD_FN_PRIVKEY, 
+                                   MD_SV_PKEY, (void**)&l2, g_pool), APR_SUCCESS);
+    ck_assert(md_pkey_get_EVP_PKEY(l1) != md_pkey_get_EVP_PKEY(l2));
+    
+    md_pkey_cache_enable(g_pool, 0);
+}
+END_TEST
+
+START_TEST(md_store_fs_batch)
+{
+    md_store_t *store;
+    md_store_batch_t *batch;
+    const char *text;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+    md_store_fs_sync_set(store, 1);
+    ck_assert_int_eq(md_store_batch_begin(&batch, store, g_pool), APR_SUCCESS);
+    
+    /* nothing is written before the commit, the last of repeated saves wins */
+    md_store_batch_save(batch, MD_SG_STAGING, "a.org", "t1.txt", MD_SV_TEXT, (void*)"1", 1);
+    md_store_batch_save(batch, MD_SG_STAGING, "a.org", "t2.txt", MD_SV_TEXT, (void*)"2", 0);
+    md_store_batch_save(batch, MD_SG_STAGING, "a.org", "t1.txt", MD_SV_TEXT, (void*)"3", 0);
+    ck_assert(APR_STATUS_IS_ENOENT(md_store_load(store, MD_SG_STAGING, "a.org", "t1.txt", 
+                                                 MD_SV_TEXT, (void**)&text, g_pool)));
+    ck_assert_int_eq(md_store_batch_commit(batch), APR_SUCCESS);
+    ck_assert_int_eq(md_store_load(store, MD_SG_STAGING, "a.org", "t1.txt", 
+                                   MD_SV_TEXT, (void**)&text, g_pool), APR_SUCCESS);
+    ck_assert_str_eq(text, "3");
+    ck_assert_int_eq(md_store_load(store, MD_SG_STAGING, "a.org", "t2.txt", 
+                                   MD_SV_TEXT, (void**)&text, g_pool), APR_SUCCESS);
+    ck_assert_str_eq(text, "2");
+    
+    /* the batch is reusable, an exclusive create of an existing value fails */
+    md_store_batch_save(batch, MD_SG_STAGING, "a.org", "t1.txt", MD_SV_TEXT, (void*)"4", 1);
+    ck_assert(APR_SUCCESS != md_store_batch_commit(batch));
+    md_store_fs_sync_set(store, 0);
+}
+END_TEST
+
+static int first_name(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    (void)ptemp;
+    *(const char **)baton = apr_pstrdup(g_pool, name);
+    return 0;
+}
+
+START_TEST(md_store_fs_keypool_claim)
+{
+    md_store_t *store;
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey;
+    const char *name = NULL, *fname;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+    memset(&spec, 0, sizeof(spec));
+    spec.type = MD_PKEY_TYPE_EC;
+    
+    ck_assert_int_eq(md_keypool_fill(store, &spec, 1, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_keypool_take(&pkey, store, &spec, g_pool), APR_SUCCESS);
+    ck_assert(pkey != NULL);
+    ck_assert_int_eq(md_keypool_count(store, &spec, g_pool), 0);
+    
+    /* a key someone else claimed is not handed out */
+    ck_assert_int_eq(md_keypool_fill(store, &spec, 1, g_pool), APR_SUCCESS);
+    md_store_iter_names(first_name, &name, store, g_pool, MD_SG_KEYS, "*");
+    ck_assert(name != NULL);
+    ck_assert_int_eq(md_store_save(store, g_pool, MD_SG_KEYS, name, "claim.txt", 
+                                   MD_SV_TEXT, (void*)"other", 1), APR_SUCCESS);
+    ck_assert(APR_STATUS_IS_ENOENT(md_keypool_take(&pkey, store, &spec, g_pool)));
+    ck_assert(pkey == NULL);
+    
+    /* claimed keys do not count, the pool gets filled again */
+    ck_assert_int_eq(md_keypool_count(store, &spec, g_pool), 0);
+    ck_assert_int_eq(md_keypool_fill(store, &spec, 1, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_keypool_count(store, &spec, g_pool), 1);
+    
+    /* a claim left behind for long goes with its key */
+    ck_assert_int_eq(md_store_get_fname(&fname, store, MD_SG_KEYS, name, "claim.txt", 
+                                        g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_mtime_set(fname, apr_time_now() - apr_time_from_sec(3600), 
+                                        g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_keypool_fill(store, &spec, 1, g_pool), APR_EEXIST);
+    ck_assert(0 == md_store_get_modified(store, MD_SG_KEYS, name, "claim.txt", g_pool));
+    ck_assert_int_eq(md_keypool_count(store, &spec, g_pool), 1);
+}
+END_TEST
+
+static void stage_and_move(md_store_t *store, const char *name, int times)
+{
+    int i;
+    
+    for (i = 0; i < times; ++i) {
+        ck_assert_int_eq(md_store_save(store, g_pool, MD_SG_STAGING, name, "t.txt", 
+                                       MD_SV_TEXT, (void*)apr_itoa(g_pool, i), 0), APR_SUCCESS);
+        ck_assert_int_eq(md_store_move(store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS, 
+                                       name, 1), APR_SUCCESS);
+    }
+}
+
+START_TEST(md_store_fs_gc)
+{
+    md_store_t *store;
+    md_store_gc_policy_t policy;
+    md_store_gc_stats_t stats;
+    const char *dir;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+    /* the first move has nothing to archive */
+    stage_and_move(store, "a.org", 5);
+    stage_and_move(store, "b.a.org", 3);
+    ck_assert_int_eq(md_util_is_dir(apr_pstrcat(g_pool, g_base, "/archive/a.org.4", NULL), 
+                                    g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_util_is_dir(apr_pstrcat(g_pool, g_base, "/archive/b.a.org.2", NULL), 
+                                    g_pool), APR_SUCCESS);
+    
+    md_store_save(store, g_pool, MD_SG_TMP, "old.org", "t.txt", MD_SV_TEXT, (void*)"x", 0);
+    md_store_save(store, g_pool, MD_SG_TMP, "new.org", "t.txt", MD_SV_TEXT, (void*)"x", 0);
+    dir = apr_pstrcat(g_pool, g_base, "/tmp/old.org", NULL);
+    ck_assert_int_eq(apr_file_mtime_set(dir, apr_time_now() - apr_time_from_sec(7200), 
+                                        g_pool), APR_SUCCESS);
+    
+    policy.archive_keep = 1;
+    policy.tmp_age = apr_time_from_sec(3600);
+    policy.challenges_age = apr_time_from_sec(3600);
+    ck_assert_int_eq(md_store_gc(store, g_pool, &policy, &stats), APR_SUCCESS);
+    ck_assert_int_eq(stats.archives, 3 + 1);
+    ck_assert_int_eq(stats.tmp, 1);
+    ck_assert_int_eq(stats.challenges, 0);
+    ck_assert(APR_STATUS_IS_ENOENT(md_util_is_dir(dir, g_pool)));
+    ck_assert_int_eq(md_util_is_dir(apr_pstrcat(g_pool, g_base, "/tmp/new.org", NULL), 
+                                    g_pool), APR_SUCCESS);
+    ck_assert(APR_STATUS_IS_ENOENT(md_util_is_dir(
+        apr_pstrcat(g_pool, g_base, "/archive/a.org.3", NULL), g_pool)));
+    
+    /* numbering goes on after the archived copies were removed */
+    stage_and_move(store, "a.org", 1);
+    ck_assert_int_eq(md_util_is_dir(apr_pstrcat(g_pool, g_base, "/archive/a.org.5", NULL), 
+                                    g_pool), APR_SUCCESS);
+}
+END_TEST
+
+#if APR_HAS_THREADS
+
+#define SAVE_MOVE_THREADS   4
+#define SAVE_MOVE_ROUNDS    25
+
+static void * APR_THREAD_FUNC save_move_run(apr_thread_t *thread, void *baton)
+{
+    md_store_t *store = baton;
+    apr_status_t rv = APR_SUCCESS;
+    apr_pool_t *p;
+    int i;
+    
+    /* each thread works in its own pool */
+    if (APR_SUCCESS == (rv = apr_pool_create(&p, NULL))) {
+        for (i = 0; i < SAVE_MOVE_ROUNDS && APR_SUCCESS == rv; ++i) {
+            rv = md_store_save(store, p, MD_SG_STAGING, "a.org", "t.txt", 
+                               MD_SV_TEXT, (void*)"x", 0);
+            if (APR_SUCCESS == rv) {
+                /* another thread may have moved our save already */
+                rv = md_store_move(store, p, MD_SG_STAGING, MD_SG_DOMAINS, "a.org", 1);
+                if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+            }
+        }
+        apr_pool_destroy(p);
+    }
+    apr_thread_exit(thread, rv);
+    return NULL;
+}
+
+START_TEST(md_store_fs_save_move_parallel)
+{
+    md_store_t *store;
+    apr_thread_t *threads[SAVE_MOVE_THREADS];
+    apr_status_t rv;
+    const char *text;
+    int i;
+
+    ck_assert_int_eq(md_store_fs_init(&store, g_pool, g_base), APR_SUCCESS);
+    for (i = 0; i < SAVE_MOVE_THREADS; ++i) {
+        ck_assert_int_eq(apr_thread_create(&threads[i], NULL, save_move_run, store, g_pool),
+                         APR_SUCCESS);
+    }
+    for (i = 0; i < SAVE_MOVE_THREADS; ++i) {
+        ck_assert_int_eq(apr_thread_join(&rv, threads[i]), APR_SUCCESS);
+        ck_assert_int_eq(rv, APR_SUCCESS);
+    }
+    ck_assert_int_eq(md_store_load(store, MD_SG_DOMAINS, "a.org", "t.txt", 
+                                   MD_SV_TEXT, (void**)&text, g_pool), APR_SUCCESS);
+    ck_assert_str_eq(text, "x");
+}
+END_TEST
+
+#endif /* APR_HAS_THREADS */
+
+TCase *md_store_fs_test_case(void)
+{
+    TCase *testcase = tcase_create("md_store_fs");
+
+    tcase_add_checked_fixture(testcase, md_store_fs_setup, md_store_fs_teardown);
+
+    tcase_add_test(testcase, md_store_fs_lease_exclusive);
+    tcase_add_test(testcase, md_store_fs_lease_expired);
+    tcase_add_test(testcase, md_store_fs_lease_takeover);
+    tcase_add_test(testcase, md_store_fs_pkey_cache);
+    tcase_add_test(testcase, md_store_fs_batch);
+    tcase_add_test(testcase, md_store_fs_gc);
+    tcase_add_test(testcase, md_store_fs_keypool_claim);
+#if APR_HAS_THREADS
+    tcase_add_test(testcase, md_store_fs_save_move_parallel);
+#endif
+
+    return testcase;
+}
@@ -0,0 +1,334 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_file_io.h>
+#include <apr_strings.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_store.h"
+#include "md_store_pack.h"
+#include "md_util.h"
+
+/*
+ * Helpers
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_base;
+
+static const char *load_text(md_store_t *store, md_store_group_t group,
+                             const char *name, const char *aspect)
+{
+    const char *text = NULL;
+
+    if (APR_SUCCESS != md_store_load(store, group, name, aspect, MD_SV_TEXT,
+                                     (void**)&text, g_pool)) {
+        return NULL;
+    }
+    return text;
+}
+
+static int count_names(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    int *pcount = baton;
+
+    (void)name;
+    (void)ptemp;
+    ++(*pcount);
+    return 1;
+}
+
+static const char *read_file(const char *fname)
+{
+    apr_finfo_t finfo;
+    apr_file_t *f;
+    char *data;
+
+    if (APR_SUCCESS != apr_stat(&finfo, fname, APR_FINFO_SIZE, g_pool)
+        || APR_SUCCESS != apr_file_open(&f, fname, APR_FOPEN_READ|APR_FOPEN_BINARY,
+                                        APR_FPROT_OS_DEFAULT, g_pool)) {
+        return NULL;
+    }
+    data = apr_pcalloc(g_pool, (apr_size_t)finfo.size + 1);
+    apr_file_read_full(f, data, (apr_size_t)finfo.size, NULL);
+    apr_file_close(f);
+    return data;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static void md_store_pack_setup(void)
+{
+    const char *tmp;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_base = apr_psprintf(g_pool, "%s/md_store_pack-%" APR_TIME_T_FMT, tmp, apr_time_now());
+}
+
+static void md_store_pack_teardown(void)
+{
+    md_util_ftree_remove(g_base, g_pool);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_store_pack_save_load)
+{
+    md_store_t *store;
+    apr_status_t rv;
+
+    ck_assert_int_eq(md_store_pack_init(&store, g_pool, g_base), APR_SUCCESS);
+
+    rv = md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "one", 1);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_str_eq(load_text(store, MD_SG_DOMAINS, "a.org", "t.txt"), "one");
+
+    rv = md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "two", 1);
+    ck_assert_int_eq(rv, APR_EEXIST);
+    rv = md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "two", 0);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_str_eq(load_text(store, MD_SG_DOMAINS, "a.org", "t.txt"), "two");
+    ck_assert(load_text(store, MD_SG_STAGING, "a.org", "t.txt") == NULL);
+
+    rv = md_store_remove(store, MD_SG_DOMAINS, "a.org", "t.txt", g_pool, 0);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    rv = md_store_remove(store, MD_SG_DOMAINS, "a.org", "t.txt", g_pool, 0);
+    ck_assert(APR_STATUS_IS_ENOENT(rv));
+    rv = md_store_remove(store, MD_SG_DOMAINS, "a.org", "t.txt", g_pool, 1);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+}
+END_TEST
+
+START_TEST(md_store_pack_reopen)
+{
+    md_store_t *store, *store2;
+    apr_file_t *f;
+    const char *fname;
+    apr_status_t rv;
+    int count = 0;
+
+    ck_assert_int_eq(md_store_pack_init(&store, g_pool, g_base), APR_SUCCESS);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "a", 0);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "b.org", "t.txt", MD_SV_TEXT, "b", 0);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "c.org", "t.txt", MD_SV_TEXT, "c", 0);
+    md_store_purge(store, g_pool, MD_SG_DOMAINS, "c.org");
+
+    /* a second instance, like another process, sees the same */
+    ck_assert_int_eq(md_store_pack_init(&store2, g_pool, g_base), APR_SUCCESS);
+    ck_assert_str_eq(load_text(store2, MD_SG_DOMAINS, "b.org", "t.txt"), "b");
+    rv = md_store_iter_names(count_names, &count, store2, g_pool, MD_SG_DOMAINS, "*");
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 2);
+
+    /* and picks up changes made by the first */
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "b.org", "t.txt", MD_SV_TEXT, "b2", 0);
+    ck_assert_str_eq(load_text(store2, MD_SG_DOMAINS, "b.org", "t.txt"), "b2");
+
+    /* a torn write at the end is ignored and overwritten */
+    ck_assert_int_eq(md_util_path_merge(&fname, g_pool, g_base, MD_FN_STORE_PACK, NULL),
+                     APR_SUCCESS);
+    ck_assert_int_eq(apr_file_open(&f, fname, APR_FOPEN_WRITE|APR_FOPEN_APPEND,
+                                   APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_write_full(f, "MDPR\0\0", 6, NULL), APR_SUCCESS);
+    apr_file_close(f);
+    ck_assert_str_eq(load_text(store2, MD_SG_DOMAINS, "a.org", "t.txt"), "a");
+    md_store_save(store2, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "a2", 0);
+    ck_assert_str_eq(load_text(store, MD_SG_DOMAINS, "a.org", "t.txt"), "a2");
+}
+END_TEST
+
+START_TEST(md_store_pack_corrupt)
+{
+    md_store_t *store, *store2;
+    apr_finfo_t finfo;
+    apr_file_t *f;
+    const char *fname;
+    char *data;
+    apr_size_t len, i;
+    apr_status_t rv;
+
+    ck_assert_int_eq(md_store_pack_init(&store, g_pool, g_base), APR_SUCCESS);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "corrupt-me", 0);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "b.org", "t.txt", MD_SV_TEXT, "b", 0);
+
+    /* damage a record that is not the last one */
+    ck_assert_int_eq(md_util_path_merge(&fname, g_pool, g_base, MD_FN_STORE_PACK, NULL),
+                     APR_SUCCESS);
+    ck_assert_int_eq(apr_stat(&finfo, fname, APR_FINFO_SIZE, g_pool), APR_SUCCESS);
+    len = (apr_size_t)finfo.size;
+    data = apr_palloc(g_pool, len);
+    ck_assert_int_eq(apr_file_open(&f, fname, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY,
+                                   APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_read_full(f, data, len, NULL), APR_SUCCESS);
+    for (i = 0; i + 10 <= len && memcmp(data + i, "corrupt-me", 10); ++i);
+    ck_assert(i + 10 <= len);
+    data[i] = 'C';
+    ck_assert_int_eq(apr_file_close(f), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_open(&f, fname, APR_FOPEN_WRITE|APR_FOPEN_BINARY,
+                                   APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_write_full(f, data, len, NULL), APR_SUCCESS);
+    apr_file_close(f);
+
+    /* it is not read past the damage, nor cut off there by a write */
+    rv = md_store_pack_init(&store2, g_pool, g_base);
+    if (APR_SUCCESS == rv) {
+        ck_assert(load_text(store2, MD_SG_DOMAINS, "b.org", "t.txt") == NULL);
+        rv = md_store_save(store2, g_pool, MD_SG_DOMAINS, "c.org", "t.txt", MD_SV_TEXT, "c", 0);
+        ck_assert(APR_SUCCESS != rv);
+    }
+    ck_assert_int_eq(apr_stat(&finfo, fname, APR_FINFO_SIZE, g_pool), APR_SUCCESS);
+    ck_assert_int_eq((int)finfo.size, (int)len);
+}
+END_TEST
+
+START_TEST(md_store_pack_bad_length)
+{
+    md_store_t *store, *store2;
+    apr_finfo_t finfo;
+    apr_file_t *f;
+    const char *fname;
+    apr_off_t offset, size;
+    apr_status_t rv;
+
+    ck_assert_int_eq(md_store_pack_init(&store, g_pool, g_base), APR_SUCCESS);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "a", 0);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "b.org", "t.txt", MD_SV_TEXT, "b", 0);
+
+    /* a length reaching past the end in the first record is no torn write */
+    ck_assert_int_eq(md_util_path_merge(&fname, g_pool, g_base, MD_FN_STORE_PACK, NULL),
+                     APR_SUCCESS);
+    ck_assert_int_eq(apr_stat(&finfo, fname, APR_FINFO_SIZE, g_pool), APR_SUCCESS);
+    size = finfo.size;
+    ck_assert_int_eq(apr_file_open(&f, fname, APR_FOPEN_WRITE|APR_FOPEN_BINARY,
+                                   APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    offset = 8 + 4;
+    ck_assert_int_eq(apr_file_seek(f, APR_SET, &offset), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_write_full(f, "\0\1\0\0", 4, NULL), APR_SUCCESS);
+    apr_file_close(f);
+
+    /* the later records are kept, writes fail instead */
+    rv = md_store_pack_init(&store2, g_pool, g_base);
+    if (APR_SUCCESS == rv) {
+        rv = md_store_save(store2, g_pool, MD_SG_DOMAINS, "c.org", "t.txt", MD_SV_TEXT, "c", 0);
+        ck_assert(APR_SUCCESS != rv);
+    }
+    ck_assert_int_eq(apr_stat(&finfo, fname, APR_FINFO_SIZE, g_pool), APR_SUCCESS);
+    ck_assert_int_eq((int)finfo.size, (int)size);
+}
+END_TEST
+
+START_TEST(md_store_pack_compact)
+{
+    md_store_t *store, *store2;
+    apr_finfo_t finfo;
+    const char *fname, *value = NULL;
+    char buf[1024];
+    int i;
+
+    ck_assert_int_eq(md_store_pack_init(&store, g_pool, g_base), APR_SUCCESS);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "b.org", "t.txt", MD_SV_TEXT, "b", 0);
+    memset(buf, 'x', sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (i = 0; i < 100; ++i) {
+        buf[0] = (char)('a' + i % 26);
+        value = apr_pstrdup(g_pool, buf);
+        ck_assert_int_eq(md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt",
+                                       MD_SV_TEXT, (void*)value, 0), APR_SUCCESS);
+    }
+
+    /* overwritten records were dropped on the way */
+    ck_assert_int_eq(md_util_path_merge(&fname, g_pool, g_base, MD_FN_STORE_PACK, NULL),
+                     APR_SUCCESS);
+    ck_assert_int_eq(apr_stat(&finfo, fname, APR_FINFO_SIZE, g_pool), APR_SUCCESS);
+    ck_assert(finfo.size < 100 * (apr_off_t)sizeof(buf) / 2);
+    ck_assert_str_eq(load_text(store, MD_SG_DOMAINS, "a.org", "t.txt"), value);
+
+    /* the compacted file is what others read */
+    ck_assert_int_eq(md_store_pack_init(&store2, g_pool, g_base), APR_SUCCESS);
+    ck_assert_str_eq(load_text(store2, MD_SG_DOMAINS, "a.org", "t.txt"), value);
+    ck_assert_str_eq(load_text(store2, MD_SG_DOMAINS, "b.org", "t.txt"), "b");
+}
+END_TEST
+
+START_TEST(md_store_pack_export)
+{
+    md_store_t *store;
+    const char *fname;
+
+    ck_assert_int_eq(md_store_pack_init(&store, g_pool, g_base), APR_SUCCESS);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "one", 0);
+    ck_assert_int_eq(md_store_get_fname(&fname, store, MD_SG_DOMAINS, "a.org", "t.txt", g_pool),
+                     APR_SUCCESS);
+    ck_assert_str_eq(read_file(fname), "one");
+
+    /* a change of the same size within the same second is exported as well */
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "two", 0);
+    ck_assert_int_eq(md_store_get_fname(&fname, store, MD_SG_DOMAINS, "a.org", "t.txt", g_pool),
+                     APR_SUCCESS);
+    ck_assert_str_eq(read_file(fname), "two");
+}
+END_TEST
+
+START_TEST(md_store_pack_move)
+{
+    md_store_t *store;
+    apr_status_t rv;
+
+    ck_assert_int_eq(md_store_pack_init(&store, g_pool, g_base), APR_SUCCESS);
+    md_store_save(store, g_pool, MD_SG_DOMAINS, "a.org", "t.txt", MD_SV_TEXT, "old", 0);
+    md_store_save(store, g_pool, MD_SG_STAGING, "a.org", "t.txt", MD_SV_TEXT, "new", 0);
+    ck_assert(md_store_is_newer(store, MD_SG_STAGING, MD_SG_DOMAINS, "a.org", "t.txt", g_pool));
+    ck_assert(!md_store_is_newer(store, MD_SG_DOMAINS, MD_SG_STAGING, "a.org", "t.txt", g_pool));
+
+    rv = md_store_move(store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS, "a.org", 0);
+    ck_assert_int_eq(rv, APR_EEXIST);
+    rv = md_store_move(store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS, "a.org", 1);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_str_eq(load_text(store, MD_SG_DOMAINS, "a.org", "t.txt"), "new");
+    ck_assert_str_eq(load_text(store, MD_SG_ARCHIVE, "a.org.1", "t.txt"), "old");
+    ck_assert(load_text(store, MD_SG_STAGING, "a.org", "t.txt") == NULL);
+
+    rv = md_store_move(store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS, "a.org", 1);
+    ck_assert(APR_STATUS_IS_ENOENT(rv));
+}
+END_TEST
+
+TCase *md_store_pack_test_case(void)
+{
+    TCase *testcase = tcase_create("md_store_pack");
+
+    tcase_add_checked_fixture(testcase, md_store_pack_setup, md_store_pack_teardown);
+
+    tcase_add_test(testcase, md_store_pack_save_load);
+    tcase_add_test(testcase, md_store_pack_reopen);
+    tcase_add_test(testcase, md_store_pack_corrupt);
+    tcase_add_test(testcase, md_store_pack_bad_length);
+    tcase_add_test(testcase, md_store_pack_move);
+    tcase_add_test(testcase, md_store_pack_compact);
+    tcase_add_test(testcase, md_store_pack_export);
+
+    return testcase;
+}
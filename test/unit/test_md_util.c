@@ -13,6 +13,10 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <apr_file_io.h>
+#include <apr_strings.h>
 
 #include "test_common.h"
 #include "md_util.h"
@@ -97,6 +101,200 @@ START_TEST(base64_md_util_largetrip)
 }
 END_TEST
 
+START_TEST(base64_md_util_inplace)
+{
+    char data[64], buf[MD_BASE64URL_LEN(sizeof(data)) + 1], *in;
+    const char *enc;
+    apr_size_t len, elen;
+    
+    for (len = 0; len <= sizeof(data); ++len) {
+        memset(data, 0, sizeof(data));
+        for (elen = 0; elen < len; ++elen) {
+            data[elen] = (char)(elen * 37 + len);
+        }
+        enc = md_util_base64url_encode(data, len, g_pool);
+        
+        /* encoding from the end of the buffer gives the same */
+        in = buf + MD_BASE64URL_INPLACE(len);
+        memcpy(in, data, len);
+        elen = md_util_base64url_encode_to(buf, in, len);
+        ck_assert_int_eq(elen, strlen(enc));
+        ck_assert_str_eq(buf, enc);
+        
+        /* decoding onto itself gives the data back */
+        ck_assert_int_eq(md_util_base64url_decode_to(buf, buf, elen), len);
+        ck_assert_mem_eq(buf, data, len);
+    }
+}
+END_TEST
+
+START_TEST(retry_after_md_util_parse)
+{
+    apr_time_t now = apr_time_now();
+    
+    ck_assert_int_eq(md_util_parse_retry_after(NULL, now), 0);
+    ck_assert_int_eq(md_util_parse_retry_after("", now), 0);
+    ck_assert_int_eq(md_util_parse_retry_after("abc", now), 0);
+    ck_assert_int_eq(md_util_parse_retry_after("120", now), now + apr_time_from_sec(120));
+    ck_assert_int_eq(md_util_parse_retry_after("99999999", now), 
+                     now + apr_time_from_sec(24 * 60 * 60));
+    ck_assert_int_eq(md_util_parse_retry_after("Sun, 06 Nov 1994 08:49:37 GMT", now), 
+                     apr_time_from_sec(784111777));
+}
+END_TEST
+
+START_TEST(rfc3339_md_util_parse)
+{
+    ck_assert_int_eq(md_util_parse_rfc3339(NULL), 0);
+    ck_assert_int_eq(md_util_parse_rfc3339(""), 0);
+    ck_assert_int_eq(md_util_parse_rfc3339("1994-11-06"), 0);
+    ck_assert_int_eq(md_util_parse_rfc3339("1994-11-06T08:49:37"), 0);
+    ck_assert_int_eq(md_util_parse_rfc3339("1994-11-06T08:49:37Z"), apr_time_from_sec(784111777));
+    ck_assert_int_eq(md_util_parse_rfc3339("1994-11-06T08:49:37.123456Z"), 
+                     apr_time_from_sec(784111777));
+    ck_assert_int_eq(md_util_parse_rfc3339("1994-11-06T10:49:37+02:00"), 
+                     apr_time_from_sec(784111777));
+    ck_assert_int_eq(md_util_parse_rfc3339("1994-11-06T07:19:37-01:30"), 
+                     apr_time_from_sec(784111777));
+}
+END_TEST
+
+static apr_status_t poll_count(void *baton, md_util_poll_t *poll)
+{
+    int *pcount = baton;
+    
+    (void)poll;
+    return (++(*pcount) >= 3)? APR_SUCCESS : APR_EAGAIN;
+}
+
+START_TEST(poll_md_util_resume)
+{
+    md_util_poll_t poll;
+    apr_status_t rv;
+    int count = 0;
+    
+    md_util_poll_init(&poll, apr_time_from_sec(5), apr_time_from_msec(50), 0, 0);
+    poll.max_block = apr_time_from_msec(10);
+    
+    rv = md_util_poll(poll_count, &count, &poll, 0);
+    ck_assert_int_eq(rv, APR_EAGAIN);
+    ck_assert_int_eq(count, 1);
+    ck_assert(poll.next_at > apr_time_now());
+    
+    poll.max_block = 0;
+    rv = md_util_poll(poll_count, &count, &poll, 0);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 3);
+    ck_assert_int_eq(poll.attempts, 3);
+}
+END_TEST
+
+static apr_status_t count_files(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                const char *dir, const char *name, apr_filetype_e ftype)
+{
+    int *pcount = baton;
+    
+    (void)p;
+    (void)ptemp;
+    (void)dir;
+    (void)name;
+    if (APR_DIR == ftype) {
+        ++(*pcount);
+    }
+    return APR_SUCCESS;
+}
+
+START_TEST(files_do_md_util_patterns)
+{
+    md_util_dcache_t *dcache;
+    const char *tmp, *base;
+    apr_status_t rv;
+    int count;
+    
+    ck_assert_int_eq(apr_temp_dir_get(&tmp, g_pool), APR_SUCCESS);
+    base = apr_psprintf(g_pool, "%s/md_util_files_do-%" APR_TIME_T_FMT, tmp, apr_time_now());
+    ck_assert_int_eq(apr_dir_make_recursive(apr_pstrcat(g_pool, base, "/a/one", NULL), 
+                                            APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_dir_make_recursive(apr_pstrcat(g_pool, base, "/a/two", NULL), 
+                                            APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_dir_make_recursive(apr_pstrcat(g_pool, base, "/b/one", NULL), 
+                                            APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_util_dcache_create(&dcache, g_pool), APR_SUCCESS);
+    
+    count = 0;
+    rv = md_util_files_do(count_files, &count, g_pool, base, "a", "*", NULL);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 2);
+    
+    count = 0;
+    rv = md_util_files_do(count_files, &count, g_pool, base, "*", "one", NULL);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 2);
+    
+    count = 0;
+    rv = md_util_files_do(count_files, &count, g_pool, base, "c", "*", NULL);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 0);
+    
+    count = 0;
+    rv = md_util_files_do(count_files, &count, g_pool, base, "c", "one", NULL);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 0);
+    
+    rv = md_util_files_do(count_files, &count, g_pool, 
+                          apr_pstrcat(g_pool, base, "/c", NULL), "one", NULL);
+    ck_assert(APR_STATUS_IS_ENOENT(rv));
+
+    count = 0;
+    rv = md_util_files_do_cached(dcache, count_files, &count, g_pool, base, "*", "*", NULL);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 3);
+    count = 0;
+    rv = md_util_files_do_cached(dcache, count_files, &count, g_pool, base, "*", "*", NULL);
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(count, 3);
+    
+    ck_assert_int_eq(md_util_ftree_remove(base, g_pool), APR_SUCCESS);
+}
+END_TEST
+
+START_TEST(str_set_md_util_ops)
+{
+    apr_array_header_t *a, *b, *c;
+    md_str_set_t *set;
+    char name[32];
+    int i;
+    
+    a = apr_array_make(g_pool, 100, sizeof(const char *));
+    for (i = 0; i < 100; ++i) {
+        apr_snprintf(name, sizeof(name), "Host%d.Example.org", i);
+        APR_ARRAY_PUSH(a, const char *) = apr_pstrdup(g_pool, name);
+    }
+    
+    set = md_str_set_from_array(g_pool, a, 0);
+    ck_assert_int_eq(md_str_set_count(set), 100);
+    ck_assert(md_str_set_contains(set, "host42.example.org"));
+    ck_assert(!md_str_set_contains(set, "host100.example.org"));
+    set = md_str_set_from_array(g_pool, a, 1);
+    ck_assert(md_str_set_contains(set, "Host42.Example.org"));
+    ck_assert(!md_str_set_contains(set, "host42.example.org"));
+
+    b = md_array_str_compact(g_pool, a, 0);
+    ck_assert_int_eq(b->nelts, 100);
+    ck_assert_str_eq(APR_ARRAY_IDX(b, 7, const char *), "host7.example.org");
+    ck_assert(md_array_str_contains_all(a, b, 0));
+    ck_assert(!md_array_str_contains_all(a, b, 1));
+    
+    c = apr_array_make(g_pool, 5, sizeof(const char *));
+    APR_ARRAY_PUSH(c, const char *) = "host3.example.org";
+    APR_ARRAY_PUSH(c, const char *) = "other.example.org";
+    ck_assert(!md_array_str_contains_all(a, c, 0));
+    ck_assert_int_eq(md_array_str_add_missing(b, c, 0), 1);
+    ck_assert_int_eq(b->nelts, 101);
+    ck_assert(md_array_str_contains_all(b, c, 0));
+}
+END_TEST
+
 TCase *md_util_test_case(void)
 {
     TCase *testcase = tcase_create("md_util");
@@ -105,6 +303,12 @@ TCase *md_util_test_case(void)
 
     tcase_add_test(testcase, base64_md_util_roundtrip);
     tcase_add_test(testcase, base64_md_util_largetrip);
+    tcase_add_test(testcase, base64_md_util_inplace);
+    tcase_add_test(testcase, retry_after_md_util_parse);
+    tcase_add_test(testcase, rfc3339_md_util_parse);
+    tcase_add_test(testcase, poll_md_util_resume);
+    tcase_add_test(testcase, files_do_md_util_patterns);
+    tcase_add_test(testcase, str_set_md_util_ops);
 
     return testcase;
 }